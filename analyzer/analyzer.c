@@ -0,0 +1,1597 @@
+/*****************************************************************************
+ * analyzer.c : Transport Stream compliance analyzer
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include <math.h>
+
+#include "../common.h"
+#include "../codecs.h"
+#include "../atsc/atsc.h"
+#include "../dvb/dvb.h"
+#include "../crc/crc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SYNC_BYTE       0x47
+#define M2TS_PACKET_SIZE 192
+#define NUM_PIDS        8192
+#define PCR_WRAP        ( (1LL << 33) * 300 )
+#define PACKET_BITS     ( TS_PACKET_SIZE * 8 )
+#define MAX_SECTION_LEN 4096
+
+/* ETR 290 timing limits in 27MHz ticks */
+#define PAT_TIMEOUT        ( 500 * 27000LL )
+#define PMT_TIMEOUT        ( 500 * 27000LL )
+#define PCR_REPETITION     ( 40 * 27000LL )
+#define PCR_DISCONTINUITY  ( 100 * 27000LL )
+#define PCR_ACCURACY       13.5 /* 500ns */
+#define PTS_REPETITION     ( 700 * 27000LL )
+#define DEFAULT_PID_TIMEOUT 5000
+
+/* ETR 290 sync hysteresis */
+#define SYNC_ACQUIRE 5
+#define SYNC_LOSE    2
+
+/* period of the PAT/PMT/PID timeout checks */
+#define CHECK_PERIOD ( 100 * 27000LL )
+
+/* packets analyzed without a PCR of the time base before extrapolating the time */
+#define MAX_QUEUED ( 1 << 17 )
+
+/* minimum span of PCRs before the muxrate estimate is used for the PCR accuracy check */
+#define PCR_ESTIMATE_SPAN ( TS_CLOCK / 2 )
+
+/* System T-STD buffer */
+#define BSYS_SIZE ( 1536 * 8 )
+
+enum
+{
+    PID_UNKNOWN,
+    PID_PSI,     /* sections on a PSI PID, modelled in the system buffers */
+    PID_SI,      /* other sections, only checked for CRC errors */
+    PID_ES,
+    PID_NULL,
+};
+
+enum
+{
+    SYNC_HUNT,
+    SYNC_PRESYNC,
+    SYNC_LOCKED,
+};
+
+typedef struct
+{
+    int size;          /* in bits, zero if not modelled */
+    double level;
+    int overflow;
+
+    double min;
+    double max;
+    double sum;
+    int64_t num_samples;
+} analyzer_buffer_t;
+
+/* system T-STD of a program */
+typedef struct
+{
+    analyzer_buffer_t tb, b;
+    double pending;
+    double last_leak;
+    int started;
+} analyzer_sys_t;
+
+typedef struct
+{
+    uint8_t data[TS_PACKET_SIZE];
+    uint64_t packet_num;
+    int new_time_base;
+} analyzer_packet_t;
+
+typedef struct
+{
+    int64_t dts;       /* removal time in 27MHz ticks */
+    double size;       /* in bits */
+} analyzer_au_t;
+
+typedef struct
+{
+    int pid;
+    int type;
+    int stream_type;
+    uint64_t packets;
+    uint64_t errors[LIBMPEGTS_ANALYZER_NUM_ERRORS];
+
+    /* continuity */
+    int cc;
+    int duplicate;
+
+    /* PID_error */
+    int referenced;
+    int64_t last_seen;
+
+    /* sections */
+    uint8_t *section;
+    int section_len;
+    int section_pos;
+    int is_pmt;
+    int64_t last_table;
+    uint32_t last_crc;
+
+    /* PCR */
+    int num_pcrs;
+    int64_t last_pcr;       /* raw value */
+    int64_t pcr;            /* unwrapped value */
+    uint64_t last_pcr_packet;
+    int64_t base_pcr;
+    uint64_t base_pcr_packet;
+
+    /* PTS_error */
+    int check_pts;
+    int64_t last_pts_time;
+
+    /* T-STD */
+    int tstd;
+    int video;
+    int started;
+    int rx;
+    int rbx;
+    analyzer_buffer_t tb, mb, eb;
+    analyzer_sys_t sys;     /* PMT PIDs only */
+    double pending;         /* elementary stream bits in the transport buffer */
+    double last_leak;
+
+    analyzer_au_t *aus;
+    int au_start;
+    int num_aus;
+    int max_aus;
+    int au_removed;         /* the access unit being received has already been decoded */
+    int underflow;
+} analyzer_pid_t;
+
+struct ts_analyzer_t
+{
+    ts_analyzer_params_t params;
+
+    /* sync */
+    int sync_state;
+    int sync_count;
+    int bad_sync;
+    int packet_size;
+    uint8_t buf[M2TS_PACKET_SIZE];
+    int buf_len;
+
+    uint64_t packets;
+    uint64_t errors[LIBMPEGTS_ANALYZER_NUM_ERRORS];
+
+    analyzer_pid_t *pids[NUM_PIDS];
+    int order[NUM_PIDS];
+    int num_pids;
+
+    /* packets since the last PCR of the time base */
+    analyzer_packet_t *queue;
+    int num_queued;
+    int max_queued;
+
+    /* time base */
+    int time_pid;
+    int num_time_pcrs;
+    int64_t last_time_pcr;     /* raw value */
+    int64_t time_pcr;          /* unwrapped value */
+    uint64_t time_pcr_packet;
+    double rate;               /* of the last PCR interval */
+    int64_t first_pcr;
+    uint64_t first_pcr_packet;
+
+    /* packet being analyzed */
+    uint64_t packet_num;
+    int time_valid;
+    int64_t time;
+
+    /* timeouts */
+    int64_t next_check;
+    int64_t pid_timeout;
+    int pat_seen;
+    int64_t last_pat;
+
+    ts_analyzer_pid_t *report_pids;
+};
+
+static const char *error_names[LIBMPEGTS_ANALYZER_NUM_ERRORS] =
+{
+    [LIBMPEGTS_ERR_SYNC_LOSS]          = "TS_sync_loss",
+    [LIBMPEGTS_ERR_SYNC_BYTE]          = "Sync_byte_error",
+    [LIBMPEGTS_ERR_PAT]                = "PAT_error",
+    [LIBMPEGTS_ERR_CC]                 = "Continuity_count_error",
+    [LIBMPEGTS_ERR_PMT]                = "PMT_error",
+    [LIBMPEGTS_ERR_PID]                = "PID_error",
+    [LIBMPEGTS_ERR_TRANSPORT]          = "Transport_error",
+    [LIBMPEGTS_ERR_CRC]                = "CRC_error",
+    [LIBMPEGTS_ERR_PCR_REPETITION]     = "PCR_repetition_error",
+    [LIBMPEGTS_ERR_PCR_DISCONTINUITY]  = "PCR_discontinuity_indicator_error",
+    [LIBMPEGTS_ERR_PCR_ACCURACY]       = "PCR_accuracy_error",
+    [LIBMPEGTS_ERR_PTS]                = "PTS_error",
+    [LIBMPEGTS_ERR_TB_OVERFLOW]        = "TB_overflow",
+    [LIBMPEGTS_ERR_MB_OVERFLOW]        = "MB_overflow",
+    [LIBMPEGTS_ERR_EB_OVERFLOW]        = "EB_overflow",
+    [LIBMPEGTS_ERR_UNDERFLOW]          = "Buffer_underflow",
+};
+
+static void report_error( ts_analyzer_t *a, analyzer_pid_t *p, int error )
+{
+    a->errors[error]++;
+    if( p )
+        p->errors[error]++;
+
+    if( a->params.error_callback )
+        a->params.error_callback( a->params.opaque, error, p ? p->pid : -1, a->packet_num, a->time_valid ? a->time : -1 );
+}
+
+static analyzer_pid_t *get_pid( ts_analyzer_t *a, int pid )
+{
+    analyzer_pid_t *p = a->pids[pid];
+
+    if( p )
+        return p;
+
+    p = calloc( 1, sizeof(*p) );
+    if( !p )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    p->pid = pid;
+    p->cc = -1;
+    p->stream_type = -1;
+    p->last_seen = a->time;
+
+    if( pid == 0x1fff )
+        p->type = PID_NULL;
+    else if( pid <= 0x1 )
+        p->type = PID_PSI;
+    else if( pid >= NIT_PID && pid <= SIT_PID )
+        p->type = PID_SI;
+
+    a->pids[pid] = p;
+    a->order[a->num_pids++] = pid;
+
+    return p;
+}
+
+/**** Buffers ****/
+static void sample_buffer( analyzer_buffer_t *b )
+{
+    if( !b->num_samples || b->level < b->min )
+        b->min = b->level;
+    if( b->level > b->max )
+        b->max = b->level;
+    b->sum += b->level;
+    b->num_samples++;
+}
+
+/* returns whether the buffer has just overflowed */
+static int check_overflow( analyzer_buffer_t *b )
+{
+    /* allow for the rounding of the leaks */
+    if( b->level > b->size + 1.0 )
+    {
+        if( b->overflow )
+            return 0;
+        b->overflow = 1;
+        return 1;
+    }
+
+    b->overflow = 0;
+    return 0;
+}
+
+static void get_buffer_stats( analyzer_buffer_t *b, ts_buffer_stats_t *stats )
+{
+    stats->size = b->size;
+    stats->fullness = b->level;
+    stats->min = b->min;
+    stats->max = b->max;
+    stats->mean = b->num_samples ? b->sum / b->num_samples : 0;
+}
+
+/* Bytes leave the transport buffer at rx and carry elementary stream data into the next buffer in proportion */
+static double leak_transport_buffer( analyzer_buffer_t *tb, double *pending, double rate, double duration )
+{
+    double out, data;
+
+    if( tb->level <= 0 )
+        return 0;
+
+    out = MIN( tb->level, rate * duration );
+    data = *pending * out / tb->level;
+    tb->level -= out;
+    *pending -= data;
+
+    return data;
+}
+
+/**** T-STD ****/
+static int setup_aac( analyzer_pid_t *p, int num_channels )
+{
+    for( int i = 0; aac_buffers[i].max_channels != 0; i++ )
+    {
+        if( num_channels <= aac_buffers[i].max_channels )
+        {
+            p->rx = aac_buffers[i].rxn;
+            p->mb.size = aac_buffers[i].bsn;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int setup_mpeg2_video( analyzer_pid_t *p, uint8_t *desc, int desc_len )
+{
+    int level = LIBMPEGTS_MPEG2_LEVEL_HIGH;
+    int profile = LIBMPEGTS_MPEG2_PROFILE_MAIN;
+    int level_idx = -1;
+
+    /* profile_and_level_indication of the video stream descriptor unless MPEG_1_only_flag is set */
+    for( int i = 0; i + 2 <= desc_len; i += 2 + desc[i+1] )
+    {
+        if( desc[i] == VIDEO_STREAM_DESCRIPTOR_TAG && desc[i+1] >= 3 && !(desc[i+2] & 0x04) )
+        {
+            int pl = desc[i+4];
+            if( pl == 0x85 )
+            {
+                level = LIBMPEGTS_MPEG2_LEVEL_MAIN;
+                profile = LIBMPEGTS_MPEG2_PROFILE_422;
+            }
+            else if( (pl & 0xf) == 0xa )
+                level = LIBMPEGTS_MPEG2_LEVEL_LOW;
+            else if( (pl & 0xf) == 0x8 )
+                level = LIBMPEGTS_MPEG2_LEVEL_MAIN;
+            else if( (pl & 0xf) == 0x6 )
+                level = LIBMPEGTS_MPEG2_LEVEL_HIGH_1440;
+
+            if( ((pl >> 4) & 0x7) == 0x5 && level == LIBMPEGTS_MPEG2_LEVEL_MAIN )
+                profile = LIBMPEGTS_MPEG2_PROFILE_SIMPLE;
+        }
+    }
+
+    for( int i = 0; mpeg2_levels[i].level != 0; i++ )
+    {
+        if( mpeg2_levels[i].level == level && mpeg2_levels[i].profile == profile )
+        {
+            level_idx = i;
+            break;
+        }
+    }
+
+    if( level_idx < 0 )
+        return 0;
+
+    /* The vbv buffer size is not signalled in the PMT so the elementary stream buffer is the level maximum.
+     * For Low and Main Level the total of MB and EB is the same as the muxer's. */
+    double bs_mux = 0.004 * mpeg2_levels[level_idx].bitrate;
+    double bs_oh = 1.0 * mpeg2_levels[level_idx].bitrate/750.0;
+
+    p->rx = 1.2 * mpeg2_levels[level_idx].bitrate;
+    p->rbx = mpeg2_levels[level_idx].bitrate;
+    p->mb.size = bs_mux + bs_oh;
+    p->eb.size = mpeg2_levels[level_idx].vbv;
+    p->video = 1;
+
+    return 1;
+}
+
+static int setup_avc( analyzer_pid_t *p, uint8_t *desc, int desc_len )
+{
+    int profile = AVC_HIGH;
+    int level = 51;
+    int level_idx = -1;
+
+    for( int i = 0; i + 2 <= desc_len; i += 2 + desc[i+1] )
+    {
+        if( desc[i] == AVC_DESCRIPTOR_TAG && desc[i+1] >= 4 )
+        {
+            for( int j = AVC_BASELINE; j <= AVC_CAVLC_444_INTRA; j++ )
+            {
+                if( avc_profiles[j] == desc[i+2] )
+                {
+                    profile = j;
+                    break;
+                }
+            }
+
+            level = desc[i+4];
+            /* level 1b */
+            if( level == 11 && profile <= AVC_MAIN && (desc[i+3] & 0x10) )
+                level = 9;
+        }
+    }
+
+    for( int i = 0; avc_levels[i].level_idc != 0; i++ )
+    {
+        if( avc_levels[i].level_idc == level )
+        {
+            level_idx = i;
+            break;
+        }
+    }
+
+    if( level_idx < 0 )
+        return 0;
+
+    int factor = (float)nal_factor[profile] * 1.2;
+    int bitrate = avc_levels[level_idx].bitrate * factor;
+    double bs_mux = 0.004 * MAX( bitrate, 2000000 );
+    double bs_oh = 1.0 * MAX( bitrate, 2000000 )/750.0;
+
+    p->rx = bitrate;
+    p->rbx = bitrate;
+    p->mb.size = bs_mux + bs_oh;
+    p->eb.size = avc_levels[level_idx].cpb * factor;
+    p->video = 1;
+
+    return 1;
+}
+
+static int find_descriptor( uint8_t *desc, int desc_len, int tag )
+{
+    for( int i = 0; i + 2 <= desc_len; i += 2 + desc[i+1] )
+    {
+        if( desc[i] == tag )
+            return i;
+    }
+
+    return -1;
+}
+
+static int find_registration( uint8_t *desc, int desc_len, const char *format_id )
+{
+    for( int i = 0; i + 2 <= desc_len; i += 2 + desc[i+1] )
+    {
+        /* libmpegts signals SMPTE 302M with a private data indicator descriptor */
+        if( ( desc[i] == REGISTRATION_DESCRIPTOR_TAG || desc[i] == PRIVATE_DATA_DESCRIPTOR_TAG ) &&
+            desc[i+1] >= 4 && i + 6 <= desc_len && !memcmp( &desc[i+2], format_id, 4 ) )
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Sets the T-STD parameters of an elementary stream from its stream_type and descriptors.
+ * atsc is set when the program is registered as ATSC or SCTE. */
+static void setup_stream( analyzer_pid_t *p, int stream_type, uint8_t *desc, int desc_len, int atsc )
+{
+    int tstd = 0, audio = 0, pos;
+
+    p->type = PID_ES;
+    if( p->stream_type == stream_type && p->tstd )
+        return;
+
+    p->stream_type = stream_type;
+    p->video = p->rbx = p->eb.size = 0;
+    p->tb.size = TB_SIZE;
+
+    switch( stream_type )
+    {
+        case VIDEO_MPEG2:
+            tstd = setup_mpeg2_video( p, desc, desc_len );
+            break;
+        case VIDEO_AVC:
+            tstd = setup_avc( p, desc, desc_len );
+            break;
+        case AUDIO_MPEG1:
+        case AUDIO_MPEG2:
+            p->rx = MISC_AUDIO_RXN;
+            p->mb.size = MISC_AUDIO_BS;
+            tstd = audio = 1;
+            break;
+        case AUDIO_ADTS:
+        case AUDIO_LATM:
+            pos = find_descriptor( desc, desc_len, MPEG2_AAC_AUDIO_DESCRIPTOR );
+            if( pos >= 0 && desc[pos+1] >= 2 )
+            {
+                int channel_map = desc[pos+3];
+                tstd = setup_aac( p, channel_map == LIBMPEGTS_MPEG2_AAC_5_POINT_1_CHANNEL ? 5 : channel_map );
+            }
+            else
+                tstd = setup_aac( p, 8 ); /* the channel count is unknown so allow 7.1 */
+            audio = 1;
+            break;
+        case AUDIO_AC3:
+        case AUDIO_EAC3:
+            p->rx = MISC_AUDIO_RXN;
+            p->mb.size = atsc ? AC3_BS_ATSC : AC3_BS_DVB;
+            tstd = audio = 1;
+            break;
+        case PRIVATE_DATA:
+            if( find_descriptor( desc, desc_len, DVB_AC3_DESCRIPTOR_TAG ) >= 0 ||
+                find_descriptor( desc, desc_len, DVB_EAC3_DESCRIPTOR_TAG ) >= 0 )
+            {
+                p->rx = MISC_AUDIO_RXN;
+                p->mb.size = AC3_BS_DVB;
+                tstd = audio = 1;
+            }
+            else if( find_registration( desc, desc_len, "BSSD" ) )
+            {
+                /* the bit depth is only in the elementary stream so allow for 24-bit */
+                p->rx = 1.2 * ((24 >> 2) + 1) * SMPTE_302M_AUDIO_SR * 8;
+                p->mb.size = SMPTE_302M_AUDIO_BS;
+                tstd = audio = 1;
+            }
+            else if( find_descriptor( desc, desc_len, DVB_SUBTITLING_DESCRIPTOR_TAG ) >= 0 )
+            {
+                /* assume there is no display definition segment */
+                p->rx = DVB_SUB_RXN;
+                p->mb.size = DVB_SUB_MB_SIZE;
+                tstd = 1;
+            }
+            else if( find_descriptor( desc, desc_len, DVB_VBI_DESCRIPTOR_TAG ) >= 0 && atsc )
+            {
+                p->rx = SCTE_VBI_RXN;
+                p->mb.size = SCTE_VBI_MB_SIZE;
+                tstd = 1;
+            }
+            else if( find_descriptor( desc, desc_len, DVB_TELETEXT_DESCRIPTOR_TAG ) >= 0 ||
+                     find_descriptor( desc, desc_len, DVB_VBI_DESCRIPTOR_TAG ) >= 0 )
+            {
+                p->tb.size = TELETEXT_T_BS;
+                p->rx = TELETEXT_RXN;
+                p->mb.size = TELETEXT_BTTX;
+                tstd = 1;
+            }
+            break;
+        case PRIVATE_SECTION:
+        case PRIVATE_USER:
+            p->type = PID_SI;
+            break;
+    }
+
+    /* subtitles and teletext are too sparse for PTS_error */
+    p->check_pts = tstd && ( p->video || audio );
+    p->tstd = tstd;
+    p->started = 0;
+}
+
+/* Leaks the buffers of an elementary stream up to time t */
+static void leak_stream( ts_analyzer_t *a, analyzer_pid_t *p, double t )
+{
+    double duration = (t - p->last_leak) / TS_CLOCK;
+    double data;
+
+    if( duration <= 0 )
+        return;
+    p->last_leak = t;
+
+    data = leak_transport_buffer( &p->tb, &p->pending, p->rx, duration );
+    p->mb.level += data;
+
+    if( p->video )
+    {
+        double out = MIN( p->mb.level, p->rbx * duration );
+        p->mb.level -= out;
+        p->eb.level += out;
+        if( check_overflow( &p->eb ) )
+            report_error( a, p, LIBMPEGTS_ERR_EB_OVERFLOW );
+    }
+
+    if( check_overflow( &p->mb ) )
+        report_error( a, p, LIBMPEGTS_ERR_MB_OVERFLOW );
+}
+
+/* Decodes all the access units which are due by time t */
+static void advance_stream( ts_analyzer_t *a, analyzer_pid_t *p, int64_t t )
+{
+    analyzer_buffer_t *b = p->video ? &p->eb : &p->mb;
+
+    while( p->num_aus && p->aus[p->au_start].dts <= t )
+    {
+        analyzer_au_t *au = &p->aus[p->au_start];
+
+        leak_stream( a, p, au->dts );
+
+        /* allow for the rounding of the leaks */
+        if( b->level + 1.0 < au->size )
+            report_error( a, p, LIBMPEGTS_ERR_UNDERFLOW );
+        b->level = MAX( b->level - au->size, 0 );
+
+        p->au_start = (p->au_start + 1) % p->max_aus;
+        p->num_aus--;
+        if( !p->num_aus )
+            p->au_removed = 1;
+    }
+
+    leak_stream( a, p, t );
+}
+
+static int add_au( analyzer_pid_t *p, int64_t dts )
+{
+    if( p->num_aus == p->max_aus )
+    {
+        int max_aus = p->max_aus ? p->max_aus * 2 : 32;
+        analyzer_au_t *aus = malloc( max_aus * sizeof(*aus) );
+        if( !aus )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+
+        for( int i = 0; i < p->num_aus; i++ )
+            aus[i] = p->aus[(p->au_start + i) % p->max_aus];
+
+        free( p->aus );
+        p->aus = aus;
+        p->au_start = 0;
+        p->max_aus = max_aus;
+    }
+
+    analyzer_au_t *au = &p->aus[(p->au_start + p->num_aus) % p->max_aus];
+    au->dts = dts;
+    au->size = 0;
+    p->num_aus++;
+    p->au_removed = 0;
+
+    return 0;
+}
+
+/* Converts a 90kHz timestamp to the 27MHz time base using the nearest wrap to the current time */
+static int64_t unwrap_timestamp( ts_analyzer_t *a, int64_t ts )
+{
+    int64_t t = ts * 300;
+    int64_t wraps = (a->time - t + PCR_WRAP / 2) / PCR_WRAP;
+
+    if( a->time - t + PCR_WRAP / 2 < 0 )
+        wraps--;
+
+    return t + wraps * PCR_WRAP;
+}
+
+static int64_t read_timestamp( uint8_t *p )
+{
+    return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+/* Packet times are those of the byte which completes a PCR, byte 10.
+ * Returns the arrival time of the given byte of the current packet. */
+static int64_t packet_time( ts_analyzer_t *a, int byte )
+{
+    double rate = a->rate > 0 ? a->rate : a->params.muxrate;
+
+    return a->time + ( rate > 0 ? (int64_t)( (byte - 11) * 8 * TS_CLOCK / rate ) : 0 );
+}
+
+static int handle_pes( ts_analyzer_t *a, analyzer_pid_t *p, uint8_t *payload, int len, int start )
+{
+    int64_t dts = -1;
+    int header_len = 0;
+
+    if( start )
+    {
+        /* stream_ids without the optional PES header are not access units */
+        if( len < 9 || payload[0] || payload[1] || payload[2] != 1 || payload[3] == 0xbe || payload[3] == 0xbf )
+            return 0;
+
+        header_len = 9 + payload[8];
+        if( (payload[7] & 0x80) && len >= 14 )
+        {
+            dts = read_timestamp( &payload[9] );
+            if( (payload[7] & 0x40) && len >= 19 )
+                dts = read_timestamp( &payload[14] );
+        }
+        header_len = MIN( header_len, len );
+
+        if( dts >= 0 && p->check_pts && a->time_valid )
+        {
+            if( p->last_pts_time && a->time - p->last_pts_time > PTS_REPETITION )
+                report_error( a, p, LIBMPEGTS_ERR_PTS );
+            p->last_pts_time = a->time;
+        }
+    }
+
+    if( !p->tstd || !a->time_valid )
+        return 0;
+
+    if( !p->started )
+    {
+        /* begin the model at the first access unit after the time base is known */
+        if( dts < 0 )
+            return 0;
+        p->started = 1;
+        p->last_leak = packet_time( a, 0 );
+    }
+
+    advance_stream( a, p, packet_time( a, 0 ) );
+
+    p->tb.level += PACKET_BITS;
+
+    if( dts >= 0 )
+    {
+        if( add_au( p, unwrap_timestamp( a, dts ) ) < 0 )
+            return -1;
+        p->underflow = 0;
+    }
+
+    if( p->au_removed )
+    {
+        /* data of an access unit which has already been decoded */
+        if( !p->underflow )
+            report_error( a, p, LIBMPEGTS_ERR_UNDERFLOW );
+        p->underflow = 1;
+    }
+    else
+    {
+        double bits = (len - header_len) * 8;
+        p->pending += bits;
+        p->aus[(p->au_start + p->num_aus - 1) % p->max_aus].size += bits;
+    }
+
+    /* the transport buffer leaks while the packet arrives */
+    advance_stream( a, p, packet_time( a, TS_PACKET_SIZE ) );
+    if( check_overflow( &p->tb ) )
+        report_error( a, p, LIBMPEGTS_ERR_TB_OVERFLOW );
+
+    sample_buffer( &p->tb );
+    sample_buffer( &p->mb );
+    if( p->video )
+        sample_buffer( &p->eb );
+
+    return 0;
+}
+
+/* System buffers for PSI packets */
+static void leak_system_buffers( ts_analyzer_t *a, analyzer_sys_t *sys, analyzer_pid_t *p, int64_t t )
+{
+    double duration = (t - sys->last_leak) / TS_CLOCK;
+    double data, r_sys;
+
+    if( duration <= 0 )
+        return;
+    sys->last_leak = t;
+
+    r_sys = MAX( R_SYS_DEFAULT, (a->params.muxrate ? a->params.muxrate : a->rate) / 500 );
+    data = leak_transport_buffer( &sys->tb, &sys->pending, RX_SYS, duration );
+    sys->b.level = MAX( sys->b.level + data - r_sys * duration, 0 );
+    if( check_overflow( &sys->b ) )
+        report_error( a, p, LIBMPEGTS_ERR_MB_OVERFLOW );
+}
+
+static void add_system_packet( ts_analyzer_t *a, analyzer_sys_t *sys, analyzer_pid_t *p, int len )
+{
+    if( !sys->started )
+    {
+        sys->started = 1;
+        sys->last_leak = packet_time( a, 0 );
+    }
+
+    leak_system_buffers( a, sys, p, packet_time( a, 0 ) );
+
+    /* the transport buffer leaks while the packet arrives */
+    sys->tb.level += PACKET_BITS;
+    sys->pending += len * 8;
+    leak_system_buffers( a, sys, p, packet_time( a, TS_PACKET_SIZE ) );
+    if( check_overflow( &sys->tb ) )
+        report_error( a, p, LIBMPEGTS_ERR_TB_OVERFLOW );
+
+    sample_buffer( &sys->tb );
+    sample_buffer( &sys->b );
+}
+
+/* A T-STD decodes a single program, so every program has its own system buffers
+ * which receive its PMT and the PSI shared by all programs */
+static void handle_psi_tstd( ts_analyzer_t *a, analyzer_pid_t *p, int len )
+{
+    if( !a->time_valid )
+        return;
+
+    if( p->is_pmt )
+    {
+        add_system_packet( a, &p->sys, p, len );
+        return;
+    }
+
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *pmt = a->pids[a->order[i]];
+        if( pmt->is_pmt )
+            add_system_packet( a, &pmt->sys, p, len );
+    }
+}
+
+/**** PSI ****/
+static void parse_pat( ts_analyzer_t *a, uint8_t *section, int len )
+{
+    for( int i = 8; i + 4 <= len - 4; i += 4 )
+    {
+        int program_num = (section[i] << 8) | section[i+1];
+        int pid = ((section[i+2] & 0x1f) << 8) | section[i+3];
+
+        analyzer_pid_t *p = get_pid( a, pid );
+        if( !p )
+            return;
+
+        if( program_num && !p->is_pmt )
+        {
+            p->is_pmt = 1;
+            p->type = PID_PSI;
+            p->last_table = a->time;
+            p->sys.tb.size = TB_SIZE;
+            p->sys.b.size = BSYS_SIZE;
+        }
+        else if( !program_num && p->type == PID_UNKNOWN )
+            p->type = PID_SI;
+    }
+}
+
+static void reference_pid( ts_analyzer_t *a, analyzer_pid_t *p )
+{
+    if( !p->referenced )
+    {
+        p->referenced = 1;
+        p->last_seen = a->time;
+    }
+}
+
+static void parse_pmt( ts_analyzer_t *a, uint8_t *section, int len )
+{
+    int pcr_pid, program_info_len, atsc;
+    analyzer_pid_t *p;
+
+    if( len < 16 )
+        return;
+
+    pcr_pid = ((section[8] & 0x1f) << 8) | section[9];
+    program_info_len = ((section[10] & 0xf) << 8) | section[11];
+    if( 12 + program_info_len > len - 4 )
+        return;
+
+    atsc = find_registration( &section[12], program_info_len, "GA94" ) ||
+           find_registration( &section[12], program_info_len, "SCTE" );
+
+    if( pcr_pid != 0x1fff )
+    {
+        p = get_pid( a, pcr_pid );
+        if( !p )
+            return;
+        reference_pid( a, p );
+    }
+
+    for( int i = 12 + program_info_len; i + 5 <= len - 4; )
+    {
+        int stream_type = section[i];
+        int pid = ((section[i+1] & 0x1f) << 8) | section[i+2];
+        int es_info_len = ((section[i+3] & 0xf) << 8) | section[i+4];
+
+        i += 5;
+        if( i + es_info_len > len - 4 )
+            break;
+
+        p = get_pid( a, pid );
+        if( !p )
+            return;
+
+        setup_stream( p, stream_type, &section[i], es_info_len, atsc );
+        reference_pid( a, p );
+        i += es_info_len;
+    }
+}
+
+static void handle_section( ts_analyzer_t *a, analyzer_pid_t *p, uint8_t *section, int len )
+{
+    int table_id = section[0];
+    uint32_t crc = 0;
+
+    if( section[1] & 0x80 )
+    {
+        if( len < 12 || crc_32( section, len ) )
+        {
+            report_error( a, p, LIBMPEGTS_ERR_CRC );
+            return;
+        }
+        crc = (section[len-4] << 24) | (section[len-3] << 16) | (section[len-2] << 8) | section[len-1];
+    }
+
+    if( p->pid == PAT_PID )
+    {
+        if( table_id != PAT_TID )
+        {
+            report_error( a, p, LIBMPEGTS_ERR_PAT );
+            return;
+        }
+
+        a->pat_seen = 1;
+        a->last_pat = a->time;
+        if( crc != p->last_crc )
+            parse_pat( a, section, len );
+    }
+    else if( p->is_pmt && table_id == PMT_TID )
+    {
+        p->last_table = a->time;
+        if( crc != p->last_crc )
+            parse_pmt( a, section, len );
+    }
+
+    p->last_crc = crc;
+}
+
+static void handle_section_data( ts_analyzer_t *a, analyzer_pid_t *p, uint8_t *data, int len )
+{
+    while( len > 0 )
+    {
+        if( !p->section_pos && data[0] == 0xff )
+            return; /* stuffing */
+
+        int copy = len;
+        if( p->section_pos < 3 )
+            copy = MIN( copy, 3 - p->section_pos );
+        else
+            copy = MIN( copy, p->section_len - p->section_pos );
+
+        memcpy( &p->section[p->section_pos], data, copy );
+        p->section_pos += copy;
+        data += copy;
+        len -= copy;
+
+        if( p->section_pos == 3 )
+        {
+            p->section_len = 3 + (((p->section[1] & 0xf) << 8) | p->section[2]);
+            if( p->section_len > MAX_SECTION_LEN )
+            {
+                report_error( a, p, LIBMPEGTS_ERR_CRC );
+                p->section_pos = 0;
+                return;
+            }
+        }
+
+        if( p->section_pos >= 3 && p->section_pos == p->section_len )
+        {
+            handle_section( a, p, p->section, p->section_len );
+            p->section_pos = 0;
+        }
+    }
+}
+
+static int handle_sections( ts_analyzer_t *a, analyzer_pid_t *p, uint8_t *payload, int len, int start )
+{
+    if( !p->section )
+    {
+        p->section = malloc( MAX_SECTION_LEN + TS_PACKET_SIZE );
+        if( !p->section )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+    }
+
+    if( start )
+    {
+        int pointer = payload[0];
+
+        if( 1 + pointer > len )
+        {
+            p->section_pos = 0;
+            return 0;
+        }
+
+        /* finish the previous section */
+        if( p->section_pos )
+            handle_section_data( a, p, &payload[1], pointer );
+        p->section_pos = 0;
+
+        handle_section_data( a, p, &payload[1+pointer], len - 1 - pointer );
+    }
+    else if( p->section_pos )
+        handle_section_data( a, p, payload, len );
+
+    return 0;
+}
+
+/**** Timing ****/
+/* Restarts the timeouts and the T-STD models for a new time base */
+static void reset_time_base( ts_analyzer_t *a )
+{
+    a->last_pat = a->time;
+
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *p = a->pids[a->order[i]];
+
+        p->last_seen = p->last_table = a->time;
+        p->last_pts_time = 0;
+        p->started = 0;
+        p->num_aus = 0;
+        p->pending = 0;
+        p->tb.level = p->mb.level = p->eb.level = 0;
+        p->sys.started = 0;
+        p->sys.pending = 0;
+        p->sys.tb.level = p->sys.b.level = 0;
+    }
+}
+
+/* ETR 290 PCR checks of a PCR PID */
+static void handle_pcr( ts_analyzer_t *a, analyzer_pid_t *p, int64_t pcr, int discontinuity )
+{
+    uint64_t packet = a->packet_num;
+    int continuous = 0;
+
+    if( p->num_pcrs )
+    {
+        int64_t delta = pcr - p->last_pcr;
+        if( delta < -PCR_WRAP / 2 )
+            delta += PCR_WRAP;
+
+        if( !discontinuity )
+        {
+            if( delta < 0 || delta > PCR_DISCONTINUITY )
+                report_error( a, p, LIBMPEGTS_ERR_PCR_DISCONTINUITY );
+            else
+            {
+                double rate = a->params.muxrate;
+
+                if( delta > PCR_REPETITION )
+                    report_error( a, p, LIBMPEGTS_ERR_PCR_REPETITION );
+
+                /* a CBR stream's muxrate can be estimated from the earlier PCRs */
+                if( !rate && p->pcr - p->base_pcr >= PCR_ESTIMATE_SPAN )
+                    rate = (double)(p->last_pcr_packet - p->base_pcr_packet) * PACKET_BITS * TS_CLOCK / (p->pcr - p->base_pcr);
+
+                continuous = 1;
+
+                if( rate && !a->params.vbr )
+                {
+                    double expected = (double)(packet - p->last_pcr_packet) * PACKET_BITS * TS_CLOCK / rate;
+                    if( fabs( delta - expected ) > PCR_ACCURACY )
+                    {
+                        report_error( a, p, LIBMPEGTS_ERR_PCR_ACCURACY );
+                        /* estimate the muxrate again after lost or inserted packets */
+                        continuous = !!a->params.muxrate;
+                    }
+                }
+            }
+        }
+
+        p->pcr += delta;
+    }
+    else
+        p->pcr = pcr;
+
+    if( !continuous )
+    {
+        p->base_pcr = p->pcr;
+        p->base_pcr_packet = packet;
+    }
+
+    p->last_pcr = pcr;
+    p->last_pcr_packet = packet;
+    p->num_pcrs++;
+}
+
+static void check_timeouts( ts_analyzer_t *a )
+{
+    if( a->pat_seen && a->time - a->last_pat > PAT_TIMEOUT )
+    {
+        report_error( a, a->pids[PAT_PID], LIBMPEGTS_ERR_PAT );
+        a->last_pat = a->time;
+    }
+
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *p = a->pids[a->order[i]];
+
+        if( p->is_pmt && a->time - p->last_table > PMT_TIMEOUT )
+        {
+            report_error( a, p, LIBMPEGTS_ERR_PMT );
+            p->last_table = a->time;
+        }
+
+        if( p->referenced && a->time - p->last_seen > a->pid_timeout )
+        {
+            report_error( a, p, LIBMPEGTS_ERR_PID );
+            p->last_seen = a->time;
+        }
+    }
+}
+
+/**** Packets ****/
+static int handle_packet( ts_analyzer_t *a, analyzer_packet_t *packet, int64_t time )
+{
+    uint8_t *pkt = packet->data;
+    int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+    int scrambled = pkt[3] >> 6;
+    int afc = (pkt[3] >> 4) & 0x3;
+    int cc = pkt[3] & 0xf;
+    int start = pkt[1] & 0x40;
+    int discontinuity = 0;
+    int payload_start = TS_HEADER_SIZE;
+    analyzer_pid_t *p;
+
+    a->packet_num = packet->packet_num;
+    a->time_valid = time >= 0;
+    if( a->time_valid )
+        a->time = time;
+    if( packet->new_time_base )
+        a->next_check = 0;
+
+    p = a->pids[pid];
+    if( !p && !(p = get_pid( a, pid )) )
+        return -1;
+
+    p->packets++;
+    if( p->type == PID_NULL )
+        return 0;
+
+    if( pkt[1] & 0x80 )
+    {
+        /* transport_error_indicator: the rest of the packet can't be trusted */
+        report_error( a, p, LIBMPEGTS_ERR_TRANSPORT );
+        return 0;
+    }
+
+    if( afc & 0x2 )
+    {
+        int af_len = pkt[4];
+        payload_start += 1 + af_len;
+
+        if( af_len > 0 )
+        {
+            discontinuity = pkt[5] & 0x80;
+            if( (pkt[5] & 0x10) && af_len >= 7 )
+            {
+                int64_t pcr_base = ((int64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+                int pcr_ext = ((pkt[10] & 1) << 8) | pkt[11];
+                handle_pcr( a, p, pcr_base * 300 + pcr_ext, discontinuity );
+            }
+        }
+    }
+
+    /* continuity_counter */
+    if( p->cc >= 0 && !discontinuity )
+    {
+        if( afc & 0x1 )
+        {
+            if( cc == p->cc )
+            {
+                /* a packet may be sent twice */
+                if( p->duplicate )
+                    report_error( a, p, LIBMPEGTS_ERR_CC );
+                p->duplicate = 1;
+                return 0;
+            }
+            else if( cc != ((p->cc + 1) & 0xf) )
+            {
+                report_error( a, p, LIBMPEGTS_ERR_CC );
+                p->section_pos = 0;
+            }
+        }
+        else if( cc != p->cc )
+            report_error( a, p, LIBMPEGTS_ERR_CC );
+    }
+    p->cc = cc;
+    p->duplicate = 0;
+
+    if( a->time_valid )
+    {
+        p->last_seen = a->time;
+
+        if( !a->next_check )
+        {
+            reset_time_base( a );
+            a->next_check = a->time + CHECK_PERIOD;
+        }
+        else if( a->time >= a->next_check )
+        {
+            check_timeouts( a );
+            a->next_check = a->time + CHECK_PERIOD;
+        }
+    }
+
+    if( scrambled )
+    {
+        if( pid == PAT_PID )
+            report_error( a, p, LIBMPEGTS_ERR_PAT );
+        else if( p->is_pmt )
+            report_error( a, p, LIBMPEGTS_ERR_PMT );
+        return 0;
+    }
+
+    if( !(afc & 0x1) || payload_start >= TS_PACKET_SIZE )
+        return 0;
+
+    if( p->type == PID_PSI || p->type == PID_SI )
+    {
+        if( p->type == PID_PSI )
+            handle_psi_tstd( a, p, TS_PACKET_SIZE - payload_start );
+        return handle_sections( a, p, &pkt[payload_start], TS_PACKET_SIZE - payload_start, start );
+    }
+    else if( p->type == PID_ES )
+        return handle_pes( a, p, &pkt[payload_start], TS_PACKET_SIZE - payload_start, start );
+
+    return 0;
+}
+
+/**** Time base ****/
+/* Analyzes the queued packets. The arrival time of each packet is interpolated between the PCRs of the
+ * time base around it, end_pcr is the PCR which ends the interval or -1 to extrapolate from the last rate. */
+static int flush_queue( ts_analyzer_t *a, int64_t end_pcr, uint64_t end_packet )
+{
+    for( int i = 0; i < a->num_queued; i++ )
+    {
+        analyzer_packet_t *packet = &a->queue[i];
+        uint64_t offset = packet->packet_num - a->time_pcr_packet;
+        int64_t time = -1;
+
+        if( end_pcr >= 0 )
+            time = a->time_pcr + (end_pcr - a->time_pcr) * offset / (end_packet - a->time_pcr_packet);
+        else if( a->num_time_pcrs && ( !offset || a->rate > 0 ) )
+            time = a->time_pcr + (int64_t)( offset ? offset * PACKET_BITS * TS_CLOCK / a->rate : 0 );
+
+        if( handle_packet( a, packet, time ) < 0 )
+            return -1;
+    }
+
+    a->num_queued = 0;
+    return 0;
+}
+
+/* Returns whether the PCR starts a new time base */
+static int update_time_base( ts_analyzer_t *a, int64_t pcr, int discontinuity, uint64_t packet )
+{
+    int new_time_base = 1;
+
+    if( a->num_time_pcrs )
+    {
+        int64_t delta = pcr - a->last_time_pcr;
+        if( delta < -PCR_WRAP / 2 )
+            delta += PCR_WRAP;
+
+        if( !discontinuity && delta > 0 && delta <= PCR_DISCONTINUITY )
+        {
+            /* the bytes within the queued packets arrive at the rate of this interval */
+            a->rate = (double)(packet - a->time_pcr_packet) * PACKET_BITS * TS_CLOCK / delta;
+            if( flush_queue( a, a->time_pcr + delta, packet ) < 0 )
+                return -1;
+            a->time_pcr += delta;
+            new_time_base = 0;
+        }
+        else if( flush_queue( a, -1, 0 ) < 0 )
+            return -1;
+    }
+    else if( flush_queue( a, -1, 0 ) < 0 )
+        return -1;
+
+    if( new_time_base )
+    {
+        a->time_pcr = a->first_pcr = pcr;
+        a->first_pcr_packet = packet;
+    }
+
+    a->last_time_pcr = pcr;
+    a->time_pcr_packet = packet;
+    a->num_time_pcrs++;
+
+    return new_time_base;
+}
+
+static int queue_packet( ts_analyzer_t *a, uint8_t *pkt )
+{
+    int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+    uint64_t packet = a->packets++;
+    int new_time_base = 0;
+
+    /* PCR */
+    if( (pkt[3] & 0x20) && pkt[4] >= 7 && (pkt[5] & 0x10) && !(pkt[1] & 0x80) )
+    {
+        if( a->time_pid < 0 )
+            a->time_pid = pid;
+
+        if( pid == a->time_pid )
+        {
+            int64_t pcr_base = ((int64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+            int pcr_ext = ((pkt[10] & 1) << 8) | pkt[11];
+
+            new_time_base = update_time_base( a, pcr_base * 300 + pcr_ext, pkt[5] & 0x80, packet );
+            if( new_time_base < 0 )
+                return -1;
+        }
+    }
+
+    if( a->num_queued == MAX_QUEUED && flush_queue( a, -1, 0 ) < 0 )
+        return -1;
+
+    if( a->num_queued == a->max_queued )
+    {
+        int max_queued = a->max_queued ? a->max_queued * 2 : 1024;
+        analyzer_packet_t *queue = realloc( a->queue, max_queued * sizeof(*queue) );
+        if( !queue )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        a->queue = queue;
+        a->max_queued = max_queued;
+    }
+
+    analyzer_packet_t *queued = &a->queue[a->num_queued++];
+    memcpy( queued->data, pkt, TS_PACKET_SIZE );
+    queued->packet_num = packet;
+    queued->new_time_base = new_time_base;
+
+    return 0;
+}
+
+/**** Sync ****/
+/* Finds the next candidate sync byte which is followed by another one a packet later.
+ * Detects 192 byte packets with a timestamp header (M2TS) as well. */
+static int find_sync( ts_analyzer_t *a, uint8_t *data, int len )
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i sync = _mm_set1_epi8( SYNC_BYTE );
+    for( ; i + 16 <= len; i += 16 )
+    {
+        int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (__m128i*)&data[i] ), sync ) );
+        while( mask )
+        {
+            int j = i + __builtin_ctz( mask );
+            if( j + M2TS_PACKET_SIZE >= len )
+                return j;
+            if( data[j+TS_PACKET_SIZE] == SYNC_BYTE || data[j+M2TS_PACKET_SIZE] == SYNC_BYTE )
+            {
+                a->packet_size = data[j+TS_PACKET_SIZE] == SYNC_BYTE ? TS_PACKET_SIZE : M2TS_PACKET_SIZE;
+                return j;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for( ; i < len; i++ )
+    {
+        if( data[i] != SYNC_BYTE )
+            continue;
+        if( i + M2TS_PACKET_SIZE >= len )
+            return i;
+        if( data[i+TS_PACKET_SIZE] == SYNC_BYTE || data[i+M2TS_PACKET_SIZE] == SYNC_BYTE )
+        {
+            a->packet_size = data[i+TS_PACKET_SIZE] == SYNC_BYTE ? TS_PACKET_SIZE : M2TS_PACKET_SIZE;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Returns whether the packet should be analyzed */
+static int check_sync( ts_analyzer_t *a, uint8_t *pkt )
+{
+    if( pkt[0] == SYNC_BYTE )
+    {
+        a->bad_sync = 0;
+        if( a->sync_state == SYNC_PRESYNC && ++a->sync_count >= SYNC_ACQUIRE )
+            a->sync_state = SYNC_LOCKED;
+        return 1;
+    }
+
+    if( a->sync_state == SYNC_LOCKED )
+    {
+        a->packet_num = a->packets;
+        report_error( a, NULL, LIBMPEGTS_ERR_SYNC_BYTE );
+        if( ++a->bad_sync < SYNC_LOSE )
+            return 1;
+        report_error( a, NULL, LIBMPEGTS_ERR_SYNC_LOSS );
+    }
+
+    a->sync_state = SYNC_HUNT;
+    return 0;
+}
+
+ts_analyzer_t *ts_create_analyzer( ts_analyzer_params_t *params )
+{
+    ts_analyzer_t *a = calloc( 1, sizeof(*a) );
+    if( !a )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    if( params )
+        memcpy( &a->params, params, sizeof(a->params) );
+
+    a->pid_timeout = (a->params.pid_timeout ? a->params.pid_timeout : DEFAULT_PID_TIMEOUT) * 27000LL;
+    a->packet_size = TS_PACKET_SIZE;
+    a->time_pid = -1;
+
+    return a;
+}
+
+int ts_analyze( ts_analyzer_t *a, uint8_t *data, int len )
+{
+    int pos = 0;
+
+    while( pos < len )
+    {
+        int size = a->packet_size;
+
+        if( a->sync_state == SYNC_HUNT )
+        {
+            int i = find_sync( a, &data[pos], len - pos );
+            if( i < 0 )
+                return 0;
+            pos += i;
+            a->sync_state = SYNC_PRESYNC;
+            a->sync_count = a->bad_sync = 0;
+            continue;
+        }
+
+        /* complete a packet split over calls */
+        if( a->buf_len )
+        {
+            int copy = MIN( size - a->buf_len, len - pos );
+            memcpy( &a->buf[a->buf_len], &data[pos], copy );
+            a->buf_len += copy;
+            pos += copy;
+            if( a->buf_len < size )
+                return 0;
+
+            a->buf_len = 0;
+            if( !check_sync( a, a->buf ) )
+            {
+                /* rescan the packet which failed */
+                pos -= MIN( copy, size - 1 );
+                continue;
+            }
+            if( queue_packet( a, a->buf ) < 0 )
+                return -1;
+            continue;
+        }
+
+        /* when locked, test the sync bytes of several packets at once */
+        if( a->sync_state == SYNC_LOCKED )
+        {
+            while( len - pos >= 8 * size )
+            {
+                uint8_t *pkt = &data[pos];
+                int bad = 0;
+
+                for( int i = 0; i < 8; i++ )
+                    bad |= pkt[i*size] ^ SYNC_BYTE;
+                if( bad )
+                    break;
+
+                a->bad_sync = 0;
+                for( int i = 0; i < 8; i++ )
+                {
+                    if( queue_packet( a, &pkt[i*size] ) < 0 )
+                        return -1;
+                }
+                pos += 8 * size;
+            }
+        }
+
+        while( a->sync_state != SYNC_HUNT && len - pos >= size )
+        {
+            if( !check_sync( a, &data[pos] ) )
+            {
+                pos++;
+                break;
+            }
+            if( queue_packet( a, &data[pos] ) < 0 )
+                return -1;
+            pos += size;
+        }
+
+        if( a->sync_state != SYNC_HUNT && len - pos < size )
+        {
+            memcpy( a->buf, &data[pos], len - pos );
+            a->buf_len = len - pos;
+            pos = len;
+        }
+    }
+
+    return 0;
+}
+
+int ts_get_analyzer_report( ts_analyzer_t *a, ts_analyzer_report_t *report )
+{
+    ts_analyzer_pid_t *pids;
+
+    /* the packets after the last PCR are timed with the rate of the last interval */
+    if( flush_queue( a, -1, 0 ) < 0 )
+        return -1;
+
+    pids = realloc( a->report_pids, MAX( a->num_pids, 1 ) * sizeof(*pids) );
+    if( !pids )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+    a->report_pids = pids;
+
+    memset( report, 0, sizeof(*report) );
+    report->packets = a->packets;
+    memcpy( report->errors, a->errors, sizeof(report->errors) );
+
+    if( a->time_pcr > a->first_pcr )
+        report->muxrate = (double)(a->time_pcr_packet - a->first_pcr_packet) * PACKET_BITS * TS_CLOCK / (a->time_pcr - a->first_pcr);
+
+    report->sys.rx = RX_SYS;
+    report->sys.rbx = MAX( R_SYS_DEFAULT, (a->params.muxrate ? a->params.muxrate : report->muxrate) / 500 );
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *p = a->pids[a->order[i]];
+
+        /* report the program whose Bsys got fullest */
+        if( p->is_pmt && ( !report->sys.tb.size || p->sys.b.max > report->sys.mb.max ) )
+        {
+            get_buffer_stats( &p->sys.tb, &report->sys.tb );
+            get_buffer_stats( &p->sys.b, &report->sys.mb );
+        }
+    }
+
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *p = a->pids[a->order[i]];
+        ts_analyzer_pid_t *out = &pids[i];
+
+        memset( out, 0, sizeof(*out) );
+        out->pid = p->pid;
+        out->stream_type = p->type == PID_ES ? p->stream_type : -1;
+        out->packets = p->packets;
+        memcpy( out->errors, p->errors, sizeof(out->errors) );
+
+        out->tstd = p->tstd;
+        if( p->tstd )
+        {
+            out->buffers.rx = p->rx;
+            out->buffers.rbx = p->rbx;
+            get_buffer_stats( &p->tb, &out->buffers.tb );
+            get_buffer_stats( &p->mb, &out->buffers.mb );
+            if( p->video )
+                get_buffer_stats( &p->eb, &out->buffers.eb );
+        }
+    }
+
+    report->num_pids = a->num_pids;
+    report->pids = pids;
+
+    return 0;
+}
+
+const char *ts_analyzer_error_name( int error )
+{
+    if( error < 0 || error >= LIBMPEGTS_ANALYZER_NUM_ERRORS )
+        return "unknown";
+
+    return error_names[error];
+}
+
+void ts_close_analyzer( ts_analyzer_t *a )
+{
+    for( int i = 0; i < a->num_pids; i++ )
+    {
+        analyzer_pid_t *p = a->pids[a->order[i]];
+        free( p->section );
+        free( p->aus );
+        free( p );
+    }
+
+    free( a->queue );
+    free( a->report_pids );
+    free( a );
+}
@@ -30,7 +30,7 @@ typedef struct
     int vbv;          /* max vbv buffer (kbit) */
 } mpeg2_level_t;
 
-const mpeg2_level_t mpeg2_levels[] =
+static const mpeg2_level_t mpeg2_levels[] =
 {
     { LIBMPEGTS_MPEG2_LEVEL_LOW,      LIBMPEGTS_MPEG2_PROFILE_MAIN,   4000000,  475136 },
     { LIBMPEGTS_MPEG2_LEVEL_MAIN,     LIBMPEGTS_MPEG2_PROFILE_SIMPLE, 15000000, 1835008 },
@@ -50,7 +50,7 @@ typedef struct
     int cpb;         /* Max CPB Size (kbit/sec) */
 } avc_level_t;
 
-const avc_level_t avc_levels[] =
+static const avc_level_t avc_levels[] =
 {
     { 10,     64,     64 }, /* level 1.0 */
     {  9,    128,    350 }, /* level 1b */
@@ -72,7 +72,7 @@ const avc_level_t avc_levels[] =
     { 0 }
 };
 
-const uint8_t avc_profiles[] =
+static const uint8_t avc_profiles[] =
 {
     [AVC_BASELINE] = 66,
     [AVC_MAIN]     = 77,
@@ -86,7 +86,7 @@ const uint8_t avc_profiles[] =
     [AVC_CAVLC_444_INTRA] = 44,
 };
 
-const int nal_factor[] =
+static const int nal_factor[] =
 {
     [AVC_BASELINE] = 1200,
     [AVC_MAIN]     = 1200,
@@ -108,7 +108,7 @@ typedef struct
     int bsn;         /* Size of Main buffer */
 } aac_buffer_t;
 
-const aac_buffer_t aac_buffers[] =
+static const aac_buffer_t aac_buffers[] =
 {
     { 2,  2000000,  3584*8 },
     { 8,  5529600,  8976*8 },
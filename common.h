@@ -47,8 +47,13 @@
 
 #define TS_HEADER_SIZE 4
 #define TS_PACKET_SIZE 188
+/* Blu-Ray source packets have a TP_extra_header and are written in aligned units of 32 */
+#define TP_EXTRA_HEADER_SIZE 4
+#define ALIGNED_UNIT_PACKETS 32
 #define TS_CLOCK       27000000LL
 #define TS_START       10
+/* the first two bits of section_length are zero and it may not exceed 0x3fd */
+#define MAX_PSI_SECTION_LENGTH 1021
 
 // arbitrary
 #define MAX_PROGRAMS   100
@@ -57,6 +62,17 @@
 /* DVB 40ms recommendation */
 #define PCR_MAX_RETRANS_TIME 35
 #define PAT_MAX_RETRANS_TIME 95
+/* TR 101 211 minimum interval between sections of a table */
+#define PSI_MIN_RETRANS_TIME 25
+
+/* seek index, the records are little-endian */
+#define INDEX_MAGIC          "TSIX"
+#define INDEX_VERSION        1
+#define INDEX_HEADER_SIZE    16
+#define INDEX_RECORD_SIZE    40
+
+/* true VBR: slots kept free for PSI and PCR packets in front of each deadline */
+#define TRUE_VBR_MARGIN 8
 
 /* PIDs */
 #define PAT_PID         0x0000
@@ -99,6 +115,7 @@
 #define MAX(a,b) ( (a)>(b) ? (a) : (b) )
 
 #define IS_VIDEO(x) ( x->stream_format == LIBMPEGTS_VIDEO_MPEG2 || x->stream_format == LIBMPEGTS_VIDEO_AVC )
+#define FULL_TSTD(w, x) ( (w)->full_tstd && (x)->mb.buf_size )
 
 /* Internal Program & Stream Structures */
 typedef struct
@@ -106,6 +123,8 @@ typedef struct
     int level;
     int profile;
     int frame_rate;
+    int vbv_maxrate;
+    int vbv_bufsize;
 } mpegvideo_stream_ctx_t;
 
 typedef struct
@@ -164,8 +183,29 @@ typedef struct
     double last_byte_removal_time;
 
     buffer_queue_t queued_packets[10];
+
+    /* telemetry */
+    int min_buf;
+    int max_buf;
+    int64_t sum_buf;
+    int64_t num_samples;
 } buffer_t;
 
+typedef struct
+{
+    ts_tstd_sample_t *samples;
+    int start;
+    int num_samples;
+    uint64_t dropped; /* overwritten before they were read */
+} tstd_history_t;
+
+/* access unit waiting in the decoder buffers for removal at its DTS */
+typedef struct
+{
+    int64_t dts;
+    int size; /* bits */
+} tstd_au_t;
+
 typedef struct
 {
     int pid;
@@ -178,6 +218,21 @@ typedef struct
 
     int64_t last_pkt_pcr;
 
+    /* the first packet has been recorded in the seek index */
+    int indexed;
+
+    /* access unit being submitted in chunks */
+    struct ts_int_pes_t *open_pes;
+
+    /* program the stream belongs to */
+    struct ts_int_program_t *program;
+
+    /* how far the mux can run with the queued access units of this stream (27MHz) */
+    int64_t horizon;
+    int horizon_pes;
+
+    ts_latency_stats_t latency;
+
     /* Stream contexts */
     mpegvideo_stream_ctx_t  *mpegvideo_ctx;
     lpcm_stream_ctx_t       *lpcm_ctx;
@@ -202,6 +257,14 @@ typedef struct
     buffer_t eb; /* elementary buffer */
     int rbx;     /* flow from multiplex to elementary buffer (video) */
 
+    /* full T-STD model */
+    int tb_payload;      /* bits of the transport buffer that are PES data */
+    tstd_au_t *decoder_aus;
+    int num_decoder_aus;
+    int decoder_aus_alloced;
+
+    tstd_history_t history;
+
     /* Language Codes */
     int write_lang_code;
     char lang_code[4];
@@ -233,12 +296,18 @@ typedef struct
     int hdmv_aspect_ratio;
 } ts_int_stream_t;
 
-typedef struct
+typedef struct ts_int_pes_t
 {
     uint8_t *data;
     int size;
     uint8_t *cur_pos;
     int bytes_left;
+    int alloced;
+
+    /* first packet of the pes has been written */
+    int started;
+    /* more chunks of the access unit are to follow */
+    int awaiting_chunks;
 
     /* stream context associated with pes */
     ts_int_stream_t *stream;
@@ -252,6 +321,9 @@ typedef struct
     int64_t dts;
     int64_t pts;
 
+    /* pcr when the frame was written to libmpegts */
+    int64_t enqueue_pcr;
+
     /* DVB AU_Information specific fields */
     uint8_t frame_type;
     int ref_pic_idc;
@@ -259,7 +331,7 @@ typedef struct
     int pic_struct;
 } ts_int_pes_t;
 
-typedef struct
+typedef struct ts_int_program_t
 {
     ts_int_stream_t pmt;
     int program_num;
@@ -270,13 +342,17 @@ typedef struct
     int num_streams;
     ts_int_stream_t *streams[MAX_STREAMS];
     ts_int_stream_t *pcr_stream;
+    ts_int_stream_t *video_stream;
 
     int pmt_version;
 
     uint64_t last_pcr;
+    int force_pcr; /* the next packet needs a PCR as the rate since the last one changed */
 
     int64_t video_dts;
 
+    int trick_cc; /* next continuity counter of the PCR stream in the trick play output */
+
     sdt_program_ctx_t sdt_ctx;
     int is_3dtv;
 
@@ -295,8 +371,12 @@ struct ts_writer_t
 
     uint64_t bytes_written;
     uint64_t packets_written;
+    /* the PCR clock restarts from this packet and PCR whenever the muxrate changes */
+    uint64_t muxrate_packet;
+    int64_t muxrate_pcr;
 
     int ts_type;
+    int packet_size; /* with the TP_extra_header of Blu-Ray */
     int ts_id;
 
     int cbr;
@@ -307,6 +387,7 @@ struct ts_writer_t
 
     int num_programs;
     ts_int_program_t *programs[MAX_PROGRAMS];
+    int num_radio_programs; /* audio and data-only programs */
 
     int pat_period;
     int pcr_period;
@@ -325,6 +406,33 @@ struct ts_writer_t
     int pcr_list_alloced;
     int64_t *pcr_list;
 
+    /* random access points of video PCR streams carry a PCR,
+     * set up for the segmenter, the seek index and trick play */
+    int random_access_pcr;
+
+    /* packets of the last output which start a random access point of a PCR stream */
+    int num_random_access;
+    int random_access_alloced;
+    int *random_access_list;
+
+    /* packets of the last output which belong to a random access point of a video PCR stream,
+     * and the trick play output made from them */
+    int trick_play;
+    int num_trick_packets;
+    int trick_packets_alloced;
+    int *trick_packets;
+    int trick_len;
+    int trick_alloced;
+    uint8_t *trick_buf;
+    int64_t *trick_pcr_list;
+
+    /* seek index records of the last output */
+    int index;
+    int index_header;
+    int index_len;
+    int index_alloced;
+    uint8_t *index_buf;
+
     /* system control */
     buffer_t tb;     /* transport buffer */
     buffer_t main_b; /* main buffer */
@@ -332,6 +440,32 @@ struct ts_writer_t
     int rx_sys;      /* flow from transport to main buffer */
     int r_sys;       /* flow from main buffer to system decoder */
 
+    /* T-STD telemetry */
+    tstd_history_t sys_history;
+    int tstd_history_size;
+    int64_t tstd_history_interval;
+    int64_t next_tstd_sample;
+
+    /* mux delay (27MHz) */
+    int64_t mux_delay;
+    int64_t min_mux_delay;
+    int64_t max_mux_delay;
+
+    /* schedule against the multiplex and elementary buffers */
+    int full_tstd;
+
+    /* send data as late as possible and skip the idle slots,
+     * the first packet after skipped slots carries a PCR */
+    int true_vbr;
+    /* nothing becomes due before this while the queue is unchanged, 0 to scan the queue */
+    int64_t lazy_next_due;
+
+    /* packet counters, average_bitrate is derived from the others */
+    ts_stats_t stats;
+    uint64_t rate_window_end; /* slot which ends the current one second window */
+    uint64_t rate_window_packets;
+    int64_t stats_start_pcr;
+
     /* CableLabs */
     int legacy_constraints;
 
@@ -367,5 +501,6 @@ void write_crc( bs_t *s, int start );
 int write_padding( bs_t *s, int start );
 int increase_pcr( ts_writer_t *w, int num_packets, int imaginary );
 ts_int_stream_t *find_stream( ts_writer_t *w, int pid );
+int check_ts_packets( uint8_t *data, int len );
 
 #endif
@@ -0,0 +1,7 @@
+#define HAVE_MALLOC_H 1
+#define ARCH_X86_64 1
+#define SYS_LINUX 1
+#define fseek fseeko
+#define ftell ftello
+#define LIBMPEGTS_VERSION " r0+21M 95d9ed6"
+#define LIBMPEGTS_POINTVER "0.0.0+21M 95d9ed6"
@@ -0,0 +1,16 @@
+prefix=/usr/local
+exec_prefix=${prefix}
+bindir=${exec_prefix}/bin
+libdir=${exec_prefix}/lib
+includedir=${prefix}/include
+ARCH=X86_64
+SYS=LINUX
+CC=gcc
+CFLAGS=-Wshadow -O3 -ffast-math  -Wall -I. -std=gnu99 -s -fomit-frame-pointer -fno-tree-vectorize
+LDFLAGS= -lm -s -lpthread
+LDFLAGSCLI=
+AR=ar
+RANLIB=ranlib
+STRIP=strip
+EXE=
+DEVNULL=/dev/null
@@ -177,6 +177,7 @@ int write_nit( ts_writer_t *w )
 
     // -40 to include header and pointer field
     write_padding( s, start - 40 );
+    w->stats.psi_packets++;
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
@@ -219,8 +220,8 @@ int write_sdt( ts_writer_t *w )
         goto end;
     }
 
-    start = bs_pos( s );
     write_packet_header( w, s, 1, SDT_PID, PAYLOAD_ONLY, &w->sdt->cc );
+    start = bs_pos( s ) - 32; /* from the sync byte */
     bs_write( s, 8, 0 );         // pointer field
 
     bs_init( &q, sdt_buf, buf_size );
@@ -285,6 +286,7 @@ int write_sdt( ts_writer_t *w )
     bs_flush( s );
 
     write_padding( s, start );
+    w->stats.psi_packets++;
     if( increase_pcr( w, 1, 0 ) < 0 )
         goto end;
 
@@ -296,13 +298,14 @@ int write_sdt( ts_writer_t *w )
     /* keep writing SDT packets */
     while( length > 0 )
     {
-        start = bs_pos( s );
         write_packet_header( w, s, 0, SDT_PID, PAYLOAD_ONLY, &w->sdt->cc );
+        start = bs_pos( s ) - 32; /* from the sync byte */
         write_bytes( s, &sdt_buf[pos], MIN( bytes_left, length ) );
         write_padding( s, start );
         pos += MIN( bytes_left, length );
         length -= MIN( bytes_left, length );
 
+        w->stats.psi_packets++;
         if( increase_pcr( w, 1, 0 ) < 0 )
             goto end;
     }
@@ -377,6 +380,7 @@ int write_tdt( ts_writer_t *w )
     // -40 to include header and pointer field
     write_padding( s, start - 40 );
 
+    w->stats.psi_packets++;
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
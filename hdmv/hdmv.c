@@ -31,7 +31,7 @@ int ts_setup_hdmv_lpcm_stream( ts_writer_t *w, int pid, int num_channels, int sa
         return -1;
     }
 
-    stream->lpcm_ctx = calloc( 1, sizeof(stream->lpcm_ctx) );
+    stream->lpcm_ctx = calloc( 1, sizeof(*stream->lpcm_ctx) );
     if( !stream->lpcm_ctx )
         return -1;
 
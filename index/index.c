@@ -0,0 +1,241 @@
+/*****************************************************************************
+ * index.c : seek index reader
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+
+/* The random access points of one PID. The PTS of different programs are unrelated,
+ * so only the points of one PID are sorted. */
+typedef struct
+{
+    int pid;
+    ts_index_entry_t *entries;
+    int num_entries;
+} index_pid_t;
+
+struct ts_index_t
+{
+    ts_index_entry_t *random_access;
+    int num_random_access;
+
+    index_pid_t *pids;
+    int num_pids;
+
+    ts_index_entry_t *first_packets;
+    int num_first_packets;
+};
+
+static uint64_t read_le( const uint8_t *p, int bytes )
+{
+    uint64_t value = 0;
+
+    for( int i = bytes - 1; i >= 0; i-- )
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static int add_entry( ts_index_entry_t **entries, int *num_entries, ts_index_entry_t *entry )
+{
+    /* grow in powers of two */
+    if( !( *num_entries & (*num_entries - 1) ) )
+    {
+        ts_index_entry_t *temp = realloc( *entries, MAX( *num_entries * 2, 16 ) * sizeof(*temp) );
+        if( !temp )
+            return -1;
+        *entries = temp;
+    }
+
+    (*entries)[(*num_entries)++] = *entry;
+    return 0;
+}
+
+static index_pid_t *find_pid( ts_index_t *idx, int pid )
+{
+    for( int i = 0; i < idx->num_pids; i++ )
+        if( idx->pids[i].pid == pid )
+            return &idx->pids[i];
+    return NULL;
+}
+
+static int add_random_access( ts_index_t *idx, ts_index_entry_t *entry )
+{
+    index_pid_t *p = find_pid( idx, entry->pid );
+
+    if( !p )
+    {
+        index_pid_t *temp = realloc( idx->pids, (idx->num_pids + 1) * sizeof(*temp) );
+        if( !temp )
+            return -1;
+        idx->pids = temp;
+        p = &idx->pids[idx->num_pids++];
+        memset( p, 0, sizeof(*p) );
+        p->pid = entry->pid;
+    }
+
+    if( add_entry( &p->entries, &p->num_entries, entry ) < 0 )
+        return -1;
+    return add_entry( &idx->random_access, &idx->num_random_access, entry );
+}
+
+ts_index_t *ts_open_index( const char *filename )
+{
+    uint8_t header[INDEX_HEADER_SIZE], record[INDEX_RECORD_SIZE];
+    int record_size;
+
+    FILE *f = fopen( filename, "rb" );
+    if( !f )
+    {
+        fprintf( stderr, "Could not open %s\n", filename );
+        return NULL;
+    }
+
+    if( fread( header, 1, INDEX_HEADER_SIZE, f ) != INDEX_HEADER_SIZE || memcmp( header, INDEX_MAGIC, 4 ) ||
+        read_le( header+4, 2 ) != INDEX_VERSION )
+    {
+        fprintf( stderr, "%s is not a seek index\n", filename );
+        fclose( f );
+        return NULL;
+    }
+    /* later versions may append fields to the records */
+    record_size = read_le( header+6, 2 );
+    if( record_size < INDEX_RECORD_SIZE )
+    {
+        fprintf( stderr, "%s is not a seek index\n", filename );
+        fclose( f );
+        return NULL;
+    }
+
+    ts_index_t *idx = calloc( 1, sizeof(*idx) );
+    if( !idx )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        fclose( f );
+        return NULL;
+    }
+
+    /* a partial record at the end is still being written */
+    while( fread( record, 1, INDEX_RECORD_SIZE, f ) == INDEX_RECORD_SIZE )
+    {
+        ts_index_entry_t entry;
+        int ret = 0;
+
+        entry.type = record[0];
+        entry.frame_type = record[1];
+        entry.pid = read_le( record+2, 2 );
+        entry.offset = read_le( record+8, 8 );
+        entry.pcr = read_le( record+16, 8 );
+        entry.pts = read_le( record+24, 8 );
+        entry.dts = read_le( record+32, 8 );
+
+        if( entry.type == LIBMPEGTS_INDEX_RANDOM_ACCESS )
+            ret = add_random_access( idx, &entry );
+        else if( entry.type == LIBMPEGTS_INDEX_FIRST_PACKET )
+            ret = add_entry( &idx->first_packets, &idx->num_first_packets, &entry );
+        if( ret < 0 )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            fclose( f );
+            ts_close_index( idx );
+            return NULL;
+        }
+
+        if( record_size > INDEX_RECORD_SIZE && fseek( f, record_size - INDEX_RECORD_SIZE, SEEK_CUR ) < 0 )
+            break;
+    }
+
+    fclose( f );
+
+    return idx;
+}
+
+/* The last random access point of pid whose PCR (or PTS) is at or before value */
+static ts_index_entry_t *find_entry( ts_index_t *idx, int pid, int64_t value, int pts )
+{
+    index_pid_t *p = find_pid( idx, pid );
+    int lo = 0, hi;
+
+    if( !p )
+        return NULL;
+
+    hi = p->num_entries;
+    while( lo < hi )
+    {
+        int mid = (lo + hi) / 2;
+        int64_t v = pts ? p->entries[mid].pts : p->entries[mid].pcr;
+
+        if( v <= value )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo ? &p->entries[lo - 1] : NULL;
+}
+
+int ts_index_find( ts_index_t *idx, int pid, int64_t pcr, ts_index_entry_t *entry )
+{
+    ts_index_entry_t *e = find_entry( idx, pid, pcr, 0 );
+
+    if( !e )
+        return -1;
+    *entry = *e;
+    return 0;
+}
+
+int ts_index_find_pts( ts_index_t *idx, int pid, int64_t pts, ts_index_entry_t *entry )
+{
+    ts_index_entry_t *e = find_entry( idx, pid, pts, 1 );
+
+    if( !e )
+        return -1;
+    *entry = *e;
+    return 0;
+}
+
+int ts_index_first_packet( ts_index_t *idx, int pid, uint64_t *offset )
+{
+    for( int i = 0; i < idx->num_first_packets; i++ )
+    {
+        if( idx->first_packets[i].pid == pid )
+        {
+            *offset = idx->first_packets[i].offset;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int ts_index_get_random_access( ts_index_t *idx, ts_index_entry_t **entries, int *num_entries )
+{
+    *entries = idx->random_access;
+    *num_entries = idx->num_random_access;
+
+    return 0;
+}
+
+int ts_close_index( ts_index_t *idx )
+{
+    for( int i = 0; i < idx->num_pids; i++ )
+        free( idx->pids[i].entries );
+    free( idx->pids );
+    free( idx->random_access );
+    free( idx->first_packets );
+    free( idx );
+
+    return 0;
+}
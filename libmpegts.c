@@ -125,6 +125,13 @@ static void write_avc_descriptor( bs_t *s, ts_int_program_t *program, ts_int_str
     bs_write( s, 8, AVC_DESCRIPTOR_TAG ); // descriptor_tag
     bs_write( s, 8, 0x04 );               // descriptor_length
 
+    /* the PMT size is checked before the video stream is set up */
+    if( !stream->mpegvideo_ctx )
+    {
+        bs_write32( s, 0 );
+        return;
+    }
+
     bs_write( s, 8, avc_profiles[stream->mpegvideo_ctx->profile] ); // profile_idc
 
     bs_write1( s, stream->mpegvideo_ctx->profile == AVC_BASELINE ); // constraint_set0_flag
@@ -208,10 +215,13 @@ static void write_iso_lang_descriptor( bs_t *s, ts_int_stream_t *stream )
 /**** PCR functions ****/
 static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
 {
+    if( program->force_pcr )
+        return 1;
+
     // if the next packet written goes over the max pcr retransmit boundary, write the pcr in the next packet
-    double next_pkt_pcr = ((w->packets_written * TS_PACKET_SIZE) + (TS_PACKET_SIZE + 7)) * 8.0 / w->ts_muxrate -
+    double next_pkt_pcr = (((w->packets_written - w->muxrate_packet) * w->packet_size) + (w->packet_size + 7)) * 8.0 / w->ts_muxrate -
                           (double)program->last_pcr / TS_CLOCK;
-    next_pkt_pcr += TS_START;
+    next_pkt_pcr += (double)w->muxrate_pcr / TS_CLOCK;
 
     if( next_pkt_pcr >= (double)w->pcr_period / 1000 )
     {
@@ -221,20 +231,65 @@ static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
     return 0;
 }
 
+/* A packet slot is a whole (source) packet at the muxrate and the offset counts from the sync byte,
+ * so the TP_extra_header of Blu-Ray takes up the end of the previous slot */
 static int64_t get_pcr_int( ts_writer_t *w, double offset )
 {
-    return (int64_t)((8.0 * (w->packets_written * TS_PACKET_SIZE + offset) / w->ts_muxrate) * TS_CLOCK + 0.5) + TS_START * TS_CLOCK;
+    return (int64_t)((8.0 * ((w->packets_written - w->muxrate_packet) * w->packet_size + offset) / w->ts_muxrate) * TS_CLOCK + 0.5) + w->muxrate_pcr;
 }
 
 static double get_pcr_double( ts_writer_t *w, double offset )
 {
-    return (8.0 * (w->packets_written * TS_PACKET_SIZE + offset) / w->ts_muxrate) + TS_START;
+    return (8.0 * ((w->packets_written - w->muxrate_packet) * w->packet_size + offset) / w->ts_muxrate) + (double)w->muxrate_pcr / TS_CLOCK;
+}
+
+/* Stamps a queued Blu-Ray source packet with the arrival time of the next slot */
+static void write_tp_extra_header( ts_writer_t *w, uint8_t *pkt )
+{
+    uint32_t ats = get_pcr_int( w, 0 ) & 0x3fffffff; // copy_permission_indicator is 0
+
+    pkt[0] = ats >> 24;
+    pkt[1] = ats >> 16;
+    pkt[2] = ats >> 8;
+    pkt[3] = ats;
+}
+
+/**** Statistics ****/
+static void add_to_histogram( ts_histogram_t *histogram, int64_t value )
+{
+    int bucket = 0;
+
+    if( value >= 0 )
+    {
+        int64_t ms = value / 27000;
+        for( bucket = 1; bucket < LIBMPEGTS_HISTOGRAM_BUCKETS-1 && ms >= (1LL << (bucket-1)); bucket++ )
+            ;
+    }
+
+    if( !histogram->count || value < histogram->min )
+        histogram->min = value;
+    if( !histogram->count || value > histogram->max )
+        histogram->max = value;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket]++;
 }
 
 /**** Buffer management ****/
+static void sample_buffer( buffer_t *buffer )
+{
+    if( !buffer->num_samples || buffer->cur_buf < buffer->min_buf )
+        buffer->min_buf = buffer->cur_buf;
+    buffer->max_buf = MAX( buffer->max_buf, buffer->cur_buf );
+    buffer->sum_buf += buffer->cur_buf;
+    buffer->num_samples++;
+}
+
 static void add_to_buffer( buffer_t *buffer )
 {
     buffer->cur_buf += TS_PACKET_SIZE * 8;
+    buffer->max_buf = MAX( buffer->max_buf, buffer->cur_buf );
 }
 
 static void drip_buffer( ts_writer_t *w, ts_int_program_t *program, int rx, buffer_t *buffer, double next_pcr )
@@ -259,6 +314,95 @@ static void drip_buffer( ts_writer_t *w, ts_int_program_t *program, int rx, buff
     buffer->last_byte_removal_time = next_pcr - offset;
 
     buffer->cur_buf = MAX( buffer->cur_buf, 0 );
+    sample_buffer( buffer );
+}
+
+/* Full T-STD model
+ * PES data leaves the transport buffer for the multiplex buffer (main buffer for audio), video moves on
+ * to the elementary buffer at Rbx with the leak method, and access units are removed at their DTS. */
+static void drip_decoder_buffers( ts_writer_t *w, ts_int_stream_t *stream, int tb_out, double next_pcr )
+{
+    double cur_pcr = get_pcr_double( w, 0 );
+    int64_t bits;
+
+    /* packet headers are discarded at the output of the transport buffer */
+    if( stream->tb.cur_buf )
+        bits = (int64_t)stream->tb_payload * tb_out / (stream->tb.cur_buf + tb_out);
+    else
+        bits = stream->tb_payload;
+    stream->tb_payload -= bits;
+    stream->mb.cur_buf += bits;
+
+    if( IS_VIDEO( stream ) )
+    {
+        /* relative to absolute time so the fractional bits are not lost */
+        bits = (int64_t)floor( stream->rbx * next_pcr ) - (int64_t)floor( stream->rbx * cur_pcr );
+        bits = MIN( bits, stream->mb.cur_buf );
+        stream->mb.cur_buf -= bits;
+        stream->eb.cur_buf += bits;
+    }
+
+    /* sample before removal so the peaks are recorded */
+    sample_buffer( &stream->mb );
+    if( IS_VIDEO( stream ) )
+        sample_buffer( &stream->eb );
+
+    /* a late access unit is removed from wherever its data is */
+    while( stream->num_decoder_aus && stream->decoder_aus[0].dts / 90000.0 <= next_pcr )
+    {
+        int size = stream->decoder_aus[0].size;
+
+        bits = MIN( size, stream->eb.cur_buf );
+        stream->eb.cur_buf -= bits;
+        size -= bits;
+        bits = MIN( size, stream->mb.cur_buf );
+        stream->mb.cur_buf -= bits;
+        size -= bits;
+        stream->tb_payload -= MIN( size, stream->tb_payload );
+
+        stream->num_decoder_aus--;
+        memmove( &stream->decoder_aus[0], &stream->decoder_aus[1], stream->num_decoder_aus * sizeof(*stream->decoder_aus) );
+    }
+}
+
+/* Waiting for the transport buffer to empty would cap a stream at muxrate / ceil( muxrate / rx ),
+ * as low as half of rx when the muxrate is just above it */
+static int tb_has_room( buffer_t *tb )
+{
+    return tb->cur_buf + TS_PACKET_SIZE * 8 <= tb->buf_size;
+}
+
+/* A packet may be sent if none of the buffers would overflow, assuming nothing is removed before it arrives */
+static int tstd_has_room( ts_int_stream_t *stream )
+{
+    int pending = stream->mb.cur_buf + stream->tb_payload + 184 * 8;
+
+    if( !tb_has_room( &stream->tb ) || pending > stream->mb.buf_size )
+        return 0;
+
+    return !IS_VIDEO( stream ) || stream->eb.cur_buf + pending <= stream->eb.buf_size;
+}
+
+static int add_decoder_au( ts_int_stream_t *stream, ts_int_pes_t *pes )
+{
+    if( stream->num_decoder_aus == stream->decoder_aus_alloced )
+    {
+        int alloced = stream->decoder_aus_alloced ? stream->decoder_aus_alloced * 2 : 16;
+        tstd_au_t *tmp = realloc( stream->decoder_aus, alloced * sizeof(*tmp) );
+        if( !tmp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        stream->decoder_aus = tmp;
+        stream->decoder_aus_alloced = alloced;
+    }
+
+    stream->decoder_aus[stream->num_decoder_aus].dts = pes->dts;
+    stream->decoder_aus[stream->num_decoder_aus].size = pes->size * 8;
+    stream->num_decoder_aus++;
+
+    return 0;
 }
 
 static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *program, ts_int_pes_t *pes,
@@ -271,7 +415,7 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
 
     private_data_flag = write_dvb_au = random_access = priority = 0;
 
-    if( pes && ( pes->data == pes->cur_pos ) )
+    if( pes && !pes->started )
     {
         ts_int_stream_t *stream = pes->stream;
         random_access = pes->random_access;
@@ -284,8 +428,9 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
                 private_data_flag = write_dvb_au = 1;
         }
 
+        /* only the first packet of the pes, the length of the adaptation field is
+         * measured with a call before the one that writes it */
         priority = pes->priority;
-        pes->random_access = 0; /* don't write this flag again */
     }
 
     /* initialise temporary bitstream */
@@ -308,6 +453,7 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
              int64_t mod = (int64_t)1 << 33;
 
              program->last_pcr = pcr;
+             program->force_pcr = 0;
 
              base = (pcr / 300) % mod;
              extension = pcr % 300;
@@ -338,6 +484,7 @@ static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *pr
 
     for( int i = 0; i < stuffing; i++ )
         bs_write( &q, 8, 0xff );
+    w->stats.stuffing_bytes += stuffing;
 
     bs_flush( &q );
     bs_write( s, 8, bs_pos( &q ) >> 3 ); // adaptation_field_length
@@ -358,6 +505,8 @@ static int write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
+    w->stats.pcr_packets++;
+
     return 0;
 }
 
@@ -367,48 +516,70 @@ static int write_pat( ts_writer_t *w )
     int start;
     bs_t *s = &w->out.bs;
 
-    write_packet_header( w, s, 1, PAT_PID, PAYLOAD_ONLY, &w->pat_cc );
-    bs_write( s, 8, 0 ); // pointer field
+    uint8_t pat_buf[1024], temp[1024];
+    bs_t o, p;
 
-    start = bs_pos( s );
-    bs_write( s, 8, PAT_TID ); // table_id
-    bs_write1( s, 1 );      // section_syntax_indicator
-    bs_write1( s, 0 );      // '0'
-    bs_write( s, 2, 0x03 ); // reserved`
-
-    // FIXME when multiple programs are allowed do this properly
-    int section_length = w->num_programs * 4 + w->network_pid * 4 + 9;
-    bs_write( s, 12, section_length & 0x3ff );
-
-    bs_write( s, 16, w->ts_id & 0xffff ); // transport_stream_id
-    bs_write( s, 2, 0x03 ); // reserved
-    bs_write( s, 5, w->pat_version ); // version_number
-    bs_write1( s, 1 );      // current_next_indicator
-    bs_write( s, 8, 0 );    // section_number
-    bs_write( s, 8, 0 );    // last_section_number
+    bs_init( &p, temp, sizeof(temp) );
+    bs_write( &p, 16, w->ts_id & 0xffff ); // transport_stream_id
+    bs_write( &p, 2, 0x03 ); // reserved
+    bs_write( &p, 5, w->pat_version ); // version_number
+    bs_write1( &p, 1 );      // current_next_indicator
+    bs_write( &p, 8, 0 );    // section_number
+    bs_write( &p, 8, 0 );    // last_section_number
 
     if( w->network_pid )
     {
-        bs_write( s, 16, 0 );   // program_number
-        bs_write( s, 3, 0x07 ); // reserved
-        bs_write( s, 13, w->network_pid & 0x1fff ); // network_PID
+        bs_write( &p, 16, 0 );   // program_number
+        bs_write( &p, 3, 0x07 ); // reserved
+        bs_write( &p, 13, w->network_pid & 0x1fff ); // network_PID
     }
 
     for( int i = 0; i < w->num_programs; i++ )
     {
-        bs_write( s, 16, w->programs[i]->program_num & 0xffff ); // program_number
-        bs_write( s, 3, 0x07 ); // reserved
-        bs_write( s, 13, w->programs[i]->pmt.pid & 0x1fff ); // program_map_PID
+        bs_write( &p, 16, w->programs[i]->program_num & 0xffff ); // program_number
+        bs_write( &p, 3, 0x07 ); // reserved
+        bs_write( &p, 13, w->programs[i]->pmt.pid & 0x1fff ); // program_map_PID
     }
 
-    bs_flush( s );
-    write_crc( s, start );
+    bs_init( &o, pat_buf, sizeof(pat_buf) );
+    bs_write( &o, 8, PAT_TID ); // table_id
+    bs_write1( &o, 1 );      // section_syntax_indicator
+    bs_write1( &o, 0 );      // '0'
+    bs_write( &o, 2, 0x03 ); // reserved
 
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-    add_to_buffer( &w->tb );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
+    /* section length includes crc */
+    bs_write( &o, 12, ((bs_pos( &p ) >> 3) + 4) & 0x3ff );
+
+    bs_flush( &p );
+    write_bytes( &o, temp, bs_pos( &p ) >> 3 );
+
+    bs_flush( &o );
+    write_crc( &o, 0 );
+    bs_flush( &o );
+
+    /* the section spans several packets with more than 40 or so programs */
+    int length = bs_pos( &o ) >> 3;
+    int pos = 0;
+
+    while( pos < length )
+    {
+        int bytes = MIN( length - pos, pos ? 184 : 183 );
+
+        write_packet_header( w, s, !pos, PAT_PID, PAYLOAD_ONLY, &w->pat_cc );
+        start = bs_pos( s );
+        if( !pos )
+            bs_write( s, 8, 0 ); // pointer field
+
+        write_bytes( s, &pat_buf[pos], bytes );
+        pos += bytes;
+
+        // -32 to include header
+        write_padding( s, start - 32 );
+        add_to_buffer( &w->tb );
+        w->stats.psi_packets++;
+        if( increase_pcr( w, 1, 0 ) < 0 )
+            return -1;
+    }
 
     return 0;
 }
@@ -417,46 +588,69 @@ static int eject_queued_pmt( ts_writer_t *w, ts_int_program_t *program, bs_t *s
 {
     uint8_t **temp;
 
-    write_bytes( s, program->pmt_packets[0], TS_PACKET_SIZE );
+    /* the arrival time stamp is only known now */
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+        write_tp_extra_header( w, program->pmt_packets[0] );
+    write_bytes( s, program->pmt_packets[0], w->packet_size );
+    free( program->pmt_packets[0] );
 
     if( program->num_queued_pmt > 1 )
+    {
         memmove( &program->pmt_packets[0], &program->pmt_packets[1], (program->num_queued_pmt-1) * sizeof(uint8_t*) );
 
-    temp = realloc( program->pmt_packets, (program->num_queued_pmt-1) * sizeof(uint8_t*) );
-    if( !temp )
+        temp = realloc( program->pmt_packets, (program->num_queued_pmt-1) * sizeof(uint8_t*) );
+        if( !temp )
+        {
+            fprintf( stderr, "malloc failed\n" );
+            return -1;
+        }
+        program->pmt_packets = temp;
+    }
+    else
     {
-        fprintf( stderr, "malloc failed\n" );
-        return -1;
+        /* realloc to zero bytes may return NULL */
+        free( program->pmt_packets );
+        program->pmt_packets = NULL;
     }
-    program->pmt_packets = temp;
 
     program->num_queued_pmt--;
 
     add_to_buffer( &w->tb );
+    w->stats.psi_packets++;
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
     return 0;
 };
 
-static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
+static uint8_t *queue_pmt_packet( ts_writer_t *w, ts_int_program_t *program )
 {
-    int start;
-    bs_t *s = &w->out.bs;
-
-    uint8_t pmt_buf[2048] = {0}, temp[2048] = {0}, temp1[2048] = {0};
-    bs_t o, p, q;
-    int section_length;
-    uint8_t **temp2;
+    uint8_t **temp = realloc( program->pmt_packets, (program->num_queued_pmt + 1) * sizeof(uint8_t*) );
+    if( !temp )
+    {
+        fprintf( stderr, "malloc failed" );
+        return NULL;
+    }
+    program->pmt_packets = temp;
 
-    /* this should never happen */
-    if( program->num_queued_pmt )
-        return eject_queued_pmt( w, program, s );
+    /* padding the packet reinitialises the bitstream which reads the word after it */
+    program->pmt_packets[program->num_queued_pmt] = malloc( w->packet_size + 4 );
+    if( !program->pmt_packets[program->num_queued_pmt] )
+    {
+        fprintf( stderr, "malloc failed" );
+        return NULL;
+    }
 
-    start = bs_pos( s );
-    write_packet_header( w, s, 1, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
+    return program->pmt_packets[program->num_queued_pmt++];
+}
 
-    bs_write( s, 8, 0 );       // pointer field
+/* Writes the program map section with its CRC into pmt_buf and returns its size,
+ * or -1 when it exceeds the maximum section_length */
+static int build_pmt( ts_writer_t *w, ts_int_program_t *program, uint8_t *pmt_buf )
+{
+    uint8_t temp[2048] = {0}, temp1[2048] = {0};
+    bs_t o, p, q;
+    int section_length;
 
     bs_init( &o, pmt_buf, 2048 );
 
@@ -600,11 +794,17 @@ static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
          bs_flush( &q );
          bs_write( &p, 12, bs_pos( &q ) >> 3 );   // ES_info_length
          write_bytes( &p, temp1, bs_pos( &q ) >> 3 );
+
+         /* stop before the section outgrows the buffers */
+         if( (bs_pos( &p ) >> 3) + 4 > MAX_PSI_SECTION_LENGTH )
+             goto too_large;
     }
 
     /* section length includes crc */
     section_length = (bs_pos( &p ) >> 3) + 4;
-    bs_write( &o, 12, section_length & 0x3ff );
+    if( section_length > MAX_PSI_SECTION_LENGTH )
+        goto too_large;
+    bs_write( &o, 12, section_length );
 
     /* write main chunk into pmt array */
     bs_flush( &p );
@@ -613,18 +813,69 @@ static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
     /* take crc of the whole program map section */
     bs_flush( &o );
     write_crc( &o, 0 );
+    bs_flush( &o );
+
+    return bs_pos( &o ) >> 3;
+
+too_large:
+    fprintf( stderr, "PMT of program %i is larger than %i bytes\n", program->program_num, MAX_PSI_SECTION_LENGTH );
+    return -1;
+}
+
+
+static int check_pmt_size( ts_writer_t *w, ts_int_program_t *program )
+{
+    uint8_t pmt_buf[2048] = {0};
+
+    return build_pmt( w, program, pmt_buf ) < 0 ? -1 : 0;
+}
+
+/* If spaced is set the whole PMT is queued, otherwise the first packet is written immediately */
+static int write_pmt( ts_writer_t *w, ts_int_program_t *program, int spaced )
+{
+    int start;
+    bs_t *s = &w->out.bs;
+
+    uint8_t pmt_buf[2048] = {0};
+    bs_t first;
+    int length;
+
+    /* this should never happen */
+    if( program->num_queued_pmt )
+        return spaced ? 0 : eject_queued_pmt( w, program, s );
+
+    /* descriptors set up after the streams can still make the section too large */
+    length = build_pmt( w, program, pmt_buf );
+    if( length < 0 )
+        return -1;
+
+    if( spaced )
+    {
+        uint8_t *pkt = queue_pmt_packet( w, program );
+        if( !pkt )
+            return -1;
+        bs_init( &first, pkt, w->packet_size );
+        s = &first;
+    }
+
+    write_packet_header( w, s, 1, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
+    start = bs_pos( s ) - 32; /* from the sync byte */
+
+    bs_write( s, 8, 0 );       // pointer field
 
-    int length = bs_pos( &o ) >> 3;
     int bytes_left = TS_PACKET_SIZE - ((bs_pos( s ) - start) >> 3);
 
-    bs_flush( &o );
     write_bytes( s, pmt_buf, MIN( bytes_left, length ) );
     bs_flush( s );
 
     write_padding( s, start );
-    add_to_buffer( &w->tb );
-    if( increase_pcr( w, 1, 0 ) < 0 )
-        return -1;
+    if( !spaced )
+    {
+        add_to_buffer( &w->tb );
+        w->stats.psi_packets++;
+        if( increase_pcr( w, 1, 0 ) < 0 )
+            return -1;
+    }
 
     int pos = MIN( bytes_left, length );
     length -= pos;
@@ -635,46 +886,35 @@ static int write_pmt( ts_writer_t *w, ts_int_program_t *program )
     while( length > 0 )
     {
         bs_t z;
-
-        temp2 = realloc( program->pmt_packets, (program->num_queued_pmt + 1) * sizeof(uint8_t*));
-        if( !temp2 )
-        {
-            fprintf( stderr, "malloc failed" );
-            return -1;
-        }
-        program->pmt_packets = temp2;
-
-        program->pmt_packets[program->num_queued_pmt] = malloc( TS_PACKET_SIZE );
-        if( !program->pmt_packets[program->num_queued_pmt] )
-        {
-            fprintf( stderr, "malloc failed" );
+        uint8_t *pkt = queue_pmt_packet( w, program );
+        if( !pkt )
             return -1;
-        }
 
-        bs_init( &z, program->pmt_packets[program->num_queued_pmt], 188 );
+        bs_init( &z, pkt, w->packet_size );
 
         write_packet_header( w, &z, 0, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
-        write_bytes( &z, &temp[pos], MIN( bytes_left, length ) );
+        start = bs_pos( &z ) - 32; /* from the sync byte */
+        write_bytes( &z, &pmt_buf[pos], MIN( bytes_left, length ) );
         bs_flush( &z );
-        write_padding( &z, 0 );
+        write_padding( &z, start );
         pos += MIN( bytes_left, length );
         length -= MIN( bytes_left, length );
-        program->num_queued_pmt++;
     }
 
     return 0;
 }
 
-static void retransmit_psi_and_si( ts_writer_t *w, ts_int_program_t *program, int first )
+static void retransmit_psi_and_si( ts_writer_t *w, int first )
 {
-    // TODO make this work with multiple programs
     int64_t cur_pcr = get_pcr_int( w, 0 );
     if( cur_pcr - w->last_pat >= w->pat_period * 27000LL || first )
     {
-        /* Although it is not in line with the mux strategy it is good practice to write PAT and PMT together */
+        /* Although it is not in line with the mux strategy it is good practice to write PAT and PMT together.
+         * The PMTs of an MPTS are spaced out so the system transport buffer doesn't overflow. */
         w->last_pat = cur_pcr;
-        write_pat( w );          // FIXME handle failure
-        write_pmt( w, program ); // FIXME handle failure
+        write_pat( w ); // FIXME handle failure
+        for( int i = 0; i < w->num_programs; i++ )
+            write_pmt( w, w->programs[i], w->num_programs > 1 ); // FIXME handle failure
     }
 
     cur_pcr = get_pcr_int( w, 0 );
@@ -731,6 +971,7 @@ static int write_sit( ts_writer_t *w )
 
     // -40 to include header and pointer field
     write_padding( s, start - 40 );
+    w->stats.psi_packets++;
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
@@ -757,8 +998,8 @@ static int write_table_section( ts_writer_t *w, ts_int_program_t *program, ts_fr
     bs_init(&s, out_pes->data, in_frame->size + 200 );
     if (doPointer)
         bs_write(&s, 8, 0); /* Pointer */
-    write_bytes(&s, in_frame->data, in_frame->size);
     header_size = bs_pos( &s ) >> 3;
+    write_bytes(&s, in_frame->data, in_frame->size);
     bs_flush(&s);
 
     out_pes->size = out_pes->bytes_left = bs_pos( &s ) >> 3;
@@ -851,20 +1092,58 @@ static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_
     return header_size;
 }
 
+static int append_pes_chunk( ts_int_pes_t *pes, ts_frame_t *in_frame )
+{
+    /* only keep the data which has not been packetised yet */
+    if( pes->cur_pos != pes->data )
+    {
+        memmove( pes->data, pes->cur_pos, pes->bytes_left );
+        pes->cur_pos = pes->data;
+    }
+
+    if( pes->bytes_left + in_frame->size > pes->alloced )
+    {
+        int alloced = pes->bytes_left + in_frame->size + 512;
+        uint8_t *temp = realloc( pes->data, alloced );
+        if( !temp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        pes->data = pes->cur_pos = temp;
+        pes->alloced = alloced;
+    }
+
+    memcpy( pes->cur_pos + pes->bytes_left, in_frame->data, in_frame->size );
+    pes->bytes_left += in_frame->size;
+    pes->size += in_frame->size;
+    pes->final_arrival_time = in_frame->cpb_final_arrival_time + TS_START * 27000000LL;
+
+    if( in_frame->chunk == LIBMPEGTS_CHUNK_LAST )
+    {
+        pes->awaiting_chunks = 0;
+        pes->stream->open_pes = NULL;
+    }
+
+    return 0;
+}
+
 static int write_null_packet( ts_writer_t *w )
 {
     int start;
     int cc = 0;
 
     bs_t *s = &w->out.bs;
-    start = bs_pos( s );
 
     write_packet_header( w, s, 0, NULL_PID, PAYLOAD_ONLY, &cc );
+    start = bs_pos( s ) - 32; /* from the sync byte */
     write_padding( s, start );
 
     if( increase_pcr( w, 1, 0 ) < 0 )
         return -1;
 
+    w->stats.null_packets++;
+
     return 0;
 }
 
@@ -874,7 +1153,8 @@ static int check_bitstream( ts_writer_t *w )
     {
         bs_flush( &w->out.bs );
         uint8_t *bs_bak = w->out.p_bitstream;
-        w->out.i_bitstream += 100000;
+        /* a raised muxrate grows the buffer back to a second of output */
+        w->out.i_bitstream = MAX( w->out.i_bitstream + 100000, w->ts_muxrate >> 3 );
         uint8_t *temp2 = realloc( w->out.p_bitstream, w->out.i_bitstream );
 
         if( !temp2 )
@@ -908,44 +1188,124 @@ ts_writer_t *ts_create_writer( void )
     return w;
 }
 
-int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
+static ts_int_stream_t *setup_stream( ts_writer_t *w, ts_int_program_t *cur_program, ts_stream_t *stream_in )
 {
-    // TODO check for PID collisions, add MPTS support
-    if( params->ts_type < TS_TYPE_GENERIC || params->ts_type > TS_TYPE_BLU_RAY )
+    if( find_stream( w, stream_in->pid ) )
     {
-        fprintf( stderr, "Invalid Transport Stream type.\n" );
-        return -1;
+        fprintf( stderr, "PID %i is used by more than one stream\n", stream_in->pid );
+        return NULL;
     }
 
-    if( params->num_programs > 1 )
+    if( cur_program->num_streams >= MAX_STREAMS )
     {
-        fprintf( stderr, "Multiple program transport streams are not yet supported.\n" );
-        return -1;
+        fprintf( stderr, "Too many streams in program %i\n", cur_program->program_num );
+        return NULL;
     }
 
-    if( !params->cbr && params->num_programs > 1 )
+    ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
+    if( !cur_stream )
     {
-        fprintf( stderr, "Multiple program transport streams cannot be variable bitrate.\n" );
-        return -1;
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
     }
 
-    if( params->network_pid && ( params->network_pid < 0x10 || params->network_pid == 0x1fff ) )
+    if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
     {
-        fprintf( stderr, "Invalid network_PID.\n" );
-        return -1;
+        if( cur_program->video_stream )
+        {
+            free( cur_stream );
+            fprintf( stderr, "Multiple video streams not allowed\n" );
+            return NULL;
+        }
     }
 
-    if( !params->muxrate )
+    cur_stream->program = cur_program;
+    cur_stream->pid = stream_in->pid;
+    cur_stream->stream_format = stream_in->stream_format;
+    for( int j = 0; steam_type_table[j][0] != 0; j++ )
     {
-        fprintf( stderr, "Muxrate must be nonzero\n" );
-        return -1;
+        if( cur_stream->stream_format == steam_type_table[j][0] )
+        {
+            /* DVB AC-3 and EAC-3 are different */
+            if( w->ts_type == TS_TYPE_DVB &&
+                ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
+                j++;
+
+            cur_stream->stream_type = steam_type_table[j][1];
+            break;
+        }
     }
 
-    BOOLIFY( params->cbr );
-    BOOLIFY( params->legacy_constraints );
+    if( !cur_stream->stream_type )
+    {
+        free( cur_stream );
+        fprintf( stderr, "Unsupported Stream Format\n" );
+        return NULL;
+    }
+
+    if( stream_in->write_lang_code )
+    {
+        cur_stream->write_lang_code = 1;
+        memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
+    }
+
+    cur_stream->audio_type = stream_in->audio_type;
+
+    cur_stream->stream_id = stream_in->stream_id;
+    /* Ignored in video streams  */
+    cur_stream->max_frame_size = stream_in->audio_frame_size;
+
+    if( stream_in->has_stream_identifier )
+    {
+        cur_stream->has_stream_identifier = 1;
+        cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
+    }
+
+    cur_stream->dvb_au = stream_in->dvb_au;
+    cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
+
+    cur_stream->hdmv_frame_rate   = stream_in->hdmv_frame_rate;
+    cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
+    cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
 
-    int internal_pcr_pid, video_stream;
-    internal_pcr_pid = video_stream = 0;
+    cur_stream->tb.buf_size = TB_SIZE;
+
+    /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
+    if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
+    {
+        /* use the defaults */
+        cur_stream->rx = MISC_AUDIO_RXN;
+        cur_stream->mb.buf_size = MISC_AUDIO_BS;
+    }
+    else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
+    {
+        cur_stream->rx = MISC_AUDIO_RXN;
+        cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
+    }
+
+    if( w->tstd_history_size )
+    {
+        cur_stream->history.samples = calloc( w->tstd_history_size, sizeof(ts_tstd_sample_t) );
+        if( !cur_stream->history.samples )
+        {
+            free( cur_stream );
+            fprintf( stderr, "Malloc failed\n" );
+            return NULL;
+        }
+    }
+
+    if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
+        cur_program->video_stream = cur_stream;
+
+    cur_program->streams[cur_program->num_streams] = cur_stream;
+    cur_program->num_streams++;
+
+    return cur_stream;
+}
+
+static int setup_program( ts_writer_t *w, ts_program_t *program_in )
+{
+    int internal_pcr_pid = 0;
     ts_int_program_t *cur_program = calloc( 1, sizeof(*cur_program) );
     if( !cur_program )
     {
@@ -953,149 +1313,145 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
         return -1;
     }
 
-    w->num_programs = 1;
-    w->programs[0] = cur_program;
+    w->programs[w->num_programs++] = cur_program;
+
+    if( program_in->num_streams > MAX_STREAMS )
+    {
+        fprintf( stderr, "Too many streams in program %i\n", program_in->program_num );
+        return -1;
+    }
 
-    cur_program->pmt.pid = params->programs[0].pmt_pid;
-    cur_program->program_num = params->programs[0].program_num;
+    cur_program->pmt.pid = program_in->pmt_pid;
+    cur_program->program_num = program_in->program_num;
 
-    cur_program->is_3dtv = params->programs[0].is_3dtv;
-    cur_program->sb_leak_rate = params->programs[0].sb_leak_rate;
-    cur_program->sb_size = params->programs[0].sb_size;
+    cur_program->is_3dtv = program_in->is_3dtv;
+    cur_program->sb_leak_rate = program_in->sb_leak_rate;
+    cur_program->sb_size = program_in->sb_size;
     cur_program->video_dts = -1;
 
-    cur_program->sdt_ctx.service_type = params->programs[0].sdt.service_type;
-    if( params->programs[0].sdt.service_name )
+    cur_program->sdt_ctx.service_type = program_in->sdt.service_type;
+    if( program_in->sdt.service_name )
     {
-        cur_program->sdt_ctx.service_name = malloc( strlen( params->programs[0].sdt.service_name ) + 1 );
+        cur_program->sdt_ctx.service_name = malloc( strlen( program_in->sdt.service_name ) + 1 );
         if( !cur_program->sdt_ctx.service_name )
         {
             fprintf( stderr, "Malloc failed\n" );
             return -1;
         }
-        strcpy( cur_program->sdt_ctx.service_name, params->programs[0].sdt.service_name );
+        strcpy( cur_program->sdt_ctx.service_name, program_in->sdt.service_name );
     }
-    if( params->programs[0].sdt.provider_name )
+    if( program_in->sdt.provider_name )
     {
-        cur_program->sdt_ctx.provider_name = malloc( strlen( params->programs[0].sdt.provider_name ) + 1 );
+        cur_program->sdt_ctx.provider_name = malloc( strlen( program_in->sdt.provider_name ) + 1 );
         if( !cur_program->sdt_ctx.provider_name )
         {
             fprintf( stderr, "Malloc failed\n" );
             return -1;
         }
-        strcpy( cur_program->sdt_ctx.provider_name, params->programs[0].sdt.provider_name );
+        strcpy( cur_program->sdt_ctx.provider_name, program_in->sdt.provider_name );
     }
 
-    for( int i = 0; i < params->programs[0].num_streams; i++ )
+    for( int i = 0; i < program_in->num_streams; i++ )
     {
-        ts_stream_t *stream_in = &params->programs[0].streams[i];
-
-        if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
-        {
-            if( !video_stream )
-                video_stream = 1;
-            else
-            {
-                fprintf( stderr, "Multiple video streams not allowed\n" );
-                return -1;
-            }
-        }
-
-        ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
+        ts_int_stream_t *cur_stream = setup_stream( w, cur_program, &program_in->streams[i] );
         if( !cur_stream )
-        {
-            fprintf( stderr, "Malloc failed\n" );
             return -1;
-        }
 
-        cur_stream->pid = stream_in->pid;
-        cur_stream->stream_format = stream_in->stream_format;
-        for( int j = 0; steam_type_table[j][0] != 0; j++ )
+        if( cur_stream->pid == program_in->pcr_pid )
         {
-            if( cur_stream->stream_format == steam_type_table[j][0] )
-            {
-                /* DVB AC-3 and EAC-3 are different */
-                if( w->ts_type == TS_TYPE_DVB &&
-                    ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
-                    j++;
-
-                cur_stream->stream_type = steam_type_table[j][1];
-                break;
-            }
+            cur_program->pcr_stream = cur_stream;
+            internal_pcr_pid = 1;
         }
+    }
 
-        if( !cur_stream->stream_type )
-        {
-            fprintf( stderr, "Unsupported Stream Format\n" );
+    /* create separate PCR stream if necessary */
+    if( !internal_pcr_pid )
+    {
+        ts_int_stream_t *pcr_stream = calloc( 1, sizeof(*pcr_stream) );
+        if( !pcr_stream )
             return -1;
-        }
+        pcr_stream->pid = program_in->pcr_pid;
+        pcr_stream->program = cur_program;
+        cur_program->pcr_stream = pcr_stream;
+    }
 
-        if( stream_in->write_lang_code )
-        {
-            cur_stream->write_lang_code = 1;
-            memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
-        }
+    if( check_pmt_size( w, cur_program ) < 0 )
+        return -1;
 
-        cur_stream->audio_type = stream_in->audio_type;
+    if( !cur_program->video_stream )
+        w->num_radio_programs++;
 
-        if( cur_stream->pid == params->programs[0].pcr_pid )
-        {
-            cur_program->pcr_stream = cur_stream;
-            internal_pcr_pid = 1;
-        }
+    return 0;
+}
 
-        cur_stream->stream_id = stream_in->stream_id;
-        /* Ignored in video streams  */
-        cur_stream->max_frame_size = stream_in->audio_frame_size;
+int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
+{
+    if( params->ts_type < TS_TYPE_GENERIC || params->ts_type > TS_TYPE_BLU_RAY )
+    {
+        fprintf( stderr, "Invalid Transport Stream type.\n" );
+        return -1;
+    }
 
-        if( stream_in->has_stream_identifier )
-        {
-            cur_stream->has_stream_identifier = 1;
-            cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
-        }
+    if( params->num_programs < 1 || params->num_programs > MAX_PROGRAMS )
+    {
+        fprintf( stderr, "Invalid number of programs.\n" );
+        return -1;
+    }
 
-        cur_stream->dvb_au = stream_in->dvb_au;
-        cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
+    if( !params->cbr && params->num_programs > 1 )
+    {
+        fprintf( stderr, "Multiple program transport streams cannot be variable bitrate.\n" );
+        return -1;
+    }
 
-        cur_stream->hdmv_frame_rate   = stream_in->hdmv_frame_rate;
-        cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
-        cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
+    if( params->network_pid && ( params->network_pid < 0x10 || params->network_pid == 0x1fff ) )
+    {
+        fprintf( stderr, "Invalid network_PID.\n" );
+        return -1;
+    }
 
-        cur_stream->tb.buf_size = TB_SIZE;
+    if( !params->muxrate )
+    {
+        fprintf( stderr, "Muxrate must be nonzero\n" );
+        return -1;
+    }
 
-        /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
-        if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
-        {
-            /* use the defaults */
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = MISC_AUDIO_BS;
-        }
-        else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
-        {
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
-        }
+    if( params->mux_delay < 0 )
+    {
+        fprintf( stderr, "Invalid mux delay\n" );
+        return -1;
+    }
 
-        cur_program->streams[cur_program->num_streams] = cur_stream;
-        cur_program->num_streams++;
+    if( params->cbr && params->true_vbr )
+    {
+        fprintf( stderr, "True VBR cannot be constant bitrate\n" );
+        return -1;
     }
 
-    /* create separate PCR stream if necessary */
-    if( !internal_pcr_pid )
+    BOOLIFY( params->cbr );
+    BOOLIFY( params->legacy_constraints );
+    BOOLIFY( params->full_tstd );
+    BOOLIFY( params->true_vbr );
+
+    /* the stream setup depends on the type */
+    w->ts_type = params->ts_type;
+    w->packet_size = w->ts_type == TS_TYPE_BLU_RAY ? TS_PACKET_SIZE + TP_EXTRA_HEADER_SIZE : TS_PACKET_SIZE;
+
+    for( int i = 0; i < params->num_programs; i++ )
     {
-        ts_int_stream_t *pcr_stream = calloc( 1, sizeof(*pcr_stream) );
-        if( !pcr_stream )
+        if( setup_program( w, &params->programs[i] ) < 0 )
             return -1;
-        pcr_stream->pid = params->programs[0].pcr_pid;
-        cur_program->pcr_stream = pcr_stream;
     }
 
     w->ts_id = params->ts_id;
     w->ts_muxrate = params->muxrate;
+    w->muxrate_pcr = w->stats_start_pcr = TS_START * TS_CLOCK;
     w->cbr = params->cbr;
-    w->ts_type = params->ts_type;
     w->network_pid = params->network_pid;
     w->legacy_constraints = params->legacy_constraints;
+    w->mux_delay = params->mux_delay * 27000LL;
+    w->full_tstd = params->full_tstd;
+    w->true_vbr = params->true_vbr;
 
     w->pcr_period = params->pcr_period ? params->pcr_period : PCR_MAX_RETRANS_TIME;
     w->pat_period = params->pat_period ? params->pat_period : PAT_MAX_RETRANS_TIME;
@@ -1107,8 +1463,7 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
     w->rx_sys = RX_SYS;
     w->r_sys = MAX( R_SYS_DEFAULT, (double)w->ts_muxrate / 500 );
 
-    // FIXME realloc if necessary
-
+    /* check_bitstream grows this as needed, also after the muxrate is raised */
     w->out.i_bitstream = w->ts_muxrate >> 3;
     w->out.p_bitstream = calloc( 1, w->out.i_bitstream );
 
@@ -1123,12 +1478,68 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
     return 0;
 }
 
+/* A full vbv has to be delivered at the slowest of the vbv, transport buffer and (payload) mux rates */
+static int64_t get_min_mux_delay( ts_writer_t *w, ts_int_stream_t *stream, int muxrate )
+{
+    int vbv_maxrate = stream->mpegvideo_ctx->vbv_maxrate;
+    int vbv_bufsize = stream->mpegvideo_ctx->vbv_bufsize;
+    double fill_rate;
+
+    if( vbv_maxrate <= 0 || vbv_bufsize <= 0 )
+        return 0;
+
+    fill_rate = MIN( MIN( vbv_maxrate, stream->rx ), (double)muxrate * (TS_PACKET_SIZE - TS_HEADER_SIZE) / w->packet_size );
+    return (int64_t)( vbv_bufsize / fill_rate * TS_CLOCK );
+}
+
+int ts_update_muxrate( ts_writer_t *w, int muxrate )
+{
+    int64_t min_delay = 0;
+
+    if( muxrate <= 0 )
+    {
+        fprintf( stderr, "Muxrate must be nonzero\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_stream_t *video = w->programs[i]->video_stream;
+        if( video && video->mpegvideo_ctx )
+            min_delay = MAX( min_delay, get_min_mux_delay( w, video, muxrate ) );
+    }
+
+    if( w->mux_delay && w->mux_delay < min_delay )
+    {
+        fprintf( stderr, "Mux delay of %"PRIi64"ms is lower than the minimum safe delay of %"PRIi64"ms at the new muxrate\n",
+                 w->mux_delay / 27000, (min_delay + 26999) / 27000 );
+        return -1;
+    }
+
+    /* the next packet keeps the time it has at the old rate and carries a PCR,
+     * so that the rate between any two PCRs stays constant */
+    w->muxrate_pcr = get_pcr_int( w, 0 );
+    w->muxrate_packet = w->packets_written;
+    w->ts_muxrate = muxrate;
+    for( int i = 0; i < w->num_programs; i++ )
+        w->programs[i]->force_pcr = 1;
+
+    w->min_mux_delay = min_delay;
+    w->r_sys = MAX( R_SYS_DEFAULT, (double)w->ts_muxrate / 500 );
+
+    /* the one second window of the peak bitrate ends here */
+    w->rate_window_end = w->packets_written;
+
+    return 0;
+}
+
 /* Codec-specific features */
 
 int ts_setup_mpegvideo_stream( ts_writer_t *w, int pid, int level, int profile, int vbv_maxrate, int vbv_bufsize, int frame_rate )
 {
     int bs_mux, bs_oh;
     int level_idx = -1;
+    int64_t min_delay;
 
     ts_int_stream_t *stream = find_stream( w, pid );
 
@@ -1237,6 +1648,19 @@ int ts_setup_mpegvideo_stream( ts_writer_t *w, int pid, int level, int profile,
         stream->rbx = bitrate;
     }
 
+    stream->mpegvideo_ctx->vbv_maxrate = vbv_maxrate;
+    stream->mpegvideo_ctx->vbv_bufsize = vbv_bufsize;
+
+    min_delay = get_min_mux_delay( w, stream, w->ts_muxrate );
+    if( w->mux_delay && w->mux_delay < min_delay )
+    {
+        fprintf( stderr, "Mux delay of %"PRIi64"ms is lower than the minimum safe delay of %"PRIi64"ms\n",
+                 w->mux_delay / 27000, (min_delay + 26999) / 27000 );
+        return -1;
+    }
+
+    w->min_mux_delay = MAX( w->min_mux_delay, min_delay );
+
     return 0;
 }
 
@@ -1281,6 +1705,7 @@ int ts_setup_mpeg2_aac_stream( ts_writer_t *w, int pid, int profile, int channel
         {
             stream->rx = aac_buffers[i].rxn;
             stream->mb.buf_size = aac_buffers[i].bsn;
+            break;
         }
     }
     return 0;
@@ -1323,6 +1748,7 @@ int ts_setup_mpeg4_aac_stream( ts_writer_t *w, int pid, int profile_and_level, i
         {
             stream->rx = aac_buffers[i].rxn;
             stream->mb.buf_size = aac_buffers[i].bsn;
+            break;
         }
     }
 
@@ -1546,500 +1972,1409 @@ void ts_remove_sdt( ts_writer_t *w )
     w->sdt = NULL;
 }
 
-int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list )
+/* The mux can only run until access units that have not been submitted yet might have to be sent.
+ * Programs with video are bounded by the arrival of the second queued video frame. Audio and data-only
+ * programs (e.g. radio services) are bounded by the earliest arrival time of the newest access unit
+ * of their slowest stream, so by default they run one access unit behind the input. Sporadic streams
+ * like subtitles and sections never hold the mux back. */
+static int64_t get_mux_horizon( ts_writer_t *w, int flush )
 {
-#if 0
-static uint64_t last_aud = 0;
-static uint64_t last_vid = 0;
+    int64_t pcr_stop = -1;
 
-for (int z = 0; z < num_frames; z++) {
-  uint64_t diff = 0;
-  if ((frames + z)->pid == 0x31)
-    diff = (frames + z)->pts - last_vid;
-  if ((frames + z)->pid == 0x32)
-    diff = (frames + z)->pts - last_aud;
-
-  printf("%s() pid = %x size:%8d dts:%16llu pts:%16llu (%llu) -- iat:%16llu fat:%16llu\n",
-    __func__,
-    (frames + z)->pid,
-    (frames + z)->size,
-    (frames + z)->dts,
-    (frames + z)->pts,
-    (frames + z)->cpb_initial_arrival_time,
-    (frames + z)->cpb_final_arrival_time,
-    diff);
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        for( int j = 0; j < w->programs[i]->num_streams; j++ )
+        {
+            w->programs[i]->streams[j]->horizon = 0;
+            w->programs[i]->streams[j]->horizon_pes = 0;
+        }
+    }
 
-if ((frames + z)->pid == 0x31)
-  last_vid = (frames + z)->pts;
-if ((frames + z)->pid == 0x32)
-  last_aud = (frames + z)->pts;
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+        ts_int_stream_t *stream = pes->stream;
 
-}
-#endif
-  
-    ts_int_program_t *program = w->programs[0];
-    ts_int_stream_t *stream;
+        if( IS_VIDEO( stream ) )
+        {
+            /* last frame is a special case - FIXME: is this acceptable in all use-cases? */
+            if( flush )
+                stream->horizon = pes->dts;
+            else if( pes->awaiting_chunks )
+                stream->horizon = pes->final_arrival_time; /* the chunks written so far can arrive by then */
+            else if( stream->horizon_pes++ )
+                stream->horizon = pes->initial_arrival_time; /* earliest that a frame can arrive */
+        }
+        else if( !stream->program->video_stream && stream->stream_format != LIBMPEGTS_DVB_SUB &&
+                 stream->stream_format != LIBMPEGTS_TABLE_SECTION && stream->stream_format != LIBMPEGTS_ANCILLARY_2038 )
+        {
+            /* flushing drains everything that is queued */
+            stream->horizon = flush ? pes->dts * 300 : pes->initial_arrival_time;
+            stream->horizon_pes++;
+        }
+    }
 
-    int initial_queued_pes = w->num_buffered_frames;
-    ts_int_pes_t **queued_pes;
-    ts_int_pes_t **new_pes;
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
 
-    int stuffing, flags, pkt_bytes_left, write_pcr, write_adapt_field, adapt_field_len, pes_start, running;
-    uint8_t temp[200];
-    bs_t q;
-    bs_t *s = &w->out.bs;
-    /* earliest arrival time that the pes packet can arrive */
-    int64_t cur_pcr = 0;
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            ts_int_stream_t *stream = program->streams[j];
+            if( program->video_stream ? stream != program->video_stream : !stream->horizon_pes )
+                continue;
 
-    w->num_pcrs = 0;
+            if( pcr_stop < 0 )
+                pcr_stop = stream->horizon;
+            else
+                pcr_stop = flush ? MAX( pcr_stop, stream->horizon ) : MIN( pcr_stop, stream->horizon );
+        }
+    }
 
-    bs_init( s, w->out.p_bitstream, w->out.i_bitstream );
+    return MAX( pcr_stop, 0 );
+}
 
-    if( num_frames < 0 )
+static ts_int_program_t *get_queued_pmt( ts_writer_t *w )
+{
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        fprintf( stderr, "Invalid number of frames\n" );
-        return -1;
+        if( w->programs[i]->num_queued_pmt )
+            return w->programs[i];
     }
+    return NULL;
+}
 
-    if (w->num_buffered_frames > 128) {
-        /* Warning once per second. */
-        static time_t last = 0, now;
-        time(&now);
-        if (last != now) {
-           last = now;
-           fprintf(stderr, "libmpegts: %s() Warning: Having %d buffered frames is beyond normality.\n", __func__, w->num_buffered_frames);
-        }
-    }
+/* returns the number of PCR packets written */
+static int write_due_pcrs( ts_writer_t *w )
+{
+    int written = 0;
 
-    if( num_frames )
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        ts_int_pes_t **tmp = realloc( w->buffered_frames, (w->num_buffered_frames+num_frames) * sizeof(w->buffered_frames) );
-        if( !tmp )
+        if( check_pcr( w, w->programs[i] ) )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            if( write_pcr_empty( w, w->programs[i], 0 ) < 0 )
+                return -1;
+            written++;
         }
-        w->buffered_frames = tmp;
-        new_pes = &w->buffered_frames[w->num_buffered_frames];
-        w->num_buffered_frames += num_frames;
     }
 
-    queued_pes = w->buffered_frames;
+    return written;
+}
 
-    for( int i = 0; i < num_frames; i++ )
-    {
-        stream = find_stream( w, frames[i].pid );
+/* Picks the PES which the next packet slot goes to, NULL if no PES can be sent yet */
+static ts_int_pes_t *get_next_pes( ts_writer_t *w, int64_t cur_pcr )
+{
+    ts_int_pes_t **queued_pes = w->buffered_frames;
+    ts_int_pes_t *pes = NULL;
+    ts_int_stream_t *stream;
 
-        if( !stream )
-        {
-            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
-            return -1;
+    // FIXME at low bitrates this might need tweaking
+
+    /* Check all the non-video packets first */
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        w->stats.queue_scan_iterations++;
+        stream = queued_pes[i]->stream;
+        if ((stream->stream_format == LIBMPEGTS_TABLE_SECTION) ||
+            (stream->stream_format == LIBMPEGTS_ANCILLARY_2038)) {
+            /* Immediate eject the PSIP */
+            pes = queued_pes[i];
+            break;
         }
 
-        /* Codec specific parameters */
-        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+        if( (!pes || queued_pes[i]->dts < pes->dts) && !IS_VIDEO( stream ) )
         {
-            if( !stream->mpegvideo_ctx )
+            int total_packets = (queued_pes[i]->size + 183) / 184;
+            int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
+            double drip_rate = (double)total_packets/ ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
+            double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr);
+
+            int ready = FULL_TSTD( w, stream ) ? tstd_has_room( stream ) : tb_has_room( &stream->tb );
+
+            /* exclude video packets */
+            if( cur_pcr >= queued_pes[i]->initial_arrival_time && ready &&
+                ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ) )
             {
-               fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
-               return -1;
+                pes = queued_pes[i];
+                break;
             }
-            program->video_dts = frames[i].dts;
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+    }
+
+    /* See if we can write a video packet if non-audio packets can't be written. */
+    if( !pes && w->num_radio_programs < w->num_programs )
+    {
+        for( int i = 0; i < w->num_buffered_frames; i++ )
         {
-            if( !stream->dvb_sub_ctx )
+            w->stats.queue_scan_iterations++;
+            stream = queued_pes[i]->stream;
+            if( IS_VIDEO( stream ) )
             {
-               fprintf( stderr, "DVB subtitle stream needs additional information. Call ts_setup_dvb_subtitles \n" );
-               return -1;
+                /* hold back a partial packet of an incomplete access unit until its data is due */
+                if( queued_pes[i]->awaiting_chunks && ( !queued_pes[i]->bytes_left ||
+                    ( queued_pes[i]->bytes_left < 184 && cur_pcr <= queued_pes[i]->final_arrival_time ) ) )
+                    continue;
+
+                int total_packets = (queued_pes[i]->size + 183) / 184;
+                int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
+                double drip_rate = (double)total_packets / ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
+                double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr );
+
+                int ready = FULL_TSTD( w, stream ) ? tstd_has_room( stream ) : tb_has_room( &stream->tb );
+
+                if( cur_pcr >= queued_pes[i]->initial_arrival_time && ready &&
+                    ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ) )
+                {
+                    pes = queued_pes[i];
+                    break;
+                }
             }
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+    }
+
+    /* with the full T-STD model, send data ahead of its schedule in slots that would otherwise be empty.
+     * Audio-only programs always do this as radio services tend to share the same deadlines. */
+    if( !pes && ( w->full_tstd || w->num_radio_programs ) )
+    {
+        for( int i = 0; i < w->num_buffered_frames; i++ )
         {
-            if( !stream->dvb_ttx_ctx )
+            w->stats.queue_scan_iterations++;
+            stream = queued_pes[i]->stream;
+            int ready = FULL_TSTD( w, stream ) ? tstd_has_room( stream ) :
+                        !stream->program->video_stream && tb_has_room( &stream->tb );
+            if( ready && !queued_pes[i]->awaiting_chunks && cur_pcr >= queued_pes[i]->initial_arrival_time )
             {
-               fprintf( stderr, "DVB Teletext stream needs additional information. Call ts_setup_dvb_teletext \n" );
-               return -1;
+                pes = queued_pes[i];
+                break;
             }
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
-        {
-            if( !stream->dvb_vbi_ctx )
-            {
-               fprintf( stderr, "DVB VBI stream needs additional information. Call ts_setup_dvb_vbi \n" );
-               return -1;
-            }
+    }
+
+    return pes;
+}
+
+/**** True VBR ****/
+/* Time needed to send the rest of a PES, packets can't arrive faster than the transport buffer leaks */
+static double get_send_time( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+    double rate = stream->rx ? MIN( w->ts_muxrate, stream->rx ) : w->ts_muxrate;
+
+    return (double)((pes->bytes_left + 183) / 184) * w->packet_size * 8 * TS_CLOCK / rate;
+}
+
+/* A PES is due once the time until its final arrival time is just enough to send it and every PES with
+ * an earlier deadline. Of the due PES the one with the earliest deadline is sent first.
+ * next_due is set to when the next PES becomes due or its buffers have room again. The queue is only
+ * scanned again when that time has come or the queue has changed since. */
+static ts_int_pes_t *get_lazy_pes( ts_writer_t *w, int64_t cur_pcr, int64_t *next_due )
+{
+    ts_int_pes_t **queued_pes = w->buffered_frames;
+    ts_int_pes_t *pes = NULL;
+    double slot = (double)w->packet_size * 8 * TS_CLOCK / w->ts_muxrate;
+
+    if( cur_pcr < w->lazy_next_due )
+    {
+        *next_due = w->lazy_next_due;
+        return NULL;
+    }
+
+    *next_due = INT64_MAX;
+
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *cand = queued_pes[i];
+        ts_int_stream_t *stream = cand->stream;
+        double backlog = TRUE_VBR_MARGIN * slot;
+        int64_t due;
+
+        w->stats.queue_scan_iterations++;
+        if( stream->stream_format == LIBMPEGTS_TABLE_SECTION || stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
+            return cand; /* immediate */
+
+        /* hold back a partial packet of an incomplete access unit until its data is due */
+        if( cand->awaiting_chunks && ( !cand->bytes_left || ( cand->bytes_left < 184 && cur_pcr <= cand->final_arrival_time ) ) )
+        {
+            if( cand->bytes_left )
+                *next_due = MIN( *next_due, cand->final_arrival_time + 1 );
+            continue;
         }
-        else if(stream->stream_format == LIBMPEGTS_TABLE_SECTION) {
-            if (!stream->pid) {
-               fprintf(stderr, "DVB TABLE SECTION pid needs additional information.\n");
-               return -1;
-            }
-	}
 
-        // TODO more
+        if( cur_pcr < cand->initial_arrival_time )
+        {
+            *next_due = MIN( *next_due, cand->initial_arrival_time );
+            continue;
+        }
 
-        new_pes[i] = calloc( 1, sizeof(ts_int_pes_t) );
-        if( !new_pes[i] )
+        for( int j = 0; j < w->num_buffered_frames; j++ )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            if( queued_pes[j]->final_arrival_time <= cand->final_arrival_time )
+                backlog += get_send_time( w, queued_pes[j] );
         }
 
-        new_pes[i]->stream = stream;
-        new_pes[i]->random_access = !!frames[i].random_access;
-        new_pes[i]->priority = !!frames[i].priority;
-        new_pes[i]->dts = frames[i].dts + TS_START * 90000LL;
-        new_pes[i]->pts = frames[i].pts + TS_START * 90000LL;
+        due = cand->final_arrival_time - (int64_t)backlog;
+        if( due > cur_pcr )
+        {
+            *next_due = MIN( *next_due, due );
+            continue;
+        }
 
-        if( IS_VIDEO( stream ) )
+        if( FULL_TSTD( w, stream ) ? !tstd_has_room( stream ) : !tb_has_room( &stream->tb ) )
         {
-            new_pes[i]->frame_type = frames[i].frame_type;
-            new_pes[i]->initial_arrival_time = frames[i].cpb_initial_arrival_time + TS_START * 27000000LL;
-            new_pes[i]->final_arrival_time = frames[i].cpb_final_arrival_time + TS_START * 27000000LL;
-            new_pes[i]->ref_pic_idc = frames[i].ref_pic_idc;
-            new_pes[i]->write_pulldown_info = frames[i].write_pulldown_info;
-            new_pes[i]->pic_struct = frames[i].pic_struct;
+            /* retry once the transport buffer has leaked enough */
+            int64_t wait = stream->rx ? (stream->tb.cur_buf + TS_PACKET_SIZE * 8 - stream->tb.buf_size) * TS_CLOCK / stream->rx : 0;
+            *next_due = MIN( *next_due, cur_pcr + MAX( wait, 1 ) );
+            continue;
         }
-        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3600) * 300; /* Teletext is special because data can only stay in the buffer for 40ms */
-        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
-            new_pes[i]->initial_arrival_time = 0; /* FIXME: is this right? */
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI && ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3003) * 300; /* SCTE-127 VBI is always in terms of NTSC */
-        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - 3600) * 300;
-        else if(stream->stream_format == LIBMPEGTS_TABLE_SECTION )
-            new_pes[i]->initial_arrival_time = 0; /* FIXME: is this right? */
-        else
-            new_pes[i]->initial_arrival_time = (new_pes[i]->dts - stream->max_frame_size) * 300; /* earliest that a frame can arrive */
 
-        if( !IS_VIDEO( stream ) )
-            new_pes[i]->final_arrival_time = new_pes[i]->dts * 300;
+        /* frames queued later can still have earlier deadlines, so the small non-video PES go first */
+        if( !pes || ( IS_VIDEO( pes->stream ) && !IS_VIDEO( stream ) ) ||
+            ( IS_VIDEO( pes->stream ) == IS_VIDEO( stream ) && cand->final_arrival_time < pes->final_arrival_time ) )
+            pes = cand;
+    }
 
-        /* probe the first normal looking ac3 frame if extra data is needed */
-        if( !stream->atsc_ac3_ctx && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
-            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
-            frames[i].size > 100 && frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
+    /* the packet sent changes the queue */
+    w->lazy_next_due = pes ? 0 : *next_due;
+
+    return pes;
+}
+
+/* Skips the idle slots until the next event, at most until the next PCR is due. The rate between the PCRs
+ * on either side of the gap stays constant, which is how a decoder interpolates the arrival times. */
+static int skip_idle_slots( ts_writer_t *w, int64_t next_event )
+{
+    ts_int_program_t *program = w->programs[0];
+    double slot = (double)w->packet_size * 8 * TS_CLOCK / w->ts_muxrate;
+    int64_t cur_pcr = get_pcr_int( w, 0 );
+    int num_slots;
+
+    /* the last packet before the gap needs a PCR */
+    if( program->last_pcr < get_pcr_int( w, 7 - w->packet_size ) )
+        return write_pcr_empty( w, program, 0 );
+
+    next_event = MIN( next_event, program->last_pcr + w->pcr_period * 27000LL - (int64_t)slot );
+    num_slots = MAX( (next_event - cur_pcr) / slot, 1 );
+
+    program->force_pcr = 1;
+    return increase_pcr( w, num_slots, 1 );
+}
+
+static uint8_t *get_index_space( ts_writer_t *w, int size )
+{
+    if( w->index_len + size > w->index_alloced )
+    {
+        int alloced = MAX( w->index_alloced * 2, 64 * INDEX_RECORD_SIZE );
+        uint8_t *temp = realloc( w->index_buf, alloced );
+        if( !temp )
         {
-            stream->atsc_ac3_ctx = calloc( 1, sizeof(ts_atsc_ac3_info) );
-            if( !stream->atsc_ac3_ctx  )
-            {
-               fprintf( stderr, "Malloc failed\n" );
-               return -1;
-            }
-            parse_ac3_frame( stream->atsc_ac3_ctx, frames[i].data );
+            fprintf( stderr, "Malloc failed\n" );
+            return NULL;
         }
+        w->index_buf = temp;
+        w->index_alloced = alloced;
+    }
 
-        /* 512 bytes is more than enough for pes overhead */
-        new_pes[i]->data = malloc( frames[i].size + 512 );
-        if( !new_pes[i]->data )
+    w->index_len += size;
+    return w->index_buf + w->index_len - size;
+}
+
+static void write_le( uint8_t *p, uint64_t value, int bytes )
+{
+    for( int i = 0; i < bytes; i++ )
+        p[i] = value >> (8*i);
+}
+
+/* Adds a seek index record for the packet of pes starting at byte pkt_start of the current
+ * output, which has just been written */
+static int add_index_record( ts_writer_t *w, int type, ts_int_pes_t *pes, int pkt_start )
+{
+    uint8_t *p = get_index_space( w, INDEX_RECORD_SIZE );
+    if( !p )
+        return -1;
+
+    write_le( p, type, 1 );
+    write_le( p+1, pes->frame_type, 1 );
+    write_le( p+2, pes->stream->pid, 2 );
+    write_le( p+4, 0, 4 );
+    write_le( p+8, w->bytes_written + pkt_start, 8 );
+    write_le( p+16, w->pcr_list[w->num_pcrs-1], 8 );
+    write_le( p+24, pes->pts, 8 );
+    write_le( p+32, pes->dts, 8 );
+
+    return 0;
+}
+
+/* Records a packet of the current output which starts a random access point */
+static int add_random_access( ts_writer_t *w, ts_int_pes_t *pes, int pkt_start )
+{
+    if( w->num_random_access == w->random_access_alloced )
+    {
+        int alloced = w->random_access_alloced ? w->random_access_alloced * 2 : 64;
+        int *temp = realloc( w->random_access_list, alloced * sizeof(int) );
+        if( !temp )
         {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
         }
+        w->random_access_list = temp;
+        w->random_access_alloced = alloced;
+    }
 
-        if (stream->stream_format == LIBMPEGTS_ANCILLARY_2038) {
-            new_pes[i]->header_size = 0;
-            new_pes[i]->header_size = write_table_section(w, program, &frames[i], new_pes[i], 0);
-            new_pes[i]->dts = 0;
-	} else
-        if (stream->stream_format == LIBMPEGTS_TABLE_SECTION) {
-            new_pes[i]->header_size = 0;
-            //write_section_table(w, stream->pid, frames[i].data, frames[i].size);
-            new_pes[i]->header_size = write_table_section(w, program, &frames[i], new_pes[i], 1);
-            new_pes[i]->dts = 0;
-        } else
-            new_pes[i]->header_size = write_pes(w, program, &frames[i], new_pes[i]);
+    w->random_access_list[w->num_random_access++] = w->num_pcrs - 1;
+
+    return w->index ? add_index_record( w, LIBMPEGTS_INDEX_RANDOM_ACCESS, pes, pkt_start ) : 0;
+}
+
+/* Records a packet of the current output which belongs to a random access point of a video PCR stream */
+static int add_trick_packet( ts_writer_t *w )
+{
+    if( w->num_trick_packets == w->trick_packets_alloced )
+    {
+        int alloced = w->trick_packets_alloced ? w->trick_packets_alloced * 2 : 256;
+        int *temp = realloc( w->trick_packets, alloced * sizeof(int) );
+        if( !temp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        w->trick_packets = temp;
+        w->trick_packets_alloced = alloced;
+    }
+
+    w->trick_packets[w->num_trick_packets++] = w->num_pcrs - 1;
+
+    return 0;
+}
+
+/* Makes the trick play output from the packets just written. The recorded packets of the random
+ * access points and the PAT and PMTs are copied, any other PCR goes out in a packet of its own so
+ * the clock stays as it is in the main output. The continuity counters of the PCR streams are
+ * renumbered as the rest of their payload is left out. */
+static int write_trick_play( ts_writer_t *w, uint8_t *out, int len )
+{
+    int num_packets = len / w->packet_size, next = 0;
+    int extra = w->packet_size - TS_PACKET_SIZE; /* Blu-Ray packets keep their arrival time stamps */
+
+    if( num_packets > w->trick_alloced )
+    {
+        uint8_t *buf = realloc( w->trick_buf, num_packets * w->packet_size );
+        if( buf )
+            w->trick_buf = buf;
+        int64_t *trick_pcr_list = realloc( w->trick_pcr_list, num_packets * sizeof(int64_t) );
+        if( trick_pcr_list )
+            w->trick_pcr_list = trick_pcr_list;
+        if( !buf || !trick_pcr_list )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        w->trick_alloced = num_packets;
     }
 
-    if( !initial_queued_pes )
+    for( int i = 0; i < num_packets; i++ )
     {
-        out = NULL;
-        *len = 0;
-        *pcr_list = NULL;
-        return 0;
+        uint8_t *src_start = out + i * w->packet_size;
+        uint8_t *dst_start = w->trick_buf + w->trick_len * w->packet_size;
+        uint8_t *src = src_start + extra, *dst = dst_start + extra;
+        int pid = ( ( src[1] & 0x1f ) << 8 ) | src[2];
+        int marked = next < w->num_trick_packets && w->trick_packets[next] == i;
+        int copy = pid == PAT_PID, pcr = 0;
+        ts_int_program_t *program = NULL;
+
+        next += marked;
+
+        for( int j = 0; j < w->num_programs && !copy && !program; j++ )
+        {
+            if( pid == w->programs[j]->pmt.pid )
+                copy = 1;
+            else if( pid == w->programs[j]->pcr_stream->pid )
+                program = w->programs[j];
+        }
+
+        if( copy )
+            memcpy( dst_start, src_start, w->packet_size );
+        else if( program && marked )
+        {
+            memcpy( dst_start, src_start, w->packet_size );
+            dst[3] = ( dst[3] & 0xf0 ) | program->trick_cc;
+            program->trick_cc = ( program->trick_cc + 1 ) & 0xf;
+        }
+        else if( program && ( src[3] & 0x20 ) && src[4] >= 7 && ( src[5] & 0x10 ) )
+        {
+            /* adaptation field only, so the continuity counter does not increment */
+            memcpy( dst_start, src_start, extra );
+            dst[0] = 0x47;
+            dst[1] = ( pid >> 8 ) & 0x1f;
+            dst[2] = pid & 0xff;
+            dst[3] = 0x20 | ( ( program->trick_cc - 1 ) & 0xf );
+            dst[4] = TS_PACKET_SIZE - 5;
+            dst[5] = 0x10;
+            memcpy( dst + 6, src + 6, 6 );
+            memset( dst + 12, 0xff, TS_PACKET_SIZE - 12 );
+            pcr = 1;
+        }
+
+        if( copy || marked || pcr )
+            w->trick_pcr_list[w->trick_len++] = w->pcr_list[i];
     }
 
-    write_pcr = 0;
-    running = 1;
+    return 0;
+}
 
-    if( !w->first_input )
+/* The last output of Blu-Ray is padded with null packets to a whole aligned unit of 6144 bytes */
+static int complete_aligned_unit( ts_writer_t *w )
+{
+    bs_t *s = &w->out.bs;
+
+    while( ( w->bytes_written + ( bs_pos( s ) >> 3 ) ) % ( ALIGNED_UNIT_PACKETS * w->packet_size ) )
     {
-        if( write_pcr_empty( w, program, 1 ) < 0 )
+        if( check_bitstream( w ) < 0 || write_null_packet( w ) < 0 )
             return -1;
-        retransmit_psi_and_si( w, program, 1 );
-        w->first_input = 1;
     }
 
-    /* loop through and find the time when the second video packet in the queue can arrive */
-    int video_found = 0;
-    int64_t pcr_stop = 0;
+    return 0;
+}
+
+int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list )
+{
+#if 0
+static uint64_t last_aud = 0;
+static uint64_t last_vid = 0;
 
-    cur_pcr = get_pcr_int( w, 0 );
+for (int z = 0; z < num_frames; z++) {
+  uint64_t diff = 0;
+  if ((frames + z)->pid == 0x31)
+    diff = (frames + z)->pts - last_vid;
+  if ((frames + z)->pid == 0x32)
+    diff = (frames + z)->pts - last_aud;
 
-    for( int i = 0; i < w->num_buffered_frames; i++ )
+  printf("%s() pid = %x size:%8d dts:%16llu pts:%16llu (%llu) -- iat:%16llu fat:%16llu\n",
+    __func__,
+    (frames + z)->pid,
+    (frames + z)->size,
+    (frames + z)->dts,
+    (frames + z)->pts,
+    (frames + z)->cpb_initial_arrival_time,
+    (frames + z)->cpb_final_arrival_time,
+    diff);
+
+if ((frames + z)->pid == 0x31)
+  last_vid = (frames + z)->pts;
+if ((frames + z)->pid == 0x32)
+  last_aud = (frames + z)->pts;
+
+}
+#endif
+  
+    ts_int_program_t *program;
+    ts_int_stream_t *stream;
+
+    int initial_queued_pes = w->num_buffered_frames;
+    ts_int_pes_t **queued_pes;
+    ts_int_pes_t **new_pes;
+    ts_int_pes_t *cur_pes;
+    int num_new_pes = 0, low_latency = 0;
+
+    int stuffing, flags, pkt_bytes_left, write_pcr, write_adapt_field, adapt_field_len, pes_start, running;
+    int pkt_start;
+    uint8_t temp[200];
+    bs_t q;
+    bs_t *s = &w->out.bs;
+    /* earliest arrival time that the pes packet can arrive */
+    int64_t cur_pcr = 0;
+
+    w->num_pcrs = 0;
+    w->num_random_access = 0;
+    w->num_trick_packets = 0;
+    w->trick_len = 0;
+
+    /* the header goes with the records of the first call */
+    w->index_len = 0;
+    if( w->index && !w->index_header )
     {
-        stream = queued_pes[i]->stream;
-        if( IS_VIDEO( stream ) )
+        uint8_t *p = get_index_space( w, INDEX_HEADER_SIZE );
+        if( !p )
+            return -1;
+        memset( p, 0, INDEX_HEADER_SIZE );
+        memcpy( p, INDEX_MAGIC, 4 );
+        write_le( p+4, INDEX_VERSION, 2 );
+        write_le( p+6, INDEX_RECORD_SIZE, 2 );
+        write_le( p+8, w->ts_type, 2 );
+        w->index_header = 1;
+    }
+
+    bs_init( s, w->out.p_bitstream, w->out.i_bitstream );
+
+    if( num_frames < 0 )
+    {
+        fprintf( stderr, "Invalid number of frames\n" );
+        return -1;
+    }
+
+    if (w->num_buffered_frames > 128) {
+        /* Warning once per second. */
+        static time_t last = 0, now;
+        time(&now);
+        if (last != now) {
+           last = now;
+           fprintf(stderr, "libmpegts: %s() Warning: Having %d buffered frames is beyond normality.\n", __func__, w->num_buffered_frames);
+        }
+    }
+
+    if( num_frames )
+    {
+        ts_int_pes_t **tmp = realloc( w->buffered_frames, (w->num_buffered_frames+num_frames) * sizeof(w->buffered_frames) );
+        if( !tmp )
         {
-            /* last frame is a special case - FIXME: is this acceptable in all use-cases? */
-            if( !num_frames )
-                pcr_stop = queued_pes[i]->dts;
-            else if( !video_found )
-                video_found = 1;
-            else
-                pcr_stop = queued_pes[i]->initial_arrival_time; /* earliest that a frame can arrive */
+           fprintf( stderr, "Malloc failed\n" );
+           return -1;
         }
+        w->buffered_frames = tmp;
+        new_pes = &w->buffered_frames[w->num_buffered_frames];
     }
 
-    while( cur_pcr < pcr_stop )
+    queued_pes = w->buffered_frames;
+
+    for( int i = 0; i < num_frames; i++ )
     {
-        //printf("\n pcr_stop %"PRIi64" cur_pcr %"PRIi64" \n", pcr_stop, cur_pcr );
+        stream = find_stream( w, frames[i].pid );
 
-        ts_int_pes_t *pes = NULL;
-        write_adapt_field = adapt_field_len = write_pcr = 0;
-        pkt_bytes_left = 184;
+        if( !stream )
+        {
+            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
+            return -1;
+        }
+
+        /* Codec specific parameters */
+        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+        {
+            if( !stream->mpegvideo_ctx )
+            {
+               fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
+               return -1;
+            }
+            stream->program->video_dts = frames[i].dts;
+        }
+        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+        {
+            if( !stream->dvb_sub_ctx )
+            {
+               fprintf( stderr, "DVB subtitle stream needs additional information. Call ts_setup_dvb_subtitles \n" );
+               return -1;
+            }
+        }
+        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+        {
+            if( !stream->dvb_ttx_ctx )
+            {
+               fprintf( stderr, "DVB Teletext stream needs additional information. Call ts_setup_dvb_teletext \n" );
+               return -1;
+            }
+        }
+        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
+        {
+            if( !stream->dvb_vbi_ctx )
+            {
+               fprintf( stderr, "DVB VBI stream needs additional information. Call ts_setup_dvb_vbi \n" );
+               return -1;
+            }
+        }
+        else if(stream->stream_format == LIBMPEGTS_TABLE_SECTION) {
+            if (!stream->pid) {
+               fprintf(stderr, "DVB TABLE SECTION pid needs additional information.\n");
+               return -1;
+            }
+	}
+
+        // TODO more
+
+        if( frames[i].chunk < LIBMPEGTS_CHUNK_NONE || frames[i].chunk > LIBMPEGTS_CHUNK_LAST )
+        {
+            fprintf( stderr, "Invalid chunk type for frame %i\n", i );
+            return -1;
+        }
+
+        if( frames[i].chunk && !IS_VIDEO( stream ) )
+        {
+            fprintf( stderr, "Sub-frame submission is only supported for video streams\n" );
+            return -1;
+        }
+
+        if( frames[i].chunk == LIBMPEGTS_CHUNK_MIDDLE || frames[i].chunk == LIBMPEGTS_CHUNK_LAST )
+        {
+            if( !stream->open_pes )
+            {
+                fprintf( stderr, "PID %i: chunk %i does not follow a first chunk\n", frames[i].pid, i );
+                return -1;
+            }
+            if( append_pes_chunk( stream->open_pes, &frames[i] ) < 0 )
+                return -1;
+            low_latency = 1;
+            continue;
+        }
+        else if( stream->open_pes )
+        {
+            fprintf( stderr, "PID %i: previous access unit has not been completed\n", frames[i].pid );
+            return -1;
+        }
+
+        cur_pes = calloc( 1, sizeof(ts_int_pes_t) );
+        if( !cur_pes )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           return -1;
+        }
+        new_pes[num_new_pes++] = cur_pes;
+        w->num_buffered_frames++;
+
+        cur_pes->stream = stream;
+        cur_pes->enqueue_pcr = get_pcr_int( w, 0 );
+        cur_pes->random_access = !!frames[i].random_access;
+        cur_pes->priority = !!frames[i].priority;
+        cur_pes->dts = frames[i].dts + TS_START * 90000LL;
+        cur_pes->pts = frames[i].pts + TS_START * 90000LL;
+
+        if( IS_VIDEO( stream ) )
+        {
+            cur_pes->frame_type = frames[i].frame_type;
+            cur_pes->initial_arrival_time = frames[i].cpb_initial_arrival_time + TS_START * 27000000LL;
+            cur_pes->final_arrival_time = frames[i].cpb_final_arrival_time + TS_START * 27000000LL;
+            cur_pes->ref_pic_idc = frames[i].ref_pic_idc;
+            cur_pes->write_pulldown_info = frames[i].write_pulldown_info;
+            cur_pes->pic_struct = frames[i].pic_struct;
+        }
+        else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+            cur_pes->initial_arrival_time = (cur_pes->dts - 3600) * 300; /* Teletext is special because data can only stay in the buffer for 40ms */
+        else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+            cur_pes->initial_arrival_time = 0; /* FIXME: is this right? */
+        else if( stream->stream_format == LIBMPEGTS_DVB_VBI && ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) )
+            cur_pes->initial_arrival_time = (cur_pes->dts - 3003) * 300; /* SCTE-127 VBI is always in terms of NTSC */
+        else if( stream->stream_format == LIBMPEGTS_DVB_VBI )
+            cur_pes->initial_arrival_time = (cur_pes->dts - 3600) * 300;
+        else if(stream->stream_format == LIBMPEGTS_TABLE_SECTION )
+            cur_pes->initial_arrival_time = 0; /* FIXME: is this right? */
+        else
+            cur_pes->initial_arrival_time = (cur_pes->dts - stream->max_frame_size) * 300; /* earliest that a frame can arrive */
+
+        /* the last packet has to have left the transport buffer by the DTS */
+        if( !IS_VIDEO( stream ) )
+            cur_pes->final_arrival_time = cur_pes->dts * 300 - ( stream->rx ? (int64_t)stream->tb.buf_size * TS_CLOCK / stream->rx : 0 );
+
+        /* don't let data arrive earlier than the latency budget allows */
+        if( w->mux_delay && stream->stream_format != LIBMPEGTS_TABLE_SECTION && stream->stream_format != LIBMPEGTS_ANCILLARY_2038 )
+            cur_pes->initial_arrival_time = MAX( cur_pes->initial_arrival_time, cur_pes->dts * 300 - w->mux_delay );
+
+        /* probe the first normal looking ac3 frame if extra data is needed */
+        if( !stream->atsc_ac3_ctx && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
+            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
+            frames[i].size > 100 && frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
+        {
+            stream->atsc_ac3_ctx = calloc( 1, sizeof(ts_atsc_ac3_info) );
+            if( !stream->atsc_ac3_ctx  )
+            {
+               fprintf( stderr, "Malloc failed\n" );
+               return -1;
+            }
+            parse_ac3_frame( stream->atsc_ac3_ctx, frames[i].data );
+        }
+
+        /* 512 bytes is more than enough for pes overhead */
+        cur_pes->alloced = frames[i].size + 512;
+        cur_pes->data = malloc( cur_pes->alloced );
+        if( !cur_pes->data )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           return -1;
+        }
+
+        if (stream->stream_format == LIBMPEGTS_ANCILLARY_2038) {
+            cur_pes->header_size = 0;
+            cur_pes->header_size = write_table_section(w, stream->program, &frames[i], cur_pes, 0);
+            cur_pes->dts = 0;
+	} else
+        if (stream->stream_format == LIBMPEGTS_TABLE_SECTION) {
+            cur_pes->header_size = 0;
+            //write_section_table(w, stream->pid, frames[i].data, frames[i].size);
+            cur_pes->header_size = write_table_section(w, stream->program, &frames[i], cur_pes, 1);
+            cur_pes->dts = 0;
+        } else
+            cur_pes->header_size = write_pes(w, stream->program, &frames[i], cur_pes);
+
+        if( frames[i].chunk == LIBMPEGTS_CHUNK_FIRST )
+        {
+            cur_pes->awaiting_chunks = 1;
+            stream->open_pes = cur_pes;
+            low_latency = 1;
+        }
+    }
+
+    /* chunks can be output straight away */
+    if( !initial_queued_pes && !low_latency )
+    {
+        /* the last aligned unit may still need completing */
+        if( !num_frames && w->ts_type == TS_TYPE_BLU_RAY )
+            goto end;
+        out = NULL;
+        *len = 0;
+        *pcr_list = NULL;
+        return 0;
+    }
+
+    write_pcr = 0;
+    running = 1;
+
+    if( !w->first_input )
+    {
+        for( int i = 0; i < w->num_programs; i++ )
+        {
+            if( write_pcr_empty( w, w->programs[i], 1 ) < 0 )
+                return -1;
+        }
+        retransmit_psi_and_si( w, 1 );
+        w->first_input = 1;
+    }
+
+    int64_t pcr_stop = get_mux_horizon( w, !num_frames );
+
+    /* new frames and chunks have been queued */
+    w->lazy_next_due = 0;
+
+    cur_pcr = get_pcr_int( w, 0 );
+
+    while( cur_pcr < pcr_stop )
+    {
+        //printf("\n pcr_stop %"PRIi64" cur_pcr %"PRIi64" \n", pcr_stop, cur_pcr );
+
+        ts_int_pes_t *pes;
+        int64_t next_due = 0;
+        write_adapt_field = adapt_field_len = write_pcr = 0;
+        pkt_bytes_left = 184;
+        w->stats.scheduler_iterations++;
+
+        if( check_bitstream( w ) < 0 )
+            return -1;
+
+        /* write any queued PMT packets */
+        if( w->tb.cur_buf == 0.0 && ( program = get_queued_pmt( w ) ) )
+        {
+            eject_queued_pmt( w, program, s );
+            cur_pcr = get_pcr_int( w, 0 );
+            continue;
+        }
+
+        if( w->true_vbr )
+            pes = get_lazy_pes( w, cur_pcr, &next_due );
+        else
+            pes = get_next_pes( w, cur_pcr );
+
+        if( pes )
+        {
+            stream = pes->stream;
+            pes_start = !pes->started; /* flag if packet contains pes header */
+
+            if( pcr_stop < cur_pcr )
+                fprintf( stderr, "\n pcr_stop is less than pcr pid: %i pcr_stop: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pcr_stop, cur_pcr );
+
+            // FIXME complain less
+            if (pes->dts && pes->dts * 3000 < cur_pcr)
+                fprintf( stderr, "\n dts is less than pcr pid: %i dts: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pes->dts*300, cur_pcr );
+
+            bs_init( &q, temp, 150 );
+
+            program = stream->program;
+            if( program->pcr_stream == stream && pes_start )
+                write_adapt_field = 1;
+
+            for( int i = 0; i < w->num_programs; i++ )
+            {
+                if( check_pcr( w, w->programs[i] ) )
+                {
+                    if( w->programs[i]->pcr_stream == stream )
+                    {
+                        /* piggyback pcr on this stream */
+                        write_adapt_field = write_pcr = 1;
+                    }
+                    else if( write_pcr_empty( w, w->programs[i], 0 ) < 0 )
+                        return -1;
+                }
+            }
+
+#if 0
+            if( IS_VIDEO( stream ) && pes_start )
+            {
+                printf("\n last pcr delta %"PRIi64" \n", get_pcr( w, 0 ) - stream->last_pkt_pcr );
+            }
+#endif
+
+            /* when the output is cut at them, a random access point of the video PCR stream carries
+             * a PCR, so the random_access_indicator is set and the packet is a clean cut point */
+            if( w->random_access_pcr && program->pcr_stream == stream && pes_start && pes->random_access && IS_VIDEO( stream ) )
+                write_adapt_field = write_pcr = 1;
+
+            stream->last_pkt_pcr = cur_pcr;
+
+            if( pes_start )
+            {
+                add_to_histogram( &stream->latency.first_packet_latency, get_pcr_int( w, 0 ) - pes->enqueue_pcr );
+                if( pes->dts )
+                    w->max_mux_delay = MAX( w->max_mux_delay, pes->dts * 300 - cur_pcr );
+            }
+
+            if( write_adapt_field )
+            {
+                adapt_field_len = write_adaptation_field( w, &q, program, pes, write_pcr, 1, 0, 0 );
+                pkt_bytes_left -= adapt_field_len;
+            }
+
+            /* DVB AU_Information is large so consider this case */
+            // FIXME consider cablelabs legacy
+            if( !adapt_field_len && pes_start && stream->dvb_au )
+            {
+                adapt_field_len = write_adaptation_field( w, &q, program, pes, 0, 1, 0, 0 );
+                pkt_bytes_left -= adapt_field_len;
+            }
+
+            pkt_start = bs_pos( s ) >> 3;
+
+            // TODO CableLabs legacy
+            if( pes->bytes_left >= pkt_bytes_left )
+            {
+                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
+                if( adapt_field_len )
+                    write_adaptation_field( w, s, program, pes, write_pcr, 1, 0, 0 );
+
+                write_bytes( s, pes->cur_pos, pkt_bytes_left );
+                pes->cur_pos += pkt_bytes_left;
+                pes->bytes_left -= pkt_bytes_left;
+                w->stats.payload_bytes += pkt_bytes_left - pes_start * pes->header_size;
+                add_to_buffer( &stream->tb );
+                if( FULL_TSTD( w, stream ) )
+                    stream->tb_payload += pkt_bytes_left * 8;
+                if( increase_pcr( w, 1, 0 ) < 0 )
+                    return -1;
+            }
+            else
+            {
+                /* stuff the last packet with an oversized adaptation field */
+                stuffing = pkt_bytes_left - pes->bytes_left;
+                flags = 1;
+
+                /* special case where the adaptation_field_length byte is the stuffing */
+                // FIXME except for cablelabs legacy
+                if( stuffing == 1 && !adapt_field_len )
+                {
+                    stuffing = flags = 0;
+                    adapt_field_len = 1;
+                    w->stats.stuffing_bytes++;
+                }
+                else if( stuffing && !adapt_field_len )
+                {
+                    adapt_field_len = 2;
+                    stuffing -= 2;  /* 2 bytes for adaptation field in this case. NOTE: needs fixing if more private data added */
+                }
+
+                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
+                if( adapt_field_len )
+                    write_adaptation_field( w, s, program, pes, write_pcr, flags, stuffing, 0 );
+
+                write_bytes(s, pes->cur_pos, pes->bytes_left );
+                pes->cur_pos += pes->bytes_left;
+                w->stats.payload_bytes += pes->bytes_left - pes_start * pes->header_size;
+                add_to_buffer( &stream->tb );
+                if( FULL_TSTD( w, stream ) )
+                    stream->tb_payload += pes->bytes_left * 8;
+                pes->bytes_left = 0;
+                if( increase_pcr( w, 1, 0 ) < 0 )
+                    return -1;
+            }
+            if( pes_start && pes->random_access && program->pcr_stream == stream &&
+                add_random_access( w, pes, pkt_start ) < 0 )
+                return -1;
+            if( w->trick_play && pes->random_access && program->pcr_stream == stream && IS_VIDEO( stream ) &&
+                add_trick_packet( w ) < 0 )
+                return -1;
+            if( w->index && !stream->indexed )
+            {
+                if( add_index_record( w, LIBMPEGTS_INDEX_FIRST_PACKET, pes, pkt_start ) < 0 )
+                    return -1;
+                stream->indexed = 1;
+            }
+            pes->started = 1;
+            w->stats.payload_packets++;
+
+            if( pes->bytes_left == 0 && !pes->awaiting_chunks )
+            {
+                int64_t last_pcr = get_pcr_int( w, 0 );
+                add_to_histogram( &stream->latency.last_packet_latency, last_pcr - pes->enqueue_pcr );
+                if( pes->dts )
+                    add_to_histogram( &stream->latency.dts_slack, pes->dts * 300 - last_pcr );
+
+                if( FULL_TSTD( w, stream ) && add_decoder_au( stream, pes ) < 0 )
+                    return -1;
+
+                /* eject the current pes from the queue */
+                for( int i = 0; i < w->num_buffered_frames; i++ )
+                {
+                    if( queued_pes[i] == pes )
+                    {
+                        w->num_buffered_frames--;
+                        memmove( &queued_pes[i], &queued_pes[i+1], (w->num_buffered_frames-i) * sizeof(queued_pes) );
+                        break;
+                    }
+                }
+
+                free( pes->data );
+                free( pes );
+                w->stats.pes_ejected++;
+            }
+
+            if( write_due_pcrs( w ) < 0 )
+                return -1;
+            retransmit_psi_and_si( w, 0 );
+        }
+        else if( w->true_vbr )
+        {
+            int pcrs = write_due_pcrs( w );
+            if( pcrs < 0 || ( !pcrs && skip_idle_slots( w, MIN( next_due, pcr_stop ) ) < 0 ) )
+                return -1;
+        }
+        else /* no packets can be written */
+        {
+            int pcrs = write_due_pcrs( w );
+            if( pcrs < 0 )
+                return -1;
+            else if( !pcrs && w->cbr )
+            {
+                if( write_null_packet( w ) < 0 )
+                    return -1;
+            }
+            else if( !pcrs && increase_pcr( w, 1, 1 ) < 0 )
+                return -1; /* write imaginary packet in capped vbr mode */
+        }
+        cur_pcr = get_pcr_int( w, 0 );
+    }
+
+end:
+    if( !num_frames && w->ts_type == TS_TYPE_BLU_RAY && complete_aligned_unit( w ) < 0 )
+        return -1;
+
+    bs_flush( s );
+
+    *out = w->out.p_bitstream;
+    *len = bs_pos( s ) >> 3;
+    *pcr_list = w->pcr_list;
+    w->bytes_written += *len;
+
+    if( w->trick_play && write_trick_play( w, *out, *len ) < 0 )
+        return -1;
+
+    // TODO count bits here
+
+    return 0;
+}
+
+int ts_get_mux_delay( ts_writer_t *w, int64_t *min_delay, int64_t *max_delay )
+{
+    if( min_delay )
+        *min_delay = w->min_mux_delay;
+    if( max_delay )
+        *max_delay = w->max_mux_delay;
+
+    return 0;
+}
+
+int ts_setup_random_access( ts_writer_t *w )
+{
+    if( w->bytes_written )
+    {
+        fprintf( stderr, "Random access points have to be set up before the first output\n" );
+        return -1;
+    }
+
+    w->random_access_pcr = 1;
+
+    return 0;
+}
+
+int ts_setup_index( ts_writer_t *w )
+{
+    if( w->bytes_written )
+    {
+        fprintf( stderr, "The seek index has to be set up before the first output\n" );
+        return -1;
+    }
+
+    w->index = w->random_access_pcr = 1;
+
+    return 0;
+}
+
+int ts_get_index( ts_writer_t *w, uint8_t **data, int *len )
+{
+    *data = w->index_buf;
+    *len = w->index_len;
+
+    return 0;
+}
+
+int ts_setup_trick_play( ts_writer_t *w )
+{
+    if( w->bytes_written )
+    {
+        fprintf( stderr, "Trick play has to be set up before the first output\n" );
+        return -1;
+    }
+
+    w->trick_play = w->random_access_pcr = 1;
+
+    return 0;
+}
+
+int ts_get_trick_play( ts_writer_t *w, uint8_t **out, int *len, int64_t **pcr_list )
+{
+    *out = w->trick_buf;
+    *len = w->trick_len * w->packet_size;
+    *pcr_list = w->trick_pcr_list;
+
+    return 0;
+}
+
+int ts_get_random_access_packets( ts_writer_t *w, int **packets, int *num_packets )
+{
+    *packets = w->random_access_list;
+    *num_packets = w->num_random_access;
+
+    return 0;
+}
+
+int ts_get_latency_stats( ts_writer_t *w, int pid, ts_latency_stats_t *stats, int reset )
+{
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    memcpy( stats, &stream->latency, sizeof(*stats) );
+    if( reset )
+        memset( &stream->latency, 0, sizeof(stream->latency) );
+
+    return 0;
+}
+
+int ts_get_stats( ts_writer_t *w, ts_stats_t *stats, int reset )
+{
+    int64_t elapsed;
+
+    memcpy( stats, &w->stats, sizeof(*stats) );
+
+    /* the slots are not all the same length if the muxrate has changed */
+    elapsed = get_pcr_int( w, 0 ) - w->stats_start_pcr;
+    stats->average_bitrate = elapsed > 0 ? (double)stats->total_packets * w->packet_size * 8 * TS_CLOCK / elapsed + 0.5 : 0;
+
+    if( reset )
+    {
+        memset( &w->stats, 0, sizeof(w->stats) );
+        w->stats_start_pcr = get_pcr_int( w, 0 );
+    }
+
+    return 0;
+}
+
+static void get_buffer_stats( buffer_t *buffer, ts_buffer_stats_t *stats, int reset )
+{
+    stats->size = buffer->buf_size;
+    stats->fullness = buffer->cur_buf;
+    stats->min = buffer->min_buf;
+    stats->max = buffer->max_buf;
+    stats->mean = buffer->num_samples ? (double)buffer->sum_buf / buffer->num_samples : buffer->cur_buf;
+
+    if( reset )
+    {
+        buffer->min_buf = buffer->max_buf = buffer->cur_buf;
+        buffer->sum_buf = buffer->num_samples = 0;
+    }
+}
+
+int ts_get_tstd_stats( ts_writer_t *w, int pid, ts_tstd_stats_t *stats, int reset )
+{
+    memset( stats, 0, sizeof(*stats) );
+
+    if( pid == LIBMPEGTS_SYSTEM_BUFFERS )
+    {
+        stats->rx = w->rx_sys;
+        stats->rbx = w->r_sys;
+        get_buffer_stats( &w->tb, &stats->tb, reset );
+        get_buffer_stats( &w->main_b, &stats->mb, reset );
+        stats->history_dropped = w->sys_history.dropped;
+        if( reset )
+            w->sys_history.dropped = 0;
+        return 0;
+    }
+
+    ts_int_stream_t *stream = find_stream( w, pid );
+
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
+
+    stats->rx = stream->rx;
+    stats->rbx = stream->rbx;
+    get_buffer_stats( &stream->tb, &stats->tb, reset );
+    get_buffer_stats( &stream->mb, &stats->mb, reset );
+    get_buffer_stats( &stream->eb, &stats->eb, reset );
+    stats->history_dropped = stream->history.dropped;
+    if( reset )
+        stream->history.dropped = 0;
+
+    return 0;
+}
+
+static void free_tstd_history( ts_writer_t *w )
+{
+    free( w->sys_history.samples );
+    memset( &w->sys_history, 0, sizeof(w->sys_history) );
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            free( program->streams[j]->history.samples );
+            memset( &program->streams[j]->history, 0, sizeof(program->streams[j]->history) );
+        }
+    }
+    w->tstd_history_size = 0;
+}
+
+int ts_setup_tstd_history( ts_writer_t *w, int num_samples, int interval )
+{
+    if( num_samples < 0 || interval <= 0 )
+    {
+        fprintf( stderr, "Invalid T-STD history parameters\n" );
+        return -1;
+    }
+
+    free_tstd_history( w );
+    if( !num_samples )
+        return 0;
+
+    w->sys_history.samples = calloc( num_samples, sizeof(ts_tstd_sample_t) );
+    if( !w->sys_history.samples )
+        goto fail;
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            program->streams[j]->history.samples = calloc( num_samples, sizeof(ts_tstd_sample_t) );
+            if( !program->streams[j]->history.samples )
+                goto fail;
+        }
+    }
+
+    w->tstd_history_size = num_samples;
+    w->tstd_history_interval = interval * 27000LL;
+    w->next_tstd_sample = 0;
+
+    return 0;
 
-        if( check_bitstream( w ) < 0 )
-            return -1;
+fail:
+    fprintf( stderr, "Malloc failed\n" );
+    free_tstd_history( w );
+    return -1;
+}
 
-        /* write any queued PMT packets */
-        if( program->num_queued_pmt && w->tb.cur_buf == 0.0 )
-        {
-            eject_queued_pmt( w, program, s );
-            cur_pcr = get_pcr_int( w, 0 );
-            continue;
-        }
+int ts_read_tstd_history( ts_writer_t *w, int pid, ts_tstd_sample_t *samples, int max_samples )
+{
+    tstd_history_t *history;
+    int num_samples;
 
-        // FIXME at low bitrates this might need tweaking
+    if( pid == LIBMPEGTS_SYSTEM_BUFFERS )
+        history = &w->sys_history;
+    else
+    {
+        ts_int_stream_t *stream = find_stream( w, pid );
 
-        /* Check all the non-video packets first */
-        for( int i = 0; i < w->num_buffered_frames; i++ )
+        if( !stream )
         {
-            stream = queued_pes[i]->stream;
-            if ((stream->stream_format == LIBMPEGTS_TABLE_SECTION) ||
-                (stream->stream_format == LIBMPEGTS_ANCILLARY_2038)) {
-                /* Immediate eject the PSIP */
-                pes = queued_pes[i];
-                break;
-            }
+            fprintf( stderr, "Invalid PID\n" );
+            return -1;
+        }
+        history = &stream->history;
+    }
 
-            if( (!pes || queued_pes[i]->dts < pes->dts) && !IS_VIDEO( stream ) )
-            {
-                int total_packets = (queued_pes[i]->size + 183) / 184;
-                int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
-                double drip_rate = (double)total_packets/ ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
-                double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr);
+    if( !w->tstd_history_size )
+        return 0;
 
-                /* exclude video packets */
-                if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream->tb.cur_buf == 0.0 &&
-                    ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ) )
-                {
-                    pes = queued_pes[i];
-                    break;
-                }
-            }
-        }
+    num_samples = MIN( max_samples, history->num_samples );
+    for( int i = 0; i < num_samples; i++ )
+        samples[i] = history->samples[(history->start + i) % w->tstd_history_size];
 
-        /* See if we can write a video packet if non-audio packets can't be written. */
-        if( !pes )
-        {
-            for( int i = 0; i < w->num_buffered_frames; i++ )
-            {
-                stream = queued_pes[i]->stream;
-                if( IS_VIDEO( stream ) )
-                {
-                    int total_packets = (queued_pes[i]->size + 183) / 184;
-                    int packets_left = (queued_pes[i]->bytes_left + 183) / 184;
-                    double drip_rate = (double)total_packets / ( queued_pes[i]->final_arrival_time - queued_pes[i]->initial_arrival_time );
-                    double remaining_drip_rate = (double)packets_left / (queued_pes[i]->final_arrival_time - cur_pcr );
+    history->start = (history->start + num_samples) % w->tstd_history_size;
+    history->num_samples -= num_samples;
 
-                    if( cur_pcr >= queued_pes[i]->initial_arrival_time && stream->tb.cur_buf == 0.0 &&
-                        ( drip_rate < remaining_drip_rate || queued_pes[i]->final_arrival_time < cur_pcr ) )
-                    {
-                        pes = queued_pes[i];
-                        break;
-                    }
-                }
-            }
-        }
+    return num_samples;
+}
 
-        if( pes )
-        {
-            stream = pes->stream;
-            pes_start = pes->data == pes->cur_pos; /* flag if packet contains pes header */
+static void free_stream( ts_int_stream_t *stream )
+{
+    // TODO free other stuff
+    if( stream->mpegvideo_ctx )
+        free( stream->mpegvideo_ctx );
+    if( stream->lpcm_ctx )
+        free( stream->lpcm_ctx );
+    if( stream->atsc_ac3_ctx )
+        free( stream->atsc_ac3_ctx );
+    if( stream->dvb_sub_ctx )
+        free( stream->dvb_sub_ctx );
+    if( stream->dvb_ttx_ctx )
+        free( stream->dvb_ttx_ctx );
+    if( stream->dvb_vbi_ctx )
+        free( stream->dvb_vbi_ctx );
+    if( stream->decoder_aus )
+        free( stream->decoder_aus );
+    if( stream->history.samples )
+        free( stream->history.samples );
 
-            if( pcr_stop < cur_pcr )
-                fprintf( stderr, "\n pcr_stop is less than pcr pid: %i pcr_stop: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pcr_stop, cur_pcr );
+    free( stream );
+}
 
-            // FIXME complain less
-            if (pes->dts && pes->dts * 3000 < cur_pcr)
-                fprintf( stderr, "\n dts is less than pcr pid: %i dts: %"PRIi64" pcr: %"PRIi64" \n", pes->stream->pid, pes->dts*300, cur_pcr );
+/* A new PMT version is sent with the next PAT, as early as the minimum section interval allows */
+static void update_pmt( ts_writer_t *w, ts_int_program_t *program )
+{
+    int64_t last_pat = w->last_pat;
+    int64_t due = MAX( get_pcr_int( w, 0 ), last_pat + PSI_MIN_RETRANS_TIME * 27000LL );
 
-            bs_init( &q, temp, 150 );
+    program->pmt_version = (program->pmt_version + 1) & 0x1f;
+    w->last_pat = MIN( last_pat, due - w->pat_period * 27000LL );
+}
 
-            if( program->pcr_stream == stream && pes_start )
-                write_adapt_field = 1;
+int ts_add_stream( ts_writer_t *w, int program_num, ts_stream_t *stream )
+{
+    ts_int_program_t *program = NULL;
 
-            if( check_pcr( w, program ) )
-            {
-                if( program->pcr_stream == stream )
-                {
-                    /* piggyback pcr on this stream */
-                    write_adapt_field = write_pcr = 1;
-                }
-                else if( write_pcr_empty( w, program, 0 ) < 0 )
-                    return -1;
-            }
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        if( w->programs[i]->program_num == program_num )
+            program = w->programs[i];
+    }
 
-#if 0
-            if( IS_VIDEO( stream ) && pes_start )
-            {
-                printf("\n last pcr delta %"PRIi64" \n", get_pcr( w, 0 ) - stream->last_pkt_pcr );
-            }
-#endif
+    if( !program )
+    {
+        fprintf( stderr, "Invalid program number\n" );
+        return -1;
+    }
 
-            stream->last_pkt_pcr = cur_pcr;
+    if( stream->pid == program->pcr_stream->pid )
+    {
+        fprintf( stderr, "PID %i is used by the PCR\n", stream->pid );
+        return -1;
+    }
 
-            if( write_adapt_field )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, write_pcr, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
+    int had_video = !!program->video_stream;
+    ts_int_stream_t *new_stream = setup_stream( w, program, stream );
+    if( !new_stream )
+        return -1;
 
-            /* DVB AU_Information is large so consider this case */
-            // FIXME consider cablelabs legacy
-            if( !adapt_field_len && pes_start && stream->dvb_au )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, 0, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
+    /* the running PMT has to keep fitting in its section */
+    if( check_pmt_size( w, program ) < 0 )
+    {
+        program->num_streams--;
+        if( program->video_stream == new_stream )
+            program->video_stream = NULL;
+        free_stream( new_stream );
+        return -1;
+    }
 
-            // TODO CableLabs legacy
-            if( pes->bytes_left >= pkt_bytes_left )
-            {
-                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
-                if( adapt_field_len )
-                    write_adaptation_field( w, s, program, pes, write_pcr, 1, 0, 0 );
+    if( !had_video && program->video_stream )
+        w->num_radio_programs--;
 
-                write_bytes( s, pes->cur_pos, pkt_bytes_left );
-                pes->cur_pos += pkt_bytes_left;
-                pes->bytes_left -= pkt_bytes_left;
-                add_to_buffer( &stream->tb );
-                if( increase_pcr( w, 1, 0 ) < 0 )
-                    return -1;
-            }
-            else
-            {
-                /* stuff the last packet with an oversized adaptation field */
-                stuffing = pkt_bytes_left - pes->bytes_left;
-                flags = 1;
+    update_pmt( w, program );
 
-                /* special case where the adaptation_field_length byte is the stuffing */
-                // FIXME except for cablelabs legacy
-                if( stuffing == 1 && !adapt_field_len )
-                {
-                    stuffing = flags = 0;
-                    adapt_field_len = 1;
-                }
-                else if( stuffing && !adapt_field_len )
-                {
-                    adapt_field_len = 2;
-                    stuffing -= 2;  /* 2 bytes for adaptation field in this case. NOTE: needs fixing if more private data added */
-                }
+    return 0;
+}
 
-                write_packet_header( w, s, pes_start, stream->pid, PAYLOAD_ONLY + ((!!adapt_field_len)<<1), &stream->cc );
-                if( adapt_field_len )
-                    write_adaptation_field( w, s, program, pes, write_pcr, flags, stuffing, 0 );
+int ts_delete_stream( ts_writer_t *w, int pid )
+{
+    ts_int_stream_t *stream = find_stream( w, pid );
 
-                write_bytes(s, pes->cur_pos, pes->bytes_left );
-                pes->bytes_left = 0;
-                add_to_buffer( &stream->tb );
-                if( increase_pcr( w, 1, 0 ) < 0 )
-                    return -1;
-            }
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
 
-            if( pes->bytes_left == 0 )
-            {
-                /* eject the current pes from the queue */
-                for( int i = 0; i < w->num_buffered_frames; i++ )
-                {
-                    if( queued_pes[i] == pes )
-                    {
-                        w->num_buffered_frames--;
-                        memmove( &queued_pes[i], &queued_pes[i+1], (w->num_buffered_frames-i) * sizeof(queued_pes) );
-                        break;
-                    }
-                }
+    ts_int_program_t *program = stream->program;
 
-                free( pes->data );
-                free( pes );
-            }
+    if( stream == program->pcr_stream )
+    {
+        fprintf( stderr, "Cannot delete the PCR stream\n" );
+        return -1;
+    }
 
-            if( check_pcr( w, program ) && write_pcr_empty( w, program, 0 ) < 0 )
-                return -1;
-            retransmit_psi_and_si( w, program, 0 );
-        }
-        else /* no packets can be written */
+    /* a partly sent PES would be left truncated */
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        if( w->buffered_frames[i]->stream == stream && w->buffered_frames[i]->started )
         {
-            if( check_pcr( w, program ) )
-            {
-                if( write_pcr_empty( w, program, 0 ) < 0 )
-                    return -1;
-            }
-            else if( w->cbr )
-            {
-                if( write_null_packet( w ) < 0 )
-                    return -1;
-            }
-            else if( increase_pcr( w, 1, 1 ) < 0 )
-                return -1; /* write imaginary packet in capped vbr mode */
+            fprintf( stderr, "Cannot delete a stream while a PES is being sent\n" );
+            return -1;
         }
-        cur_pcr = get_pcr_int( w, 0 );
     }
 
-    bs_flush( s );
-
-    *out = w->out.p_bitstream;
-    *len = bs_pos( s ) >> 3;
-    *pcr_list = w->pcr_list;
+    /* drop everything which has not been sent */
+    for( int i = 0; i < w->num_buffered_frames; i++ )
+    {
+        ts_int_pes_t *pes = w->buffered_frames[i];
+        if( pes->stream == stream )
+        {
+            w->num_buffered_frames--;
+            memmove( &w->buffered_frames[i], &w->buffered_frames[i+1], (w->num_buffered_frames-i) * sizeof(w->buffered_frames[0]) );
+            free( pes->data );
+            free( pes );
+            i--;
+        }
+    }
 
-    // TODO if it's the final packet write blu-ray overflows
-    // TODO count bits here
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        if( program->streams[i] == stream )
+        {
+            program->num_streams--;
+            memmove( &program->streams[i], &program->streams[i+1], (program->num_streams-i) * sizeof(program->streams[0]) );
+            break;
+        }
+    }
 
-    return 0;
-}
+    if( stream == program->video_stream )
+    {
+        program->video_stream = NULL;
+        w->num_radio_programs++;
+    }
 
-int ts_delete_stream( ts_writer_t *w, int pid )
-{
-    // TODO
+    free_stream( stream );
+    update_pmt( w, program );
 
     return 0;
 }
 
 int ts_close_writer( ts_writer_t *w )
 {
+    if( w->num_programs )
+        free_tstd_history( w );
+
     for( int i = 0; i < w->num_programs; i++ )
     {
         for( int j = 0; j < w->programs[i]->num_streams; j++ )
-        {
-            // TODO free other stuff
-            if( w->programs[i]->streams[j]->mpegvideo_ctx )
-                free( w->programs[i]->streams[j]->mpegvideo_ctx );
-            if( w->programs[i]->streams[j]->lpcm_ctx )
-                free( w->programs[i]->streams[j]->lpcm_ctx );
-            if( w->programs[i]->streams[j]->atsc_ac3_ctx )
-                free( w->programs[i]->streams[j]->atsc_ac3_ctx );
-            if( w->programs[i]->streams[j]->dvb_sub_ctx )
-                free( w->programs[i]->streams[j]->dvb_sub_ctx );
-            if( w->programs[i]->streams[j]->dvb_ttx_ctx )
-                free( w->programs[i]->streams[j]->dvb_ttx_ctx );
-            if( w->programs[i]->streams[j]->dvb_vbi_ctx )
-                free( w->programs[i]->streams[j]->dvb_vbi_ctx );
-
-            free( w->programs[i]->streams[j] );
-        }
+            free_stream( w->programs[i]->streams[j] );
 
         for( int j = 0; j < w->programs[i]->num_queued_pmt; j++ )
             free( w->programs[i]->pmt_packets[j] );
@@ -2066,6 +3401,11 @@ int ts_close_writer( ts_writer_t *w )
 
     if( w->pcr_list )
         free( w->pcr_list );
+    free( w->random_access_list );
+    free( w->trick_packets );
+    free( w->trick_buf );
+    free( w->trick_pcr_list );
+    free( w->index_buf );
 
     if( w->out.p_bitstream )
         free( w->out.p_bitstream );
@@ -2080,7 +3420,7 @@ void write_packet_header( ts_writer_t *w, bs_t *s, int start, int pid, int adapt
     {
         // tp_extra_header
         bs_write( s, 2, 0 ); // copy_permission_indicator
-        bs_write( s, 30, 0 ); // arrival_time_stamp FIXME
+        bs_write( s, 30, get_pcr_int( w, 0 ) & 0x3fffffff ); // arrival_time_stamp
     }
 
     bs_write( s, 8, 0x47 ); // sync byte
@@ -2125,22 +3465,102 @@ void write_bytes( bs_t *s, uint8_t *bytes, int length )
     s->p_start = p_start;
 }
 
+/* Output of the sinks has to be 188 byte packets. The length alone lets Blu-Ray source packets
+ * through whenever it is a multiple of both packet sizes. */
+int check_ts_packets( uint8_t *data, int len )
+{
+    if( len % TS_PACKET_SIZE )
+        return -1;
+
+    for( int i = 0; i < len; i += TS_PACKET_SIZE )
+    {
+        if( data[i] != 0x47 )
+            return -1;
+    }
+
+    return 0;
+}
+
+static void add_tstd_sample( ts_writer_t *w, tstd_history_t *history, int64_t pcr, buffer_t *tb, buffer_t *mb, buffer_t *eb )
+{
+    ts_tstd_sample_t *sample;
+
+    /* overwrite the oldest sample when full */
+    if( history->num_samples == w->tstd_history_size )
+    {
+        history->start = (history->start + 1) % w->tstd_history_size;
+        history->num_samples--;
+        history->dropped++;
+    }
+
+    sample = &history->samples[(history->start + history->num_samples) % w->tstd_history_size];
+    sample->pcr = pcr;
+    sample->tb = tb->cur_buf;
+    sample->mb = mb->cur_buf;
+    sample->eb = eb ? eb->cur_buf : 0;
+    history->num_samples++;
+}
+
+static void sample_tstd_history( ts_writer_t *w )
+{
+    int64_t pcr = get_pcr_int( w, 0 );
+
+    add_tstd_sample( w, &w->sys_history, pcr, &w->tb, &w->main_b, NULL );
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        for( int j = 0; j < w->programs[i]->num_streams; j++ )
+        {
+            ts_int_stream_t *stream = w->programs[i]->streams[j];
+            add_tstd_sample( w, &stream->history, pcr, &stream->tb, &stream->mb, &stream->eb );
+        }
+    }
+
+    w->next_tstd_sample = pcr + w->tstd_history_interval;
+}
+
 int increase_pcr( ts_writer_t *w, int num_packets, int imaginary )
 {
     int64_t *temp;
     int64_t pcr;
 
-    // TODO do this for all programs
-    ts_int_program_t *program = w->programs[0];
-    double next_pcr = TS_START + (w->packets_written + num_packets) * 8.0 * TS_PACKET_SIZE / w->ts_muxrate;
+    double next_pcr = (double)w->muxrate_pcr / TS_CLOCK + (w->packets_written - w->muxrate_packet + num_packets) * 8.0 * w->packet_size / w->ts_muxrate;
+    uint64_t window = MAX( w->ts_muxrate / (w->packet_size * 8), 1 );
+
+    /* peak bitrate over one second windows */
+    if( w->packets_written >= w->rate_window_end )
+    {
+        w->stats.peak_bitrate = MAX( w->stats.peak_bitrate, w->rate_window_packets * w->ts_muxrate / window );
+        w->rate_window_end += window * ( ( w->packets_written - w->rate_window_end ) / window + 1 );
+        w->rate_window_packets = 0;
+    }
+    if( !imaginary )
+        w->rate_window_packets += num_packets;
+
     /* buffer drip (TODO: all buffers?) */
-    drip_buffer( w, program, w->rx_sys, &w->tb, next_pcr );
-    for( int i = 0; i < program->num_streams; i++ )
+    drip_buffer( w, w->programs[0], w->rx_sys, &w->tb, next_pcr );
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        drip_buffer( w, program, program->streams[i]->rx, &program->streams[i]->tb, next_pcr );
+        ts_int_program_t *program = w->programs[i];
+
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            ts_int_stream_t *stream = program->streams[j];
+            int tb_fill = stream->tb.cur_buf;
+
+            drip_buffer( w, program, stream->rx, &stream->tb, next_pcr );
+            if( FULL_TSTD( w, stream ) )
+                drip_decoder_buffers( w, stream, tb_fill - stream->tb.cur_buf, next_pcr );
+        }
     }
 
     w->packets_written += num_packets;
+    if( imaginary )
+        w->stats.imaginary_packets += num_packets;
+    else
+        w->stats.total_packets += num_packets;
+
+    if( w->tstd_history_size && get_pcr_int( w, 0 ) >= w->next_tstd_sample )
+        sample_tstd_history( w );
 
     if( !imaginary )
     {
@@ -2175,10 +3595,15 @@ void write_crc( bs_t *s, int start )
 
 ts_int_stream_t *find_stream( ts_writer_t *w, int pid )
 {
-    for( int i = 0; i < w->programs[0]->num_streams; i++ )
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        if( pid == w->programs[0]->streams[i]->pid )
-            return w->programs[0]->streams[i];
+        ts_int_program_t *program = w->programs[i];
+
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            if( pid == program->streams[j]->pid )
+                return program->streams[j];
+        }
     }
     return NULL;
 }
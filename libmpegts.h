@@ -252,6 +252,8 @@ typedef struct
  * PIDs must be between 33 and 8190 (DVB)
  * program_num must be between 1 and 8190
  * PCR PID can be the same as a stream in the program (video PID or separate PID recommended)
+ * The PMT has to fit in one section of 1021 bytes, which limits the number of streams with
+ * their descriptors (about 70 AAC streams). Setup fails if it does not.
  *
  * is_3dtv -
  * Write 3d_MPEG2_descriptor in PMT (CableLabs OC-SP-CEP3.0-I01-100827).
@@ -287,18 +289,34 @@ ts_writer_t *ts_create_writer( void );
 
 /*
  * ts_id - Transport Stream ID
- * muxrate - Transport stream muxing rate
+ * muxrate - Transport stream muxing rate. For Blu-Ray this is the rate of the 192 byte source packets
  * cbr - Pad to constant bitrate with null packets
  * ts_type - Type of transport stream to write
  * network_pid - PID of the network table (0 otherwise)
  * legacy_constraints - Comply with CableLabs legacy contraints in Section 7.3 of Content Encoding Profiles 3.0 Specification
  *
+ * mux_delay - Latency budget in milliseconds. No data arrives earlier than mux_delay before its DTS.
+ *             Must not be lower than the minimum safe delay of the video stream (see ts_get_mux_delay).
+ *             0 uses the delay implied by the CPB arrival times of the frames.
+ *
+ * full_tstd - Model the multiplex and elementary buffers of the T-STD with removal at DTS and send
+ *             PES data as soon as they have room, instead of spreading it evenly over its arrival window.
+ *             Streams without a known buffer model keep the default scheduling.
+ *
+ * true_vbr - Variable bitrate without empty slots at the muxrate. Data is sent as late as the buffers
+ *            allow, in bursts at the muxrate which then acts as the peak rate, and idle periods are
+ *            skipped. PCRs are written on both sides of each idle period so that the rate between two
+ *            PCRs stays constant. Requires cbr to be unset. See ts_stats_t for the resulting bitrates.
+ *
  * retransmit periods in milliseconds
  *
+ * Multiple program transport streams must be constant bitrate and the PIDs of all programs must be unique.
+ * Programs without video (e.g. radio services, DVB_SERVICE_TYPE_DIGITAL_RADIO_SOUND) carry the PCR
+ * on one of their streams or a separate PCR PID.
+ *
  * CURRENT LIMITATIONS
  *
- * Single Program Transport Streams only supported currently.
- * Only one video stream allowed.
+ * Only one video stream per program allowed.
  *
  *
  * */
@@ -326,10 +344,35 @@ typedef struct ts_main_t
     int nit_period;
     int tdt_period;
     int tot_period;
+
+    int mux_delay;
+    int full_tstd;
+    int true_vbr;
 } ts_main_t;
 
 int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params );
 
+/* ts_update_muxrate
+ *
+ * Changes the muxrate of a running writer, e.g. when the bandwidth allocation of a service changes.
+ * The new rate applies from the next packet written and the PCR continues without a discontinuity.
+ * PSI/SI and the queued frames are unaffected and the output buffer grows as needed.
+ *
+ * Fails without changing anything if mux_delay (see ts_main_t) is lower than the minimum safe delay
+ * of a video stream at the new rate.
+ */
+
+int ts_update_muxrate( ts_writer_t *w, int muxrate );
+
+/* Mux delay
+ *
+ * min_delay - minimum safe mux delay derived from the vbv setup of the video stream and the muxrate
+ * max_delay - largest delay between the first packet of a PES and its DTS written so far
+ *
+ * Both are in 27MHz clock ticks. Either pointer may be NULL. */
+
+int ts_get_mux_delay( ts_writer_t *w, int64_t *min_delay, int64_t *max_delay );
+
 /**** Additional Codec-Specific functions ****/
 /* Many formats require extra information. Setup the relevant information using the following functions */
 
@@ -637,9 +680,23 @@ int ts_setup_dtcp( ts_writer_t *w, uint8_t byte_1, uint8_t byte_2 );
  * write_pulldown_info - Write pulldown info in AU_Information
  * pic_struct - AVC pic_struct element - only used if write_pulldown_info set
  *
+ * ** Low-latency sub-frame submission (Video Only) **
+ *
+ * chunk - LIBMPEGTS_CHUNK_NONE (the default) submits a whole access unit.
+ * Otherwise the access unit is submitted in several pieces (e.g. slices) which share one PES header.
+ * The LIBMPEGTS_CHUNK_FIRST piece carries the timestamps, random_access and AU_information for the whole access unit
+ * and the pieces that follow are appended in order until LIBMPEGTS_CHUNK_LAST.
+ * cpb_final_arrival_time of every piece is the final arrival time of the last byte of that piece.
+ * Each piece can be output as soon as it has been written, without waiting for the next access unit.
+ *
  * opaque - opaque pointer that libmpegts does nothing with
  */
 
+#define LIBMPEGTS_CHUNK_NONE   0
+#define LIBMPEGTS_CHUNK_FIRST  1
+#define LIBMPEGTS_CHUNK_MIDDLE 2
+#define LIBMPEGTS_CHUNK_LAST   3
+
 typedef struct
 {
     uint8_t *data;
@@ -659,26 +716,843 @@ typedef struct
     int pic_struct;
 
     void *opaque;
+
+    int chunk;
 } ts_frame_t;
 
 /* ts_write_frames
  *
  * libmpegts buffers one frame so the last set of packets can be output by setting num_frames = 0.
  *
- * pcr_list contains an array of pcr values, one for each output packet. The array length is len/188.
+ * Output runs up to the arrival of the second queued video frame. Without video it runs up to the
+ * earliest arrival time of the newest access unit of each stream, i.e. about one access unit (or
+ * mux_delay if that is shorter) behind the latest DTS of the slowest stream.
+ *
+ * pcr_list contains an array of pcr values, one for each output packet. The array length is len/188,
+ * or len/192 for Blu-Ray.
  * NOTE: This PCR list does not wrap around
  *
+ * Blu-Ray source packets carry the arrival time of their first byte in the arrival_time_stamp. The
+ * output of the final call with num_frames = 0 is padded with null packets to complete the last
+ * aligned unit of 6144 bytes.
+ *
  */
 
 int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len, int64_t **pcr_list );
 
-/* INACTIVE
+/* ts_setup_random_access
  *
- * */
+ * Makes the random access points of video PCR streams clean cut points: their first packet
+ * carries a PCR and a random_access_indicator. Needed by the HLS segmenter, ts_setup_index and
+ * ts_setup_trick_play do the same. Has to be called before the first output.
+ */
+int ts_setup_random_access( ts_writer_t *w );
+
+/* ts_get_random_access_packets
+ *
+ * Indices of the packets of the last ts_write_frames output which start a random access point
+ * of a PCR stream. On a video PCR stream only the packets with a PCR carry a random_access_indicator,
+ * after ts_setup_random_access, ts_setup_index or ts_setup_trick_play that is all of them.
+ * The array is valid until the next ts_write_frames call.
+ */
+int ts_get_random_access_packets( ts_writer_t *w, int **packets, int *num_packets );
+
+/**** Trick play ****/
+
+/* The writer can produce a second transport stream alongside the output for fast forward, rewind
+ * and I-frame playlists. It carries the packets of the random access points of the video PCR
+ * streams, the PAT, the PMTs and every PCR of the output, which keeps its timing. Other PCRs
+ * go into packets without payload and the continuity counters of the video PIDs are renumbered.
+ */
+
+/* ts_setup_trick_play
+ *
+ * Enables the trick play output. Has to be called before the first output.
+ */
+int ts_setup_trick_play( ts_writer_t *w );
+
+/* ts_get_trick_play
+ *
+ * The trick play output of the last ts_write_frames call, with its PCR list. The buffers are
+ * valid until the next ts_write_frames call.
+ */
+int ts_get_trick_play( ts_writer_t *w, uint8_t **out, int *len, int64_t **pcr_list );
+
+/**** Seek index ****/
+
+/* The writer can produce a seek index alongside the output, so that VOD and timeshift servers
+ * do not have to scan the recording. The index is a 16 byte header followed by one 40 byte
+ * record for every random access point of a PCR stream and for the first PES packet of every
+ * elementary stream, in output order. All fields are little-endian.
+ *
+ * Header: "TSIX", version (2 bytes, 1), record size (2 bytes, 40), ts_type (2 bytes), 6 reserved bytes
+ *
+ * Record: type (1 byte), frame_type (1 byte), PID (2 bytes), 4 reserved bytes,
+ *         byte offset of the packet in the output (8 bytes), PCR of the packet in 27MHz units
+ *         as in the PCR list (8 bytes), PTS (8 bytes) and DTS (8 bytes) of the access unit
+ */
+
+#define LIBMPEGTS_INDEX_RANDOM_ACCESS 1
+#define LIBMPEGTS_INDEX_FIRST_PACKET  2
+
+/* ts_setup_index
+ *
+ * Enables the seek index. Has to be called before the first output.
+ */
+int ts_setup_index( ts_writer_t *w );
+
+/* ts_get_index
+ *
+ * The index data produced by the last ts_write_frames call, the first call also returns the
+ * header. Appending the data of every call to a file gives the complete index.
+ */
+int ts_get_index( ts_writer_t *w, uint8_t **data, int *len );
+
+/* ts_index_entry_t
+ *
+ * A record of a seek index
+ */
+typedef struct
+{
+    int type;
+    int frame_type;
+    int pid;
+    uint64_t offset;
+    int64_t pcr;
+    int64_t pts;
+    int64_t dts;
+} ts_index_entry_t;
+
+typedef struct ts_index_t ts_index_t;
+
+/* ts_open_index
+ *
+ * Reads an index file, or the part of it written so far for a recording in progress
+ */
+ts_index_t *ts_open_index( const char *filename );
+
+/* ts_index_find
+ *
+ * Finds the last random access point of pid at or before pcr with a binary search. pid is the
+ * PCR stream of the program, the points of each PID are kept apart so that in a multiple
+ * program transport stream only those of one program are searched. Returns -1 if there is none.
+ */
+int ts_index_find( ts_index_t *idx, int pid, int64_t pcr, ts_index_entry_t *entry );
+
+/* ts_index_find_pts
+ *
+ * Like ts_index_find, with the PTS (90kHz) of the random access point.
+ */
+int ts_index_find_pts( ts_index_t *idx, int pid, int64_t pts, ts_index_entry_t *entry );
+
+/* ts_index_first_packet
+ *
+ * Byte offset of the first PES packet of pid, packets carrying only a PCR come before it.
+ * Returns -1 if the PID is not in the index.
+ */
+int ts_index_first_packet( ts_index_t *idx, int pid, uint64_t *offset );
+
+/* ts_index_get_random_access
+ *
+ * All random access points of every PID in output order, valid until ts_close_index.
+ */
+int ts_index_get_random_access( ts_index_t *idx, ts_index_entry_t **entries, int *num_entries );
+
+int ts_close_index( ts_index_t *idx );
+
+/**** Statistics ****/
+
+/* ts_histogram_t
+ *
+ * Fixed bucket histogram of values in 27MHz clock ticks.
+ * Bucket 0 counts negative values, bucket 1 values below 1ms and bucket n values below 2^(n-1)ms.
+ * The last bucket also counts everything larger.
+ */
+
+#define LIBMPEGTS_HISTOGRAM_BUCKETS 16
+
+typedef struct
+{
+    uint64_t count;
+    int64_t min;
+    int64_t max;
+    int64_t sum;
+    uint64_t buckets[LIBMPEGTS_HISTOGRAM_BUCKETS];
+} ts_histogram_t;
+
+/* ts_latency_stats_t
+ *
+ * first_packet_latency - time from a frame being written to libmpegts until its first packet is output
+ * last_packet_latency - time from a frame being written to libmpegts until its last packet is output
+ * dts_slack - DTS of a frame minus the PCR of its last packet. Negative values are late frames
+ */
+
+typedef struct
+{
+    ts_histogram_t first_packet_latency;
+    ts_histogram_t last_packet_latency;
+    ts_histogram_t dts_slack;
+} ts_latency_stats_t;
+
+/* ts_get_latency_stats
+ *
+ * Copies the latency statistics of the stream on the given PID.
+ * reset - clear the statistics afterwards so that the next call covers a new window
+ */
+
+int ts_get_latency_stats( ts_writer_t *w, int pid, ts_latency_stats_t *stats, int reset );
+
+/* T-STD buffer telemetry
+ *
+ * All buffer sizes and fullness values are in bits, leak rates in bits/s.
+ * LIBMPEGTS_SYSTEM_BUFFERS in place of a PID returns the system buffers: the transport buffer in tb
+ * and the main buffer in mb, with rx_sys and r_sys as leak rates.
+ *
+ * The multiplex and elementary buffers are only modelled with full_tstd set (see ts_main_t),
+ * buffers which are not modelled report zero fullness.
+ */
+
+#define LIBMPEGTS_SYSTEM_BUFFERS -1
+
+typedef struct
+{
+    int size;
+    int fullness; /* at the time of the call */
+    int min;
+    int max;
+    double mean;
+} ts_buffer_stats_t;
+
+typedef struct
+{
+    int rx;  /* leak rate from the transport buffer */
+    int rbx; /* leak rate from the multiplex buffer (video only) */
+
+    ts_buffer_stats_t tb; /* transport buffer */
+    ts_buffer_stats_t mb; /* multiplex buffer (video) or main buffer */
+    ts_buffer_stats_t eb; /* elementary stream buffer (video only) */
+
+    uint64_t history_dropped; /* samples of the history overwritten before they were read */
+} ts_tstd_stats_t;
+
+/* ts_get_tstd_stats
+ *
+ * Copies the buffer statistics of the PID since the writer was created or the last reset.
+ */
+
+int ts_get_tstd_stats( ts_writer_t *w, int pid, ts_tstd_stats_t *stats, int reset );
+
+typedef struct
+{
+    int64_t pcr;
+    int tb;
+    int mb;
+    int eb;
+} ts_tstd_sample_t;
+
+/* ts_setup_tstd_history
+ *
+ * Keep a time series of buffer fullness for every PID in a ring buffer. When the ring is full the
+ * oldest sample is overwritten and counted in history_dropped of ts_tstd_stats_t.
+ *
+ * num_samples - number of samples kept per PID (0 disables the history)
+ * interval - time between samples in milliseconds
+ */
+
+int ts_setup_tstd_history( ts_writer_t *w, int num_samples, int interval );
+
+/* ts_read_tstd_history
+ *
+ * Copies up to max_samples of the oldest samples of the PID (or LIBMPEGTS_SYSTEM_BUFFERS) and removes
+ * them from the ring buffer.
+ * Returns the number of samples copied.
+ */
+
+int ts_read_tstd_history( ts_writer_t *w, int pid, ts_tstd_sample_t *samples, int max_samples );
+
+/* ts_stats_t
+ *
+ * Packet counters of the writer. Imaginary packets are the empty slots of a VBR stream
+ * and are not counted in total_packets.
+ *
+ * payload_bytes - elementary stream and table section bytes, without the PES headers and pointer fields
+ * stuffing_bytes - adaptation field stuffing bytes
+ * scheduler_iterations - number of packet slots considered by ts_write_frames
+ * queue_scan_iterations - number of queued PES examined while scheduling
+ * average_bitrate - output bits/s since the writer started or the counters were reset
+ * peak_bitrate - highest output bits/s in a one second window of the stream, 0 until one has completed
+ *
+ * payload_bytes / (total_packets * packet size) gives the muxrate efficiency, the packets are
+ * 188 bytes or 192 bytes for Blu-Ray.
+ */
+
+typedef struct
+{
+    uint64_t total_packets;
+    uint64_t payload_packets;
+    uint64_t pcr_packets; /* PCR-only packets */
+    uint64_t null_packets;
+    uint64_t psi_packets; /* PSI/SI packets */
+    uint64_t imaginary_packets;
+
+    uint64_t payload_bytes;
+    uint64_t stuffing_bytes;
+
+    uint64_t scheduler_iterations;
+    uint64_t queue_scan_iterations;
+    uint64_t pes_ejected;
+
+    uint64_t average_bitrate;
+    uint64_t peak_bitrate;
+} ts_stats_t;
+
+/* ts_get_stats
+ *
+ * Copies the packet counters of the writer.
+ * reset - clear the counters afterwards so that the next call covers a new window
+ */
+
+int ts_get_stats( ts_writer_t *w, ts_stats_t *stats, int reset );
+
+/* ts_add_stream
+ *
+ * Adds a stream to a running program. The PMT version is incremented and the new PMT is sent
+ * with the next PAT. Codec-specific setup functions have to be called for the new PID before
+ * its first frame, as during the initial setup.
+ */
+int ts_add_stream( ts_writer_t *w, int program_num, ts_stream_t *stream );
+
+/* ts_delete_stream
+ *
+ * Removes a stream from a running program and increments the PMT version. Frames of the stream
+ * which have not been sent are discarded. The PCR stream cannot be removed.
+ * Fails while a PES of the stream is partly sent, try again after the next ts_write_frames.
+ */
 int ts_delete_stream( ts_writer_t *w, int pid );
 
 
 
 int ts_close_writer( ts_writer_t *w );
 
+/**** Analyzer ****/
+
+/* The analyzer re-parses a transport stream and checks the ETR 290 priority 1 and 2 items
+ * and the T-STD buffer model of ISO 13818-1 for every elementary stream.
+ *
+ * Time is derived from the PCRs of the first program, so the checks which need a time base
+ * start after the second PCR.
+ */
+
+/* Errors */
+/* ETR 290 Priority 1 */
+#define LIBMPEGTS_ERR_SYNC_LOSS      0  /* 1.1 TS_sync_loss */
+#define LIBMPEGTS_ERR_SYNC_BYTE      1  /* 1.2 Sync_byte_error */
+#define LIBMPEGTS_ERR_PAT            2  /* 1.3 PAT_error: missing for 0.5s, wrong table_id or scrambled */
+#define LIBMPEGTS_ERR_CC             3  /* 1.4 Continuity_count_error */
+#define LIBMPEGTS_ERR_PMT            4  /* 1.5 PMT_error: missing for 0.5s or scrambled */
+#define LIBMPEGTS_ERR_PID            5  /* 1.6 PID_error: a PID of the PMT missing for pid_timeout */
+
+/* ETR 290 Priority 2 */
+#define LIBMPEGTS_ERR_TRANSPORT      6  /* 2.1 Transport_error (transport_error_indicator) */
+#define LIBMPEGTS_ERR_CRC            7  /* 2.2 CRC_error */
+#define LIBMPEGTS_ERR_PCR_REPETITION 8  /* 2.3a PCR_repetition_error: more than 40ms between PCRs */
+#define LIBMPEGTS_ERR_PCR_DISCONTINUITY 9  /* 2.3b PCR_discontinuity_indicator_error */
+#define LIBMPEGTS_ERR_PCR_ACCURACY   10 /* 2.4 PCR_accuracy_error: more than 500ns */
+#define LIBMPEGTS_ERR_PTS            11 /* 2.5 PTS_error: more than 700ms between PTSs */
+
+/* T-STD */
+#define LIBMPEGTS_ERR_TB_OVERFLOW    12
+#define LIBMPEGTS_ERR_MB_OVERFLOW    13 /* the main buffer or, for non-video streams, buffer Bn */
+#define LIBMPEGTS_ERR_EB_OVERFLOW    14
+#define LIBMPEGTS_ERR_UNDERFLOW      15 /* an access unit is not completely in EB (or Bn) at its decode time */
+
+#define LIBMPEGTS_ANALYZER_NUM_ERRORS 16
+
+/* Analyzer parameters
+ *
+ * muxrate - constant muxrate in bits/s used for the PCR accuracy check.
+ *           0 estimates it from the PCRs, which is only meaningful for CBR streams.
+ * vbr - the stream is variable bitrate so skip the PCR accuracy check
+ * pid_timeout - PID_error timeout in milliseconds (default 5000)
+ *
+ * error_callback - optional, called for every error.
+ *                  packet_num counts from 0 and time is in 27MHz ticks (-1 before the time base is known).
+ */
+typedef struct
+{
+    int muxrate;
+    int vbr;
+    int pid_timeout;
+
+    void (*error_callback)( void *opaque, int error, int pid, uint64_t packet_num, int64_t time );
+    void *opaque;
+} ts_analyzer_params_t;
+
+typedef struct ts_analyzer_t ts_analyzer_t;
+
+/* ts_analyzer_pid_t
+ *
+ * stream_type - from the PMT, -1 for PSI and other PIDs which are not elementary streams
+ * tstd - set if a T-STD model is known for the stream type.
+ *        The buffers are sampled at every packet of the PID and only count elementary stream data
+ *        after the transport buffer. Streams other than video only use mb.
+ */
+typedef struct
+{
+    int pid;
+    int stream_type;
+    uint64_t packets;
+    uint64_t errors[LIBMPEGTS_ANALYZER_NUM_ERRORS];
+
+    int tstd;
+    ts_tstd_stats_t buffers;
+} ts_analyzer_pid_t;
+
+/* ts_analyzer_report_t
+ *
+ * muxrate - average muxrate in bits/s measured from the PCRs
+ * sys - system T-STD buffers for the PSI. tb is the system transport buffer and mb is Bsys.
+ *       Every program has its own system buffers, this is the program whose Bsys got fullest.
+ * pids - one entry per PID in order of appearance, owned by the analyzer and valid until the next call
+ */
+typedef struct
+{
+    uint64_t packets;
+    double muxrate;
+    uint64_t errors[LIBMPEGTS_ANALYZER_NUM_ERRORS];
+
+    ts_tstd_stats_t sys;
+
+    int num_pids;
+    ts_analyzer_pid_t *pids;
+} ts_analyzer_report_t;
+
+/* Create Analyzer (params can be NULL) */
+ts_analyzer_t *ts_create_analyzer( ts_analyzer_params_t *params );
+
+/* ts_analyze
+ *
+ * Analyzes the next len bytes of the stream. The data does not need to be packet aligned.
+ */
+int ts_analyze( ts_analyzer_t *a, uint8_t *data, int len );
+
+int ts_get_analyzer_report( ts_analyzer_t *a, ts_analyzer_report_t *report );
+
+/* Returns the name of an error */
+const char *ts_analyzer_error_name( int error );
+
+void ts_close_analyzer( ts_analyzer_t *a );
+
+/**** Output ****/
+
+/* Apart from the file sink, the sinks only take 188 byte packets. Output whose packets do not
+ * all start with a sync byte, such as Blu-Ray source packets, is rejected.
+ */
+
+/* The UDP sink sends the output of ts_write_frames as datagrams of 7 packets, either raw or
+ * with an RTP header (RFC 2250). Where sendmmsg is available a whole batch of datagrams is
+ * sent with one system call.
+ */
+
+/* UDP sink parameters
+ *
+ * host - destination address or host name, unicast or multicast, IPv4 or IPv6
+ * port - destination port
+ * rtp - prefix every datagram with an RTP header of payload type 33. The timestamp is the PCR
+ *       of the first packet in the datagram in 90kHz units, the sequence number starts at 0.
+ * ssrc - RTP synchronisation source identifier
+ * ttl - multicast TTL (hop limit), 0 keeps the system default
+ * packets_per_datagram - 1 to 7 (default 7)
+ * batch_size - maximum number of datagrams per system call (default 64)
+ *
+ * fec_l, fec_d - SMPTE 2022-1 (Pro-MPEG COP3) FEC over a matrix of fec_l columns by fec_d rows
+ *                of RTP packets. fec_l is 1 to 20, fec_d 4 to 20 and fec_l * fec_d at most 100.
+ *                0 disables FEC. Column FEC packets are sent to port + 2.
+ * fec_row - also send row FEC packets to port + 4
+ */
+typedef struct
+{
+    const char *host;
+    int port;
+    int rtp;
+    uint32_t ssrc;
+    int ttl;
+    int packets_per_datagram;
+    int batch_size;
+
+    int fec_l;
+    int fec_d;
+    int fec_row;
+} ts_udp_params_t;
+
+/* datagrams include the FEC packets */
+typedef struct
+{
+    uint64_t packets;
+    uint64_t datagrams;
+    uint64_t fec_packets;
+    uint64_t syscalls;
+} ts_udp_stats_t;
+
+typedef struct ts_udp_sink_t ts_udp_sink_t;
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_params_t *params );
+
+/* ts_udp_send
+ *
+ * Sends the output and PCR list of a ts_write_frames call. Packets which do not fill a datagram
+ * are kept until the next call, so that all datagrams except the last are full.
+ */
+int ts_udp_send( ts_udp_sink_t *u, uint8_t *data, int len, int64_t *pcr_list );
+
+int ts_get_udp_stats( ts_udp_sink_t *u, ts_udp_stats_t *stats );
+
+/* Sends the remaining packets and closes the socket */
+int ts_close_udp_sink( ts_udp_sink_t *u );
+
+/* The pacer smooths the bursts returned by ts_write_frames. Packets are passed on in bursts
+ * of 7 when the monotonic clock reaches the PCR of the first packet of the burst, relative to
+ * the first burst. ts_pace blocks until the last complete burst has been released, so a pacer
+ * usually runs in its own thread or after the writer in a realtime loop.
+ */
+
+/* Pacer parameters
+ *
+ * packets_per_burst - 1 to 7 (default 7), use the datagram size of the UDP sink
+ * speed - playout speed, 1.0 (default) is realtime
+ * max_late - in ms (default 100). A burst which is later than this, e.g. because the writer
+ *            stalled, restarts the schedule instead of sending the backlog at once.
+ * write - called for every burst with the packets and their PCRs, e.g. ts_udp_send
+ */
+typedef struct
+{
+    int packets_per_burst;
+    double speed;
+    int max_late;
+
+    int (*write)( void *opaque, uint8_t *data, int len, int64_t *pcr_list );
+    void *opaque;
+} ts_pacer_params_t;
+
+/* Pacer statistics
+ *
+ * resyncs - restarts of the schedule after a stall or a PCR discontinuity
+ * jitter - difference in ns between the interval of two consecutive releases and the interval
+ *          of their PCRs
+ * lateness - time in ns a burst was released after its slot
+ */
+typedef struct
+{
+    uint64_t packets;
+    uint64_t bursts;
+    uint64_t resyncs;
+
+    int64_t mean_jitter;
+    int64_t max_jitter;
+    int64_t mean_lateness;
+    int64_t max_lateness;
+} ts_pacer_stats_t;
+
+typedef struct ts_pacer_t ts_pacer_t;
+
+ts_pacer_t *ts_create_pacer( ts_pacer_params_t *params );
+
+/* ts_pace
+ *
+ * Releases the output and PCR list of a ts_write_frames call on schedule. Packets which
+ * do not fill a burst are kept until the next call.
+ */
+int ts_pace( ts_pacer_t *p, uint8_t *data, int len, int64_t *pcr_list );
+
+int ts_get_pacer_stats( ts_pacer_t *p, ts_pacer_stats_t *stats, int reset );
+
+/* Releases the remaining packets */
+int ts_close_pacer( ts_pacer_t *p );
+
+/* The file sink writes the output to a file without blocking the writer on disk I/O. The
+ * output is copied into aligned blocks which are queued to an io_uring, or to a writer
+ * thread where io_uring is not available. ts_file_write only waits when every block is
+ * still being written. On Linux, space is reserved with fallocate ahead of the writes so that
+ * the file does not fragment.
+ */
+
+/* File sink parameters
+ *
+ * filename - file to create or truncate
+ * direct - open with O_DIRECT where the file system supports it, bypassing the page cache
+ * preallocate - bytes to reserve ahead of the write position, 0 disables preallocation.
+ *               The reserved space beyond the end of the file is released on close.
+ * block_size - size of the writes, a multiple of 4096 (default 1MiB)
+ * num_blocks - number of blocks, i.e. the maximum number of writes in flight (default 16)
+ * no_io_uring - always use the writer thread
+ */
+typedef struct
+{
+    const char *filename;
+    int direct;
+    int64_t preallocate;
+    int block_size;
+    int num_blocks;
+    int no_io_uring;
+} ts_file_params_t;
+
+/* File sink statistics
+ *
+ * writes - blocks submitted
+ * stalls - number of times ts_file_write had to wait for a block to be written
+ * fallocate_errors - failed preallocations, e.g. on file systems without fallocate.
+ *                    Outside Linux every preallocation counts as failed.
+ * direct - the file was opened with O_DIRECT
+ * io_uring - the writes use io_uring rather than the writer thread
+ */
+typedef struct
+{
+    uint64_t bytes;
+    uint64_t writes;
+    uint64_t stalls;
+    uint64_t fallocate_errors;
+    int direct;
+    int io_uring;
+} ts_file_stats_t;
+
+typedef struct ts_file_sink_t ts_file_sink_t;
+
+ts_file_sink_t *ts_create_file_sink( ts_file_params_t *params );
+
+/* ts_file_write
+ *
+ * Queues the output of a ts_write_frames call. Returns -1 if an earlier write failed.
+ */
+int ts_file_write( ts_file_sink_t *f, uint8_t *data, int len );
+
+int ts_get_file_stats( ts_file_sink_t *f, ts_file_stats_t *stats );
+
+/* Writes the remaining data, waits for all writes to complete and closes the file */
+int ts_close_file_sink( ts_file_sink_t *f );
+
+/* The shared memory ring passes the output to consumers in other processes, e.g. a UDP
+ * sender, a recorder and a monitor, without pipes. The writer copies the packets and their
+ * PCRs into fixed size blocks of a POSIX shared memory object. Readers map the same object
+ * and use the blocks in place, so any number of readers costs no additional copies.
+ *
+ * There is no locking and the writer never waits for readers. Every reader keeps its own
+ * cursor and has to stay less than num_slots blocks behind the writer, a reader which falls
+ * further behind skips the overwritten blocks and counts them as overruns.
+ */
+
+/* Shared memory ring parameters
+ *
+ * name - name of the shared memory object, e.g. "mux1"
+ * packets_per_slot - maximum number of packets per block (default 64)
+ * num_slots - number of blocks, a power of two (default 1024)
+ */
+typedef struct
+{
+    const char *name;
+    int packets_per_slot;
+    int num_slots;
+} ts_shm_params_t;
+
+typedef struct ts_shm_ring_t ts_shm_ring_t;
+
+ts_shm_ring_t *ts_create_shm_ring( ts_shm_params_t *params );
+
+/* ts_shm_write
+ *
+ * Publishes the output and PCR list of a ts_write_frames call. Every call publishes all its
+ * packets, so the last block of a call may not be full.
+ */
+int ts_shm_write( ts_shm_ring_t *r, uint8_t *data, int len, int64_t *pcr_list );
+
+/* Tells the readers the ring has ended and removes the name. Readers keep their mapping. */
+int ts_close_shm_ring( ts_shm_ring_t *r );
+
+/* Reader statistics
+ *
+ * overruns - blocks lost because the writer overwrote them before or while they were read
+ * lag - blocks published but not yet read
+ */
+typedef struct
+{
+    uint64_t blocks;
+    uint64_t packets;
+    uint64_t overruns;
+    uint64_t lag;
+} ts_shm_reader_stats_t;
+
+typedef struct ts_shm_reader_t ts_shm_reader_t;
+
+/* Opens the ring of a running writer, reading starts with the next block published */
+ts_shm_reader_t *ts_open_shm_reader( const char *name );
+
+/* ts_shm_read
+ *
+ * Returns the next block in place: the packets in data and len and one PCR per packet in
+ * pcr_list. Returns 1 when a block was returned, 0 when there is no new block and -1 when
+ * the writer has closed the ring and every block has been read.
+ *
+ * The block stays valid until ts_shm_release or the next ts_shm_read.
+ */
+int ts_shm_read( ts_shm_reader_t *rd, uint8_t **data, int *len, int64_t **pcr_list );
+
+/* ts_shm_release
+ *
+ * Returns -1 if the writer overwrote the block while it was being used, in which case
+ * anything derived from it has to be discarded.
+ */
+int ts_shm_release( ts_shm_reader_t *rd );
+
+/* Waits up to timeout ms for a new block or the end of the ring. Returns 1 when either is there. */
+int ts_shm_wait( ts_shm_reader_t *rd, int timeout );
+
+int ts_get_shm_reader_stats( ts_shm_reader_t *rd, ts_shm_reader_stats_t *stats );
+
+int ts_close_shm_reader( ts_shm_reader_t *rd );
+
+/* The fan-out passes the output to several sinks, e.g. primary and backup UDP destinations,
+ * a recorder and a monitor, with a single copy. The output of every ts_write_frames call is
+ * copied into a reference counted block which all sinks share. A sink which needs the block
+ * after its write callback returns, e.g. to send it from another thread, takes a reference
+ * with ts_ref_block and drops it with ts_unref_block when done. The block goes back to the
+ * pool when the last reference is dropped, so the memory traffic does not grow with the
+ * number of sinks.
+ */
+
+/* Output block, read only for sinks
+ *
+ * data - packets
+ * len - length of data in bytes
+ * pcr_list - PCR of every packet in 27MHz units
+ */
+typedef struct
+{
+    uint8_t *data;
+    int len;
+    int64_t *pcr_list;
+} ts_block_t;
+
+/* ts_ref_block, ts_unref_block
+ *
+ * Can be called from any thread, also after the fan-out has been closed.
+ */
+void ts_ref_block( ts_block_t *block );
+void ts_unref_block( ts_block_t *block );
+
+/* Fan-out parameters
+ *
+ * max_blocks - maximum number of blocks, including those held by sinks (default 64).
+ *              ts_fanout_write fails when every block is held.
+ */
+typedef struct
+{
+    int max_blocks;
+} ts_fanout_params_t;
+
+/* Fan-out statistics
+ *
+ * blocks, bytes - blocks and bytes written, every byte is copied once
+ * sink_errors - failed sink writes
+ * allocated_blocks - blocks in the pool, free or in use
+ * blocks_in_use - blocks currently referenced by sinks
+ */
+typedef struct
+{
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t sink_errors;
+    int allocated_blocks;
+    int blocks_in_use;
+    int max_blocks_in_use;
+} ts_fanout_stats_t;
+
+typedef struct ts_fanout_t ts_fanout_t;
+
+ts_fanout_t *ts_create_fanout( ts_fanout_params_t *params );
+
+/* ts_fanout_add_sink
+ *
+ * Registers a sink, up to 16. write is called with every block and opaque, in the order the
+ * sinks were added.
+ */
+int ts_fanout_add_sink( ts_fanout_t *f, int (*write)( void *opaque, ts_block_t *block ), void *opaque );
+
+/* Unregisters the sink with this opaque. References it holds stay valid. */
+int ts_fanout_remove_sink( ts_fanout_t *f, void *opaque );
+
+/* ts_fanout_write
+ *
+ * Passes the output and PCR list of a ts_write_frames call to every sink. Returns -1 if any
+ * sink failed, the other sinks still get the block.
+ */
+int ts_fanout_write( ts_fanout_t *f, uint8_t *data, int len, int64_t *pcr_list );
+
+int ts_get_fanout_stats( ts_fanout_t *f, ts_fanout_stats_t *stats );
+
+/* Blocks still referenced by sinks are freed when they are released */
+int ts_close_fanout( ts_fanout_t *f );
+
+/* The HLS segmenter cuts the output into segments at the random access points of the PCR
+ * stream reported by the writer, so the output does not have to be parsed again to find
+ * them. Every segment starts with the latest PAT and PMTs followed by the random access
+ * packet, the output before the first random access point is dropped. A rolling m3u8
+ * playlist lists the newest segments. Meant for single program transport streams.
+ */
+
+/* ts_hls_segment_t
+ *
+ * index - media sequence number of the segment
+ * duration - in 27MHz units, from the PCR of the first packet to that of the next segment
+ */
+typedef struct
+{
+    int index;
+    uint8_t *data;
+    int len;
+    int64_t duration;
+} ts_hls_segment_t;
+
+/* HLS parameters
+ *
+ * segment_filename - printf pattern of the segment files with the index, e.g. "seg%05d.ts".
+ *                    It must have exactly one integer conversion and no other, a literal %
+ *                    is written as %%. NULL writes no files. The playlist refers to the
+ *                    segments by their file names without the directory.
+ * playlist_filename - m3u8 playlist, NULL writes no playlist
+ * target_duration - in seconds (default 6), rounded up to whole seconds. It is the
+ *                   EXT-X-TARGETDURATION of the playlist. A segment ends at the last random
+ *                   access point that keeps its duration, rounded to whole seconds, within the
+ *                   target. Only if there is none, it ends at the first one after and is longer.
+ *                   The output is held back until the end of the segment is known.
+ * list_size - number of segments in the playlist (default 5), -1 keeps every segment
+ * delete_segments - delete segment files which have left the playlist
+ * first_index - index of the first segment
+ * segment - called with every complete segment in memory, may be NULL
+ */
+typedef struct
+{
+    const char *segment_filename;
+    const char *playlist_filename;
+    double target_duration;
+    int list_size;
+    int delete_segments;
+    int first_index;
+
+    int (*segment)( void *opaque, ts_hls_segment_t *segment );
+    void *opaque;
+} ts_hls_params_t;
+
+typedef struct ts_hls_t ts_hls_t;
+
+ts_hls_t *ts_create_hls( ts_hls_params_t *params );
+
+/* ts_hls_write
+ *
+ * Segments the output and PCR list of the last ts_write_frames call of w. The random access
+ * points of w have to be set up with ts_setup_random_access.
+ */
+int ts_hls_write( ts_hls_t *h, ts_writer_t *w, uint8_t *data, int len, int64_t *pcr_list );
+
+/* Ends the last segment and the playlist */
+int ts_close_hls( ts_hls_t *h );
+
 #endif
@@ -0,0 +1,310 @@
+/*****************************************************************************
+ * fanout.c : reference counted output blocks for multiple sinks
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+#include <pthread.h>
+
+#define MAX_SINKS           16
+#define DEFAULT_MAX_BLOCKS  64
+
+typedef struct fanout_pool_t fanout_pool_t;
+
+/* the public part comes first so a ts_block_t is also a fanout_block_t */
+typedef struct fanout_block_t
+{
+    ts_block_t b;
+    int refs;
+    int size;     /* allocated packet bytes */
+    int max_pcrs; /* allocated PCR entries */
+    fanout_pool_t *pool;
+    struct fanout_block_t *next;
+} fanout_block_t;
+
+/* Blocks can be released from any thread and after the fan-out has been closed,
+ * so the pool lives until the last block comes back */
+struct fanout_pool_t
+{
+    pthread_mutex_t mutex;
+    fanout_block_t *free_list;
+    int allocated;
+    int in_use;
+    int max_in_use;
+    int closed;
+};
+
+typedef struct
+{
+    int (*write)( void *opaque, ts_block_t *block );
+    void *opaque;
+} fanout_sink_t;
+
+struct ts_fanout_t
+{
+    fanout_pool_t *pool;
+    int max_blocks;
+
+    fanout_sink_t sinks[MAX_SINKS];
+    int num_sinks;
+
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t sink_errors;
+};
+
+static void free_block( fanout_block_t *block )
+{
+    free( block->b.data );
+    free( block->b.pcr_list );
+    free( block );
+}
+
+static void free_pool( fanout_pool_t *pool )
+{
+    while( pool->free_list )
+    {
+        fanout_block_t *block = pool->free_list;
+        pool->free_list = block->next;
+        free_block( block );
+    }
+    pthread_mutex_destroy( &pool->mutex );
+    free( pool );
+}
+
+/* Takes a block from the pool or allocates one, and makes it large enough for len bytes */
+static fanout_block_t *get_block( ts_fanout_t *f, int len )
+{
+    fanout_pool_t *pool = f->pool;
+    int num_pcrs = len / TS_PACKET_SIZE;
+    fanout_block_t *block;
+
+    pthread_mutex_lock( &pool->mutex );
+    block = pool->free_list;
+    if( block )
+        pool->free_list = block->next;
+    else if( pool->allocated < f->max_blocks )
+        pool->allocated++;
+    else
+    {
+        pthread_mutex_unlock( &pool->mutex );
+        fprintf( stderr, "All %d output blocks are held by sinks\n", f->max_blocks );
+        return NULL;
+    }
+    pool->in_use++;
+    pool->max_in_use = MAX( pool->max_in_use, pool->in_use );
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( !block )
+    {
+        block = calloc( 1, sizeof(*block) );
+        if( !block )
+            goto fail;
+        block->pool = pool;
+    }
+
+    if( block->size < len )
+    {
+        uint8_t *data = realloc( block->b.data, len );
+        if( !data )
+            goto fail;
+        block->b.data = data;
+        block->size = len;
+    }
+    if( block->max_pcrs < num_pcrs )
+    {
+        int64_t *pcr_list = realloc( block->b.pcr_list, num_pcrs * sizeof(int64_t) );
+        if( !pcr_list )
+            goto fail;
+        block->b.pcr_list = pcr_list;
+        block->max_pcrs = num_pcrs;
+    }
+
+    block->refs = 1;
+    block->next = NULL;
+    return block;
+
+fail:
+    fprintf( stderr, "Malloc failed\n" );
+    pthread_mutex_lock( &pool->mutex );
+    pool->in_use--;
+    if( block )
+    {
+        block->next = pool->free_list;
+        pool->free_list = block;
+    }
+    else
+        pool->allocated--;
+    pthread_mutex_unlock( &pool->mutex );
+    return NULL;
+}
+
+void ts_ref_block( ts_block_t *b )
+{
+    fanout_block_t *block = (fanout_block_t *)b;
+
+    __atomic_add_fetch( &block->refs, 1, __ATOMIC_RELAXED );
+}
+
+void ts_unref_block( ts_block_t *b )
+{
+    fanout_block_t *block = (fanout_block_t *)b;
+    fanout_pool_t *pool = block->pool;
+    int last;
+
+    if( __atomic_sub_fetch( &block->refs, 1, __ATOMIC_ACQ_REL ) )
+        return;
+
+    pthread_mutex_lock( &pool->mutex );
+    block->next = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+    last = pool->closed && !pool->in_use;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( last )
+        free_pool( pool );
+}
+
+ts_fanout_t *ts_create_fanout( ts_fanout_params_t *params )
+{
+    if( params->max_blocks < 0 )
+    {
+        fprintf( stderr, "Invalid fan-out parameters\n" );
+        return NULL;
+    }
+
+    ts_fanout_t *f = calloc( 1, sizeof(*f) );
+    if( !f )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    f->pool = calloc( 1, sizeof(*f->pool) );
+    if( !f->pool )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( f );
+        return NULL;
+    }
+    pthread_mutex_init( &f->pool->mutex, NULL );
+
+    f->max_blocks = params->max_blocks ? params->max_blocks : DEFAULT_MAX_BLOCKS;
+
+    return f;
+}
+
+int ts_fanout_add_sink( ts_fanout_t *f, int (*write)( void *opaque, ts_block_t *block ), void *opaque )
+{
+    if( f->num_sinks == MAX_SINKS )
+    {
+        fprintf( stderr, "Too many sinks\n" );
+        return -1;
+    }
+
+    f->sinks[f->num_sinks].write = write;
+    f->sinks[f->num_sinks].opaque = opaque;
+    f->num_sinks++;
+
+    return 0;
+}
+
+int ts_fanout_remove_sink( ts_fanout_t *f, void *opaque )
+{
+    for( int i = 0; i < f->num_sinks; i++ )
+    {
+        if( f->sinks[i].opaque == opaque )
+        {
+            memmove( &f->sinks[i], &f->sinks[i+1], (f->num_sinks - i - 1) * sizeof(*f->sinks) );
+            f->num_sinks--;
+            return 0;
+        }
+    }
+
+    fprintf( stderr, "Sink not found\n" );
+    return -1;
+}
+
+int ts_fanout_write( ts_fanout_t *f, uint8_t *data, int len, int64_t *pcr_list )
+{
+    fanout_block_t *block;
+    int ret = 0;
+
+    if( check_ts_packets( data, len ) < 0 )
+    {
+        fprintf( stderr, "Fan-out needs 188 byte packets\n" );
+        return -1;
+    }
+    if( !len )
+        return 0;
+
+    /* the only copy, however many sinks there are */
+    block = get_block( f, len );
+    if( !block )
+        return -1;
+    memcpy( block->b.data, data, len );
+    memcpy( block->b.pcr_list, pcr_list, len / TS_PACKET_SIZE * sizeof(int64_t) );
+    block->b.len = len;
+    f->blocks++;
+    f->bytes += len;
+
+    /* a sink which fails does not keep the others from getting the block */
+    for( int i = 0; i < f->num_sinks; i++ )
+    {
+        if( f->sinks[i].write( f->sinks[i].opaque, &block->b ) < 0 )
+        {
+            f->sink_errors++;
+            ret = -1;
+        }
+    }
+
+    ts_unref_block( &block->b );
+
+    return ret;
+}
+
+int ts_get_fanout_stats( ts_fanout_t *f, ts_fanout_stats_t *stats )
+{
+    stats->blocks = f->blocks;
+    stats->bytes = f->bytes;
+    stats->sink_errors = f->sink_errors;
+
+    pthread_mutex_lock( &f->pool->mutex );
+    stats->allocated_blocks = f->pool->allocated;
+    stats->blocks_in_use = f->pool->in_use;
+    stats->max_blocks_in_use = f->pool->max_in_use;
+    pthread_mutex_unlock( &f->pool->mutex );
+
+    return 0;
+}
+
+int ts_close_fanout( ts_fanout_t *f )
+{
+    fanout_pool_t *pool = f->pool;
+    int last;
+
+    pthread_mutex_lock( &pool->mutex );
+    pool->closed = 1;
+    last = !pool->in_use;
+    pthread_mutex_unlock( &pool->mutex );
+
+    if( last )
+        free_pool( pool );
+    free( f );
+
+    return 0;
+}
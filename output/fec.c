@@ -0,0 +1,115 @@
+/*****************************************************************************
+ * fec.c : SMPTE 2022-1 FEC
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+#include <stddef.h>
+#include "fec.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define RTP_PAYLOAD_FEC 96
+
+void fec_xor( uint8_t *dst, const uint8_t *src, int len )
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for( ; i + 64 <= len; i += 64 )
+    {
+        __m128i a = _mm_xor_si128( _mm_loadu_si128( (__m128i*)&dst[i] ),    _mm_loadu_si128( (__m128i*)&src[i] ) );
+        __m128i b = _mm_xor_si128( _mm_loadu_si128( (__m128i*)&dst[i+16] ), _mm_loadu_si128( (__m128i*)&src[i+16] ) );
+        __m128i c = _mm_xor_si128( _mm_loadu_si128( (__m128i*)&dst[i+32] ), _mm_loadu_si128( (__m128i*)&src[i+32] ) );
+        __m128i d = _mm_xor_si128( _mm_loadu_si128( (__m128i*)&dst[i+48] ), _mm_loadu_si128( (__m128i*)&src[i+48] ) );
+        _mm_storeu_si128( (__m128i*)&dst[i],    a );
+        _mm_storeu_si128( (__m128i*)&dst[i+16], b );
+        _mm_storeu_si128( (__m128i*)&dst[i+32], c );
+        _mm_storeu_si128( (__m128i*)&dst[i+48], d );
+    }
+    for( ; i + 16 <= len; i += 16 )
+        _mm_storeu_si128( (__m128i*)&dst[i], _mm_xor_si128( _mm_loadu_si128( (__m128i*)&dst[i] ), _mm_loadu_si128( (__m128i*)&src[i] ) ) );
+#else
+    for( ; i + 8 <= len; i += 8 )
+    {
+        uint64_t a, b;
+        memcpy( &a, &dst[i], 8 );
+        memcpy( &b, &src[i], 8 );
+        a ^= b;
+        memcpy( &dst[i], &a, 8 );
+    }
+#endif
+
+    for( ; i < len; i++ )
+        dst[i] ^= src[i];
+}
+
+void fec_accumulate( fec_accumulator_t *acc, const uint8_t *rtp_header, const uint8_t *payload, int len )
+{
+    acc->length_recovery ^= len;
+    acc->pt_recovery ^= rtp_header[1] & 0x7f;
+    acc->ts_recovery ^= ((uint32_t)rtp_header[4] << 24) | (rtp_header[5] << 16) | (rtp_header[6] << 8) | rtp_header[7];
+
+    if( !acc->count++ )
+    {
+        acc->sn_base = (rtp_header[2] << 8) | rtp_header[3];
+        memcpy( acc->payload, payload, len );
+        acc->payload_size = len;
+        return;
+    }
+
+    /* shorter packets are padded with zeros */
+    if( len > acc->payload_size )
+    {
+        memset( acc->payload + acc->payload_size, 0, len - acc->payload_size );
+        acc->payload_size = len;
+    }
+    fec_xor( acc->payload, payload, len );
+}
+
+int fec_write_packet( uint8_t *p, fec_accumulator_t *acc, uint16_t seq, int row, int offset, int na )
+{
+    /* RTP header, the timestamp is unused and the SSRC is 0 */
+    memset( p, 0, RTP_HEADER_SIZE );
+    p[0] = 0x80;
+    p[1] = RTP_PAYLOAD_FEC;
+    p[2] = seq >> 8;
+    p[3] = seq;
+    p += RTP_HEADER_SIZE;
+
+    p[0] = acc->sn_base >> 8;
+    p[1] = acc->sn_base;
+    p[2] = acc->length_recovery >> 8;
+    p[3] = acc->length_recovery;
+    p[4] = 0x80 | acc->pt_recovery; // E
+    p[5] = p[6] = p[7] = 0;         // mask
+    p[8] = acc->ts_recovery >> 24;
+    p[9] = acc->ts_recovery >> 16;
+    p[10] = acc->ts_recovery >> 8;
+    p[11] = acc->ts_recovery;
+    p[12] = row ? 0x40 : 0;         // N, D, type XOR, index 0
+    p[13] = offset;
+    p[14] = na;
+    p[15] = 0;                      // SNBase ext bits
+    memcpy( p + FEC_HEADER_SIZE, acc->payload, acc->payload_size );
+
+    int size = RTP_HEADER_SIZE + FEC_HEADER_SIZE + acc->payload_size;
+    memset( acc, 0, offsetof( fec_accumulator_t, payload ) );
+
+    return size;
+}
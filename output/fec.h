@@ -0,0 +1,52 @@
+/*****************************************************************************
+ * fec.h : SMPTE 2022-1 FEC header
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#ifndef LIBMPEGTS_FEC_H
+#define LIBMPEGTS_FEC_H
+
+#define RTP_HEADER_SIZE   12
+#define FEC_HEADER_SIZE   16
+#define FEC_MAX_PAYLOAD   ( 7 * 188 )
+#define FEC_PACKET_SIZE   ( RTP_HEADER_SIZE + FEC_HEADER_SIZE + FEC_MAX_PAYLOAD )
+
+/* the column FEC is sent to the media port + 2, the row FEC to the media port + 4 */
+#define FEC_COLUMN_PORT_OFFSET 2
+#define FEC_ROW_PORT_OFFSET    4
+
+/* XOR of the media packets protected by one FEC packet */
+typedef struct
+{
+    int count;
+    uint16_t sn_base;
+    uint16_t length_recovery;
+    uint8_t pt_recovery;
+    uint32_t ts_recovery;
+    int payload_size;
+    uint8_t payload[FEC_MAX_PAYLOAD];
+} fec_accumulator_t;
+
+void fec_xor( uint8_t *dst, const uint8_t *src, int len );
+
+/* Adds a media packet with its RTP header */
+void fec_accumulate( fec_accumulator_t *acc, const uint8_t *rtp_header, const uint8_t *payload, int len );
+
+/* Writes the RTP and FEC headers and the payload and resets the accumulator. Returns the size.
+ * row - set for row FEC, offset and na are the matrix parameters of the FEC header */
+int fec_write_packet( uint8_t *p, fec_accumulator_t *acc, uint16_t seq, int row, int offset, int na );
+
+#endif
@@ -0,0 +1,594 @@
+/*****************************************************************************
+ * file.c : asynchronous file output sink
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* O_DIRECT and fallocate */
+#define _GNU_SOURCE
+
+#include "../common.h"
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+/* O_DIRECT needs the buffers, sizes and offsets aligned to the logical block size */
+#define FILE_ALIGN          4096
+#define DEFAULT_BLOCK_SIZE  ( 1 << 20 )
+#define DEFAULT_NUM_BLOCKS  16
+
+typedef struct
+{
+    uint8_t *data;
+    int size;
+    int64_t offset;
+    int in_flight;
+} file_block_t;
+
+struct ts_file_sink_t
+{
+    int fd;
+    int direct;
+    int block_size;
+    int num_blocks;
+    file_block_t *blocks;
+    int cur;
+    int64_t offset; /* of the block being filled */
+
+    int64_t preallocate;
+    int64_t preallocated; /* end of the reserved space */
+
+    int error;
+    ts_file_stats_t stats;
+
+#ifdef HAVE_IO_URING
+    int ring_fd;
+    uint8_t *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+
+    /* thread fallback, the worker writes the blocks in queue order */
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int *queue;
+    int queue_start;
+    int queue_len;
+    int64_t queue_fallocate; /* end of the space the worker should reserve */
+    int quit;
+};
+
+#define FALLOCATE_TAG -1
+
+/**** io_uring ****/
+
+#ifdef HAVE_IO_URING
+static int setup_ring( ts_file_sink_t *f )
+{
+    struct io_uring_params p;
+
+    memset( &p, 0, sizeof(p) );
+    /* every block plus a fallocate can be in flight */
+    f->ring_fd = syscall( __NR_io_uring_setup, f->num_blocks + 1, &p );
+    if( f->ring_fd < 0 )
+        return -1;
+
+    f->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    f->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    f->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    f->sq_ring = mmap( NULL, f->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_SQ_RING );
+    f->cq_ring = mmap( NULL, f->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_CQ_RING );
+    f->sqes = mmap( NULL, f->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f->ring_fd, IORING_OFF_SQES );
+    if( f->sq_ring == MAP_FAILED || f->cq_ring == MAP_FAILED || f->sqes == MAP_FAILED )
+        return -1;
+
+    f->sq_head = (unsigned *)( f->sq_ring + p.sq_off.head );
+    f->sq_tail = (unsigned *)( f->sq_ring + p.sq_off.tail );
+    f->sq_mask = (unsigned *)( f->sq_ring + p.sq_off.ring_mask );
+    f->sq_array = (unsigned *)( f->sq_ring + p.sq_off.array );
+    f->cq_head = (unsigned *)( f->cq_ring + p.cq_off.head );
+    f->cq_tail = (unsigned *)( f->cq_ring + p.cq_off.tail );
+    f->cq_mask = (unsigned *)( f->cq_ring + p.cq_off.ring_mask );
+    f->cqes = (struct io_uring_cqe *)( f->cq_ring + p.cq_off.cqes );
+
+    return 0;
+}
+
+static void close_ring( ts_file_sink_t *f )
+{
+    if( f->sq_ring && f->sq_ring != MAP_FAILED )
+        munmap( f->sq_ring, f->sq_ring_size );
+    if( f->cq_ring && f->cq_ring != MAP_FAILED )
+        munmap( f->cq_ring, f->cq_ring_size );
+    if( f->sqes && f->sqes != MAP_FAILED )
+        munmap( f->sqes, f->sqes_size );
+    if( f->ring_fd >= 0 )
+        close( f->ring_fd );
+}
+
+static int ring_submit( ts_file_sink_t *f, int opcode, int tag, uint8_t *data, int64_t len, int64_t offset )
+{
+    unsigned tail = *f->sq_tail;
+    unsigned idx = tail & *f->sq_mask;
+    struct io_uring_sqe *sqe = &f->sqes[idx];
+
+    memset( sqe, 0, sizeof(*sqe) );
+    sqe->opcode = opcode;
+    sqe->fd = f->fd;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)(int64_t)tag;
+    if( opcode == IORING_OP_FALLOCATE )
+    {
+        /* io_uring is Linux only, the same reservation as reserve_space */
+        sqe->addr = len;
+        sqe->len = FALLOC_FL_KEEP_SIZE;
+    }
+    else
+    {
+        sqe->addr = (uintptr_t)data;
+        sqe->len = len;
+    }
+    f->sq_array[idx] = idx;
+    __atomic_store_n( f->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    while( syscall( __NR_io_uring_enter, f->ring_fd, 1, 0, 0, NULL, 0 ) < 0 )
+    {
+        if( errno != EINTR )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Marks completed blocks as free, optionally waiting for at least one completion */
+static int ring_reap( ts_file_sink_t *f, int wait )
+{
+    unsigned head = *f->cq_head;
+
+    if( wait && head == __atomic_load_n( f->cq_tail, __ATOMIC_ACQUIRE ) )
+    {
+        while( syscall( __NR_io_uring_enter, f->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 )
+        {
+            if( errno != EINTR )
+                return -1;
+        }
+    }
+
+    while( head != __atomic_load_n( f->cq_tail, __ATOMIC_ACQUIRE ) )
+    {
+        struct io_uring_cqe *cqe = &f->cqes[head & *f->cq_mask];
+        int tag = (int64_t)cqe->user_data;
+
+        if( tag == FALLOCATE_TAG )
+        {
+            /* not supported by every file system or kernel, the writes still work */
+            if( cqe->res < 0 )
+                f->stats.fallocate_errors++;
+        }
+        else
+        {
+            if( cqe->res != f->blocks[tag].size )
+                f->error = 1;
+            f->blocks[tag].in_flight = 0;
+        }
+        head++;
+    }
+    __atomic_store_n( f->cq_head, head, __ATOMIC_RELEASE );
+
+    return 0;
+}
+#endif
+
+/**** Thread ****/
+
+static int write_all( int fd, uint8_t *data, int len, int64_t offset )
+{
+    while( len > 0 )
+    {
+        ssize_t ret = pwrite( fd, data, len, offset );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+/* Reserves space beyond the end of the file without changing its size. Only Linux can do that,
+ * posix_fallocate elsewhere would extend the file, so the reservation counts as failed there. */
+static int reserve_space( int fd, int64_t offset, int64_t len )
+{
+#ifdef __linux__
+    return fallocate( fd, FALLOC_FL_KEEP_SIZE, offset, len );
+#else
+    return -1;
+#endif
+}
+
+static void *file_thread( void *arg )
+{
+    ts_file_sink_t *f = arg;
+    int64_t fallocated = 0;
+
+    pthread_mutex_lock( &f->mutex );
+    while( 1 )
+    {
+        while( !f->queue_len && !f->quit )
+            pthread_cond_wait( &f->cond, &f->mutex );
+        if( !f->queue_len )
+            break;
+
+        int idx = f->queue[f->queue_start];
+        int64_t fallocate_end = f->queue_fallocate;
+        file_block_t *block = &f->blocks[idx];
+        pthread_mutex_unlock( &f->mutex );
+
+        int fallocate_error = 0;
+        if( fallocate_end > fallocated )
+        {
+            fallocate_error = reserve_space( f->fd, fallocated, fallocate_end - fallocated ) < 0;
+            fallocated = fallocate_end;
+        }
+        int ret = write_all( f->fd, block->data, block->size, block->offset );
+
+        pthread_mutex_lock( &f->mutex );
+        f->stats.fallocate_errors += fallocate_error;
+        if( ret < 0 )
+            f->error = 1;
+        block->in_flight = 0;
+        f->queue_start = (f->queue_start + 1) % f->num_blocks;
+        f->queue_len--;
+        pthread_cond_broadcast( &f->cond );
+    }
+    pthread_mutex_unlock( &f->mutex );
+
+    return NULL;
+}
+
+/**** Blocks ****/
+
+/* Queues the write of a block and reserves more space when the writes get close to the end of it */
+static int submit_block( ts_file_sink_t *f, file_block_t *block )
+{
+    int64_t fallocate_end = f->preallocated;
+
+    if( f->preallocate && block->offset + block->size > f->preallocated - f->preallocate / 2 )
+        fallocate_end = f->preallocated + f->preallocate;
+
+    block->in_flight = 1;
+    f->stats.writes++;
+
+#ifdef HAVE_IO_URING
+    if( !f->threaded )
+    {
+        if( fallocate_end > f->preallocated &&
+            ring_submit( f, IORING_OP_FALLOCATE, FALLOCATE_TAG, NULL, fallocate_end - f->preallocated, f->preallocated ) < 0 )
+            return -1;
+        f->preallocated = fallocate_end;
+        return ring_submit( f, IORING_OP_WRITE, block - f->blocks, block->data, block->size, block->offset );
+    }
+#endif
+
+    f->preallocated = fallocate_end;
+    pthread_mutex_lock( &f->mutex );
+    f->queue[(f->queue_start + f->queue_len) % f->num_blocks] = block - f->blocks;
+    f->queue_len++;
+    f->queue_fallocate = fallocate_end;
+    pthread_cond_broadcast( &f->cond );
+    pthread_mutex_unlock( &f->mutex );
+
+    return 0;
+}
+
+/* Waits until the block is not in flight */
+static int wait_block( ts_file_sink_t *f, file_block_t *block )
+{
+#ifdef HAVE_IO_URING
+    if( !f->threaded )
+    {
+        if( ring_reap( f, 0 ) < 0 )
+            return -1;
+        if( block->in_flight )
+            f->stats.stalls++;
+        while( block->in_flight )
+        {
+            if( ring_reap( f, 1 ) < 0 )
+                return -1;
+        }
+        return 0;
+    }
+#endif
+
+    pthread_mutex_lock( &f->mutex );
+    if( block->in_flight )
+        f->stats.stalls++;
+    while( block->in_flight )
+        pthread_cond_wait( &f->cond, &f->mutex );
+    pthread_mutex_unlock( &f->mutex );
+
+    return 0;
+}
+
+static int get_error( ts_file_sink_t *f )
+{
+    int error;
+
+    if( !f->threaded )
+        return f->error;
+
+    pthread_mutex_lock( &f->mutex );
+    error = f->error;
+    pthread_mutex_unlock( &f->mutex );
+    return error;
+}
+
+/* Closes the file and frees the sink, nothing may be in flight */
+static int free_file_sink( ts_file_sink_t *f )
+{
+    int ret = 0;
+
+    if( f->fd >= 0 && close( f->fd ) < 0 )
+        ret = -1;
+
+    if( f->blocks )
+    {
+        for( int i = 0; i < f->num_blocks; i++ )
+            free( f->blocks[i].data );
+    }
+    free( f->blocks );
+    free( f->queue );
+    free( f );
+
+    return ret;
+}
+
+ts_file_sink_t *ts_create_file_sink( ts_file_params_t *params )
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if( !params->filename || params->block_size < 0 || params->block_size % FILE_ALIGN ||
+        params->num_blocks < 0 || params->preallocate < 0 )
+    {
+        fprintf( stderr, "Invalid file sink parameters\n" );
+        return NULL;
+    }
+
+    ts_file_sink_t *f = calloc( 1, sizeof(*f) );
+    if( !f )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    f->fd = -1;
+#ifdef HAVE_IO_URING
+    f->ring_fd = -1;
+#endif
+
+    f->block_size = params->block_size ? params->block_size : DEFAULT_BLOCK_SIZE;
+    f->num_blocks = params->num_blocks ? params->num_blocks : DEFAULT_NUM_BLOCKS;
+    f->preallocate = params->preallocate;
+
+    f->blocks = calloc( f->num_blocks, sizeof(*f->blocks) );
+    f->queue = calloc( f->num_blocks, sizeof(*f->queue) );
+    if( !f->blocks || !f->queue )
+        goto malloc_fail;
+    for( int i = 0; i < f->num_blocks; i++ )
+    {
+        if( posix_memalign( (void **)&f->blocks[i].data, FILE_ALIGN, f->block_size ) )
+            goto malloc_fail;
+    }
+
+    /* not every file system supports O_DIRECT */
+    if( params->direct && O_DIRECT )
+    {
+        f->fd = open( params->filename, flags | O_DIRECT, 0644 );
+        f->direct = f->fd >= 0;
+    }
+    if( f->fd < 0 )
+        f->fd = open( params->filename, flags, 0644 );
+    if( f->fd < 0 )
+    {
+        fprintf( stderr, "Could not open %s: %s\n", params->filename, strerror( errno ) );
+        goto fail;
+    }
+    f->stats.direct = f->direct;
+
+    f->threaded = 1;
+#ifdef HAVE_IO_URING
+    if( !params->no_io_uring && !setup_ring( f ) )
+        f->threaded = 0;
+    else
+    {
+        close_ring( f );
+        f->sq_ring = f->cq_ring = NULL;
+        f->sqes = NULL;
+        f->ring_fd = -1;
+    }
+#endif
+    f->stats.io_uring = !f->threaded;
+
+    if( f->threaded )
+    {
+        pthread_mutex_init( &f->mutex, NULL );
+        pthread_cond_init( &f->cond, NULL );
+        if( pthread_create( &f->thread, NULL, file_thread, f ) )
+        {
+            fprintf( stderr, "Could not create the file sink thread\n" );
+            pthread_mutex_destroy( &f->mutex );
+            pthread_cond_destroy( &f->cond );
+            goto fail;
+        }
+    }
+
+    return f;
+
+malloc_fail:
+    fprintf( stderr, "Malloc failed\n" );
+fail:
+    /* there is no thread or ring to stop and nothing has been written */
+    free_file_sink( f );
+    return NULL;
+}
+
+int ts_file_write( ts_file_sink_t *f, uint8_t *data, int len )
+{
+    if( get_error( f ) )
+    {
+        fprintf( stderr, "File sink write failed\n" );
+        return -1;
+    }
+
+    while( len > 0 )
+    {
+        file_block_t *block = &f->blocks[f->cur];
+        int size = MIN( len, f->block_size - block->size );
+
+        memcpy( block->data + block->size, data, size );
+        block->size += size;
+        data += size;
+        len -= size;
+        f->stats.bytes += size;
+
+        if( block->size == f->block_size )
+        {
+            block->offset = f->offset;
+            f->offset += f->block_size;
+            if( submit_block( f, block ) < 0 )
+                return -1;
+
+            f->cur = (f->cur + 1) % f->num_blocks;
+            if( wait_block( f, &f->blocks[f->cur] ) < 0 )
+                return -1;
+            f->blocks[f->cur].size = 0;
+        }
+    }
+
+    return 0;
+}
+
+int ts_get_file_stats( ts_file_sink_t *f, ts_file_stats_t *stats )
+{
+    if( f->threaded )
+        pthread_mutex_lock( &f->mutex );
+    *stats = f->stats;
+    if( f->threaded )
+        pthread_mutex_unlock( &f->mutex );
+
+    return 0;
+}
+
+int ts_close_file_sink( ts_file_sink_t *f )
+{
+    int ret = 0;
+
+    if( f->fd >= 0 && f->blocks )
+    {
+        /* the last block is padded for O_DIRECT and the file cut to size afterwards */
+        file_block_t *block = &f->blocks[f->cur];
+        int64_t size = f->offset + block->size;
+
+        if( block->size )
+        {
+            int padded = f->direct ? ( block->size + FILE_ALIGN - 1 ) / FILE_ALIGN * FILE_ALIGN : block->size;
+            memset( block->data + block->size, 0, padded - block->size );
+            block->size = padded;
+            block->offset = f->offset;
+            ret |= submit_block( f, block );
+        }
+
+        for( int i = 0; i < f->num_blocks; i++ )
+            ret |= wait_block( f, &f->blocks[i] );
+
+        ret |= -get_error( f );
+        /* also releases the space reserved beyond the end */
+        if( ftruncate( f->fd, size ) < 0 )
+            ret = -1;
+    }
+
+    if( f->threaded )
+    {
+        pthread_mutex_lock( &f->mutex );
+        f->quit = 1;
+        pthread_cond_broadcast( &f->cond );
+        pthread_mutex_unlock( &f->mutex );
+        pthread_join( f->thread, NULL );
+        pthread_mutex_destroy( &f->mutex );
+        pthread_cond_destroy( &f->cond );
+    }
+#ifdef HAVE_IO_URING
+    else
+        close_ring( f );
+#endif
+
+    if( free_file_sink( f ) < 0 )
+        ret = -1;
+
+    return ret < 0 ? -1 : 0;
+}
+
+#else
+
+ts_file_sink_t *ts_create_file_sink( ts_file_params_t *params )
+{
+    fprintf( stderr, "The file sink is not supported on this system\n" );
+    return NULL;
+}
+
+int ts_file_write( ts_file_sink_t *f, uint8_t *data, int len )
+{
+    return -1;
+}
+
+int ts_get_file_stats( ts_file_sink_t *f, ts_file_stats_t *stats )
+{
+    return -1;
+}
+
+int ts_close_file_sink( ts_file_sink_t *f )
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,607 @@
+/*****************************************************************************
+ * hls.c : HLS segmenter
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+#include <errno.h>
+
+#define DEFAULT_TARGET_DURATION 6
+#define DEFAULT_LIST_SIZE       5
+#define MAX_PSI_PIDS            8  /* the PAT and the PMTs */
+#define MAX_PSI_PACKETS         8  /* of one section */
+#define MAX_URI_LENGTH          256
+
+/* the last complete section of a PSI PID, repeated at the start of every segment */
+typedef struct
+{
+    int pid;
+    int cc; /* of the segmenter output */
+
+    uint8_t packets[MAX_PSI_PACKETS][TS_PACKET_SIZE];
+    int num_packets;
+    uint8_t capture[MAX_PSI_PACKETS][TS_PACKET_SIZE];
+    int num_capture;
+    int bytes_left; /* of the section being captured */
+} hls_psi_t;
+
+typedef struct
+{
+    int index;
+    double duration;
+    char uri[MAX_URI_LENGTH];
+    char filename[MAX_URI_LENGTH];
+} hls_entry_t;
+
+struct ts_hls_t
+{
+    char *segment_filename;
+    char *playlist_filename;
+    char *playlist_temp;
+    int target_duration; /* EXT-X-TARGETDURATION, fixed for the whole playlist */
+    int64_t max_length; /* of a segment whose rounded duration is within the target (27MHz) */
+    int list_size;
+    int delete_segments;
+    int (*segment)( void *opaque, ts_hls_segment_t *segment );
+    void *opaque;
+
+    hls_psi_t psi[MAX_PSI_PIDS];
+    int num_psi;
+
+    /* current segment */
+    int open;
+    int index;
+    int64_t start_pcr;
+    int64_t last_pcr;
+    int64_t packet_duration;
+    FILE *fp;
+    char filename[MAX_URI_LENGTH];
+    uint8_t *buf;
+    int buf_len;
+    int buf_alloced;
+
+    /* the output since the last random access point which can still end the segment in time.
+     * It goes to the next segment if the segment ends there. */
+    int held;
+    int64_t cut_pcr;
+    uint8_t *hold;
+    int hold_len;
+    int hold_alloced;
+
+    hls_entry_t *entries;
+    int num_entries;
+};
+
+static hls_psi_t *find_psi( ts_hls_t *h, int pid )
+{
+    for( int i = 0; i < h->num_psi; i++ )
+        if( h->psi[i].pid == pid )
+            return &h->psi[i];
+    return NULL;
+}
+
+static hls_psi_t *add_psi( ts_hls_t *h, int pid )
+{
+    hls_psi_t *psi = find_psi( h, pid );
+
+    if( !psi && h->num_psi < MAX_PSI_PIDS )
+    {
+        psi = &h->psi[h->num_psi++];
+        memset( psi, 0, sizeof(*psi) );
+        psi->pid = pid;
+    }
+    return psi;
+}
+
+static int payload_offset( uint8_t *pkt )
+{
+    int offset = 4;
+
+    if( pkt[3] & 0x20 )
+        offset += 1 + pkt[4];
+    return MIN( offset, TS_PACKET_SIZE );
+}
+
+/* Learns the PMT PIDs from a complete PAT */
+static void parse_pat( ts_hls_t *h, hls_psi_t *pat )
+{
+    uint8_t section[MAX_PSI_PACKETS * TS_PACKET_SIZE];
+    int len = 0, section_length;
+
+    for( int i = 0; i < pat->num_packets; i++ )
+    {
+        int offset = payload_offset( pat->packets[i] );
+        if( !i )
+            offset += 1 + pat->packets[i][offset]; /* pointer_field */
+        if( offset < TS_PACKET_SIZE )
+        {
+            memcpy( section + len, pat->packets[i] + offset, TS_PACKET_SIZE - offset );
+            len += TS_PACKET_SIZE - offset;
+        }
+    }
+
+    section_length = ( ( section[1] & 0x0f ) << 8 ) | section[2];
+    /* header of 8 bytes, program loop, CRC */
+    for( int i = 8; i + 4 <= MIN( 3 + section_length - 4, len ); i += 4 )
+    {
+        int program_number = ( section[i] << 8 ) | section[i+1];
+        int pid = ( ( section[i+2] & 0x1f ) << 8 ) | section[i+3];
+
+        if( program_number )
+            add_psi( h, pid );
+    }
+}
+
+/* Captures the packets of a PSI PID until a section is complete */
+static void capture_psi( ts_hls_t *h, hls_psi_t *psi, uint8_t *pkt )
+{
+    int offset = payload_offset( pkt );
+
+    if( pkt[1] & 0x40 )
+    {
+        int start = offset + 1 + pkt[offset];
+        if( start + 3 > TS_PACKET_SIZE )
+        {
+            psi->num_capture = 0;
+            return;
+        }
+        psi->num_capture = 0;
+        psi->bytes_left = 3 + ( ( ( pkt[start+1] & 0x0f ) << 8 ) | pkt[start+2] );
+        offset = start;
+    }
+    else if( !psi->num_capture )
+        return;
+
+    if( psi->num_capture == MAX_PSI_PACKETS )
+    {
+        psi->num_capture = 0;
+        return;
+    }
+
+    memcpy( psi->capture[psi->num_capture++], pkt, TS_PACKET_SIZE );
+    psi->bytes_left -= TS_PACKET_SIZE - offset;
+    if( psi->bytes_left <= 0 )
+    {
+        memcpy( psi->packets, psi->capture, psi->num_capture * TS_PACKET_SIZE );
+        psi->num_packets = psi->num_capture;
+        psi->num_capture = 0;
+        if( !psi->pid )
+            parse_pat( h, psi );
+    }
+}
+
+static int buffer_data( uint8_t **buf, int *buf_len, int *buf_alloced, uint8_t *data, int len )
+{
+    if( *buf_len + len > *buf_alloced )
+    {
+        int alloced = MAX( *buf_alloced * 2, *buf_len + len );
+        uint8_t *temp = realloc( *buf, alloced );
+        if( !temp )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        *buf = temp;
+        *buf_alloced = alloced;
+    }
+    memcpy( *buf + *buf_len, data, len );
+    *buf_len += len;
+
+    return 0;
+}
+
+static int append( ts_hls_t *h, uint8_t *data, int len )
+{
+    if( h->fp && fwrite( data, 1, len, h->fp ) != (size_t)len )
+    {
+        fprintf( stderr, "Could not write %s\n", h->filename );
+        return -1;
+    }
+
+    if( h->segment && buffer_data( &h->buf, &h->buf_len, &h->buf_alloced, data, len ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+/* Writes a PSI packet with the continuity counter of the segmenter output */
+static int append_psi( ts_hls_t *h, hls_psi_t *psi, uint8_t *pkt )
+{
+    uint8_t temp[TS_PACKET_SIZE];
+
+    memcpy( temp, pkt, TS_PACKET_SIZE );
+    temp[3] = ( temp[3] & 0xf0 ) | psi->cc;
+    psi->cc = ( psi->cc + 1 ) & 0xf;
+
+    return append( h, temp, TS_PACKET_SIZE );
+}
+
+/* Appends output which was held back, the PSI packets get the continuity counter of the segmenter output */
+static int append_packets( ts_hls_t *h, uint8_t *data, int len )
+{
+    int run = 0;
+
+    for( int i = 0; i < len; i += TS_PACKET_SIZE )
+    {
+        hls_psi_t *psi = find_psi( h, ( ( data[i+1] & 0x1f ) << 8 ) | data[i+2] );
+        if( !psi )
+            continue;
+        if( run < i && append( h, data + run, i - run ) < 0 )
+            return -1;
+        if( append_psi( h, psi, data + i ) < 0 )
+            return -1;
+        run = i + TS_PACKET_SIZE;
+    }
+
+    return run < len ? append( h, data + run, len - run ) : 0;
+}
+
+/* Output goes to the open segment unless it is held back */
+static int write_run( ts_hls_t *h, uint8_t *data, int len )
+{
+    if( !h->open || !len )
+        return 0;
+    if( h->held )
+        return buffer_data( &h->hold, &h->hold_len, &h->hold_alloced, data, len );
+    return append( h, data, len );
+}
+
+/* The pattern is passed to snprintf, so the index has to be its only conversion */
+static int check_pattern( const char *pattern )
+{
+    int conversions = 0;
+
+    for( const char *p = pattern; *p; p++ )
+    {
+        if( *p != '%' )
+            continue;
+        if( *++p == '%' )
+            continue;
+
+        p += strspn( p, "-+ #0" );
+        p += strspn( p, "0123456789" );
+        if( *p == '.' )
+            p += 1 + strspn( p + 1, "0123456789" );
+        if( !*p || !strchr( "diouxX", *p ) )
+            return -1;
+        conversions++;
+    }
+
+    return conversions == 1 ? 0 : -1;
+}
+
+static void make_name( char *dst, const char *pattern, int index )
+{
+    snprintf( dst, MAX_URI_LENGTH, pattern, index );
+}
+
+static int write_playlist( ts_hls_t *h, int end )
+{
+    FILE *fp;
+
+    if( !h->playlist_filename )
+        return 0;
+
+    /* replaced atomically so that clients never see a partial playlist */
+    fp = fopen( h->playlist_temp, "w" );
+    if( !fp )
+    {
+        fprintf( stderr, "Could not open %s: %s\n", h->playlist_temp, strerror( errno ) );
+        return -1;
+    }
+
+    fprintf( fp, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%d\n",
+             h->target_duration, h->num_entries ? h->entries[0].index : 0 );
+    for( int i = 0; i < h->num_entries; i++ )
+        fprintf( fp, "#EXTINF:%.3f,\n%s\n", h->entries[i].duration, h->entries[i].uri );
+    if( end )
+        fprintf( fp, "#EXT-X-ENDLIST\n" );
+
+    if( fclose( fp ) )
+    {
+        fprintf( stderr, "Could not write %s\n", h->playlist_temp );
+        return -1;
+    }
+#ifdef _WIN32
+    remove( h->playlist_filename );
+#endif
+    if( rename( h->playlist_temp, h->playlist_filename ) < 0 )
+    {
+        fprintf( stderr, "Could not rename %s: %s\n", h->playlist_temp, strerror( errno ) );
+        return -1;
+    }
+
+    return 0;
+}
+
+static int start_segment( ts_hls_t *h, int64_t pcr )
+{
+    h->open = 1;
+    h->start_pcr = pcr;
+    h->buf_len = 0;
+
+    if( h->segment_filename )
+    {
+        make_name( h->filename, h->segment_filename, h->index );
+        h->fp = fopen( h->filename, "wb" );
+        if( !h->fp )
+        {
+            fprintf( stderr, "Could not open %s: %s\n", h->filename, strerror( errno ) );
+            return -1;
+        }
+    }
+
+    /* every segment starts with the PAT and the PMTs */
+    for( int i = 0; i < h->num_psi; i++ )
+    {
+        hls_psi_t *psi = &h->psi[i];
+        for( int j = 0; j < psi->num_packets; j++ )
+            if( append_psi( h, psi, psi->packets[j] ) < 0 )
+                return -1;
+    }
+
+    return 0;
+}
+
+static int end_segment( ts_hls_t *h, int64_t end_pcr )
+{
+    double duration = ( end_pcr - h->start_pcr ) / 27000000.0;
+    hls_entry_t *entry;
+    int ret = 0;
+
+    h->open = 0;
+    if( h->fp && fclose( h->fp ) )
+    {
+        fprintf( stderr, "Could not write %s\n", h->filename );
+        ret = -1;
+    }
+    h->fp = NULL;
+
+    if( h->segment )
+    {
+        ts_hls_segment_t segment;
+
+        segment.index = h->index;
+        segment.data = h->buf;
+        segment.len = h->buf_len;
+        segment.duration = end_pcr - h->start_pcr;
+        if( h->segment( h->opaque, &segment ) < 0 )
+            ret = -1;
+    }
+
+    /* the oldest entry leaves the playlist */
+    if( h->list_size && h->num_entries == h->list_size )
+    {
+        if( h->delete_segments && h->entries[0].filename[0] )
+            remove( h->entries[0].filename );
+        memmove( h->entries, h->entries + 1, (h->num_entries - 1) * sizeof(*h->entries) );
+        h->num_entries--;
+    }
+    else if( !h->list_size )
+    {
+        hls_entry_t *entries = realloc( h->entries, (h->num_entries + 1) * sizeof(*entries) );
+        if( !entries )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return -1;
+        }
+        h->entries = entries;
+    }
+
+    entry = &h->entries[h->num_entries++];
+    memset( entry, 0, sizeof(*entry) );
+    entry->index = h->index;
+    entry->duration = duration;
+    if( h->segment_filename )
+    {
+        const char *base = strrchr( h->filename, '/' );
+        strcpy( entry->filename, h->filename );
+        strcpy( entry->uri, base ? base + 1 : h->filename );
+    }
+    else
+        snprintf( entry->uri, sizeof(entry->uri), "%d.ts", h->index );
+
+    h->index++;
+
+    if( write_playlist( h, 0 ) < 0 )
+        ret = -1;
+
+    return ret;
+}
+
+/* Ends the segment at the random access point held back and starts the next one with the output since */
+static int cut_held( ts_hls_t *h )
+{
+    h->held = 0;
+    if( end_segment( h, h->cut_pcr ) < 0 || start_segment( h, h->cut_pcr ) < 0 )
+        return -1;
+    return append_packets( h, h->hold, h->hold_len );
+}
+
+ts_hls_t *ts_create_hls( ts_hls_params_t *params )
+{
+    if( ( !params->segment_filename && !params->segment ) || params->target_duration < 0 || params->list_size < -1 )
+    {
+        fprintf( stderr, "Invalid HLS parameters\n" );
+        return NULL;
+    }
+
+    if( params->segment_filename && check_pattern( params->segment_filename ) < 0 )
+    {
+        fprintf( stderr, "Segment filename needs exactly one integer conversion for the index\n" );
+        return NULL;
+    }
+
+    ts_hls_t *h = calloc( 1, sizeof(*h) );
+    if( !h )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    /* the target duration of the playlist is a whole number of seconds */
+    h->target_duration = params->target_duration ? (int)params->target_duration : DEFAULT_TARGET_DURATION;
+    if( h->target_duration < params->target_duration )
+        h->target_duration++;
+    h->max_length = h->target_duration * 27000000LL + 13500000;
+    /* 0 keeps every segment */
+    h->list_size = params->list_size < 0 ? 0 : params->list_size ? params->list_size : DEFAULT_LIST_SIZE;
+    h->delete_segments = params->delete_segments;
+    h->segment = params->segment;
+    h->opaque = params->opaque;
+    h->index = params->first_index;
+
+    if( params->segment_filename )
+        h->segment_filename = strdup( params->segment_filename );
+    if( params->playlist_filename )
+    {
+        h->playlist_filename = strdup( params->playlist_filename );
+        h->playlist_temp = malloc( strlen( params->playlist_filename ) + 5 );
+        if( h->playlist_temp )
+            sprintf( h->playlist_temp, "%s.tmp", params->playlist_filename );
+    }
+    if( h->list_size )
+        h->entries = calloc( h->list_size, sizeof(*h->entries) );
+    if( ( params->segment_filename && !h->segment_filename ) ||
+        ( params->playlist_filename && ( !h->playlist_filename || !h->playlist_temp ) ) || ( h->list_size && !h->entries ) )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        ts_close_hls( h );
+        return NULL;
+    }
+
+    /* the PAT is always repeated */
+    add_psi( h, 0 );
+
+    return h;
+}
+
+int ts_hls_write( ts_hls_t *h, ts_writer_t *w, uint8_t *data, int len, int64_t *pcr_list )
+{
+    int *ra_list, num_ra, ra = 0, run = 0;
+    int num_packets = len / TS_PACKET_SIZE;
+
+    if( check_ts_packets( data, len ) < 0 )
+    {
+        fprintf( stderr, "HLS needs 188 byte packets\n" );
+        return -1;
+    }
+
+    if( !w->random_access_pcr )
+    {
+        fprintf( stderr, "HLS needs the random access points of the writer\n" );
+        return -1;
+    }
+
+    ts_get_random_access_packets( w, &ra_list, &num_ra );
+
+    /* runs of packets are written at once, PSI packets on their own */
+    for( int i = 0; i < num_packets; i++ )
+    {
+        uint8_t *pkt = data + i * TS_PACKET_SIZE;
+        int pid = ( ( pkt[1] & 0x1f ) << 8 ) | pkt[2];
+        hls_psi_t *psi = find_psi( h, pid );
+        int64_t length = pcr_list[i] - h->start_pcr;
+        int is_ra;
+
+        while( ra < num_ra && ra_list[ra] < i )
+            ra++;
+        is_ra = ra < num_ra && ra_list[ra] == i;
+
+        if( psi || is_ra || ( h->open && h->held && length >= h->max_length ) )
+        {
+            if( run < i && write_run( h, data + run * TS_PACKET_SIZE, ( i - run ) * TS_PACKET_SIZE ) < 0 )
+                return -1;
+            run = i;
+        }
+
+        /* no later random access point can end the segment in time */
+        if( h->open && h->held && length >= h->max_length )
+        {
+            if( cut_held( h ) < 0 )
+                return -1;
+            length = pcr_list[i] - h->start_pcr;
+        }
+
+        if( is_ra && ( !h->open || length >= h->max_length ) )
+        {
+            /* the first segment starts at the first random access point. Without one in time,
+             * the segment ends at the first one after and is longer than the target. */
+            if( h->open && end_segment( h, pcr_list[i] ) < 0 )
+                return -1;
+            if( start_segment( h, pcr_list[i] ) < 0 )
+                return -1;
+        }
+        else if( is_ra )
+        {
+            /* the segment may end here, hold back the output until a later point proves to be in time */
+            if( h->held && append_packets( h, h->hold, h->hold_len ) < 0 )
+                return -1;
+            h->held = 1;
+            h->cut_pcr = pcr_list[i];
+            h->hold_len = 0;
+        }
+
+        if( psi )
+        {
+            capture_psi( h, psi, pkt );
+            if( h->open && ( h->held ? write_run( h, pkt, TS_PACKET_SIZE ) : append_psi( h, psi, pkt ) ) < 0 )
+                return -1;
+            run = i + 1;
+        }
+
+        if( i )
+            h->packet_duration = pcr_list[i] - pcr_list[i-1];
+        h->last_pcr = pcr_list[i];
+    }
+
+    if( run < num_packets && write_run( h, data + run * TS_PACKET_SIZE, ( num_packets - run ) * TS_PACKET_SIZE ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+int ts_close_hls( ts_hls_t *h )
+{
+    int ret = 0;
+
+    if( h->open )
+    {
+        int64_t end_pcr = h->last_pcr + h->packet_duration;
+
+        if( h->held && end_pcr - h->start_pcr >= h->max_length )
+            ret |= cut_held( h );
+        else if( h->held )
+        {
+            h->held = 0;
+            ret |= append_packets( h, h->hold, h->hold_len );
+        }
+        ret |= end_segment( h, end_pcr );
+        ret |= write_playlist( h, 1 );
+    }
+    if( h->fp )
+        fclose( h->fp );
+
+    free( h->segment_filename );
+    free( h->playlist_filename );
+    free( h->playlist_temp );
+    free( h->entries );
+    free( h->buf );
+    free( h->hold );
+    free( h );
+
+    return ret < 0 ? -1 : 0;
+}
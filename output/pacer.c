@@ -0,0 +1,241 @@
+/*****************************************************************************
+ * pacer.c : PCR-locked output pacing
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+#include <errno.h>
+#include <time.h>
+
+#define MAX_BURST_PACKETS     7
+#define DEFAULT_MAX_LATE      100 /* ms */
+/* a PCR step larger than this is a discontinuity rather than a gap */
+#define MAX_PCR_STEP          ( 1000 * 27000LL )
+
+struct ts_pacer_t
+{
+    int burst_packets;
+    double speed;
+    int64_t max_late; /* ns */
+
+    int (*write)( void *opaque, uint8_t *data, int len, int64_t *pcr_list );
+    void *opaque;
+
+    /* release time of base_pcr on CLOCK_MONOTONIC in ns, set by the first burst */
+    int started;
+    int64_t base_time;
+    int64_t base_pcr;
+    int64_t last_pcr;
+    int64_t last_due;
+    int64_t last_release;
+
+    /* packets which did not fill a burst, released with the next call */
+    uint8_t pending[MAX_BURST_PACKETS * TS_PACKET_SIZE];
+    int64_t pending_pcr[MAX_BURST_PACKETS];
+    int num_pending;
+
+    ts_pacer_stats_t stats;
+    int64_t jitter_sum;
+    int64_t num_jitter;
+    int64_t lateness_sum;
+};
+
+static int64_t get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until( int64_t t )
+{
+    struct timespec ts;
+    int64_t now;
+
+    /* macOS has no clock_nanosleep */
+#if defined(TIMER_ABSTIME) && !defined(__APPLE__)
+    int ret;
+    ts.tv_sec = t / 1000000000LL;
+    ts.tv_nsec = t % 1000000000LL;
+    do
+        ret = clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+    while( ret == EINTR );
+    if( !ret )
+        return;
+    /* e.g. ENOTSUP, fall back to relative sleeps */
+#endif
+
+    while( ( now = get_time() ) < t )
+    {
+        ts.tv_sec = ( t - now ) / 1000000000LL;
+        ts.tv_nsec = ( t - now ) % 1000000000LL;
+        nanosleep( &ts, NULL );
+    }
+}
+
+/* Waits for the slot of the first packet of the burst and passes it on */
+static int release_burst( ts_pacer_t *p, uint8_t *data, int packets, int64_t *pcr_list )
+{
+    int64_t pcr = pcr_list[0], due, now;
+
+    if( !p->started || pcr < p->last_pcr || pcr - p->last_pcr > MAX_PCR_STEP )
+    {
+        p->stats.resyncs += p->started;
+        p->started = 1;
+        p->base_time = get_time();
+        p->base_pcr = pcr;
+    }
+
+    due = p->base_time + (int64_t)( ( pcr - p->base_pcr ) * 1000 / 27 / p->speed );
+    now = get_time();
+
+    /* after a stall start again from now instead of sending everything that is late at once */
+    if( now - due > p->max_late )
+    {
+        p->stats.resyncs++;
+        p->base_time = due = now;
+        p->base_pcr = pcr;
+    }
+    else if( now < due )
+    {
+        sleep_until( due );
+        now = get_time();
+    }
+
+    /* the interval to the previous burst compared with the interval of their PCRs */
+    if( p->last_release )
+    {
+        int64_t jitter = llabs( ( now - p->last_release ) - ( due - p->last_due ) );
+        p->jitter_sum += jitter;
+        p->num_jitter++;
+        p->stats.max_jitter = MAX( p->stats.max_jitter, jitter );
+    }
+    p->lateness_sum += now - due;
+    p->stats.max_lateness = MAX( p->stats.max_lateness, now - due );
+    p->stats.bursts++;
+    p->stats.packets += packets;
+
+    p->last_pcr = pcr;
+    p->last_due = due;
+    p->last_release = now;
+
+    return p->write( p->opaque, data, packets * TS_PACKET_SIZE, pcr_list );
+}
+
+ts_pacer_t *ts_create_pacer( ts_pacer_params_t *params )
+{
+    if( !params->write )
+    {
+        fprintf( stderr, "Pacer needs a write callback\n" );
+        return NULL;
+    }
+
+    if( params->packets_per_burst < 0 || params->packets_per_burst > MAX_BURST_PACKETS ||
+        params->speed < 0 || params->max_late < 0 )
+    {
+        fprintf( stderr, "Invalid pacer parameters\n" );
+        return NULL;
+    }
+
+    ts_pacer_t *p = calloc( 1, sizeof(*p) );
+    if( !p )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    p->burst_packets = params->packets_per_burst ? params->packets_per_burst : MAX_BURST_PACKETS;
+    p->speed = params->speed > 0 ? params->speed : 1.0;
+    p->max_late = ( params->max_late ? params->max_late : DEFAULT_MAX_LATE ) * 1000000LL;
+    p->write = params->write;
+    p->opaque = params->opaque;
+
+    return p;
+}
+
+int ts_pace( ts_pacer_t *p, uint8_t *data, int len, int64_t *pcr_list )
+{
+    int num_packets, i = 0;
+
+    if( check_ts_packets( data, len ) < 0 )
+    {
+        fprintf( stderr, "Pacing needs 188 byte packets\n" );
+        return -1;
+    }
+    num_packets = len / TS_PACKET_SIZE;
+
+    /* complete the burst of the last call */
+    if( p->num_pending )
+    {
+        int packets = MIN( p->burst_packets - p->num_pending, num_packets );
+
+        memcpy( p->pending + p->num_pending * TS_PACKET_SIZE, data, packets * TS_PACKET_SIZE );
+        memcpy( p->pending_pcr + p->num_pending, pcr_list, packets * sizeof(int64_t) );
+        p->num_pending += packets;
+        i = packets;
+
+        if( p->num_pending < p->burst_packets )
+            return 0;
+
+        p->num_pending = 0;
+        if( release_burst( p, p->pending, p->burst_packets, p->pending_pcr ) < 0 )
+            return -1;
+    }
+
+    for( ; i + p->burst_packets <= num_packets; i += p->burst_packets )
+    {
+        if( release_burst( p, data + i * TS_PACKET_SIZE, p->burst_packets, pcr_list + i ) < 0 )
+            return -1;
+    }
+
+    if( i < num_packets )
+    {
+        p->num_pending = num_packets - i;
+        memcpy( p->pending, data + i * TS_PACKET_SIZE, p->num_pending * TS_PACKET_SIZE );
+        memcpy( p->pending_pcr, pcr_list + i, p->num_pending * sizeof(int64_t) );
+    }
+
+    return 0;
+}
+
+int ts_get_pacer_stats( ts_pacer_t *p, ts_pacer_stats_t *stats, int reset )
+{
+    *stats = p->stats;
+    if( p->num_jitter )
+        stats->mean_jitter = p->jitter_sum / p->num_jitter;
+    if( p->stats.bursts )
+        stats->mean_lateness = p->lateness_sum / (int64_t)p->stats.bursts;
+
+    if( reset )
+    {
+        memset( &p->stats, 0, sizeof(p->stats) );
+        p->jitter_sum = p->num_jitter = p->lateness_sum = 0;
+    }
+
+    return 0;
+}
+
+int ts_close_pacer( ts_pacer_t *p )
+{
+    int ret = 0;
+
+    if( p->num_pending )
+        ret = release_burst( p, p->pending, p->num_pending, p->pending_pcr );
+
+    free( p );
+
+    return ret;
+}
@@ -0,0 +1,473 @@
+/*****************************************************************************
+ * shm.c : shared memory packet ring
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include "../common.h"
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define SHM_MAGIC           0x54535247 /* "TSRG" */
+#define SHM_VERSION         1
+#define SHM_ALIGN           64
+#define DEFAULT_SLOT_PACKETS 64
+#define DEFAULT_NUM_SLOTS   1024
+
+#define ALIGN_UP( x ) ( ( (x) + SHM_ALIGN - 1 ) & ~(SHM_ALIGN - 1) )
+
+/* The ring is a header followed by num_slots slots. A slot is its header, the PCR of every
+ * packet and the packets. The writer publishes slot n by setting its seq to n + 1 and then
+ * head to n + 1. Before reusing a slot it clears seq, so a reader which finds seq unchanged
+ * after using a slot knows the writer did not touch it meanwhile. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_packets;
+    uint64_t slot_size;
+    uint8_t pad0[SHM_ALIGN - 24];
+
+    /* written by the writer only, on their own cache line */
+    uint64_t head;
+    uint32_t futex; /* bumped on every publish, readers sleep on it */
+    uint32_t closed;
+    uint8_t pad1[SHM_ALIGN - 16];
+
+    uint32_t waiters;
+    uint8_t pad2[SHM_ALIGN - 4];
+} shm_header_t;
+
+typedef struct
+{
+    uint64_t seq;
+    uint32_t num_packets;
+    uint8_t pad[SHM_ALIGN - 12];
+} shm_slot_t;
+
+typedef struct
+{
+    char *name;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    shm_header_t *hdr;
+} shm_map_t;
+
+struct ts_shm_ring_t
+{
+    shm_map_t m;
+    uint64_t head;
+};
+
+struct ts_shm_reader_t
+{
+    shm_map_t m;
+    uint64_t cursor;
+    shm_slot_t *slot; /* slot returned by ts_shm_read and not yet released */
+    uint64_t slot_seq;
+    ts_shm_reader_stats_t stats;
+};
+
+static inline shm_slot_t *get_slot( shm_map_t *m, uint64_t n )
+{
+    return (shm_slot_t *)( m->map + sizeof(shm_header_t) + ( n & ( m->hdr->num_slots - 1 ) ) * m->hdr->slot_size );
+}
+
+static inline int64_t *slot_pcrs( shm_slot_t *slot )
+{
+    return (int64_t *)( slot + 1 );
+}
+
+static inline uint8_t *slot_packets( shm_map_t *m, shm_slot_t *slot )
+{
+    return (uint8_t *)slot + ALIGN_UP( sizeof(shm_slot_t) + m->hdr->slot_packets * sizeof(int64_t) );
+}
+
+static void unmap( shm_map_t *m )
+{
+    if( m->map && m->map != MAP_FAILED )
+        munmap( m->map, m->map_size );
+    if( m->fd >= 0 )
+        close( m->fd );
+    free( m->name );
+}
+
+/* shm_open wants a single leading slash */
+static char *make_name( const char *name )
+{
+    char *ret = malloc( strlen( name ) + 2 );
+
+    if( ret )
+    {
+        ret[0] = '/';
+        strcpy( ret + 1, name[0] == '/' ? name + 1 : name );
+    }
+    return ret;
+}
+
+/**** Writer ****/
+
+ts_shm_ring_t *ts_create_shm_ring( ts_shm_params_t *params )
+{
+    int num_slots = params->num_slots ? params->num_slots : DEFAULT_NUM_SLOTS;
+    int slot_packets = params->packets_per_slot ? params->packets_per_slot : DEFAULT_SLOT_PACKETS;
+    uint64_t slot_size;
+
+    if( !params->name || num_slots < 2 || ( num_slots & (num_slots - 1) ) || slot_packets < 1 )
+    {
+        fprintf( stderr, "Invalid shared memory ring parameters\n" );
+        return NULL;
+    }
+
+    ts_shm_ring_t *r = calloc( 1, sizeof(*r) );
+    if( !r )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    r->m.fd = -1;
+
+    r->m.name = make_name( params->name );
+    if( !r->m.name )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
+    }
+
+    slot_size = ALIGN_UP( sizeof(shm_slot_t) + slot_packets * sizeof(int64_t) ) +
+                ALIGN_UP( slot_packets * TS_PACKET_SIZE );
+    r->m.map_size = sizeof(shm_header_t) + num_slots * slot_size;
+
+    /* readers of an earlier ring with the same name keep the old memory */
+    shm_unlink( r->m.name );
+    r->m.fd = shm_open( r->m.name, O_RDWR | O_CREAT | O_EXCL, 0644 );
+    if( r->m.fd < 0 || ftruncate( r->m.fd, r->m.map_size ) < 0 )
+    {
+        fprintf( stderr, "Could not create shared memory %s: %s\n", r->m.name, strerror( errno ) );
+        goto fail;
+    }
+
+    r->m.map = mmap( NULL, r->m.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->m.fd, 0 );
+    if( r->m.map == MAP_FAILED )
+    {
+        fprintf( stderr, "Could not map shared memory %s: %s\n", r->m.name, strerror( errno ) );
+        shm_unlink( r->m.name );
+        goto fail;
+    }
+
+    /* the file is zeroed by ftruncate, readers check the magic last */
+    r->m.hdr = (shm_header_t *)r->m.map;
+    r->m.hdr->version = SHM_VERSION;
+    r->m.hdr->num_slots = num_slots;
+    r->m.hdr->slot_packets = slot_packets;
+    r->m.hdr->slot_size = slot_size;
+    __atomic_store_n( &r->m.hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE );
+
+    return r;
+
+fail:
+    unmap( &r->m );
+    free( r );
+    return NULL;
+}
+
+static void wake_readers( shm_header_t *hdr )
+{
+    __atomic_add_fetch( &hdr->futex, 1, __ATOMIC_SEQ_CST );
+#ifdef __linux__
+    if( __atomic_load_n( &hdr->waiters, __ATOMIC_SEQ_CST ) )
+        syscall( SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+#endif
+}
+
+int ts_shm_write( ts_shm_ring_t *r, uint8_t *data, int len, int64_t *pcr_list )
+{
+    shm_header_t *hdr = r->m.hdr;
+    int num_packets;
+
+    if( check_ts_packets( data, len ) < 0 )
+    {
+        fprintf( stderr, "Shared memory ring needs 188 byte packets\n" );
+        return -1;
+    }
+    num_packets = len / TS_PACKET_SIZE;
+
+    while( num_packets > 0 )
+    {
+        shm_slot_t *slot = get_slot( &r->m, r->head );
+        int packets = MIN( num_packets, (int)hdr->slot_packets );
+
+        /* invalidate the old contents before overwriting them */
+        __atomic_store_n( &slot->seq, 0, __ATOMIC_RELAXED );
+        __atomic_thread_fence( __ATOMIC_RELEASE );
+
+        memcpy( slot_packets( &r->m, slot ), data, packets * TS_PACKET_SIZE );
+        memcpy( slot_pcrs( slot ), pcr_list, packets * sizeof(int64_t) );
+        slot->num_packets = packets;
+
+        r->head++;
+        __atomic_store_n( &slot->seq, r->head, __ATOMIC_RELEASE );
+        __atomic_store_n( &hdr->head, r->head, __ATOMIC_RELEASE );
+
+        data += packets * TS_PACKET_SIZE;
+        pcr_list += packets;
+        num_packets -= packets;
+    }
+
+    wake_readers( hdr );
+
+    return 0;
+}
+
+int ts_close_shm_ring( ts_shm_ring_t *r )
+{
+    __atomic_store_n( &r->m.hdr->closed, 1, __ATOMIC_RELEASE );
+    wake_readers( r->m.hdr );
+
+    /* mapped readers keep their mapping */
+    shm_unlink( r->m.name );
+    unmap( &r->m );
+    free( r );
+
+    return 0;
+}
+
+/**** Reader ****/
+
+ts_shm_reader_t *ts_open_shm_reader( const char *name )
+{
+    struct stat st;
+
+    ts_shm_reader_t *rd = calloc( 1, sizeof(*rd) );
+    if( !rd )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    rd->m.fd = -1;
+
+    rd->m.name = make_name( name );
+    if( !rd->m.name )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto fail;
+    }
+
+    rd->m.fd = shm_open( rd->m.name, O_RDWR, 0 );
+    if( rd->m.fd < 0 || fstat( rd->m.fd, &st ) < 0 || st.st_size < (off_t)sizeof(shm_header_t) )
+    {
+        fprintf( stderr, "Could not open shared memory %s\n", rd->m.name );
+        goto fail;
+    }
+
+    /* readers only write the waiter count */
+    rd->m.map_size = st.st_size;
+    rd->m.map = mmap( NULL, rd->m.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, rd->m.fd, 0 );
+    if( rd->m.map == MAP_FAILED )
+    {
+        fprintf( stderr, "Could not map shared memory %s: %s\n", rd->m.name, strerror( errno ) );
+        goto fail;
+    }
+
+    rd->m.hdr = (shm_header_t *)rd->m.map;
+    if( __atomic_load_n( &rd->m.hdr->magic, __ATOMIC_ACQUIRE ) != SHM_MAGIC || rd->m.hdr->version != SHM_VERSION ||
+        rd->m.map_size < sizeof(shm_header_t) + rd->m.hdr->num_slots * rd->m.hdr->slot_size )
+    {
+        fprintf( stderr, "Invalid shared memory ring %s\n", rd->m.name );
+        goto fail;
+    }
+
+    /* start with the next block */
+    rd->cursor = __atomic_load_n( &rd->m.hdr->head, __ATOMIC_ACQUIRE );
+
+    return rd;
+
+fail:
+    unmap( &rd->m );
+    free( rd );
+    return NULL;
+}
+
+int ts_shm_read( ts_shm_reader_t *rd, uint8_t **data, int *len, int64_t **pcr_list )
+{
+    shm_header_t *hdr = rd->m.hdr;
+
+    if( rd->slot )
+        ts_shm_release( rd );
+
+    while( 1 )
+    {
+        int closed = __atomic_load_n( &hdr->closed, __ATOMIC_ACQUIRE );
+        uint64_t head = __atomic_load_n( &hdr->head, __ATOMIC_ACQUIRE );
+
+        if( rd->cursor == head )
+            return closed ? -1 : 0;
+
+        /* the writer has lapped the reader */
+        if( head - rd->cursor > hdr->num_slots )
+        {
+            rd->stats.overruns += head - hdr->num_slots - rd->cursor;
+            rd->cursor = head - hdr->num_slots;
+        }
+
+        shm_slot_t *slot = get_slot( &rd->m, rd->cursor );
+        uint64_t seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+        if( seq != rd->cursor + 1 )
+        {
+            /* being overwritten */
+            rd->stats.overruns++;
+            rd->cursor++;
+            continue;
+        }
+
+        rd->slot = slot;
+        rd->slot_seq = seq;
+        *data = slot_packets( &rd->m, slot );
+        *len = slot->num_packets * TS_PACKET_SIZE;
+        *pcr_list = slot_pcrs( slot );
+        return 1;
+    }
+}
+
+int ts_shm_release( ts_shm_reader_t *rd )
+{
+    int ret = 0;
+
+    if( !rd->slot )
+        return 0;
+
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    if( __atomic_load_n( &rd->slot->seq, __ATOMIC_RELAXED ) != rd->slot_seq )
+    {
+        rd->stats.overruns++;
+        ret = -1;
+    }
+    else
+    {
+        rd->stats.blocks++;
+        rd->stats.packets += rd->slot->num_packets;
+    }
+
+    rd->slot = NULL;
+    rd->cursor++;
+
+    return ret;
+}
+
+int ts_shm_wait( ts_shm_reader_t *rd, int timeout )
+{
+    shm_header_t *hdr = rd->m.hdr;
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = ( timeout % 1000 ) * 1000000;
+
+    uint32_t futex = __atomic_load_n( &hdr->futex, __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &hdr->head, __ATOMIC_ACQUIRE ) != rd->cursor + !!rd->slot ||
+        __atomic_load_n( &hdr->closed, __ATOMIC_ACQUIRE ) )
+        return 1;
+
+#ifdef __linux__
+    __atomic_add_fetch( &hdr->waiters, 1, __ATOMIC_SEQ_CST );
+    syscall( SYS_futex, &hdr->futex, FUTEX_WAIT, futex, &ts, NULL, 0 );
+    __atomic_sub_fetch( &hdr->waiters, 1, __ATOMIC_SEQ_CST );
+#else
+    (void)futex;
+    nanosleep( &ts, NULL );
+#endif
+
+    return __atomic_load_n( &hdr->head, __ATOMIC_ACQUIRE ) != rd->cursor + !!rd->slot ||
+           __atomic_load_n( &hdr->closed, __ATOMIC_ACQUIRE );
+}
+
+int ts_get_shm_reader_stats( ts_shm_reader_t *rd, ts_shm_reader_stats_t *stats )
+{
+    *stats = rd->stats;
+    stats->lag = __atomic_load_n( &rd->m.hdr->head, __ATOMIC_ACQUIRE ) - rd->cursor;
+
+    return 0;
+}
+
+int ts_close_shm_reader( ts_shm_reader_t *rd )
+{
+    unmap( &rd->m );
+    free( rd );
+
+    return 0;
+}
+
+#else
+
+ts_shm_ring_t *ts_create_shm_ring( ts_shm_params_t *params )
+{
+    fprintf( stderr, "Shared memory rings are not supported on this system\n" );
+    return NULL;
+}
+
+int ts_shm_write( ts_shm_ring_t *r, uint8_t *data, int len, int64_t *pcr_list )
+{
+    return -1;
+}
+
+int ts_close_shm_ring( ts_shm_ring_t *r )
+{
+    return -1;
+}
+
+ts_shm_reader_t *ts_open_shm_reader( const char *name )
+{
+    fprintf( stderr, "Shared memory rings are not supported on this system\n" );
+    return NULL;
+}
+
+int ts_shm_read( ts_shm_reader_t *rd, uint8_t **data, int *len, int64_t **pcr_list )
+{
+    return -1;
+}
+
+int ts_shm_release( ts_shm_reader_t *rd )
+{
+    return -1;
+}
+
+int ts_shm_wait( ts_shm_reader_t *rd, int timeout )
+{
+    return -1;
+}
+
+int ts_get_shm_reader_stats( ts_shm_reader_t *rd, ts_shm_reader_stats_t *stats )
+{
+    return -1;
+}
+
+int ts_close_shm_reader( ts_shm_reader_t *rd )
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,461 @@
+/*****************************************************************************
+ * udp.c : UDP/RTP output sink
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* sendmmsg */
+#define _GNU_SOURCE
+
+#include "../common.h"
+#include <errno.h>
+#include "fec.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+
+#define MAX_DATAGRAM_PACKETS 7
+#define DEFAULT_BATCH_SIZE  64
+#define MAX_BATCH_SIZE      1024
+
+#define RTP_PAYLOAD_MP2T    33
+
+/* SMPTE 2022-1 matrix limits */
+#define FEC_MAX_L           20
+#define FEC_MIN_D           4
+#define FEC_MAX_D           20
+#define FEC_MAX_LD          100
+
+enum
+{
+    DEST_MEDIA,
+    DEST_FEC_COLUMN,
+    DEST_FEC_ROW,
+};
+
+#ifndef _WIN32
+
+struct ts_udp_sink_t
+{
+    int fd;
+    struct sockaddr_storage addr[3]; /* indexed by DEST_* */
+    socklen_t addr_len;
+
+    int rtp;
+    uint32_t ssrc;
+    uint16_t seq;
+    int datagram_packets;
+    int batch_size;
+
+    /* packets which did not fill a datagram, sent with the next call */
+    uint8_t pending[MAX_DATAGRAM_PACKETS * TS_PACKET_SIZE];
+    int num_pending;
+    int64_t pending_pcr;
+
+    /* FEC over a matrix of fec_l columns by fec_d rows of media packets */
+    int fec_l;
+    int fec_d;
+    int fec_row;
+    int fec_pos;
+    uint16_t fec_seq[3];
+    fec_accumulator_t *fec_columns;
+    fec_accumulator_t fec_row_acc;
+
+    /* one entry per datagram of a batch, FEC packets are written to fec_out */
+    uint8_t (*rtp_headers)[RTP_HEADER_SIZE];
+    uint8_t (*fec_out)[FEC_PACKET_SIZE];
+    struct iovec *iov;
+    int *iovlen;
+    int *dest;
+#ifdef __linux__
+    struct mmsghdr *msgs;
+#endif
+
+    ts_udp_stats_t stats;
+};
+
+/* RFC 3550 fixed header, the RTP timestamp is the 90kHz part of the PCR */
+static void write_rtp_header( uint8_t *p, uint16_t seq, int64_t pcr, uint32_t ssrc )
+{
+    uint32_t timestamp = pcr / 300;
+
+    p[0] = 0x80; // version 2, no padding, extension or CSRCs
+    p[1] = RTP_PAYLOAD_MP2T; // marker 0
+    p[2] = seq >> 8;
+    p[3] = seq;
+    p[4] = timestamp >> 24;
+    p[5] = timestamp >> 16;
+    p[6] = timestamp >> 8;
+    p[7] = timestamp;
+    p[8] = ssrc >> 24;
+    p[9] = ssrc >> 16;
+    p[10] = ssrc >> 8;
+    p[11] = ssrc;
+}
+
+/* Sends the first num datagrams set up in u->iov */
+static int send_batch( ts_udp_sink_t *u, int num )
+{
+    int sent = 0;
+
+#ifdef __linux__
+    for( int i = 0; i < num; i++ )
+    {
+        memset( &u->msgs[i], 0, sizeof(u->msgs[i]) );
+        u->msgs[i].msg_hdr.msg_name = &u->addr[u->dest[i]];
+        u->msgs[i].msg_hdr.msg_namelen = u->addr_len;
+        u->msgs[i].msg_hdr.msg_iov = &u->iov[i * 2];
+        u->msgs[i].msg_hdr.msg_iovlen = u->iovlen[i];
+    }
+
+    while( sent < num )
+    {
+        int ret = sendmmsg( u->fd, &u->msgs[sent], num - sent, 0 );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            perror( "sendmmsg" );
+            return -1;
+        }
+        u->stats.syscalls++;
+        sent += ret;
+    }
+#else
+    while( sent < num )
+    {
+        struct msghdr msg = { 0 };
+
+        msg.msg_name = &u->addr[u->dest[sent]];
+        msg.msg_namelen = u->addr_len;
+        msg.msg_iov = &u->iov[sent * 2];
+        msg.msg_iovlen = u->iovlen[sent];
+        if( sendmsg( u->fd, &msg, 0 ) < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            perror( "sendmsg" );
+            return -1;
+        }
+        u->stats.syscalls++;
+        sent++;
+    }
+#endif
+
+    u->stats.datagrams += num;
+    return 0;
+}
+
+/* Moves on to the next entry of the batch, sending the batch when it is full */
+static int next_entry( ts_udp_sink_t *u, int *num )
+{
+    if( ++*num == u->batch_size )
+    {
+        *num = 0;
+        return send_batch( u, u->batch_size );
+    }
+
+    return 0;
+}
+
+static int queue_fec( ts_udp_sink_t *u, int *num, int dest, fec_accumulator_t *acc )
+{
+    int row = dest == DEST_FEC_ROW;
+    int size = fec_write_packet( u->fec_out[*num], acc, u->fec_seq[dest]++, row,
+                                 row ? 1 : u->fec_l, row ? u->fec_l : u->fec_d );
+
+    u->iov[*num * 2].iov_base = u->fec_out[*num];
+    u->iov[*num * 2].iov_len = size;
+    u->iovlen[*num] = 1;
+    u->dest[*num] = dest;
+    u->stats.fec_packets++;
+
+    return next_entry( u, num );
+}
+
+/* Adds a datagram to the batch followed by the FEC packets it completes */
+static int queue_datagram( ts_udp_sink_t *u, int *num, uint8_t *data, int packets, int64_t pcr )
+{
+    struct iovec *iov = &u->iov[*num * 2];
+    uint8_t *rtp_header = u->rtp_headers[*num];
+    int len = packets * TS_PACKET_SIZE;
+
+    u->iovlen[*num] = 1;
+    u->dest[*num] = DEST_MEDIA;
+    if( u->rtp )
+    {
+        write_rtp_header( rtp_header, u->seq++, pcr, u->ssrc );
+        iov->iov_base = rtp_header;
+        iov->iov_len = RTP_HEADER_SIZE;
+        iov++;
+        u->iovlen[*num] = 2;
+    }
+    iov->iov_base = data;
+    iov->iov_len = len;
+    u->stats.packets += packets;
+
+    if( !u->fec_l )
+        return next_entry( u, num );
+
+    /* a FEC packet is sent as soon as its last media packet has been queued */
+    int column = u->fec_pos % u->fec_l;
+    int last_row = u->fec_pos / u->fec_l == u->fec_d - 1;
+
+    fec_accumulate( &u->fec_columns[column], rtp_header, data, len );
+    if( u->fec_row )
+        fec_accumulate( &u->fec_row_acc, rtp_header, data, len );
+    u->fec_pos = (u->fec_pos + 1) % (u->fec_l * u->fec_d);
+
+    if( next_entry( u, num ) < 0 ||
+        ( u->fec_row && column == u->fec_l - 1 && queue_fec( u, num, DEST_FEC_ROW, &u->fec_row_acc ) < 0 ) ||
+        ( last_row && queue_fec( u, num, DEST_FEC_COLUMN, &u->fec_columns[column] ) < 0 ) )
+        return -1;
+
+    return 0;
+}
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_params_t *params )
+{
+    struct addrinfo hints = { 0 }, *res;
+    char service[16];
+    int ret;
+
+    if( !params->host || params->port <= 0 || params->port > 65535 )
+    {
+        fprintf( stderr, "Invalid UDP destination\n" );
+        return NULL;
+    }
+
+    if( params->packets_per_datagram < 0 || params->packets_per_datagram > MAX_DATAGRAM_PACKETS ||
+        params->batch_size < 0 || params->batch_size > MAX_BATCH_SIZE )
+    {
+        fprintf( stderr, "Invalid UDP datagram or batch size\n" );
+        return NULL;
+    }
+
+    if( params->fec_l && ( !params->rtp || params->fec_l < 0 || params->fec_l > FEC_MAX_L ||
+        params->fec_d < FEC_MIN_D || params->fec_d > FEC_MAX_D || params->fec_l * params->fec_d > FEC_MAX_LD ||
+        params->port + FEC_ROW_PORT_OFFSET > 65535 ) )
+    {
+        fprintf( stderr, "Invalid FEC matrix\n" );
+        return NULL;
+    }
+
+    ts_udp_sink_t *u = calloc( 1, sizeof(*u) );
+    if( !u )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+    u->fd = -1;
+
+    u->rtp = !!params->rtp;
+    u->ssrc = params->ssrc;
+    u->datagram_packets = params->packets_per_datagram ? params->packets_per_datagram : MAX_DATAGRAM_PACKETS;
+    u->batch_size = params->batch_size ? params->batch_size : DEFAULT_BATCH_SIZE;
+
+    u->rtp_headers = malloc( u->batch_size * RTP_HEADER_SIZE );
+    u->iov = malloc( u->batch_size * 2 * sizeof(*u->iov) );
+    u->iovlen = malloc( u->batch_size * sizeof(*u->iovlen) );
+    u->dest = malloc( u->batch_size * sizeof(*u->dest) );
+#ifdef __linux__
+    u->msgs = malloc( u->batch_size * sizeof(*u->msgs) );
+    if( !u->msgs )
+        goto malloc_fail;
+#endif
+    if( !u->rtp_headers || !u->iov || !u->iovlen || !u->dest )
+        goto malloc_fail;
+
+    if( params->fec_l )
+    {
+        u->fec_l = params->fec_l;
+        u->fec_d = params->fec_d;
+        u->fec_row = !!params->fec_row;
+        u->fec_columns = calloc( u->fec_l, sizeof(*u->fec_columns) );
+        u->fec_out = malloc( u->batch_size * FEC_PACKET_SIZE );
+        if( !u->fec_columns || !u->fec_out )
+            goto malloc_fail;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf( service, sizeof(service), "%i", params->port );
+    ret = getaddrinfo( params->host, service, &hints, &res );
+    if( ret )
+    {
+        fprintf( stderr, "Could not resolve %s: %s\n", params->host, gai_strerror( ret ) );
+        goto fail;
+    }
+
+    for( int i = 0; i < 3; i++ )
+        memcpy( &u->addr[i], res->ai_addr, res->ai_addrlen );
+    u->addr_len = res->ai_addrlen;
+    u->fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+    freeaddrinfo( res );
+    if( u->fd < 0 )
+    {
+        perror( "socket" );
+        goto fail;
+    }
+
+    for( int i = DEST_FEC_COLUMN; i <= DEST_FEC_ROW; i++ )
+    {
+        int port = params->port + ( i == DEST_FEC_COLUMN ? FEC_COLUMN_PORT_OFFSET : FEC_ROW_PORT_OFFSET );
+
+        if( u->addr[i].ss_family == AF_INET6 )
+            ((struct sockaddr_in6 *)&u->addr[i])->sin6_port = htons( port );
+        else
+            ((struct sockaddr_in *)&u->addr[i])->sin_port = htons( port );
+    }
+
+    if( params->ttl )
+    {
+        if( u->addr[0].ss_family == AF_INET6 )
+            ret = setsockopt( u->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &params->ttl, sizeof(params->ttl) );
+        else
+        {
+            uint8_t ttl = params->ttl;
+            ret = setsockopt( u->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl) );
+        }
+        if( ret < 0 )
+        {
+            perror( "setsockopt" );
+            goto fail;
+        }
+    }
+
+    return u;
+
+malloc_fail:
+    fprintf( stderr, "Malloc failed\n" );
+fail:
+    ts_close_udp_sink( u );
+    return NULL;
+}
+
+int ts_udp_send( ts_udp_sink_t *u, uint8_t *data, int len, int64_t *pcr_list )
+{
+    int num_packets, num = 0;
+    int i = 0;
+
+    if( check_ts_packets( data, len ) < 0 )
+    {
+        fprintf( stderr, "UDP output needs 188 byte packets\n" );
+        return -1;
+    }
+    num_packets = len / TS_PACKET_SIZE;
+
+    /* complete the datagram of the last call */
+    if( u->num_pending )
+    {
+        int packets = MIN( u->datagram_packets - u->num_pending, num_packets );
+
+        memcpy( u->pending + u->num_pending * TS_PACKET_SIZE, data, packets * TS_PACKET_SIZE );
+        u->num_pending += packets;
+        i = packets;
+
+        if( u->num_pending < u->datagram_packets )
+            return 0;
+
+        u->num_pending = 0;
+        if( queue_datagram( u, &num, u->pending, u->datagram_packets, u->pending_pcr ) < 0 )
+            return -1;
+    }
+
+    /* full datagrams are sent from the writer's buffer */
+    for( ; i + u->datagram_packets <= num_packets; i += u->datagram_packets )
+    {
+        if( queue_datagram( u, &num, data + i * TS_PACKET_SIZE, u->datagram_packets, pcr_list[i] ) < 0 )
+            return -1;
+    }
+
+    if( num && send_batch( u, num ) < 0 )
+        return -1;
+
+    if( i < num_packets )
+    {
+        u->num_pending = num_packets - i;
+        u->pending_pcr = pcr_list[i];
+        memcpy( u->pending, data + i * TS_PACKET_SIZE, u->num_pending * TS_PACKET_SIZE );
+    }
+
+    return 0;
+}
+
+int ts_get_udp_stats( ts_udp_sink_t *u, ts_udp_stats_t *stats )
+{
+    *stats = u->stats;
+    return 0;
+}
+
+int ts_close_udp_sink( ts_udp_sink_t *u )
+{
+    int ret = 0;
+
+    if( u->num_pending && u->fd >= 0 )
+    {
+        int num = 0;
+
+        ret = queue_datagram( u, &num, u->pending, u->num_pending, u->pending_pcr );
+        if( !ret && num )
+            ret = send_batch( u, num );
+    }
+
+    if( u->fd >= 0 )
+        close( u->fd );
+    free( u->rtp_headers );
+    free( u->fec_out );
+    free( u->fec_columns );
+    free( u->iov );
+    free( u->iovlen );
+    free( u->dest );
+#ifdef __linux__
+    free( u->msgs );
+#endif
+    free( u );
+
+    return ret;
+}
+
+#else
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_params_t *params )
+{
+    fprintf( stderr, "UDP output is not supported on this system\n" );
+    return NULL;
+}
+
+int ts_udp_send( ts_udp_sink_t *u, uint8_t *data, int len, int64_t *pcr_list )
+{
+    return -1;
+}
+
+int ts_get_udp_stats( ts_udp_sink_t *u, ts_udp_stats_t *stats )
+{
+    return -1;
+}
+
+int ts_close_udp_sink( ts_udp_sink_t *u )
+{
+    return -1;
+}
+
+#endif
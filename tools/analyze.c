@@ -0,0 +1,207 @@
+/*****************************************************************************
+ * analyze.c : Transport Stream compliance analyzer
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "../libmpegts.h"
+
+#define READ_SIZE ( 188 * 7 * 1024 )
+
+static int max_messages = 100;
+static int num_messages;
+
+static void print_error( void *opaque, int error, int pid, uint64_t packet_num, int64_t time )
+{
+    if( num_messages++ >= max_messages )
+        return;
+
+    if( time >= 0 )
+        printf( "packet %10"PRIu64" %12.6fs pid %5i: %s\n", packet_num, time / 27e6, pid, ts_analyzer_error_name( error ) );
+    else
+        printf( "packet %10"PRIu64" %12s pid %5i: %s\n", packet_num, "-", pid, ts_analyzer_error_name( error ) );
+
+    if( num_messages == max_messages )
+        printf( "further errors are not printed\n" );
+}
+
+static void print_buffer( const char *name, ts_buffer_stats_t *b )
+{
+    if( b->size )
+        printf( " %s %3.0f%%/%3.0f%%", name, 100.0 * b->mean / b->size, 100.0 * b->max / b->size );
+}
+
+static void print_report( ts_analyzer_report_t *r, double seconds )
+{
+    uint64_t total_errors = 0;
+
+    printf( "\n%"PRIu64" packets, measured muxrate %.0f bits/s", r->packets, r->muxrate );
+    if( seconds > 0 )
+        printf( ", analyzed at %.0f Mbit/s (%.1fx realtime)", r->packets * 188 * 8 / seconds / 1e6,
+                r->muxrate > 0 ? r->packets * 188 * 8 / r->muxrate / seconds : 0 );
+    printf( "\n\n" );
+
+    printf( "  pid  type  packets  T-STD mean/max fullness\n" );
+    for( int i = 0; i < r->num_pids; i++ )
+    {
+        ts_analyzer_pid_t *p = &r->pids[i];
+
+        printf( "%5i  ", p->pid );
+        if( p->stream_type >= 0 )
+            printf( "0x%02x", p->stream_type );
+        else
+            printf( "  - " );
+        printf( " %8"PRIu64" ", p->packets );
+
+        if( p->tstd )
+        {
+            print_buffer( "TB", &p->buffers.tb );
+            print_buffer( "MB", &p->buffers.mb );
+            print_buffer( "EB", &p->buffers.eb );
+        }
+        else if( !p->pid )
+        {
+            print_buffer( "TBsys", &r->sys.tb );
+            print_buffer( "Bsys", &r->sys.mb );
+        }
+        printf( "\n" );
+    }
+
+    printf( "\n" );
+    for( int i = 0; i < LIBMPEGTS_ANALYZER_NUM_ERRORS; i++ )
+    {
+        if( r->errors[i] )
+            printf( "%-36s %"PRIu64"\n", ts_analyzer_error_name( i ), r->errors[i] );
+        total_errors += r->errors[i];
+    }
+
+    if( !total_errors )
+        printf( "no errors\n" );
+}
+
+static void help( void )
+{
+    printf( "Usage: analyze [options] [file]\n"
+            "Checks a transport stream from a file or stdin for ETR 290 priority 1 and 2\n"
+            "errors and T-STD buffer violations. Returns 1 if there are any errors.\n"
+            "  -r, --muxrate <int>   muxrate in bits/s for the PCR accuracy check\n"
+            "                        [estimated from the PCRs]\n"
+            "  -V, --vbr             variable bitrate stream, skips the PCR accuracy check\n"
+            "  -t, --pid-timeout <int>  PID_error timeout in ms [5000]\n"
+            "  -m, --messages <int>  maximum number of errors to print [100]\n"
+            "  -q, --quiet           only print the summary\n"
+            "  -h, --help\n" );
+}
+
+int main( int argc, char **argv )
+{
+    static const struct option long_options[] =
+    {
+        { "muxrate",     required_argument, NULL, 'r' },
+        { "vbr",         no_argument,       NULL, 'V' },
+        { "pid-timeout", required_argument, NULL, 't' },
+        { "messages",    required_argument, NULL, 'm' },
+        { "quiet",       no_argument,       NULL, 'q' },
+        { "help",        no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    ts_analyzer_params_t params = { 0 };
+    ts_analyzer_report_t report;
+    ts_analyzer_t *a;
+    FILE *f = stdin;
+    uint8_t *buf;
+    struct timespec start, end;
+    int ret = 0, c, len;
+
+    params.error_callback = print_error;
+
+    while( ( c = getopt_long( argc, argv, "r:Vt:m:qh", long_options, NULL ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'r':
+                params.muxrate = atoi( optarg );
+                break;
+            case 'V':
+                params.vbr = 1;
+                break;
+            case 't':
+                params.pid_timeout = atoi( optarg );
+                break;
+            case 'm':
+                max_messages = atoi( optarg );
+                break;
+            case 'q':
+                max_messages = 0;
+                break;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( optind < argc && strcmp( argv[optind], "-" ) )
+    {
+        f = fopen( argv[optind], "rb" );
+        if( !f )
+        {
+            fprintf( stderr, "Could not open %s\n", argv[optind] );
+            return 1;
+        }
+    }
+
+    buf = malloc( READ_SIZE );
+    a = ts_create_analyzer( &params );
+    if( !buf || !a )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return 1;
+    }
+
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &start );
+    while( ( len = fread( buf, 1, READ_SIZE, f ) ) > 0 )
+    {
+        if( ts_analyze( a, buf, len ) < 0 )
+        {
+            ret = 1;
+            break;
+        }
+    }
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &end );
+
+    if( ts_get_analyzer_report( a, &report ) < 0 )
+        ret = 1;
+    else
+    {
+        print_report( &report, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 );
+        for( int i = 0; i < LIBMPEGTS_ANALYZER_NUM_ERRORS; i++ )
+            ret |= !!report.errors[i];
+    }
+
+    ts_close_analyzer( a );
+    free( buf );
+    if( f != stdin )
+        fclose( f );
+
+    return ret;
+}
@@ -0,0 +1,336 @@
+/*****************************************************************************
+ * bench.c : end-to-end muxing throughput benchmark
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "../libmpegts.h"
+#include "synth.h"
+
+/* Allocation counting needs the linker to wrap the allocator (see Makefile) */
+#ifdef HAVE_MALLOC_WRAP
+static uint64_t num_allocs;
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t nmemb, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+
+void *__wrap_malloc( size_t size )
+{
+    num_allocs++;
+    return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t nmemb, size_t size )
+{
+    num_allocs++;
+    return __real_calloc( nmemb, size );
+}
+
+void *__wrap_realloc( void *ptr, size_t size )
+{
+    num_allocs++;
+    return __real_realloc( ptr, size );
+}
+#define ALLOCS num_allocs
+#else
+#define ALLOCS 0
+#endif
+
+typedef struct
+{
+    const char *name;
+    synth_params_t params;
+} bench_preset_t;
+
+#define SPTS( vf, af, pids, rate, cbr ) { 1, pids, vf, af, rate, cbr, TS_TYPE_DVB, 1 }
+#define MPTS( vf, af, progs, pids, rate ) { progs, pids, vf, af, rate, 1, TS_TYPE_DVB, 1 }
+#define TRUE_VBR( vf, af, pids, rate ) { 1, pids, vf, af, rate, 0, TS_TYPE_DVB, 1, 0, 1 }
+#define INTRA( rate ) { 1, 2, LIBMPEGTS_VIDEO_AVC, LIBMPEGTS_AUDIO_302M, rate, 1, TS_TYPE_DVB, 1, 1 }
+
+static const bench_preset_t presets[] =
+{
+    { "avc-1pid-1M",        SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 1,   1000000,   1 ) },
+    { "avc-aac-8M",         SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 2,   8000000,   1 ) },
+    { "avc-aac-8M-vbr",     SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 2,   8000000,   0 ) },
+    { "mpeg2-ac3-dvb-15M",  SPTS( LIBMPEGTS_VIDEO_MPEG2, LIBMPEGTS_AUDIO_AC3,  6,   15000000,  1 ) },
+    { "avc-302m-20M-vbr",   SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_302M, 3,   20000000,  0 ) },
+    /* peak rate of the bursts, the output averages the video bitrate */
+    { "avc-aac-8M-tvbr",    TRUE_VBR( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 2,   8000000 ) },
+    { "mpeg2-ac3-15M-tvbr", TRUE_VBR( LIBMPEGTS_VIDEO_MPEG2, LIBMPEGTS_AUDIO_AC3,  6,   15000000 ) },
+    { "avc-aac-16pid-40M",  SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 16,  40000000,  1 ) },
+    { "avc-aac-48pid-40M",  SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 48,  40000000,  1 ) },
+    { "avc-aac-200M",       SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 2,   200000000, 1 ) },
+    { "avc-aac-400M",       SPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 2,   400000000, 1 ) },
+    { "mpts-4x-avc-40M",    MPTS( LIBMPEGTS_VIDEO_AVC,   LIBMPEGTS_AUDIO_ADTS, 4, 6, 40000000 ) },
+    /* radio services, PCR on the audio */
+    { "radio-1x-aac-1M",    MPTS( 0,                     LIBMPEGTS_AUDIO_ADTS, 1, 1, 1000000 ) },
+    { "radio-50x-aac-15M",  MPTS( 0,                     LIBMPEGTS_AUDIO_ADTS, 50, 1, 15000000 ) },
+    { "radio-50x-ac3-40M",  MPTS( 0,                     LIBMPEGTS_AUDIO_AC3,  50, 1, 40000000 ) },
+    /* contribution muxes, muxrate far above the transport buffer leak rate of the audio */
+    { "intra-422-80M",      INTRA( 80000000 ) },
+    { "intra-422-200M",     INTRA( 200000000 ) },
+    { "intra-422-400M",     INTRA( 400000000 ) },
+    { "intra-422-1G",       INTRA( 1000000000 ) },
+    { 0 }
+};
+
+static int64_t get_time( clockid_t clock )
+{
+    struct timespec ts;
+    clock_gettime( clock, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void print_header( void )
+{
+    printf( "%-20s %8s %10s %10s %9s %8s %8s %8s %8s %8s %6s %7s\n",
+            "name", "mux", "pkts/s", "Mbit/s/c", "ns/pkt", "allocs/f", "realtime", "vbitrate", "avgrate", "peak", "eff%", "errors" );
+}
+
+static int check_output;
+
+static int run_bench( const char *name, synth_params_t *params, int seconds )
+{
+    synth_t *s;
+    ts_writer_t *w;
+    ts_frame_t *frames;
+    ts_stats_t stats;
+    uint8_t *out;
+    int64_t *pcr_list;
+    int len, num_frames;
+    int num_periods = seconds * 90000 / SYNTH_FRAME_DURATION;
+    uint64_t total_frames = 0, total_bytes = 0, allocs, errors = 0;
+    int64_t cpu_time, wall_time, check_time = 0;
+    ts_analyzer_t *a = NULL;
+
+    s = synth_open( params );
+    if( !s )
+        return -1;
+
+    w = ts_create_writer();
+    if( !w || synth_setup_writer( s, w ) < 0 )
+    {
+        printf( "%-20s unsupported\n", name );
+        if( w )
+            ts_close_writer( w );
+        synth_close( s );
+        return 0;
+    }
+
+    if( check_output )
+    {
+        ts_analyzer_params_t analyzer_params = { 0 };
+        analyzer_params.muxrate = params->muxrate;
+        analyzer_params.vbr = !params->cbr;
+        a = ts_create_analyzer( &analyzer_params );
+        if( !a )
+        {
+            ts_close_writer( w );
+            synth_close( s );
+            return -1;
+        }
+    }
+
+    allocs = ALLOCS;
+    cpu_time = get_time( CLOCK_PROCESS_CPUTIME_ID );
+    wall_time = get_time( CLOCK_MONOTONIC );
+
+    for( int i = 0; i <= num_periods; i++ )
+    {
+        /* flush the last frame */
+        num_frames = i < num_periods ? synth_next_frames( s, &frames ) : 0;
+        if( ts_write_frames( w, frames, num_frames, &out, &len, &pcr_list ) < 0 )
+        {
+            fprintf( stderr, "%s: ts_write_frames failed\n", name );
+            if( a )
+                ts_close_analyzer( a );
+            ts_close_writer( w );
+            synth_close( s );
+            return -1;
+        }
+        total_frames += num_frames;
+        total_bytes += len;
+
+        /* the analysis is not part of the measured time */
+        if( a && len > 0 )
+        {
+            int64_t start = get_time( CLOCK_PROCESS_CPUTIME_ID );
+            ts_analyze( a, out, len );
+            check_time += get_time( CLOCK_PROCESS_CPUTIME_ID ) - start;
+        }
+    }
+
+    cpu_time = get_time( CLOCK_PROCESS_CPUTIME_ID ) - cpu_time - check_time;
+    wall_time = get_time( CLOCK_MONOTONIC ) - wall_time;
+    allocs = ALLOCS - allocs;
+
+    ts_get_stats( w, &stats, 0 );
+
+    if( a )
+    {
+        ts_analyzer_report_t report;
+        if( ts_get_analyzer_report( a, &report ) == 0 )
+            for( int i = 0; i < LIBMPEGTS_ANALYZER_NUM_ERRORS; i++ )
+                errors += report.errors[i];
+        ts_close_analyzer( a );
+    }
+
+    {
+        double packets = total_bytes / 188.0;
+        double cpu_s = cpu_time / 1e9;
+
+        printf( "%-20s %8.1f %10.0f %10.1f %9.1f %8.2f %8.1f %8.1f %8.1f %8.1f %6.1f", name,
+                params->muxrate / 1e6,
+                packets / cpu_s,
+                total_bytes * 8 / cpu_s / 1e6,
+                cpu_time / packets,
+                (double)allocs / total_frames,
+                (double)seconds * 1e9 / wall_time,
+                synth_video_bitrate( s ) / 1e6,
+                stats.average_bitrate / 1e6,
+                stats.peak_bitrate / 1e6,
+                100.0 * stats.payload_bytes / total_bytes );
+        if( check_output )
+            printf( " %7"PRIu64"\n", errors );
+        else
+            printf( " %7s\n", "-" );
+    }
+
+    ts_close_writer( w );
+    synth_close( s );
+
+    return 0;
+}
+
+static void help( void )
+{
+    printf( "Usage: bench [options]\n"
+            "Runs the built-in suite of muxes unless a mux is given.\n"
+            "  -r, --muxrate <int>   muxrate in Mbit/s\n"
+            "  -p, --pids <int>      elementary streams per program (1-100) [2]\n"
+            "  -P, --programs <int>  number of programs [1]\n"
+            "  -v, --video <string>  avc, mpeg2 or none [avc]\n"
+            "  -a, --audio <string>  aac, ac3 or 302m [aac]\n"
+            "  -V, --vbr             variable bitrate\n"
+            "  -T, --true-vbr        variable bitrate without empty slots, muxrate is the peak\n"
+            "  -i, --intra           AVC High 4:2:2 Intra video\n"
+            "  -s, --seconds <int>   duration of media per mux [10]\n"
+            "  -c, --check           check the output with the analyzer\n"
+            "  -h, --help\n"
+            "\n"
+            "pkts/s, Mbit/s/c (per core) and ns/pkt are measured in CPU time,\n"
+            "realtime is the wall clock speed relative to the media duration,\n"
+            "avgrate and peak are the average and peak output rate in Mbit/s,\n"
+            "eff%% is payload bytes divided by the output bytes and errors is the\n"
+            "number of errors the analyzer found (not included in the CPU time).\n" );
+}
+
+int main( int argc, char **argv )
+{
+    static const struct option long_options[] =
+    {
+        { "muxrate",  required_argument, NULL, 'r' },
+        { "pids",     required_argument, NULL, 'p' },
+        { "programs", required_argument, NULL, 'P' },
+        { "video",    required_argument, NULL, 'v' },
+        { "audio",    required_argument, NULL, 'a' },
+        { "vbr",      no_argument,       NULL, 'V' },
+        { "true-vbr", no_argument,       NULL, 'T' },
+        { "intra",    no_argument,       NULL, 'i' },
+        { "seconds",  required_argument, NULL, 's' },
+        { "check",    no_argument,       NULL, 'c' },
+        { "help",     no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    synth_params_t params = SPTS( LIBMPEGTS_VIDEO_AVC, LIBMPEGTS_AUDIO_ADTS, 2, 0, 1 );
+    int seconds = 10, ret = 0, c;
+
+    while( ( c = getopt_long( argc, argv, "r:p:P:v:a:VTis:ch", long_options, NULL ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'r':
+                params.muxrate = atof( optarg ) * 1000000;
+                break;
+            case 'p':
+                params.num_pids = atoi( optarg );
+                break;
+            case 'P':
+                params.num_programs = atoi( optarg );
+                break;
+            case 'v':
+                params.video_format = !strcmp( optarg, "mpeg2" ) ? LIBMPEGTS_VIDEO_MPEG2 :
+                                      !strcmp( optarg, "none" ) ? 0 : LIBMPEGTS_VIDEO_AVC;
+                break;
+            case 'a':
+                params.audio_format = !strcmp( optarg, "ac3" ) ? LIBMPEGTS_AUDIO_AC3 :
+                                      !strcmp( optarg, "302m" ) ? LIBMPEGTS_AUDIO_302M : LIBMPEGTS_AUDIO_ADTS;
+                break;
+            case 'V':
+                params.cbr = 0;
+                break;
+            case 'T':
+                params.cbr = 0;
+                params.true_vbr = 1;
+                break;
+            case 'i':
+                params.intra = 1;
+                break;
+            case 's':
+                seconds = atoi( optarg );
+                break;
+            case 'c':
+                check_output = 1;
+                break;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( seconds <= 0 )
+    {
+        fprintf( stderr, "Invalid duration\n" );
+        return 1;
+    }
+
+    print_header();
+
+    if( params.muxrate )
+    {
+        char name[64];
+        snprintf( name, sizeof(name), "custom-%ix%i", params.num_programs, params.num_pids );
+        ret = run_bench( name, &params, seconds );
+    }
+    else
+    {
+        for( int i = 0; presets[i].name; i++ )
+        {
+            params = presets[i].params;
+            ret |= run_bench( presets[i].name, &params, seconds );
+        }
+    }
+
+    return !!ret;
+}
@@ -0,0 +1,843 @@
+/*****************************************************************************
+ * golden.c : byte-exact output regression tests
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Every case is a scripted sequence of frames muxed with a fixed configuration.
+ * The FNV-1a hashes of the TS output and of the PCR list are compared with tools/golden.txt.
+ *
+ * When a hash changes on purpose, regenerate the expected file with -g.
+ * When it changes by accident, dump the output of a known good build with -w <dir>
+ * and run the current build with -d <dir> to find and decode the first diverging packet. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../libmpegts.h"
+
+#define GOLDEN_FRAMES     150 /* 6 seconds at 25fps */
+#define GOLDEN_MAX_EXTRA  4
+#define GOLDEN_MAX_PROGRAMS 8
+#define GOLDEN_PID( program, stream ) ( 0x100 + 16 * (program) + (stream) )
+#define GOLDEN_DURATION   3600
+
+typedef struct
+{
+    const char *name;
+    int ts_type;
+    int cbr;
+    int muxrate;
+    int video_format;
+    int vbv_maxrate;
+    int vbv_bufsize; /* 0 is vbv_maxrate */
+    int dvb_au;
+    int chunks;    /* sub-frame submission */
+    int mux_delay; /* ms */
+    int formats[GOLDEN_MAX_EXTRA];
+    int full_tstd;
+    int num_programs; /* 0 is a single program */
+    int true_vbr;
+    int new_muxrate; /* switched to halfway through */
+    int dynamic;     /* the last extra stream is added after a third and deleted after two thirds */
+} golden_case_t;
+
+#define V_AVC   LIBMPEGTS_VIDEO_AVC
+#define V_MPEG2 LIBMPEGTS_VIDEO_MPEG2
+
+static const golden_case_t cases[] =
+{
+    /* transport stream types */
+    { .name = "generic-avc-mp2-cbr", .ts_type = TS_TYPE_GENERIC, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_MPEG1 } },
+    { .name = "generic-avc-mp2-vbr", .ts_type = TS_TYPE_GENERIC, .cbr = 0, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_MPEG1 } },
+    { .name = "dvb-avc-aac-cbr", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .dvb_au = 1, .formats = { LIBMPEGTS_AUDIO_ADTS } },
+    { .name = "dvb-mpeg2-ac3-vbr", .ts_type = TS_TYPE_DVB, .cbr = 0, .muxrate = 20000000,
+      .video_format = V_MPEG2, .vbv_maxrate = 15000000, .dvb_au = 1, .formats = { LIBMPEGTS_AUDIO_AC3 } },
+    { .name = "cablelabs-mpeg2-ac3", .ts_type = TS_TYPE_CABLELABS, .cbr = 1, .muxrate = 15000000,
+      .video_format = V_MPEG2, .vbv_maxrate = 10000000, .formats = { LIBMPEGTS_AUDIO_AC3 } },
+    { .name = "atsc-mpeg2-ac3", .ts_type = TS_TYPE_ATSC, .cbr = 1, .muxrate = 19392658,
+      .video_format = V_MPEG2, .vbv_maxrate = 15000000,
+      .formats = { LIBMPEGTS_AUDIO_AC3, LIBMPEGTS_AUDIO_EAC3 } },
+    { .name = "isdb-avc-latm", .ts_type = TS_TYPE_ISDB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_LATM } },
+    { .name = "bluray-avc-ac3", .ts_type = TS_TYPE_BLU_RAY, .cbr = 1, .muxrate = 20000000,
+      .video_format = V_AVC, .vbv_maxrate = 15000000, .formats = { LIBMPEGTS_AUDIO_AC3 } },
+
+    /* stream formats */
+    { .name = "format-mpeg2-audio", .ts_type = TS_TYPE_GENERIC, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_MPEG2 } },
+    { .name = "format-302m", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 12000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_302M } },
+    { .name = "format-dts", .ts_type = TS_TYPE_GENERIC, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_DTS } },
+    { .name = "format-dvb-data", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000,
+      .formats = { LIBMPEGTS_DVB_SUB, LIBMPEGTS_DVB_TELETEXT, LIBMPEGTS_DVB_VBI, LIBMPEGTS_TABLE_SECTION } },
+    { .name = "format-atsc-vbi", .ts_type = TS_TYPE_ATSC, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_MPEG2, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_DVB_VBI } },
+    { .name = "format-smpte-anc", .ts_type = TS_TYPE_GENERIC, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000,
+      .formats = { LIBMPEGTS_ANCILLARY_RDD11, LIBMPEGTS_ANCILLARY_2038 } },
+    { .name = "format-bluray-audio", .ts_type = TS_TYPE_BLU_RAY, .cbr = 1, .muxrate = 40000000,
+      .video_format = V_AVC, .vbv_maxrate = 15000000,
+      .formats = { LIBMPEGTS_AUDIO_LPCM, LIBMPEGTS_AUDIO_DOLBY_LOSSLESS,
+                   LIBMPEGTS_AUDIO_DTS_HD, LIBMPEGTS_AUDIO_DTS_HD_XLL } },
+    { .name = "format-bluray-secondary", .ts_type = TS_TYPE_BLU_RAY, .cbr = 1, .muxrate = 30000000,
+      .video_format = V_AVC, .vbv_maxrate = 15000000,
+      .formats = { LIBMPEGTS_AUDIO_EAC3_SECONDARY, LIBMPEGTS_AUDIO_DTS_HD_SECONDARY,
+                   LIBMPEGTS_SUB_PRESENTATION_GRAPHICS, LIBMPEGTS_SUB_INTERACTIVE_GRAPHICS } },
+    { .name = "format-bluray-text", .ts_type = TS_TYPE_BLU_RAY, .cbr = 1, .muxrate = 20000000,
+      .video_format = V_AVC, .vbv_maxrate = 15000000, .formats = { LIBMPEGTS_SUB_TEXT } },
+
+    /* features */
+    { .name = "feature-chunks", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .chunks = 4, .formats = { LIBMPEGTS_AUDIO_ADTS } },
+    /* the frames arrive 200ms before their DTS, a budget of 150ms holds them back */
+    { .name = "feature-mux-delay", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .vbv_bufsize = 500000,
+      .mux_delay = 150, .formats = { LIBMPEGTS_AUDIO_ADTS } },
+    { .name = "feature-full-tstd", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_ADTS }, .full_tstd = 1 },
+    { .name = "feature-full-tstd-mpeg2", .ts_type = TS_TYPE_CABLELABS, .cbr = 1, .muxrate = 15000000,
+      .video_format = V_MPEG2, .vbv_maxrate = 10000000, .formats = { LIBMPEGTS_AUDIO_AC3 }, .full_tstd = 1 },
+    { .name = "feature-true-vbr", .ts_type = TS_TYPE_DVB, .cbr = 0, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .dvb_au = 1,
+      .formats = { LIBMPEGTS_AUDIO_ADTS }, .true_vbr = 1 },
+    { .name = "feature-muxrate-change", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000,
+      .formats = { LIBMPEGTS_AUDIO_ADTS }, .new_muxrate = 7000000 },
+    { .name = "feature-dynamic-stream", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 8000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000,
+      .formats = { LIBMPEGTS_AUDIO_ADTS, LIBMPEGTS_DVB_TELETEXT }, .dynamic = 1 },
+
+    /* multiple programs */
+    { .name = "mpts-avc-aac", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 20000000,
+      .video_format = V_AVC, .vbv_maxrate = 5000000, .formats = { LIBMPEGTS_AUDIO_ADTS }, .num_programs = 3 },
+    { .name = "radio-aac", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 1000000,
+      .formats = { LIBMPEGTS_AUDIO_ADTS } },
+    { .name = "radio-mpts-aac-ac3", .ts_type = TS_TYPE_DVB, .cbr = 1, .muxrate = 6000000,
+      .formats = { LIBMPEGTS_AUDIO_ADTS, LIBMPEGTS_AUDIO_AC3, LIBMPEGTS_DVB_TELETEXT }, .num_programs = 8 },
+    { 0 }
+};
+
+/* frame duration (90kHz), frame size and stream_id of each stream format */
+typedef struct
+{
+    int format;
+    int duration;
+    int size;
+    int stream_id;
+} golden_format_t;
+
+static const golden_format_t formats[] =
+{
+    { LIBMPEGTS_AUDIO_MPEG1,               2160,  384,  LIBMPEGTS_STREAM_ID_MPEGAUDIO },
+    { LIBMPEGTS_AUDIO_MPEG2,               2160,  384,  LIBMPEGTS_STREAM_ID_MPEGAUDIO },
+    { LIBMPEGTS_AUDIO_ADTS,                1920,  341,  LIBMPEGTS_STREAM_ID_MPEGAUDIO },
+    { LIBMPEGTS_AUDIO_LATM,                1920,  341,  LIBMPEGTS_STREAM_ID_MPEGAUDIO },
+    { LIBMPEGTS_AUDIO_AC3,                 2880,  1536, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_EAC3,                2880,  768,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_LPCM,                450,   964,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_DTS,                 960,   1006, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_DOLBY_LOSSLESS,      2880,  2000, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_DTS_HD,              960,   2012, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_DTS_HD_XLL,          960,   2012, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_EAC3_SECONDARY,      2880,  768,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_AUDIO_DTS_HD_SECONDARY,    960,   512,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_SUB_PRESENTATION_GRAPHICS, 45000, 2000, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_SUB_INTERACTIVE_GRAPHICS,  45000, 4000, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_SUB_TEXT,                  90000, 200,  LIBMPEGTS_STREAM_ID_PRIVATE_2 },
+    { LIBMPEGTS_AUDIO_302M,                3600,  9604, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_ANCILLARY_RDD11,           3600,  500,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_ANCILLARY_2038,            3600,  100,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_DVB_SUB,                   45000, 1500, LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_DVB_TELETEXT,              3600,  139,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_DVB_VBI,                   3600,  139,  LIBMPEGTS_STREAM_ID_PRIVATE_1 },
+    { LIBMPEGTS_TABLE_SECTION,             90000, 20,   0 },
+    { 0 }
+};
+
+typedef struct
+{
+    uint64_t packets;
+    uint64_t ts_hash;
+    uint64_t pcr_hash;
+} golden_result_t;
+
+static uint64_t fnv1a( uint64_t hash, const uint8_t *p, size_t len )
+{
+    for( size_t i = 0; i < len; i++ )
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static const golden_format_t *find_format( int format )
+{
+    for( int i = 0; formats[i].format; i++ )
+        if( formats[i].format == format )
+            return &formats[i];
+    return NULL;
+}
+
+static int setup_stream( ts_writer_t *w, const golden_case_t *c, int pid, int format )
+{
+    ts_dvb_sub_t sub = { "eng", LIBMPEGTS_DVB_SUB_TYPE_NORMAL_NO_AR, 1, 1 };
+    ts_dvb_ttx_t ttx = { "eng", LIBMPEGTS_DVB_TTX_TYPE_INITIAL, 1, 0 };
+    ts_dvb_vbi_line_t line = { 1, 21 };
+    ts_dvb_vbi_t vbi = { LIBMPEGTS_DVB_VBI_DATA_SERVICE_ID_VITC, 1, &line };
+
+    switch( format )
+    {
+        case LIBMPEGTS_AUDIO_ADTS:
+            return ts_setup_mpeg2_aac_stream( w, pid, LIBMPEGTS_MPEG2_AAC_LC_PROFILE, LIBMPEGTS_MPEG2_AAC_2_CHANNEL );
+        case LIBMPEGTS_AUDIO_LATM:
+            return ts_setup_mpeg4_aac_stream( w, pid, LIBMPEGTS_MPEG4_AAC_PROFILE_LEVEL_2, 2 );
+        case LIBMPEGTS_AUDIO_302M:
+            return ts_setup_302m_stream( w, pid, 16, 2 );
+        case LIBMPEGTS_AUDIO_LPCM:
+            return ts_setup_hdmv_lpcm_stream( w, pid, 2, 48, 16 );
+        case LIBMPEGTS_DVB_SUB:
+            return ts_setup_dvb_subtitles( w, pid, 0, 1, &sub );
+        case LIBMPEGTS_DVB_TELETEXT:
+            return ts_setup_dvb_teletext( w, pid, 1, &ttx );
+        case LIBMPEGTS_DVB_VBI:
+            return ts_setup_dvb_vbi( w, pid, 1, &vbi );
+    }
+
+    return 0;
+}
+
+/**** Blu-Ray source packets ****/
+
+typedef struct
+{
+    uint64_t bytes;
+    int64_t last_pcr; /* the arrival time of the next packet */
+    double pcr_offset; /* from the sync byte to the PCR */
+    int errors;
+} golden_m2ts_t;
+
+/* Checks that every packet is 192 bytes and that its arrival time stamp and PCR follow the slots of the output */
+static void check_source_packets( golden_m2ts_t *g, uint8_t *out, int len, int64_t *pcr_list )
+{
+    for( int i = 0; i < len / 192; i++ )
+    {
+        uint8_t *p = out + i * 192;
+        int64_t ats = ( ( p[0] & 0x3f ) << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+
+        g->errors += p[4] != 0x47;
+        if( g->last_pcr >= 0 )
+            g->errors += ats != ( g->last_pcr & 0x3fffffff );
+        if( ( p[7] & 0x20 ) && p[8] >= 7 && ( p[9] & 0x10 ) )
+        {
+            int64_t base = ( (int64_t)p[10] << 25 ) | ( p[11] << 17 ) | ( p[12] << 9 ) | ( p[13] << 1 ) | ( p[14] >> 7 );
+            int64_t pcr = base * 300 + ( ( p[14] & 1 ) << 8 ) + p[15];
+            g->errors += llabs( ( ( pcr - ats ) & 0x3fffffff ) - (int64_t)( g->pcr_offset + 0.5 ) ) > 1;
+        }
+        g->last_pcr = pcr_list[i];
+    }
+    g->bytes += len;
+}
+
+/* The output ends with a whole aligned unit of 32 packets */
+static int close_source_packets( golden_m2ts_t *g, golden_result_t *res )
+{
+    if( res && ( g->errors || g->bytes % 6144 || g->bytes != res->packets * 192 ) )
+    {
+        fprintf( stderr, "Blu-Ray: %"PRIu64" bytes in %"PRIu64" packets, %d errors\n", g->bytes, res->packets, g->errors );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Muxes a case and calls back with every output buffer */
+static int run_case( const golden_case_t *c, golden_result_t *res, FILE *ts_file, FILE *pcr_file )
+{
+    ts_writer_t *w;
+    ts_stream_t streams[GOLDEN_MAX_PROGRAMS][1 + GOLDEN_MAX_EXTRA];
+    const golden_format_t *fmt[GOLDEN_MAX_EXTRA];
+    int64_t next_dts[GOLDEN_MAX_PROGRAMS][GOLDEN_MAX_EXTRA];
+    ts_program_t programs[GOLDEN_MAX_PROGRAMS];
+    ts_main_t params;
+    ts_frame_t frames[GOLDEN_MAX_PROGRAMS * (1 + GOLDEN_MAX_EXTRA * 4)];
+    uint8_t *data;
+    int num_extra = 0, num_programs = c->num_programs ? c->num_programs : 1;
+    int64_t last_arrival = 0;
+    uint32_t seed = 1;
+    golden_m2ts_t m2ts = { 0, -1, 7 * 8 * 27000000.0 / c->muxrate, 0 };
+    int max_video = c->video_format ? c->vbv_maxrate / 8 / 5 : 0;
+
+    memset( res, 0, sizeof(*res) );
+    res->ts_hash = res->pcr_hash = 14695981039346656037ULL;
+
+    for( int i = 0; i < GOLDEN_MAX_EXTRA && c->formats[i]; i++ )
+    {
+        fmt[i] = find_format( c->formats[i] );
+        num_extra++;
+    }
+
+    /* program n uses PMT PID 0x42+n and PIDs 0x100+16n onwards, the video PID is 0x100+16n */
+    memset( streams, 0, sizeof(streams) );
+    memset( programs, 0, sizeof(programs) );
+    memset( next_dts, 0, sizeof(next_dts) );
+    for( int p = 0; p < num_programs; p++ )
+    {
+        ts_program_t *program = &programs[p];
+        int num_streams = 0;
+
+        if( c->video_format )
+        {
+            ts_stream_t *stream = &streams[p][num_streams++];
+
+            stream->pid = GOLDEN_PID( p, 0 );
+            stream->stream_format = c->video_format;
+            stream->stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+            stream->dvb_au = c->dvb_au;
+            stream->dvb_au_frame_rate = LIBMPEGTS_DVB_AU_25_FPS;
+            stream->hdmv_frame_rate = LIBMPEGTS_DVB_AU_25_FPS;
+            stream->hdmv_aspect_ratio = LIBMPEGTS_HDMV_AR_16_9;
+            stream->hdmv_video_format = LIBMPEGTS_HDMV_1080I;
+        }
+
+        for( int i = 0; i < num_extra; i++ )
+        {
+            ts_stream_t *stream = &streams[p][num_streams++];
+
+            stream->pid = GOLDEN_PID( p, 1 + i );
+            stream->stream_format = fmt[i]->format;
+            stream->stream_id = fmt[i]->stream_id;
+            stream->audio_frame_size = fmt[i]->duration;
+            stream->write_lang_code = 1;
+            memcpy( stream->lang_code, "eng", 4 );
+        }
+
+        program->pmt_pid = 0x42 + p;
+        program->program_num = 1 + p;
+        /* radio services carry the PCR on the audio */
+        program->pcr_pid = streams[p][0].pid;
+        program->num_streams = num_streams - !!c->dynamic;
+        program->streams = streams[p];
+        program->sdt.service_type = c->video_format ? DVB_SERVICE_TYPE_DIGITAL_TELEVISION : DVB_SERVICE_TYPE_DIGITAL_RADIO_SOUND;
+        program->sdt.service_name = "golden";
+        program->sdt.provider_name = "libmpegts";
+    }
+
+    memset( &params, 0, sizeof(params) );
+    params.num_programs = num_programs;
+    params.programs = programs;
+    params.ts_id = 1;
+    params.muxrate = c->muxrate;
+    params.cbr = c->cbr;
+    params.ts_type = c->ts_type;
+    params.mux_delay = c->mux_delay;
+    params.full_tstd = c->full_tstd;
+    params.true_vbr = c->true_vbr;
+
+    w = ts_create_writer();
+    if( !w || ts_setup_transport_stream( w, &params ) < 0 )
+        return -1;
+
+    for( int p = 0; p < num_programs; p++ )
+    {
+        if( c->video_format &&
+            ts_setup_mpegvideo_stream( w, GOLDEN_PID( p, 0 ), c->video_format == V_AVC ? 40 : LIBMPEGTS_MPEG2_LEVEL_HIGH,
+                                       c->video_format == V_AVC ? AVC_HIGH : LIBMPEGTS_MPEG2_PROFILE_MAIN,
+                                       c->vbv_maxrate, c->vbv_bufsize ? c->vbv_bufsize : c->vbv_maxrate, 0 ) < 0 )
+            goto fail;
+
+        for( int i = 0; i < num_extra - !!c->dynamic; i++ )
+            if( setup_stream( w, c, GOLDEN_PID( p, 1 + i ), fmt[i]->format ) < 0 )
+                goto fail;
+    }
+
+    if( c->ts_type == TS_TYPE_DVB && ts_setup_sdt( w ) < 0 )
+        goto fail;
+
+    data = malloc( max_video + 4096 );
+    if( !data )
+        goto fail;
+    for( int i = 0; i < max_video + 4096; i++ )
+        data[i] = i * 7 + 3;
+
+    for( int f = 0; f <= GOLDEN_FRAMES; f++ )
+    {
+        int num_frames = 0, num_chunks = c->chunks ? c->chunks : 1;
+        int64_t dts = GOLDEN_DURATION * f + 18000;
+        uint8_t *out;
+        int64_t *pcr_list;
+        int len;
+
+        for( int chunk = 0; chunk < num_chunks; chunk++ )
+        {
+            num_frames = 0;
+
+            /* flush the last frame */
+            if( f < GOLDEN_FRAMES )
+            {
+                ts_frame_t video = { 0 };
+
+                if( c->video_format )
+                {
+                    int size, start, end;
+                    int64_t initial_arrival, final_arrival;
+
+                    seed = seed * 1664525 + 1013904223;
+                    size = f % 12 == 0 ? max_video : c->vbv_maxrate / 8 / 25 / 2 + (seed >> 22);
+
+                    /* CBR HRD starting 200ms before the first DTS */
+                    initial_arrival = (dts - 18000) * 300;
+                    if( initial_arrival < last_arrival )
+                        initial_arrival = last_arrival;
+                    final_arrival = initial_arrival + (int64_t)size * 8 * 27000000 / c->vbv_maxrate;
+                    if( chunk == num_chunks - 1 )
+                        last_arrival = final_arrival;
+
+                    start = (int64_t)size * chunk / num_chunks;
+                    end = (int64_t)size * (chunk + 1) / num_chunks;
+
+                    video.data = data + start;
+                    video.size = end - start;
+                    video.dts = dts;
+                    video.pts = dts + (f % 3 ? 0 : 2 * GOLDEN_DURATION);
+                    video.cpb_initial_arrival_time = initial_arrival;
+                    video.cpb_final_arrival_time = initial_arrival + (final_arrival - initial_arrival) * (chunk + 1) / num_chunks;
+                    video.random_access = f % 12 == 0;
+                    video.frame_type = f % 12 == 0 ? LIBMPEGTS_CODING_TYPE_I : f % 3 ? LIBMPEGTS_CODING_TYPE_B : LIBMPEGTS_CODING_TYPE_P;
+                    video.ref_pic_idc = f % 3 == 0;
+                    if( c->chunks )
+                        video.chunk = !chunk ? LIBMPEGTS_CHUNK_FIRST : chunk == num_chunks - 1 ? LIBMPEGTS_CHUNK_LAST : LIBMPEGTS_CHUNK_MIDDLE;
+                }
+
+                for( int p = 0; p < num_programs; p++ )
+                {
+                    if( c->video_format )
+                    {
+                        frames[num_frames] = video;
+                        frames[num_frames++].pid = GOLDEN_PID( p, 0 );
+                    }
+
+                    /* everything else goes with the first chunk */
+                    for( int i = 0; i < num_extra && !chunk; i++ )
+                    {
+                        int active = !c->dynamic || i < num_extra - 1 ||
+                                     ( f >= GOLDEN_FRAMES / 3 && f < 2 * GOLDEN_FRAMES / 3 );
+
+                        while( next_dts[p][i] + 18000 < dts + GOLDEN_DURATION )
+                        {
+                            if( !active )
+                            {
+                                next_dts[p][i] += fmt[i]->duration;
+                                continue;
+                            }
+                            ts_frame_t *frame = &frames[num_frames++];
+                            memset( frame, 0, sizeof(*frame) );
+                            frame->pid = GOLDEN_PID( p, 1 + i );
+                            frame->data = data;
+                            frame->size = fmt[i]->size;
+                            frame->dts = frame->pts = next_dts[p][i] + 18000;
+                            frame->random_access = 1;
+                            next_dts[p][i] += fmt[i]->duration;
+                        }
+                    }
+                }
+            }
+            else if( chunk )
+                break;
+
+            if( c->new_muxrate && f == GOLDEN_FRAMES / 2 && !chunk && ts_update_muxrate( w, c->new_muxrate ) < 0 )
+            {
+                free( data );
+                goto fail;
+            }
+
+            if( c->dynamic && !chunk && ( f == GOLDEN_FRAMES / 3 || f == 2 * GOLDEN_FRAMES / 3 ) )
+            {
+                for( int p = 0; p < num_programs; p++ )
+                {
+                    ts_stream_t *stream = &streams[p][programs[p].num_streams];
+                    int ret = f == GOLDEN_FRAMES / 3 ?
+                              ts_add_stream( w, 1 + p, stream ) < 0 || setup_stream( w, c, stream->pid, stream->stream_format ) < 0 :
+                              ts_delete_stream( w, stream->pid ) < 0;
+                    if( ret )
+                    {
+                        free( data );
+                        goto fail;
+                    }
+                }
+            }
+
+            if( ts_write_frames( w, frames, num_frames, &out, &len, &pcr_list ) < 0 )
+            {
+                free( data );
+                goto fail;
+            }
+
+            if( len > 0 )
+            {
+                /* one PCR per packet, Blu-ray packets are 192 bytes */
+                ts_stats_t stats;
+                ts_get_stats( w, &stats, 0 );
+                int num_pcrs = stats.total_packets - res->packets;
+
+                res->packets = stats.total_packets;
+                res->ts_hash = fnv1a( res->ts_hash, out, len );
+                res->pcr_hash = fnv1a( res->pcr_hash, (uint8_t *)pcr_list, num_pcrs * sizeof(int64_t) );
+                if( ts_file )
+                    fwrite( out, 1, len, ts_file );
+                if( pcr_file )
+                    fwrite( pcr_list, sizeof(int64_t), num_pcrs, pcr_file );
+                if( c->ts_type == TS_TYPE_BLU_RAY )
+                    check_source_packets( &m2ts, out, len, pcr_list );
+            }
+        }
+    }
+
+    free( data );
+    ts_close_writer( w );
+    if( c->ts_type == TS_TYPE_BLU_RAY && close_source_packets( &m2ts, res ) < 0 )
+        return -1;
+    return 0;
+
+fail:
+    ts_close_writer( w );
+    return -1;
+}
+
+/**** Packet decoding ****/
+
+static int64_t read_timestamp( const uint8_t *p )
+{
+    return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+static void decode_packet( const uint8_t *p, int64_t pcr )
+{
+    int pusi = !!(p[1] & 0x40);
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+    int afc = (p[3] >> 4) & 3;
+    int pos = 4;
+
+    printf( "    sync 0x%02x pusi %d pid 0x%04x scrambling %d afc %d cc %d (output pcr %"PRIi64")\n",
+            p[0], pusi, pid, (p[3] >> 6) & 3, afc, p[3] & 0xf, pcr );
+
+    if( afc & 2 )
+    {
+        int len = p[4];
+        printf( "    adaptation_field length %d", len );
+        if( len )
+        {
+            int flags = p[5];
+            printf( " discontinuity %d random_access %d priority %d pcr_flag %d opcr_flag %d splicing %d private %d extension %d",
+                    flags >> 7, (flags >> 6) & 1, (flags >> 5) & 1, (flags >> 4) & 1, (flags >> 3) & 1,
+                    (flags >> 2) & 1, (flags >> 1) & 1, flags & 1 );
+            if( flags & 0x10 )
+            {
+                const uint8_t *q = &p[6];
+                int64_t base = ((int64_t)q[0] << 25) | (q[1] << 17) | (q[2] << 9) | (q[3] << 1) | (q[4] >> 7);
+                int ext = ((q[4] & 1) << 8) | q[5];
+                printf( " pcr %"PRIi64, base * 300 + ext );
+            }
+        }
+        printf( "\n" );
+        pos += 1 + len;
+    }
+
+    if( (afc & 1) && pusi && pos + 9 <= 188 )
+    {
+        const uint8_t *q = &p[pos];
+        if( q[0] == 0 && q[1] == 0 && q[2] == 1 )
+        {
+            printf( "    pes stream_id 0x%02x length %d", q[3], (q[4] << 8) | q[5] );
+            if( (q[7] & 0x80) && pos + 14 <= 188 )
+                printf( " pts %"PRIi64, read_timestamp( &q[9] ) );
+            if( (q[7] & 0x40) && pos + 19 <= 188 )
+                printf( " dts %"PRIi64, read_timestamp( &q[14] ) );
+            printf( "\n" );
+        }
+        else if( pos + 1 + q[0] + 3 <= 188 )
+        {
+            const uint8_t *t = &q[1 + q[0]];
+            printf( "    section pointer %d table_id 0x%02x length %d\n", q[0], t[0], ((t[1] & 0xf) << 8) | t[2] );
+        }
+    }
+
+    for( int i = 0; i < 188; i += 16 )
+    {
+        printf( "    %3d:", i );
+        for( int j = i; j < i + 16 && j < 188; j++ )
+            printf( " %02x", p[j] );
+        printf( "\n" );
+    }
+}
+
+/* Compares the output of a case with the files written by a reference build */
+static int diff_case( const golden_case_t *c, const char *dir )
+{
+    char path[512];
+    FILE *ref_ts, *ref_pcr, *cur_ts, *cur_pcr;
+    golden_result_t res;
+    uint8_t ref[192], cur[192];
+    int64_t ref_clk, cur_clk;
+    int size = c->ts_type == TS_TYPE_BLU_RAY ? 192 : 188, ret = 0;
+
+    snprintf( path, sizeof(path), "%s/%s.ts", dir, c->name );
+    ref_ts = fopen( path, "rb" );
+    snprintf( path, sizeof(path), "%s/%s.pcr", dir, c->name );
+    ref_pcr = fopen( path, "rb" );
+    cur_ts = tmpfile();
+    cur_pcr = tmpfile();
+    if( !ref_ts || !ref_pcr || !cur_ts || !cur_pcr )
+    {
+        fprintf( stderr, "%s: could not open reference output in %s\n", c->name, dir );
+        ret = -1;
+        goto end;
+    }
+
+    if( run_case( c, &res, cur_ts, cur_pcr ) < 0 )
+    {
+        printf( "%-26s FAIL (mux error)\n", c->name );
+        ret = -1;
+        goto end;
+    }
+    rewind( cur_ts );
+    rewind( cur_pcr );
+
+    for( uint64_t n = 0; ; n++ )
+    {
+        int ref_ok = fread( ref, size, 1, ref_ts ) == 1 && fread( &ref_clk, 8, 1, ref_pcr ) == 1;
+        int cur_ok = fread( cur, size, 1, cur_ts ) == 1 && fread( &cur_clk, 8, 1, cur_pcr ) == 1;
+
+        if( !ref_ok && !cur_ok )
+            break;
+
+        if( ref_ok != cur_ok || memcmp( ref, cur, size ) || ref_clk != cur_clk )
+        {
+            printf( "%-26s first difference at packet %"PRIu64" (byte offset %"PRIu64")\n", c->name, n, n * size );
+            printf( "  expected:\n" );
+            if( ref_ok )
+                decode_packet( ref + size - 188, ref_clk );
+            else
+                printf( "    end of stream\n" );
+            printf( "  got:\n" );
+            if( cur_ok )
+                decode_packet( cur + size - 188, cur_clk );
+            else
+                printf( "    end of stream\n" );
+            ret = 1;
+            goto end;
+        }
+    }
+
+    printf( "%-26s identical\n", c->name );
+
+end:
+    if( ref_ts )
+        fclose( ref_ts );
+    if( ref_pcr )
+        fclose( ref_pcr );
+    if( cur_ts )
+        fclose( cur_ts );
+    if( cur_pcr )
+        fclose( cur_pcr );
+    return ret;
+}
+
+static int write_case( const golden_case_t *c, const char *dir )
+{
+    char path[512];
+    FILE *ts_file, *pcr_file;
+    golden_result_t res;
+    int ret;
+
+    snprintf( path, sizeof(path), "%s/%s.ts", dir, c->name );
+    ts_file = fopen( path, "wb" );
+    snprintf( path, sizeof(path), "%s/%s.pcr", dir, c->name );
+    pcr_file = fopen( path, "wb" );
+    if( !ts_file || !pcr_file )
+    {
+        fprintf( stderr, "Could not write to %s\n", dir );
+        ret = -1;
+    }
+    else
+        ret = run_case( c, &res, ts_file, pcr_file );
+
+    if( ts_file )
+        fclose( ts_file );
+    if( pcr_file )
+        fclose( pcr_file );
+    return ret;
+}
+
+static int find_expected( FILE *f, const char *name, golden_result_t *exp )
+{
+    char line[256], case_name[128];
+    uint64_t packets, ts_hash, pcr_hash;
+
+    rewind( f );
+    while( fgets( line, sizeof(line), f ) )
+    {
+        if( line[0] == '#' )
+            continue;
+        if( sscanf( line, "%127s %"SCNu64" %"SCNx64" %"SCNx64, case_name, &packets, &ts_hash, &pcr_hash ) == 4 &&
+            !strcmp( case_name, name ) )
+        {
+            exp->packets = packets;
+            exp->ts_hash = ts_hash;
+            exp->pcr_hash = pcr_hash;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void help( void )
+{
+    printf( "Usage: golden [options] [case...]\n"
+            "Checks the output of each case (or those named) against the expected hashes.\n"
+            "  -e, --expected <file>  expected hashes [tools/golden.txt]\n"
+            "  -g, --generate         print the hashes of the current build in the expected file format\n"
+            "  -w, --write <dir>      write the TS output and PCR list of every case to <dir>\n"
+            "  -d, --diff <dir>       compare packet by packet against the output written by -w\n"
+            "  -l, --list             list the cases\n"
+            "  -h, --help\n" );
+}
+
+int main( int argc, char **argv )
+{
+    static const struct option long_options[] =
+    {
+        { "expected", required_argument, NULL, 'e' },
+        { "generate", no_argument,       NULL, 'g' },
+        { "write",    required_argument, NULL, 'w' },
+        { "diff",     required_argument, NULL, 'd' },
+        { "list",     no_argument,       NULL, 'l' },
+        { "help",     no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    const char *expected_path = "tools/golden.txt", *write_dir = NULL, *diff_dir = NULL;
+    FILE *expected = NULL;
+    int generate = 0, failed = 0, c;
+
+    while( ( c = getopt_long( argc, argv, "e:gw:d:lh", long_options, NULL ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'e':
+                expected_path = optarg;
+                break;
+            case 'g':
+                generate = 1;
+                break;
+            case 'w':
+                write_dir = optarg;
+                break;
+            case 'd':
+                diff_dir = optarg;
+                break;
+            case 'l':
+                for( int i = 0; cases[i].name; i++ )
+                    printf( "%s\n", cases[i].name );
+                return 0;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( !generate && !write_dir && !diff_dir )
+    {
+        expected = fopen( expected_path, "r" );
+        if( !expected )
+        {
+            fprintf( stderr, "Could not open %s\n", expected_path );
+            return 1;
+        }
+    }
+
+    if( generate )
+        printf( "# name packets ts_hash pcr_hash\n" );
+
+    for( int i = 0; cases[i].name; i++ )
+    {
+        const golden_case_t *gc = &cases[i];
+        golden_result_t res, exp;
+        int selected = optind == argc;
+
+        for( int j = optind; j < argc; j++ )
+            selected |= !strcmp( argv[j], gc->name );
+        if( !selected )
+            continue;
+
+        if( write_dir )
+        {
+            if( write_case( gc, write_dir ) < 0 )
+                failed++;
+            continue;
+        }
+
+        if( diff_dir )
+        {
+            failed += !!diff_case( gc, diff_dir );
+            continue;
+        }
+
+        if( run_case( gc, &res, NULL, NULL ) < 0 )
+        {
+            printf( "%-26s FAIL (mux error)\n", gc->name );
+            failed++;
+            continue;
+        }
+
+        if( generate )
+        {
+            printf( "%-26s %8"PRIu64" %016"PRIx64" %016"PRIx64"\n", gc->name, res.packets, res.ts_hash, res.pcr_hash );
+            continue;
+        }
+
+        if( find_expected( expected, gc->name, &exp ) < 0 )
+        {
+            printf( "%-26s FAIL (no expected hashes)\n", gc->name );
+            failed++;
+        }
+        else if( res.packets != exp.packets || res.ts_hash != exp.ts_hash || res.pcr_hash != exp.pcr_hash )
+        {
+            printf( "%-26s FAIL (packets %"PRIu64" ts %016"PRIx64" pcr %016"PRIx64", expected %"PRIu64" %016"PRIx64" %016"PRIx64")\n",
+                    gc->name, res.packets, res.ts_hash, res.pcr_hash, exp.packets, exp.ts_hash, exp.pcr_hash );
+            failed++;
+        }
+        else
+            printf( "%-26s ok\n", gc->name );
+    }
+
+    if( expected )
+        fclose( expected );
+
+    if( failed && !generate )
+        fprintf( stderr, "%d case(s) failed\n", failed );
+
+    return !!failed;
+}
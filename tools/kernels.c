@@ -0,0 +1,413 @@
+/*****************************************************************************
+ * kernels.c : microbenchmarks of the bitstream, CRC and packetisation kernels
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* The packetisation functions are static so build them into this file */
+#include "../libmpegts.c"
+#include "../crc/crc.h"
+#include "../output/fec.h"
+
+#include <getopt.h>
+
+#define KERNEL_RUNS    21 /* timed runs, the median is reported */
+#define KERNEL_WARMUP  3  /* untimed runs */
+#define KERNEL_MIN_NS  2000000 /* minimum length of a timed run */
+
+typedef struct
+{
+    ts_writer_t *w;
+    ts_int_program_t *program;
+    ts_int_stream_t *video;
+    ts_int_stream_t *audio;
+    ts_int_pes_t pes;
+    ts_frame_t frame;
+    uint8_t *buf;
+    uint8_t *data;
+    bs_t s;
+} kernel_ctx_t;
+
+typedef struct
+{
+    const char *name;
+    void (*func)( kernel_ctx_t *ctx, int iterations );
+} kernel_t;
+
+static int64_t get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**** Kernels ****/
+
+/* one packet header's worth of mixed width fields */
+static void bench_bs_write( kernel_ctx_t *ctx, int iterations )
+{
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        bs_write( &ctx->s, 8, 0x47 );
+        bs_write1( &ctx->s, 0 );
+        bs_write1( &ctx->s, i & 1 );
+        bs_write1( &ctx->s, 0 );
+        bs_write( &ctx->s, 13, i & 0x1fff );
+        bs_write( &ctx->s, 2, 0 );
+        bs_write( &ctx->s, 2, 1 );
+        bs_write( &ctx->s, 4, i & 0xf );
+        if( (i & 1023) == 1023 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+    bs_flush( &ctx->s );
+}
+
+static void bench_bs_write32( kernel_ctx_t *ctx, int iterations )
+{
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        bs_write32( &ctx->s, i );
+        if( (i & 4095) == 4095 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+    bs_flush( &ctx->s );
+}
+
+/* packet payload copy including the bs_flush/bs_init of write_bytes */
+static void bench_write_bytes( kernel_ctx_t *ctx, int iterations )
+{
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        bs_write( &ctx->s, 32, 0x47000010 );
+        write_bytes( &ctx->s, ctx->data, 184 );
+        if( (i & 1023) == 1023 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+}
+
+static void bench_write_padding( kernel_ctx_t *ctx, int iterations )
+{
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        int start = bs_pos( &ctx->s );
+        bs_write( &ctx->s, 32, 0x471fff10 );
+        write_padding( &ctx->s, start );
+        if( (i & 1023) == 1023 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+}
+
+static void bench_crc_32_188( kernel_ctx_t *ctx, int iterations )
+{
+    uint32_t crc = 0;
+    for( int i = 0; i < iterations; i++ )
+        crc += crc_32( ctx->data, 188 );
+    ctx->buf[0] = crc;
+}
+
+static void bench_crc_32_1024( kernel_ctx_t *ctx, int iterations )
+{
+    uint32_t crc = 0;
+    for( int i = 0; i < iterations; i++ )
+        crc += crc_32( ctx->data, 1024 );
+    ctx->buf[0] = crc;
+}
+
+/* one RTP payload into a FEC accumulator */
+static void bench_fec_xor_1316( kernel_ctx_t *ctx, int iterations )
+{
+    for( int i = 0; i < iterations; i++ )
+        fec_xor( ctx->buf, ctx->data + (i & 7), 1316 );
+}
+
+static void bench_write_pes_video( kernel_ctx_t *ctx, int iterations )
+{
+    ctx->pes.stream = ctx->video;
+    ctx->frame.size = 1000;
+    for( int i = 0; i < iterations; i++ )
+        write_pes( ctx->w, ctx->program, &ctx->frame, &ctx->pes );
+}
+
+static void bench_write_pes_audio( kernel_ctx_t *ctx, int iterations )
+{
+    ctx->pes.stream = ctx->audio;
+    ctx->frame.size = 384;
+    for( int i = 0; i < iterations; i++ )
+        write_pes( ctx->w, ctx->program, &ctx->frame, &ctx->pes );
+}
+
+/* first packet of a random access point with a PCR */
+static void bench_write_adaptation_field_pcr( kernel_ctx_t *ctx, int iterations )
+{
+    ctx->pes.stream = ctx->video;
+    ctx->pes.started = 0;
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        write_adaptation_field( ctx->w, &ctx->s, ctx->program, &ctx->pes, 1, 1, 0, 0 );
+        if( (i & 1023) == 1023 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+}
+
+/* last packet of a PES stuffed with 100 bytes */
+static void bench_write_adaptation_field_stuffing( kernel_ctx_t *ctx, int iterations )
+{
+    ctx->pes.stream = ctx->video;
+    ctx->pes.started = 1;
+    bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    for( int i = 0; i < iterations; i++ )
+    {
+        write_adaptation_field( ctx->w, &ctx->s, ctx->program, &ctx->pes, 0, 1, 100, 0 );
+        if( (i & 1023) == 1023 )
+            bs_init( &ctx->s, ctx->buf, 188 * 1024 );
+    }
+}
+
+/* includes the packet accounting in increase_pcr */
+static void bench_write_pmt( kernel_ctx_t *ctx, int iterations )
+{
+    ts_writer_t *w = ctx->w;
+    for( int i = 0; i < iterations; i++ )
+    {
+        if( !(i & 1023) )
+        {
+            bs_init( &w->out.bs, w->out.p_bitstream, w->out.i_bitstream );
+            w->num_pcrs = 0;
+        }
+        write_pmt( w, ctx->program, 0 );
+    }
+}
+
+static const kernel_t kernels[] =
+{
+    { "bs_write_header",                 bench_bs_write },
+    { "bs_write32",                      bench_bs_write32 },
+    { "write_bytes_184",                 bench_write_bytes },
+    { "write_padding",                   bench_write_padding },
+    { "crc_32_188",                      bench_crc_32_188 },
+    { "crc_32_1024",                     bench_crc_32_1024 },
+    { "fec_xor_1316",                    bench_fec_xor_1316 },
+    { "write_pes_video",                 bench_write_pes_video },
+    { "write_pes_audio",                 bench_write_pes_audio },
+    { "write_adaptation_field_pcr",      bench_write_adaptation_field_pcr },
+    { "write_adaptation_field_stuffing", bench_write_adaptation_field_stuffing },
+    { "write_pmt",                       bench_write_pmt },
+    { 0 }
+};
+
+/**** Harness ****/
+
+static int kernel_ctx_init( kernel_ctx_t *ctx )
+{
+    ts_stream_t streams[2];
+    ts_program_t program;
+    ts_main_t params;
+
+    memset( ctx, 0, sizeof(*ctx) );
+    memset( streams, 0, sizeof(streams) );
+    memset( &program, 0, sizeof(program) );
+    memset( &params, 0, sizeof(params) );
+
+    streams[0].pid = 0x100;
+    streams[0].stream_format = LIBMPEGTS_VIDEO_AVC;
+    streams[0].stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+    streams[1].pid = 0x101;
+    streams[1].stream_format = LIBMPEGTS_AUDIO_ADTS;
+    streams[1].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO;
+    streams[1].audio_frame_size = 1920;
+    streams[1].write_lang_code = 1;
+    memcpy( streams[1].lang_code, "eng", 4 );
+
+    program.pmt_pid = 0x1000;
+    program.program_num = 1;
+    program.pcr_pid = 0x100;
+    program.num_streams = 2;
+    program.streams = streams;
+
+    params.num_programs = 1;
+    params.programs = &program;
+    params.ts_id = 1;
+    params.muxrate = 20000000;
+    params.cbr = 1;
+    params.ts_type = TS_TYPE_DVB;
+
+    ctx->w = ts_create_writer();
+    if( !ctx->w || ts_setup_transport_stream( ctx->w, &params ) < 0 ||
+        ts_setup_mpegvideo_stream( ctx->w, 0x100, 40, AVC_HIGH, 10000000, 10000000, 0 ) < 0 ||
+        ts_setup_mpeg2_aac_stream( ctx->w, 0x101, LIBMPEGTS_MPEG2_AAC_LC_PROFILE, LIBMPEGTS_MPEG2_AAC_2_CHANNEL ) < 0 )
+        return -1;
+
+    ctx->program = ctx->w->programs[0];
+    ctx->video = find_stream( ctx->w, 0x100 );
+    ctx->audio = find_stream( ctx->w, 0x101 );
+
+    ctx->buf = malloc( 188 * 1024 + 1024 );
+    ctx->data = malloc( 4096 );
+    ctx->pes.data = malloc( 4096 );
+    if( !ctx->buf || !ctx->data || !ctx->pes.data )
+        return -1;
+
+    for( int i = 0; i < 4096; i++ )
+        ctx->data[i] = i * 7 + 3;
+
+    ctx->frame.data = ctx->data;
+    ctx->pes.random_access = 1;
+    ctx->pes.dts = 900000;
+    ctx->pes.pts = 903600;
+
+    return 0;
+}
+
+static void kernel_ctx_close( kernel_ctx_t *ctx )
+{
+    free( ctx->buf );
+    free( ctx->data );
+    free( ctx->pes.data );
+    if( ctx->w )
+        ts_close_writer( ctx->w );
+}
+
+/* Finds the iteration count of a run lasting at least KERNEL_MIN_NS,
+ * warms up and returns the median and minimum time per call of KERNEL_RUNS runs. */
+static void run_kernel( kernel_ctx_t *ctx, const kernel_t *k, double *median, double *min )
+{
+    double results[KERNEL_RUNS];
+    int iterations = 16;
+
+    while( 1 )
+    {
+        int64_t t = get_time();
+        k->func( ctx, iterations );
+        if( get_time() - t >= KERNEL_MIN_NS || iterations >= (1 << 28) )
+            break;
+        iterations <<= 1;
+    }
+
+    for( int i = 0; i < KERNEL_WARMUP; i++ )
+        k->func( ctx, iterations );
+
+    for( int i = 0; i < KERNEL_RUNS; i++ )
+    {
+        int64_t t = get_time();
+        k->func( ctx, iterations );
+        results[i] = (double)(get_time() - t) / iterations;
+    }
+
+    qsort( results, KERNEL_RUNS, sizeof(double), cmp_double );
+    *median = results[KERNEL_RUNS / 2];
+    *min = results[0];
+}
+
+/* Looks up the median of a kernel in the output of a previous run */
+static double find_baseline( FILE *f, const char *name )
+{
+    char line[256], kernel[128];
+    double median;
+
+    if( !f )
+        return 0;
+
+    rewind( f );
+    while( fgets( line, sizeof(line), f ) )
+        if( sscanf( line, "%127s %lf", kernel, &median ) == 2 && !strcmp( kernel, name ) )
+            return median;
+
+    return 0;
+}
+
+static void help( void )
+{
+    printf( "Usage: kernels [options] [kernel...]\n"
+            "Times each kernel (or those named) and prints the median and minimum ns per call.\n"
+            "  -c, --compare <file>  print the change relative to the output of a previous run\n"
+            "  -h, --help\n" );
+}
+
+int main( int argc, char **argv )
+{
+    static const struct option long_options[] =
+    {
+        { "compare", required_argument, NULL, 'c' },
+        { "help",    no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    kernel_ctx_t ctx;
+    FILE *baseline = NULL;
+    int c;
+
+    while( ( c = getopt_long( argc, argv, "c:h", long_options, NULL ) ) != -1 )
+    {
+        switch( c )
+        {
+            case 'c':
+                baseline = fopen( optarg, "r" );
+                if( !baseline )
+                {
+                    fprintf( stderr, "Could not open %s\n", optarg );
+                    return 1;
+                }
+                break;
+            default:
+                help();
+                return c != 'h';
+        }
+    }
+
+    if( kernel_ctx_init( &ctx ) < 0 )
+    {
+        fprintf( stderr, "Could not setup writer\n" );
+        kernel_ctx_close( &ctx );
+        return 1;
+    }
+
+    printf( "%-32s %10s %10s%s\n", "kernel", "median_ns", "min_ns", baseline ? "   change" : "" );
+
+    for( int i = 0; kernels[i].name; i++ )
+    {
+        double median, min, old;
+        int selected = optind == argc;
+
+        for( int j = optind; j < argc; j++ )
+            selected |= !strcmp( argv[j], kernels[i].name );
+        if( !selected )
+            continue;
+
+        run_kernel( &ctx, &kernels[i], &median, &min );
+        printf( "%-32s %10.2f %10.2f", kernels[i].name, median, min );
+
+        old = find_baseline( baseline, kernels[i].name );
+        if( old > 0 )
+            printf( " %+7.1f%%", 100.0 * (median - old) / old );
+        printf( "\n" );
+        fflush( stdout );
+    }
+
+    if( baseline )
+        fclose( baseline );
+    kernel_ctx_close( &ctx );
+
+    return 0;
+}
@@ -0,0 +1,1409 @@
+/*****************************************************************************
+ * outputs.c : tests of the output sinks, seek index and trick play
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Every test muxes the same synthetic programme and passes each output buffer to the output
+ * under test. When the writer is closed, what came out of the output is checked against the
+ * TS output, which is hashed the same way as in tools/golden.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../libmpegts.h"
+#include "synth.h"
+
+#define TEST_FRAMES    150 /* 6 seconds at 25fps */
+#define TEST_MUXRATE   8000000
+/* the single programme of synth_open with a video and an audio stream */
+#define TEST_PMT_PID   0x20
+#define TEST_VIDEO_PID 0x21
+#define TEST_AUDIO_PID 0x22
+
+typedef struct
+{
+    uint64_t packets;
+    uint64_t ts_hash;
+    uint64_t pcr_hash;
+} test_result_t;
+
+static uint64_t fnv1a( uint64_t hash, const uint8_t *p, size_t len )
+{
+    for( size_t i = 0; i < len; i++ )
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int64_t read_timestamp( const uint8_t *p )
+{
+    return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+/**** RTP loopback ****/
+
+#define TEST_SSRC       0x4c4d5453
+#define TEST_FEC_L      5
+#define TEST_FEC_D      10
+#define TEST_MAX_SEQ    65536
+
+typedef struct
+{
+    int fd[3]; /* media, column FEC and row FEC */
+    ts_udp_sink_t *sink;
+    int64_t *pcrs; /* of every packet sent */
+    uint64_t num_pcrs;
+    uint64_t received;
+    uint16_t seq;
+    uint64_t hash;
+    int errors;
+
+    /* with FEC the datagrams are kept until the end, some are dropped and then recovered */
+    int fec;
+    uint8_t *media[TEST_MAX_SEQ];
+    int media_len[TEST_MAX_SEQ];
+    int num_media;
+    uint8_t **fec_packets;
+    int *fec_len;
+    int num_fec;
+} test_rtp_t;
+
+static int bind_loopback( int port )
+{
+    struct sockaddr_in addr = { 0 };
+    int rcvbuf = 8 << 20;
+    int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = htons( port );
+    if( fd < 0 || bind( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 )
+    {
+        if( fd >= 0 )
+            close( fd );
+        return -1;
+    }
+    setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) );
+
+    return fd;
+}
+
+static int open_rtp( void *opaque, ts_writer_t *w, int fec )
+{
+    test_rtp_t *r = opaque;
+    struct sockaddr_in addr = { 0 };
+    socklen_t addr_len = sizeof(addr);
+    ts_udp_params_t params = { 0 };
+
+    memset( r, 0, sizeof(*r) );
+    r->fd[0] = r->fd[1] = r->fd[2] = -1;
+    r->hash = 14695981039346656037ULL;
+    r->fec = fec;
+
+    /* the FEC ports are at fixed offsets so try until all three are free */
+    for( int i = 0; i < 20 && r->fd[0] < 0; i++ )
+    {
+        r->fd[0] = bind_loopback( 0 );
+        if( r->fd[0] < 0 || getsockname( r->fd[0], (struct sockaddr *)&addr, &addr_len ) < 0 )
+            break;
+        if( !fec )
+            continue;
+
+        r->fd[1] = bind_loopback( ntohs( addr.sin_port ) + 2 );
+        r->fd[2] = bind_loopback( ntohs( addr.sin_port ) + 4 );
+        if( r->fd[1] < 0 || r->fd[2] < 0 )
+        {
+            for( int j = 0; j < 3; j++ )
+            {
+                if( r->fd[j] >= 0 )
+                    close( r->fd[j] );
+                r->fd[j] = -1;
+            }
+        }
+    }
+    if( r->fd[0] < 0 )
+    {
+        perror( "loopback socket" );
+        return -1;
+    }
+
+    params.host = "127.0.0.1";
+    params.port = ntohs( addr.sin_port );
+    params.rtp = 1;
+    params.ssrc = TEST_SSRC;
+    if( fec )
+    {
+        params.fec_l = TEST_FEC_L;
+        params.fec_d = TEST_FEC_D;
+        params.fec_row = 1;
+    }
+    r->sink = ts_create_udp_sink( &params );
+
+    return r->sink ? 0 : -1;
+}
+
+/* Checks the header of a media datagram and hashes the payload */
+static void check_media( test_rtp_t *r, uint8_t *buf, int len )
+{
+    uint32_t timestamp = ((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+    uint16_t seq = (buf[2] << 8) | buf[3];
+
+    if( len < 12 + 188 || (len - 12) % 188 || buf[0] != 0x80 || buf[1] != 33 || seq != r->seq ||
+        r->received >= r->num_pcrs || timestamp != (uint32_t)(r->pcrs[r->received] / 300) )
+        r->errors++;
+
+    r->seq = seq + 1;
+    r->received += (len - 12) / 188;
+    r->hash = fnv1a( r->hash, buf + 12, len - 12 );
+}
+
+static int store_packet( uint8_t **dst, int *dst_len, uint8_t *buf, int len )
+{
+    *dst = malloc( len );
+    if( !*dst )
+        return -1;
+    memcpy( *dst, buf, len );
+    *dst_len = len;
+    return 0;
+}
+
+static void drain_rtp( test_rtp_t *r )
+{
+    uint8_t buf[12 + 16 + 7 * 188];
+    int len;
+
+    for( int i = 0; i < 3; i++ )
+    {
+        while( r->fd[i] >= 0 && ( len = recv( r->fd[i], buf, sizeof(buf), MSG_DONTWAIT ) ) > 0 )
+        {
+            if( !r->fec )
+                check_media( r, buf, len );
+            else if( !i )
+            {
+                uint16_t seq = (buf[2] << 8) | buf[3];
+                if( len < 12 || r->media[seq] || store_packet( &r->media[seq], &r->media_len[seq], buf, len ) < 0 )
+                    r->errors++;
+                if( seq >= r->num_media )
+                    r->num_media = seq + 1;
+            }
+            else
+            {
+                uint8_t **packets = realloc( r->fec_packets, (r->num_fec + 1) * sizeof(*packets) );
+                int *lens = realloc( r->fec_len, (r->num_fec + 1) * sizeof(*lens) );
+                if( packets )
+                    r->fec_packets = packets;
+                if( lens )
+                    r->fec_len = lens;
+                if( !packets || !lens || len < 12 + 16 ||
+                    store_packet( &r->fec_packets[r->num_fec], &r->fec_len[r->num_fec], buf, len ) < 0 )
+                    r->errors++;
+                else
+                    r->num_fec++;
+            }
+        }
+    }
+}
+
+/* Rebuilds the single missing packet protected by a FEC packet, returns 1 if one was recovered */
+static int recover_packet( test_rtp_t *r, uint8_t *f, int len )
+{
+    uint8_t *fec = f + 12;
+    int sn_base = (fec[0] << 8) | fec[1], offset = fec[13], na = fec[14];
+    int length = (fec[2] << 8) | fec[3], pt = fec[4] & 0x7f;
+    uint32_t ts = ((uint32_t)fec[8] << 24) | (fec[9] << 16) | (fec[10] << 8) | fec[11];
+    uint8_t payload[7 * 188] = { 0 };
+    int missing = -1;
+
+    for( int k = 0; k < na; k++ )
+    {
+        int seq = (sn_base + k * offset) & 0xffff;
+        if( r->media[seq] )
+            continue;
+        if( missing >= 0 || seq >= r->num_media )
+            return 0;
+        missing = seq;
+    }
+    if( missing < 0 )
+        return 0;
+
+    memcpy( payload, fec + 16, len - 12 - 16 < (int)sizeof(payload) ? len - 12 - 16 : (int)sizeof(payload) );
+    for( int k = 0; k < na; k++ )
+    {
+        uint8_t *m = r->media[(sn_base + k * offset) & 0xffff];
+        if( !m )
+            continue;
+        int m_len = r->media_len[(sn_base + k * offset) & 0xffff] - 12;
+        length ^= m_len;
+        pt ^= m[1] & 0x7f;
+        ts ^= ((uint32_t)m[4] << 24) | (m[5] << 16) | (m[6] << 8) | m[7];
+        for( int i = 0; i < m_len && i < (int)sizeof(payload); i++ )
+            payload[i] ^= m[12 + i];
+    }
+
+    if( length <= 0 || length > (int)sizeof(payload) )
+        return 0;
+
+    uint8_t *m = malloc( 12 + length );
+    if( !m )
+        return 0;
+    m[0] = 0x80;
+    m[1] = pt;
+    m[2] = missing >> 8;
+    m[3] = missing;
+    m[4] = ts >> 24;
+    m[5] = ts >> 16;
+    m[6] = ts >> 8;
+    m[7] = ts;
+    m[8] = (TEST_SSRC >> 24) & 0xff;
+    m[9] = (TEST_SSRC >> 16) & 0xff;
+    m[10] = (TEST_SSRC >> 8) & 0xff;
+    m[11] = TEST_SSRC & 0xff;
+    memcpy( m + 12, payload, length );
+    r->media[missing] = m;
+    r->media_len[missing] = 12 + length;
+
+    return 1;
+}
+
+/* Drops a burst of 5 packets and a single one from every complete matrix, checks they are all
+ * recovered from the FEC and passes the media on in order. The single loss shares a column
+ * with the burst so it needs the row FEC first. */
+static void receive_fec( test_rtp_t *r )
+{
+    int matrix = TEST_FEC_L * TEST_FEC_D;
+    int dropped = 0, recovered = 0, progress = 1;
+
+    for( int seq = 0; seq < r->num_media / matrix * matrix; seq++ )
+    {
+        int pos = seq % matrix;
+        if( ( pos >= 7 && pos < 12 ) || pos == 33 )
+        {
+            free( r->media[seq] );
+            r->media[seq] = NULL;
+            dropped++;
+        }
+    }
+
+    while( progress )
+    {
+        progress = 0;
+        for( int i = 0; i < r->num_fec; i++ )
+            progress += recover_packet( r, r->fec_packets[i], r->fec_len[i] );
+        recovered += progress;
+    }
+
+    if( recovered != dropped )
+        r->errors++;
+
+    for( int seq = 0; seq < r->num_media; seq++ )
+    {
+        if( r->media[seq] )
+            check_media( r, r->media[seq], r->media_len[seq] );
+        else
+            r->errors++;
+        free( r->media[seq] );
+    }
+    for( int i = 0; i < r->num_fec; i++ )
+        free( r->fec_packets[i] );
+    free( r->fec_packets );
+    free( r->fec_len );
+}
+
+static int send_rtp( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_rtp_t *r = opaque;
+    int num_pcrs = len / 188;
+    int64_t *tmp = realloc( r->pcrs, (r->num_pcrs + num_pcrs) * sizeof(int64_t) );
+
+    if( !tmp )
+        return -1;
+    r->pcrs = tmp;
+    memcpy( r->pcrs + r->num_pcrs, pcr_list, num_pcrs * sizeof(int64_t) );
+    r->num_pcrs += num_pcrs;
+
+    if( ts_udp_send( r->sink, out, len, pcr_list ) < 0 )
+        return -1;
+    drain_rtp( r );
+
+    return 0;
+}
+
+static int write_rtp( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_rtp_t *r = opaque;
+    return ts_udp_send( r->sink, out, len, pcr_list );
+}
+
+/* Flushes the sink and compares what arrived with the TS output unless res is NULL */
+static int close_rtp( void *opaque, test_result_t *res )
+{
+    test_rtp_t *r = opaque;
+    int ret = 0;
+
+    if( r->sink && ts_close_udp_sink( r->sink ) < 0 )
+        ret = -1;
+    drain_rtp( r );
+    if( r->fec )
+        receive_fec( r );
+    for( int i = 0; i < 3; i++ )
+        if( r->fd[i] >= 0 )
+            close( r->fd[i] );
+    free( r->pcrs );
+
+    if( !ret && res && ( r->errors || r->received != res->packets || r->hash != res->ts_hash ) )
+    {
+        fprintf( stderr, "RTP loopback: %"PRIu64" of %"PRIu64" packets received, %d errors, payload %s\n",
+                 r->received, res->packets, r->errors, r->hash == res->ts_hash ? "matches" : "differs" );
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**** Pacing ****/
+
+typedef struct
+{
+    ts_pacer_t *pacer;
+    test_rtp_t rtp; /* the paced output is sent over RTP */
+    double speed;
+    uint64_t packets;
+    uint64_t hash;
+    int64_t first_pcr, last_pcr;
+    int64_t first_release, last_release; /* ns */
+} test_pace_t;
+
+static int64_t get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int pace_write( void *opaque, uint8_t *data, int len, int64_t *pcr_list )
+{
+    test_pace_t *g = opaque;
+
+    g->last_release = get_time();
+    g->last_pcr = pcr_list[0];
+    if( !g->packets )
+    {
+        g->first_release = g->last_release;
+        g->first_pcr = g->last_pcr;
+    }
+    g->packets += len / 188;
+    g->hash = fnv1a( g->hash, data, len );
+
+    return send_rtp( &g->rtp, NULL, data, len, pcr_list );
+}
+
+static int open_pace( void *opaque, ts_writer_t *w, int speed )
+{
+    test_pace_t *g = opaque;
+    ts_pacer_params_t params = { 0 };
+
+    memset( g, 0, sizeof(*g) );
+    g->hash = 14695981039346656037ULL;
+    g->speed = speed;
+    if( open_rtp( &g->rtp, w, 0 ) < 0 )
+        return -1;
+
+    params.speed = speed;
+    params.write = pace_write;
+    params.opaque = g;
+    g->pacer = ts_create_pacer( &params );
+
+    return g->pacer ? 0 : -1;
+}
+
+static int send_pace( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_pace_t *g = opaque;
+
+    return ts_pace( g->pacer, out, len, pcr_list );
+}
+
+static int write_pace( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    return send_pace( opaque, w, out, len, pcr_list );
+}
+
+/* Releases the rest and checks that everything passed unchanged, not ahead of its PCR and
+ * arrived over RTP */
+static int close_pace( void *opaque, test_result_t *res )
+{
+    test_pace_t *g = opaque;
+    ts_pacer_stats_t stats = { 0 };
+    int64_t span;
+
+    if( g->pacer )
+        ts_get_pacer_stats( g->pacer, &stats, 0 );
+    if( !g->pacer || ts_close_pacer( g->pacer ) < 0 )
+        res = NULL;
+    if( close_rtp( &g->rtp, res ) < 0 || !res )
+        return -1;
+
+    /* a stall of the test machine restarts the schedule */
+    span = (int64_t)( ( g->last_pcr - g->first_pcr ) * 1000 / 27 / g->speed );
+    if( g->packets != res->packets || g->hash != res->ts_hash || ( !stats.resyncs && g->last_release - g->first_release < span ) )
+    {
+        fprintf( stderr, "Pacer: %"PRIu64" of %"PRIu64" packets passed in %.3fs for %.3fs, payload %s\n",
+                 g->packets, res->packets, ( g->last_release - g->first_release ) / 1e9, span / 1e9,
+                 g->hash == res->ts_hash ? "matches" : "differs" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**** File sink ****/
+
+/* small blocks so that the blocks wrap around many times */
+#define TEST_FILE_BLOCK  65536
+#define TEST_FILE_BLOCKS 4
+
+typedef struct
+{
+    ts_file_sink_t *sink;
+    char filename[64];
+} test_file_t;
+
+static int open_file( void *opaque, ts_writer_t *w, int mode )
+{
+    test_file_t *g = opaque;
+    ts_file_params_t params = { 0 };
+    int fd;
+
+    strcpy( g->filename, "/tmp/outputs-XXXXXX" );
+    fd = mkstemp( g->filename );
+    if( fd < 0 )
+    {
+        g->filename[0] = 0;
+        return -1;
+    }
+    close( fd );
+
+    params.filename = g->filename;
+    params.block_size = TEST_FILE_BLOCK;
+    params.num_blocks = TEST_FILE_BLOCKS;
+    params.preallocate = 4 * TEST_FILE_BLOCK;
+    params.direct = mode == 2;
+    params.no_io_uring = mode == 2;
+    g->sink = ts_create_file_sink( &params );
+
+    return g->sink ? 0 : -1;
+}
+
+static int send_file( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_file_t *g = opaque;
+
+    return ts_file_write( g->sink, out, len );
+}
+
+/* Closes the sink and compares the file with the TS output unless res is NULL */
+static int close_file( void *opaque, test_result_t *res )
+{
+    test_file_t *g = opaque;
+    uint64_t hash = 14695981039346656037ULL, size = 0;
+    uint8_t buf[65536];
+    size_t len;
+    FILE *f;
+    int ret = 0;
+
+    if( g->sink && ts_close_file_sink( g->sink ) < 0 )
+        ret = -1;
+
+    if( !ret && res )
+    {
+        f = fopen( g->filename, "rb" );
+        if( !f )
+            ret = -1;
+        else
+        {
+            while( ( len = fread( buf, 1, sizeof(buf), f ) ) > 0 )
+            {
+                hash = fnv1a( hash, buf, len );
+                size += len;
+            }
+            fclose( f );
+        }
+
+        if( !ret && ( size != res->packets * 188 || hash != res->ts_hash ) )
+        {
+            fprintf( stderr, "File sink: %"PRIu64" of %"PRIu64" bytes written, payload %s\n",
+                     size, res->packets * 188, hash == res->ts_hash ? "matches" : "differs" );
+            ret = -1;
+        }
+    }
+
+    if( g->filename[0] )
+        unlink( g->filename );
+
+    return ret;
+}
+
+/**** Shared memory ring ****/
+
+#define TEST_SHM_READERS 4
+
+/* every reader maps the ring separately like a consumer in another process would */
+typedef struct
+{
+    ts_shm_ring_t *ring;
+    ts_shm_reader_t *readers[TEST_SHM_READERS];
+    uint64_t packets[TEST_SHM_READERS];
+    uint64_t ts_hash[TEST_SHM_READERS];
+    uint64_t pcr_hash[TEST_SHM_READERS];
+    int num_readers;
+    char name[32];
+} test_shm_t;
+
+static int open_shm( void *opaque, ts_writer_t *w, int num_readers )
+{
+    test_shm_t *g = opaque;
+    ts_shm_params_t params = { 0 };
+
+    memset( g, 0, sizeof(*g) );
+    snprintf( g->name, sizeof(g->name), "outputs-%d", (int)getpid() );
+    params.name = g->name;
+    params.num_slots = 64;
+    g->ring = ts_create_shm_ring( &params );
+    if( !g->ring )
+        return -1;
+
+    for( int i = 0; i < num_readers; i++ )
+    {
+        g->readers[i] = ts_open_shm_reader( g->name );
+        if( !g->readers[i] )
+            return -1;
+        g->ts_hash[i] = g->pcr_hash[i] = 14695981039346656037ULL;
+        g->num_readers++;
+    }
+
+    return 0;
+}
+
+static void drain_shm( test_shm_t *g )
+{
+    uint8_t *data;
+    int64_t *pcr_list;
+    int len;
+
+    for( int i = 0; i < g->num_readers; i++ )
+    {
+        while( ts_shm_read( g->readers[i], &data, &len, &pcr_list ) > 0 )
+        {
+            g->ts_hash[i] = fnv1a( g->ts_hash[i], data, len );
+            g->pcr_hash[i] = fnv1a( g->pcr_hash[i], (uint8_t *)pcr_list, len / 188 * sizeof(int64_t) );
+            g->packets[i] += len / 188;
+            ts_shm_release( g->readers[i] );
+        }
+    }
+}
+
+static int send_shm( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_shm_t *g = opaque;
+    if( ts_shm_write( g->ring, out, len, pcr_list ) < 0 )
+        return -1;
+    drain_shm( g );
+    return 0;
+}
+
+static int write_shm( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_shm_t *g = opaque;
+    return ts_shm_write( g->ring, out, len, pcr_list );
+}
+
+/* Closes the ring and checks that every reader got everything unless res is NULL */
+static int close_shm( void *opaque, test_result_t *res )
+{
+    test_shm_t *g = opaque;
+    ts_shm_reader_stats_t stats;
+    int ret = 0;
+
+    if( g->ring )
+        ts_close_shm_ring( g->ring );
+    drain_shm( g );
+
+    for( int i = 0; i < g->num_readers; i++ )
+    {
+        uint8_t *data;
+        int64_t *pcr_list;
+        int len;
+
+        ts_get_shm_reader_stats( g->readers[i], &stats );
+        if( res && ( ts_shm_read( g->readers[i], &data, &len, &pcr_list ) != -1 || stats.overruns ||
+            g->packets[i] != res->packets || g->ts_hash[i] != res->ts_hash || g->pcr_hash[i] != res->pcr_hash ) )
+        {
+            fprintf( stderr, "Shared memory reader %d: %"PRIu64" of %"PRIu64" packets, %"PRIu64" overruns, payload %s, PCRs %s\n",
+                     i, g->packets[i], res->packets, stats.overruns, g->ts_hash[i] == res->ts_hash ? "match" : "differ",
+                     g->pcr_hash[i] == res->pcr_hash ? "match" : "differ" );
+            ret = -1;
+        }
+        ts_close_shm_reader( g->readers[i] );
+    }
+
+    return ret;
+}
+
+/**** Fan-out ****/
+
+#define TEST_FANOUT_SINKS 4
+#define TEST_FANOUT_HOLD  ( 2 * (TEST_FANOUT_SINKS - 1) )
+
+/* A sink which keeps references like an asynchronous sender and hashes blocks when it drops them */
+typedef struct
+{
+    ts_block_t *held[TEST_FANOUT_HOLD + 1];
+    int hold;
+    int num_held;
+    uint64_t packets;
+    uint64_t ts_hash;
+    uint64_t pcr_hash;
+} test_sink_t;
+
+typedef struct
+{
+    ts_fanout_t *fanout;
+    test_sink_t sinks[TEST_FANOUT_SINKS];
+    int num_sinks;
+} test_fanout_t;
+
+static void sink_release( test_sink_t *s )
+{
+    ts_block_t *block = s->held[0];
+
+    s->ts_hash = fnv1a( s->ts_hash, block->data, block->len );
+    s->pcr_hash = fnv1a( s->pcr_hash, (uint8_t *)block->pcr_list, block->len / 188 * sizeof(int64_t) );
+    s->packets += block->len / 188;
+    ts_unref_block( block );
+    memmove( s->held, s->held + 1, --s->num_held * sizeof(*s->held) );
+}
+
+static int sink_write( void *opaque, ts_block_t *block )
+{
+    test_sink_t *s = opaque;
+
+    ts_ref_block( block );
+    s->held[s->num_held++] = block;
+    if( s->num_held > s->hold )
+        sink_release( s );
+
+    return 0;
+}
+
+static int open_fanout( void *opaque, ts_writer_t *w, int num_sinks )
+{
+    test_fanout_t *g = opaque;
+    ts_fanout_params_t params = { 0 };
+
+    memset( g, 0, sizeof(*g) );
+    g->fanout = ts_create_fanout( &params );
+    if( !g->fanout )
+        return -1;
+
+    for( int i = 0; i < num_sinks; i++ )
+    {
+        test_sink_t *s = &g->sinks[i];
+
+        s->hold = 2 * i;
+        s->ts_hash = s->pcr_hash = 14695981039346656037ULL;
+        if( ts_fanout_add_sink( g->fanout, sink_write, s ) < 0 )
+            return -1;
+        g->num_sinks++;
+    }
+
+    return 0;
+}
+
+static int send_fanout( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_fanout_t *g = opaque;
+
+    return ts_fanout_write( g->fanout, out, len, pcr_list );
+}
+
+static int write_fanout( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    return send_fanout( opaque, w, out, len, pcr_list );
+}
+
+/* Closes the fan-out before the sinks drop their last blocks and checks that every sink got
+ * everything with a single copy and no more blocks than the sinks held, unless res is NULL */
+static int close_fanout( void *opaque, test_result_t *res )
+{
+    test_fanout_t *g = opaque;
+    ts_fanout_stats_t stats = { 0 };
+    int ret = 0;
+
+    if( g->fanout )
+    {
+        ts_get_fanout_stats( g->fanout, &stats );
+        ts_close_fanout( g->fanout );
+    }
+
+    for( int i = 0; i < g->num_sinks; i++ )
+    {
+        test_sink_t *s = &g->sinks[i];
+
+        while( s->num_held )
+            sink_release( s );
+        if( res && ( s->packets != res->packets || s->ts_hash != res->ts_hash || s->pcr_hash != res->pcr_hash ) )
+        {
+            fprintf( stderr, "Fan-out sink %d: %"PRIu64" of %"PRIu64" packets, payload %s, PCRs %s\n",
+                     i, s->packets, res->packets, s->ts_hash == res->ts_hash ? "matches" : "differs",
+                     s->pcr_hash == res->pcr_hash ? "match" : "differ" );
+            ret = -1;
+        }
+    }
+
+    if( res && ( stats.bytes != res->packets * 188 || stats.allocated_blocks > TEST_FANOUT_HOLD + 1 ) )
+    {
+        fprintf( stderr, "Fan-out: %"PRIu64" bytes copied for %"PRIu64", %d blocks allocated\n",
+                 stats.bytes, res->packets * 188, stats.allocated_blocks );
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**** HLS ****/
+
+#define TEST_HLS_LIST_SIZE 3
+
+typedef struct
+{
+    ts_hls_t *hls;
+    char dir[32];
+    char pattern[64];
+    char playlist[64];
+    int target;
+    int segments;
+    int errors;
+    int pat_cc;
+    int started;
+    int closing; /* the last segment can be shorter */
+    /* hashes of everything except the PAT and PMT, which the segmenter repeats */
+    uint64_t ref_hash;
+    uint64_t seg_hash;
+} test_hls_t;
+
+static int is_psi( const uint8_t *p )
+{
+    int pid = ( ( p[1] & 0x1f ) << 8 ) | p[2];
+    return pid == 0 || pid == TEST_PMT_PID;
+}
+
+static uint64_t hash_es( uint64_t hash, const uint8_t *data, int len )
+{
+    for( int i = 0; i < len; i += 188 )
+        if( !is_psi( data + i ) )
+            hash = fnv1a( hash, data + i, 188 );
+    return hash;
+}
+
+/* Checks that a segment starts with the PAT, the PMT and then a random access point with a PCR,
+ * that its rounded duration is the target, that the file matches and that the PAT continuity
+ * counter runs on across segments */
+static int check_segment( void *opaque, ts_hls_segment_t *seg )
+{
+    test_hls_t *g = opaque;
+    uint8_t *p = seg->data, *es = NULL;
+    char filename[96];
+    FILE *f;
+    int ok = seg->len >= 3 * 188 && ( ( p[1] & 0x1f ) << 8 | p[2] ) == 0 && ( ( p[189] & 0x1f ) << 8 | p[190] ) == TEST_PMT_PID;
+
+    for( int i = 0; i < seg->len; i += 188 )
+    {
+        if( ( ( seg->data[i+1] & 0x1f ) << 8 | seg->data[i+2] ) == 0 )
+        {
+            ok &= g->pat_cc < 0 || ( seg->data[i+3] & 0xf ) == ( ( g->pat_cc + 1 ) & 0xf );
+            g->pat_cc = seg->data[i+3] & 0xf;
+        }
+        if( !es && !is_psi( seg->data + i ) )
+            es = seg->data + i;
+    }
+    ok &= es && ( ( es[1] & 0x1f ) << 8 | es[2] ) == TEST_VIDEO_PID && ( es[3] & 0x20 ) && ( es[5] & 0x50 ) == 0x50;
+    ok &= seg->duration >= g->target * 27000000LL || g->closing;
+    ok &= seg->duration < g->target * 27000000LL + 13500000;
+
+    snprintf( filename, sizeof(filename), g->pattern, seg->index );
+    f = fopen( filename, "rb" );
+    if( f )
+    {
+        uint8_t *buf = malloc( seg->len + 1 );
+        ok &= buf && fread( buf, 1, seg->len + 1, f ) == (size_t)seg->len && !memcmp( buf, seg->data, seg->len );
+        free( buf );
+        fclose( f );
+    }
+    else
+        ok = 0;
+
+    g->seg_hash = hash_es( g->seg_hash, seg->data, seg->len );
+    g->errors += !ok;
+    g->segments++;
+
+    return 0;
+}
+
+static int open_hls( void *opaque, ts_writer_t *w, int target )
+{
+    test_hls_t *g = opaque;
+    ts_hls_params_t params = { 0 };
+
+    static const char *bad_patterns[] = { "seg.ts", "seg%s.ts", "seg%d-%d.ts", "seg%ld.ts", "seg%d%", "seg%%d.ts" };
+
+    /* the pattern is used as a format string */
+    params.segment = check_segment;
+    for( int i = 0; i < (int)(sizeof(bad_patterns) / sizeof(*bad_patterns)); i++ )
+    {
+        params.segment_filename = bad_patterns[i];
+        if( ( g->hls = ts_create_hls( &params ) ) )
+        {
+            fprintf( stderr, "HLS: segment filename %s was accepted\n", bad_patterns[i] );
+            ts_close_hls( g->hls );
+            return -1;
+        }
+    }
+
+    memset( g, 0, sizeof(*g) );
+    g->ref_hash = g->seg_hash = 14695981039346656037ULL;
+    g->target = target;
+    g->pat_cc = -1;
+    strcpy( g->dir, "/tmp/outputs-XXXXXX" );
+    if( !mkdtemp( g->dir ) )
+    {
+        g->dir[0] = 0;
+        return -1;
+    }
+    snprintf( g->pattern, sizeof(g->pattern), "%s/seg%%03d.ts", g->dir );
+    snprintf( g->playlist, sizeof(g->playlist), "%s/index.m3u8", g->dir );
+
+    params.segment_filename = g->pattern;
+    params.playlist_filename = g->playlist;
+    params.target_duration = target;
+    params.list_size = TEST_HLS_LIST_SIZE;
+    params.delete_segments = 1;
+    params.segment = check_segment;
+    params.opaque = g;
+    g->hls = ts_create_hls( &params );
+
+    return g->hls && ts_setup_random_access( w ) == 0 ? 0 : -1;
+}
+
+static int write_hls( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_hls_t *g = opaque;
+    return ts_hls_write( g->hls, w, out, len, pcr_list );
+}
+
+/* The segments start with the first random access point */
+static int send_hls( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_hls_t *g = opaque;
+    int *ra_list, num_ra, start = 0;
+
+    if( !g->started )
+    {
+        ts_get_random_access_packets( w, &ra_list, &num_ra );
+        g->started = num_ra > 0;
+        start = g->started ? ra_list[0] * 188 : len;
+    }
+    g->ref_hash = hash_es( g->ref_hash, out + start, len - start );
+
+    return ts_hls_write( g->hls, w, out, len, pcr_list );
+}
+
+/* Ends the playlist, checks it and the remaining segment files unless res is NULL and cleans up */
+static int close_hls( void *opaque, test_result_t *res )
+{
+    test_hls_t *g = opaque;
+    char line[256], expected[300];
+    int ret = 0, entries = 0, end = 0, files = 0, sequence = -1, target = -1, too_long = 0;
+    struct dirent *d;
+    DIR *dir;
+    FILE *f;
+
+    g->closing = 1;
+    if( g->hls && ts_close_hls( g->hls ) < 0 )
+        ret = -1;
+
+    if( !ret && res )
+    {
+        f = fopen( g->playlist, "r" );
+        while( f && fgets( line, sizeof(line), f ) )
+        {
+            if( !strncmp( line, "#EXTINF:", 8 ) )
+            {
+                entries++;
+                too_long += (int)( atof( line + 8 ) + 0.5 ) > g->target;
+            }
+            end |= !strcmp( line, "#EXT-X-ENDLIST\n" );
+            if( !strncmp( line, "#EXT-X-MEDIA-SEQUENCE:", 22 ) )
+                sequence = atoi( line + 22 );
+            if( !strncmp( line, "#EXT-X-TARGETDURATION:", 22 ) )
+                target = atoi( line + 22 );
+        }
+        if( f )
+            fclose( f );
+
+        if( g->errors || g->segments < 4 || g->seg_hash != g->ref_hash || !end || target != g->target || too_long ||
+            entries != TEST_HLS_LIST_SIZE || sequence != g->segments - TEST_HLS_LIST_SIZE )
+        {
+            fprintf( stderr, "HLS: %d segments, %d bad, %d playlist entries from %d, %d longer than the target of %d, payload %s\n",
+                     g->segments, g->errors, entries, sequence, too_long, target, g->seg_hash == g->ref_hash ? "matches" : "differs" );
+            ret = -1;
+        }
+    }
+
+    if( g->dir[0] && ( dir = opendir( g->dir ) ) )
+    {
+        while( ( d = readdir( dir ) ) )
+        {
+            if( d->d_name[0] == '.' )
+                continue;
+            files += !!strstr( d->d_name, ".ts" );
+            snprintf( expected, sizeof(expected), "%s/%s", g->dir, d->d_name );
+            unlink( expected );
+        }
+        closedir( dir );
+        rmdir( g->dir );
+    }
+
+    /* the older segments have been deleted */
+    if( !ret && res && files != TEST_HLS_LIST_SIZE )
+    {
+        fprintf( stderr, "HLS: %d segment files left\n", files );
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**** Seek index ****/
+
+/* the output is kept to check the index against it */
+typedef struct
+{
+    uint8_t *ts;
+    int64_t *pcrs;
+    uint8_t *index;
+    size_t ts_len, num_pcrs, index_len;
+} test_index_t;
+
+static int append_data( uint8_t **dst, size_t *dst_len, const void *src, size_t len )
+{
+    uint8_t *temp = realloc( *dst, *dst_len + len );
+
+    if( !temp )
+        return -1;
+    memcpy( temp + *dst_len, src, len );
+    *dst = temp;
+    *dst_len += len;
+    return 0;
+}
+
+static int open_index( void *opaque, ts_writer_t *w, int unused )
+{
+    return ts_setup_index( w );
+}
+
+static int send_index( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_index_t *g = opaque;
+    uint8_t *data;
+    int index_len;
+    size_t pcr_bytes = g->num_pcrs * sizeof(int64_t);
+
+    ts_get_index( w, &data, &index_len );
+    if( append_data( &g->index, &g->index_len, data, index_len ) < 0 ||
+        append_data( &g->ts, &g->ts_len, out, len ) < 0 ||
+        append_data( (uint8_t **)&g->pcrs, &pcr_bytes, pcr_list, len / 188 * sizeof(int64_t) ) < 0 )
+        return -1;
+    g->num_pcrs = pcr_bytes / sizeof(int64_t);
+
+    return 0;
+}
+
+/* Checks one random access entry against the packet it points at */
+static int check_entry( test_index_t *g, ts_index_entry_t *e )
+{
+    uint8_t *p = g->ts + e->offset, *pes;
+    int64_t mod = (int64_t)1 << 33;
+
+    if( e->offset % 188 || e->offset >= g->ts_len || e->pid != TEST_VIDEO_PID ||
+        ( ( p[1] & 0x1f ) << 8 | p[2] ) != e->pid || !( p[1] & 0x40 ) || !( p[3] & 0x20 ) || !( p[5] & 0x40 ) ||
+        e->pcr != g->pcrs[e->offset / 188] || e->frame_type != LIBMPEGTS_CODING_TYPE_I )
+        return -1;
+
+    pes = p + 5 + p[4];
+    if( read_timestamp( pes + 9 ) != e->pts % mod ||
+        read_timestamp( pes + ( pes[7] & 0x40 ? 14 : 9 ) ) != e->dts % mod )
+        return -1;
+
+    return 0;
+}
+
+/* Writes the index to a file, reads it back and checks every entry and some lookups unless res is NULL */
+static int close_index( void *opaque, test_result_t *res )
+{
+    test_index_t *g = opaque;
+    char filename[] = "/tmp/outputs-XXXXXX";
+    ts_index_entry_t *entries, entry;
+    ts_index_t *idx = NULL;
+    int num_entries, flagged = 0, errors = 0, fd;
+    uint64_t offset;
+    FILE *f;
+
+    if( res && ( fd = mkstemp( filename ) ) >= 0 )
+    {
+        f = fdopen( fd, "wb" );
+        if( f && fwrite( g->index, 1, g->index_len, f ) == g->index_len && !fclose( f ) )
+            idx = ts_open_index( filename );
+        unlink( filename );
+    }
+
+    if( idx )
+    {
+        for( size_t i = 0; i < g->ts_len; i += 188 )
+            flagged += ( ( g->ts[i+1] & 0x1f ) << 8 | g->ts[i+2] ) == TEST_VIDEO_PID &&
+                       ( g->ts[i+3] & 0x20 ) && g->ts[i+4] && ( g->ts[i+5] & 0x40 );
+
+        ts_index_get_random_access( idx, &entries, &num_entries );
+        errors += num_entries != flagged || num_entries < 2;
+        for( int i = 0; i < num_entries; i++ )
+            errors += check_entry( g, &entries[i] ) < 0;
+
+        /* lookups before the first, between and after entries, and on a PID without any */
+        errors += !ts_index_find( idx, TEST_VIDEO_PID, entries[0].pcr - 1, &entry );
+        errors += !ts_index_find( idx, TEST_AUDIO_PID, entries[0].pcr, &entry );
+        errors += !ts_index_find_pts( idx, TEST_AUDIO_PID, entries[0].pts, &entry );
+        for( int i = 0; i < num_entries; i++ )
+        {
+            int64_t next = i + 1 < num_entries ? entries[i+1].pcr : entries[i].pcr + 27000000;
+
+            errors += ts_index_find( idx, TEST_VIDEO_PID, ( entries[i].pcr + next ) / 2, &entry ) < 0 || entry.offset != entries[i].offset;
+            errors += ts_index_find_pts( idx, TEST_VIDEO_PID, entries[i].pts, &entry ) < 0 || entry.offset != entries[i].offset;
+        }
+
+        /* the first PES packet of each stream */
+        for( int pid = TEST_VIDEO_PID; pid <= TEST_AUDIO_PID; pid++ )
+        {
+            size_t first = 0;
+            while( first < g->ts_len && ( ( g->ts[first+1] & 0x5f ) << 8 | g->ts[first+2] ) != ( 0x4000 | pid ) )
+                first += 188;
+            errors += ts_index_first_packet( idx, pid, &offset ) < 0 || offset != first;
+        }
+        errors += ts_index_first_packet( idx, 0x1fff, &offset ) != -1;
+
+        if( errors )
+            fprintf( stderr, "Seek index: %d random access points for %d flagged packets, %d errors\n",
+                     num_entries, flagged, errors );
+        ts_close_index( idx );
+    }
+
+    free( g->ts );
+    free( g->pcrs );
+    free( g->index );
+
+    return res && ( !idx || errors ) ? -1 : 0;
+}
+
+/**** Trick play ****/
+
+/* The random access points of the output, found by demuxing it, and the trick play output are
+ * hashed the same way */
+typedef struct
+{
+    uint64_t ref_hash;
+    uint64_t trick_hash;
+    int in_ra;        /* the video PES of the output being demuxed is a random access point */
+    int ref_ra;
+    int trick_ra;
+    int video_cc;
+    int errors;
+} test_trick_t;
+
+static uint64_t hash_trick_packet( uint64_t hash, const uint8_t *p, int64_t pcr )
+{
+    uint8_t header[4] = { p[0], p[1], p[2], p[3] & 0xf0 };
+
+    hash = fnv1a( hash, header, 4 );
+    hash = fnv1a( hash, p + 4, 184 );
+    return fnv1a( hash, (uint8_t *)&pcr, sizeof(pcr) );
+}
+
+static int has_pcr( const uint8_t *p )
+{
+    return ( p[3] & 0x20 ) && p[4] >= 7 && ( p[5] & 0x10 );
+}
+
+static int open_trick( void *opaque, ts_writer_t *w, int unused )
+{
+    test_trick_t *g = opaque;
+
+    g->ref_hash = g->trick_hash = 14695981039346656037ULL;
+    g->video_cc = -1;
+
+    return ts_setup_trick_play( w );
+}
+
+static int send_trick( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list )
+{
+    test_trick_t *g = opaque;
+    uint8_t *trick, pcr_only[188];
+    int64_t *trick_pcr_list;
+    int trick_len;
+
+    for( int i = 0; i < len / 188; i++ )
+    {
+        uint8_t *p = out + i * 188;
+        int pid = ( p[1] & 0x1f ) << 8 | p[2];
+
+        if( pid == TEST_VIDEO_PID && ( p[1] & 0x40 ) )
+        {
+            g->in_ra = ( p[3] & 0x20 ) && p[4] && ( p[5] & 0x40 );
+            g->ref_ra += g->in_ra;
+        }
+        if( is_psi( p ) || ( pid == TEST_VIDEO_PID && ( p[3] & 0x10 ) && g->in_ra ) )
+            g->ref_hash = hash_trick_packet( g->ref_hash, p, pcr_list[i] );
+        else if( pid == TEST_VIDEO_PID && has_pcr( p ) )
+        {
+            /* the PCR on its own */
+            memset( pcr_only, 0xff, 188 );
+            memcpy( pcr_only, p, 4 );
+            pcr_only[1] &= 0x1f;
+            pcr_only[3] = 0x20;
+            pcr_only[4] = 183;
+            pcr_only[5] = 0x10;
+            memcpy( pcr_only + 6, p + 6, 6 );
+            g->ref_hash = hash_trick_packet( g->ref_hash, pcr_only, pcr_list[i] );
+        }
+    }
+
+    ts_get_trick_play( w, &trick, &trick_len, &trick_pcr_list );
+    for( int i = 0; i < trick_len / 188; i++ )
+    {
+        uint8_t *p = trick + i * 188;
+        int pid = ( p[1] & 0x1f ) << 8 | p[2];
+
+        if( pid == TEST_VIDEO_PID && ( p[3] & 0x10 ) )
+        {
+            g->errors += g->video_cc >= 0 && ( p[3] & 0xf ) != ( ( g->video_cc + 1 ) & 0xf );
+            g->video_cc = p[3] & 0xf;
+            g->trick_ra += !!( p[1] & 0x40 );
+        }
+        else if( pid == TEST_VIDEO_PID )
+            g->errors += g->video_cc >= 0 && ( p[3] & 0xf ) != g->video_cc;
+        else if( !is_psi( p ) )
+            g->errors++;
+        g->trick_hash = hash_trick_packet( g->trick_hash, p, trick_pcr_list[i] );
+    }
+
+    return 0;
+}
+
+static int close_trick( void *opaque, test_result_t *res )
+{
+    test_trick_t *g = opaque;
+
+    if( res && ( g->errors || g->trick_ra < 2 || g->trick_ra != g->ref_ra || g->trick_hash != g->ref_hash ) )
+    {
+        fprintf( stderr, "Trick play: %d of %d random access points, %d errors, packets %s\n",
+                 g->trick_ra, g->ref_ra, g->errors, g->trick_hash == g->ref_hash ? "match" : "differ" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**** Tests ****/
+
+typedef struct
+{
+    const char *name;
+    size_t size; /* of the state passed to the callbacks */
+    int param;
+    int (*open)( void *opaque, ts_writer_t *w, int param );
+    int (*send)( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list );
+    /* checks the output against res, when res is NULL it only cleans up */
+    int (*close)( void *opaque, test_result_t *res );
+    /* optional, passes data straight to a sink of 188 byte packets, which has to reject Blu-Ray output */
+    int (*write)( void *opaque, ts_writer_t *w, uint8_t *out, int len, int64_t *pcr_list );
+} output_test_t;
+
+static const output_test_t tests[] =
+{
+    { "rtp-loopback",  sizeof(test_rtp_t),    0, open_rtp,    send_rtp,    close_rtp,    write_rtp },
+    { "rtp-paced",     sizeof(test_pace_t),   8, open_pace,   send_pace,   close_pace,   write_pace },
+    { "rtp-fec",       sizeof(test_rtp_t),    1, open_rtp,    send_rtp,    close_rtp,    write_rtp },
+    { "file-io-uring", sizeof(test_file_t),   1, open_file,   send_file,   close_file },
+    { "file-direct",   sizeof(test_file_t),   2, open_file,   send_file,   close_file },
+    { "shm-ring",      sizeof(test_shm_t),    3, open_shm,    send_shm,    close_shm,    write_shm },
+    { "fanout",        sizeof(test_fanout_t), 4, open_fanout, send_fanout, close_fanout, write_fanout },
+    { "hls",           sizeof(test_hls_t),    1, open_hls,    send_hls,    close_hls,    write_hls },
+    { "index",         sizeof(test_index_t),  0, open_index,  send_index,  close_index },
+    { "trick-play",    sizeof(test_trick_t),  0, open_trick,  send_trick,  close_trick },
+    { 0 }
+};
+
+#define TEST_BD_PACKETS 47 /* as long as 48 TS packets */
+
+/* Blu-Ray source packets made of the first TS packets of out, which has to hold 48 of them */
+static void make_source_packets( uint8_t *bd, uint8_t *out )
+{
+    for( int i = 0; i < TEST_BD_PACKETS; i++ )
+    {
+        uint32_t ats = i * 1000; /* copy_permission_indicator is 0 */
+
+        bd[i*192+0] = ats >> 24;
+        bd[i*192+1] = ats >> 16;
+        bd[i*192+2] = ats >> 8;
+        bd[i*192+3] = ats;
+        memcpy( &bd[i*192+4], &out[i*188], 188 );
+    }
+}
+
+/* Muxes the synthetic programme into the output under test and checks it */
+static int run_test( const output_test_t *t )
+{
+    synth_params_t params = { 0 };
+    test_result_t res = { 0, 14695981039346656037ULL, 14695981039346656037ULL };
+    synth_t *synth;
+    ts_writer_t *w = NULL;
+    ts_frame_t *frames = NULL;
+    void *opaque;
+    int bd_checked = !t->write;
+    int ret = -1;
+
+    params.num_programs = 1;
+    params.num_pids = 2;
+    params.video_format = LIBMPEGTS_VIDEO_AVC;
+    params.audio_format = LIBMPEGTS_AUDIO_ADTS;
+    params.muxrate = TEST_MUXRATE;
+    params.cbr = 1;
+    params.ts_type = TS_TYPE_DVB;
+    params.seed = 1;
+
+    synth = synth_open( &params );
+    opaque = calloc( 1, t->size );
+    if( !synth || !opaque )
+        goto end;
+
+    w = ts_create_writer();
+    if( !w || synth_setup_writer( synth, w ) < 0 )
+        goto end;
+    if( t->open( opaque, w, t->param ) < 0 )
+    {
+        t->close( opaque, NULL );
+        goto end;
+    }
+
+    /* the last call flushes the frames which are still buffered */
+    for( int f = 0; f <= TEST_FRAMES; f++ )
+    {
+        int num_frames = f < TEST_FRAMES ? synth_next_frames( synth, &frames ) : 0;
+        uint8_t *out;
+        int64_t *pcr_list;
+        int len;
+
+        /* also without TS output, the first call returns the header of the index */
+        if( ts_write_frames( w, frames, num_frames, &out, &len, &pcr_list ) < 0 )
+        {
+            t->close( opaque, NULL );
+            goto end;
+        }
+
+        /* the length of Blu-Ray output can be a multiple of 188 bytes as well, the sink has to
+         * reject it and carry on unaffected */
+        if( !bd_checked && len >= TEST_BD_PACKETS * 192 )
+        {
+            uint8_t bd[TEST_BD_PACKETS * 192];
+
+            make_source_packets( bd, out );
+            bd_checked = 1;
+            if( t->write( opaque, w, bd, sizeof(bd), pcr_list ) == 0 )
+            {
+                fprintf( stderr, "%s: Blu-Ray source packets accepted\n", t->name );
+                t->close( opaque, NULL );
+                goto end;
+            }
+        }
+
+        if( t->send( opaque, w, out, len, pcr_list ) < 0 )
+        {
+            t->close( opaque, NULL );
+            goto end;
+        }
+
+        res.packets += len / 188;
+        res.ts_hash = fnv1a( res.ts_hash, out, len );
+        res.pcr_hash = fnv1a( res.pcr_hash, (uint8_t *)pcr_list, len / 188 * sizeof(int64_t) );
+    }
+
+    /* the writer goes first, the outputs must not depend on its buffers */
+    ts_close_writer( w );
+    w = NULL;
+    ret = t->close( opaque, &res );
+
+end:
+    if( w )
+        ts_close_writer( w );
+    synth_close( synth );
+    free( opaque );
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    int failed = 0;
+
+    for( int i = 0; tests[i].name; i++ )
+    {
+        int selected = argc < 2;
+
+        for( int j = 1; j < argc; j++ )
+            selected |= !strcmp( argv[j], tests[i].name );
+        if( !selected )
+            continue;
+
+        if( run_test( &tests[i] ) < 0 )
+        {
+            printf( "%-26s FAIL\n", tests[i].name );
+            failed++;
+        }
+        else
+            printf( "%-26s ok\n", tests[i].name );
+    }
+
+    if( failed )
+        fprintf( stderr, "%d test(s) failed\n", failed );
+
+    return !!failed;
+}
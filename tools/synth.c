@@ -0,0 +1,498 @@
+/*****************************************************************************
+ * synth.c : synthetic audio/video source for benchmarks and tests
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../libmpegts.h"
+#include "../crc/crc.h"
+#include "synth.h"
+
+#define MIN(a,b) ( (a)<(b) ? (a) : (b) )
+#define MAX(a,b) ( (a)>(b) ? (a) : (b) )
+
+#define SYNTH_GOP_LENGTH    12 /* IBBPBBPBBPBB */
+#define SYNTH_SUB_PERIOD    50 /* frames between subtitle pages */
+#define SYNTH_SCTE35_PERIOD 25 /* frames between splice_null() sections */
+
+#define SYNTH_SUB_SIZE      1500
+#define SYNTH_TTX_SIZE      (1 + 3 * 46) /* data_identifier and three data units fill the 45 byte PES header to 184 bytes */
+#define SYNTH_SCTE35_SIZE   20
+
+enum synth_type_t
+{
+    SYNTH_VIDEO,
+    SYNTH_AUDIO,
+    SYNTH_SUBTITLE,
+    SYNTH_TELETEXT,
+    SYNTH_SCTE35,
+};
+
+typedef struct
+{
+    int type;
+    int pid;
+    int duration;   /* 90kHz */
+    int frame_size; /* bytes */
+    int bitrate;    /* bits/s */
+    int64_t dts;    /* of the next frame */
+    int frame_num;
+
+    /* video */
+    int vbv_maxrate;
+    int vbv_bufsize;
+    int64_t init_delay;   /* 27MHz */
+    int64_t last_arrival; /* final arrival time of the previous frame */
+} synth_pid_t;
+
+struct synth_t
+{
+    synth_params_t params;
+
+    int num_pids;
+    synth_pid_t *pids;
+    ts_program_t *programs;
+    ts_stream_t *streams;
+
+    int video_bitrate;
+    int64_t period_end; /* 90kHz */
+
+    uint8_t *data;
+    int data_size;
+    uint8_t ttx[SYNTH_TTX_SIZE];
+    uint8_t scte35[SYNTH_SCTE35_SIZE];
+
+    ts_frame_t *frames;
+    int max_frames;
+
+    uint32_t rand;
+};
+
+static uint32_t synth_rand( synth_t *s )
+{
+    s->rand = s->rand * 1664525 + 1013904223;
+    return s->rand >> 8;
+}
+
+/* uniform in [-range, range] percent */
+static int synth_jitter( synth_t *s, int value, int range )
+{
+    return value + (int64_t)value * ((int)(synth_rand( s ) % (2 * range + 1)) - range) / 100;
+}
+
+static int synth_stream_type( synth_params_t *p, int idx )
+{
+    if( p->video_format && !idx )
+        return SYNTH_VIDEO;
+
+    switch( ( idx + !p->video_format ) % 5 )
+    {
+        case 3:  return SYNTH_SUBTITLE;
+        case 4:  return SYNTH_TELETEXT;
+        case 0:  return SYNTH_SCTE35;
+        default: return SYNTH_AUDIO;
+    }
+}
+
+static void synth_write_scte35( uint8_t *p )
+{
+    /* splice_info_section() with a splice_null() command */
+    static const uint8_t section[SYNTH_SCTE35_SIZE - 4] =
+    {
+        0xfc, 0x30, SYNTH_SCTE35_SIZE - 3,  /* table_id, flags, section_length */
+        0x00,                               /* protocol_version */
+        0x00, 0x00, 0x00, 0x00, 0x00,       /* encrypted_packet, encryption_algorithm, pts_adjustment */
+        0x00,                               /* cw_index */
+        0xff, 0xf0, 0x00,                   /* tier, splice_command_length */
+        0x00,                               /* splice_command_type */
+        0x00, 0x00,                         /* descriptor_loop_length */
+    };
+    uint32_t crc;
+
+    memcpy( p, section, sizeof(section) );
+    crc = crc_32( p, sizeof(section) );
+    p[16] = crc >> 24;
+    p[17] = crc >> 16;
+    p[18] = crc >> 8;
+    p[19] = crc;
+}
+
+synth_t *synth_open( synth_params_t *params )
+{
+    synth_t *s;
+    int other_bitrate = 0, program_bitrate, max_frame = SYNTH_SUB_SIZE;
+
+    if( params->num_programs <= 0 || params->num_pids <= 0 || params->num_pids > 100 ||
+        params->num_programs * (params->num_pids + 1) > 8000 )
+    {
+        fprintf( stderr, "Invalid number of programs or PIDs\n" );
+        return NULL;
+    }
+
+    s = calloc( 1, sizeof(*s) );
+    if( !s )
+        return NULL;
+
+    s->params = *params;
+    s->rand = params->seed ? params->seed : 1;
+    s->num_pids = params->num_programs * params->num_pids;
+    s->pids = calloc( s->num_pids, sizeof(*s->pids) );
+    s->programs = calloc( params->num_programs, sizeof(*s->programs) );
+    s->streams = calloc( s->num_pids, sizeof(*s->streams) );
+    /* at most three audio frames fall into one frame period */
+    s->max_frames = s->num_pids * 3;
+    s->frames = calloc( s->max_frames, sizeof(*s->frames) );
+    if( !s->pids || !s->programs || !s->streams || !s->frames )
+        goto fail;
+
+    for( int i = 0; i < params->num_programs; i++ )
+    {
+        ts_program_t *program = &s->programs[i];
+        int base_pid = 0x20 + i * (params->num_pids + 1);
+
+        program->pmt_pid = base_pid;
+        program->program_num = i + 1;
+        program->pcr_pid = base_pid + 1;
+        program->num_streams = params->num_pids;
+        program->streams = &s->streams[i * params->num_pids];
+        program->sdt.service_type = params->video_format ? DVB_SERVICE_TYPE_DIGITAL_TELEVISION : DVB_SERVICE_TYPE_DIGITAL_RADIO_SOUND;
+
+        for( int j = 0; j < params->num_pids; j++ )
+        {
+            synth_pid_t *pid = &s->pids[i * params->num_pids + j];
+            ts_stream_t *stream = &program->streams[j];
+
+            pid->type = synth_stream_type( params, j );
+            pid->pid = stream->pid = base_pid + 1 + j;
+
+            switch( pid->type )
+            {
+                case SYNTH_VIDEO:
+                    stream->stream_format = params->video_format;
+                    stream->stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+                    pid->duration = SYNTH_FRAME_DURATION;
+                    break;
+                case SYNTH_AUDIO:
+                    stream->stream_format = params->audio_format;
+                    if( params->audio_format == LIBMPEGTS_AUDIO_ADTS )
+                    {
+                        /* 128kbit/s stereo, 1024 samples per frame at 48kHz */
+                        stream->stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO + (j & 31);
+                        pid->duration = 1920;
+                        pid->bitrate = 128000;
+                    }
+                    else if( params->audio_format == LIBMPEGTS_AUDIO_AC3 )
+                    {
+                        /* 384kbit/s, 1536 samples per frame at 48kHz */
+                        stream->stream_id = LIBMPEGTS_STREAM_ID_PRIVATE_1;
+                        pid->duration = 2880;
+                        pid->bitrate = 384000;
+                    }
+                    else
+                    {
+                        /* 24-bit stereo, one frame per video frame, 4 byte header */
+                        stream->stream_id = LIBMPEGTS_STREAM_ID_PRIVATE_1;
+                        pid->duration = SYNTH_FRAME_DURATION;
+                        pid->bitrate = (4 + 48000 * SYNTH_FRAME_DURATION / 90000 * 7) * 8 * (90000 / SYNTH_FRAME_DURATION);
+                    }
+                    pid->frame_size = (int64_t)pid->bitrate * pid->duration / 90000 / 8;
+                    stream->audio_frame_size = pid->duration;
+                    break;
+                case SYNTH_SUBTITLE:
+                    stream->stream_format = LIBMPEGTS_DVB_SUB;
+                    stream->stream_id = LIBMPEGTS_STREAM_ID_PRIVATE_1;
+                    pid->duration = SYNTH_FRAME_DURATION * SYNTH_SUB_PERIOD;
+                    pid->frame_size = SYNTH_SUB_SIZE;
+                    pid->bitrate = SYNTH_SUB_SIZE * 8 * 90000 / pid->duration;
+                    break;
+                case SYNTH_TELETEXT:
+                    stream->stream_format = LIBMPEGTS_DVB_TELETEXT;
+                    stream->stream_id = LIBMPEGTS_STREAM_ID_PRIVATE_1;
+                    pid->duration = SYNTH_FRAME_DURATION;
+                    pid->frame_size = SYNTH_TTX_SIZE;
+                    pid->bitrate = 184 * 8 * 90000 / pid->duration;
+                    break;
+                case SYNTH_SCTE35:
+                    stream->stream_format = LIBMPEGTS_TABLE_SECTION;
+                    pid->duration = SYNTH_FRAME_DURATION * SYNTH_SCTE35_PERIOD;
+                    pid->frame_size = SYNTH_SCTE35_SIZE;
+                    pid->bitrate = 188 * 8 * 90000 / pid->duration;
+                    break;
+            }
+
+            if( i == 0 )
+                other_bitrate += pid->bitrate;
+            max_frame = MAX( max_frame, pid->frame_size );
+        }
+    }
+
+    /* leave headroom for packet headers, PSI and PCR */
+    program_bitrate = (int64_t)params->muxrate / params->num_programs * 184 / 188 * 85 / 100;
+    if( params->video_format )
+    {
+        int level_max;
+
+        s->video_bitrate = program_bitrate - other_bitrate * 110 / 100;
+        if( params->video_format == LIBMPEGTS_VIDEO_MPEG2 )
+            level_max = 80000000;
+        else if( params->intra )
+            level_max = 960000000; /* Level 5.1 with the 4:2:2 Intra cpbBrNalFactor */
+        else
+            level_max = 240000000;
+        s->video_bitrate = MIN( s->video_bitrate, level_max );
+
+        if( s->video_bitrate < 100000 )
+        {
+            fprintf( stderr, "Muxrate too low for %i PIDs\n", params->num_pids );
+            goto fail;
+        }
+    }
+    else if( program_bitrate < other_bitrate )
+    {
+        fprintf( stderr, "Muxrate too low for %i PIDs\n", params->num_pids );
+        goto fail;
+    }
+
+    for( int i = 0; i < s->num_pids; i++ )
+    {
+        synth_pid_t *pid = &s->pids[i];
+
+        if( pid->type != SYNTH_VIDEO )
+            continue;
+
+        /* CBR HRD with half a second of buffer */
+        pid->bitrate = pid->vbv_maxrate = s->video_bitrate;
+        pid->vbv_bufsize = s->video_bitrate / 2;
+        pid->frame_size = (int64_t)pid->bitrate * pid->duration / 90000 / 8;
+        pid->init_delay = (int64_t)pid->vbv_bufsize * 9 / 10 * 27000000LL / pid->vbv_maxrate;
+        pid->dts = pid->init_delay / 300;
+
+        /* I-frames are at most 3.6 times the average size, plus jitter */
+        max_frame = MAX( max_frame, pid->frame_size * 5 );
+    }
+
+    /* everything else starts with the first video frame, audio-only programs start half a period in
+     * so the first access units are not already late */
+    for( int i = 0; i < s->num_pids; i++ )
+        if( s->pids[i].type != SYNTH_VIDEO )
+            s->pids[i].dts = params->video_format ? s->pids[0].dts : SYNTH_FRAME_DURATION / 2;
+
+    s->data_size = max_frame;
+    s->data = malloc( s->data_size );
+    if( !s->data )
+        goto fail;
+    for( int i = 0; i < s->data_size; i++ )
+        s->data[i] = synth_rand( s );
+
+    s->ttx[0] = 0x10; /* data_identifier: EBU data */
+    for( int i = 0; i < 3; i++ )
+    {
+        uint8_t *unit = &s->ttx[1 + i * 46];
+        unit[0] = 0x02; /* data_unit_id: EBU Teletext non-subtitle data */
+        unit[1] = 44;   /* data_unit_length */
+        memset( &unit[2], 0x55, 44 );
+    }
+
+    synth_write_scte35( s->scte35 );
+
+    return s;
+
+fail:
+    synth_close( s );
+    return NULL;
+}
+
+int synth_setup_writer( synth_t *s, ts_writer_t *w )
+{
+    synth_params_t *p = &s->params;
+    ts_main_t params;
+    ts_dvb_sub_t sub = { "eng", LIBMPEGTS_DVB_SUB_TYPE_NORMAL_NO_AR, 1, 1 };
+    ts_dvb_ttx_t ttx = { "eng", LIBMPEGTS_DVB_TTX_TYPE_INITIAL, 1, 0 };
+
+    memset( &params, 0, sizeof(params) );
+    params.num_programs = p->num_programs;
+    params.programs = s->programs;
+    params.ts_id = 1;
+    params.muxrate = p->muxrate;
+    params.cbr = p->cbr;
+    params.true_vbr = p->true_vbr;
+    params.mux_delay = p->mux_delay;
+    params.full_tstd = p->full_tstd;
+    params.ts_type = p->ts_type;
+
+    if( ts_setup_transport_stream( w, &params ) < 0 )
+        return -1;
+
+    for( int i = 0; i < s->num_pids; i++ )
+    {
+        synth_pid_t *pid = &s->pids[i];
+        int ret = 0;
+
+        if( pid->type == SYNTH_VIDEO )
+        {
+            if( p->video_format == LIBMPEGTS_VIDEO_MPEG2 )
+            {
+                int level = pid->vbv_maxrate <= 15000000 ? LIBMPEGTS_MPEG2_LEVEL_MAIN : LIBMPEGTS_MPEG2_LEVEL_HIGH;
+                ret = ts_setup_mpegvideo_stream( w, pid->pid, level, LIBMPEGTS_MPEG2_PROFILE_MAIN,
+                                                 pid->vbv_maxrate, pid->vbv_bufsize, 0 );
+            }
+            else
+            {
+                int scale = p->intra ? 4 : 1;
+                int level = pid->vbv_maxrate <= 20000000 * scale ? 40 : pid->vbv_maxrate <= 50000000 * scale ? 41 : 51;
+                ret = ts_setup_mpegvideo_stream( w, pid->pid, level, p->intra ? AVC_HIGH_422_INTRA : AVC_HIGH,
+                                                 pid->vbv_maxrate, pid->vbv_bufsize, 0 );
+            }
+        }
+        else if( pid->type == SYNTH_AUDIO && p->audio_format == LIBMPEGTS_AUDIO_ADTS )
+            ret = ts_setup_mpeg2_aac_stream( w, pid->pid, LIBMPEGTS_MPEG2_AAC_LC_PROFILE, LIBMPEGTS_MPEG2_AAC_2_CHANNEL );
+        else if( pid->type == SYNTH_AUDIO && p->audio_format == LIBMPEGTS_AUDIO_302M )
+            ret = ts_setup_302m_stream( w, pid->pid, 24, 2 );
+        else if( pid->type == SYNTH_SUBTITLE )
+            ret = ts_setup_dvb_subtitles( w, pid->pid, 0, 1, &sub );
+        else if( pid->type == SYNTH_TELETEXT )
+            ret = ts_setup_dvb_teletext( w, pid->pid, 1, &ttx );
+
+        if( ret < 0 )
+            return -1;
+    }
+
+    return 0;
+}
+
+static void synth_video_frame( synth_t *s, synth_pid_t *pid, ts_frame_t *frame )
+{
+    int gop_pos = s->params.intra ? 0 : pid->frame_num % SYNTH_GOP_LENGTH;
+    int frame_type, weight, size;
+    int64_t initial_arrival, final_arrival, removal;
+
+    /* I:P:B size ratio of 6:2:1 gives a GOP weight of 20 */
+    if( !gop_pos )
+    {
+        frame_type = LIBMPEGTS_CODING_TYPE_I;
+        weight = 6;
+    }
+    else if( gop_pos % 3 == 0 )
+    {
+        frame_type = LIBMPEGTS_CODING_TYPE_P;
+        weight = 2;
+    }
+    else
+    {
+        frame_type = LIBMPEGTS_CODING_TYPE_B;
+        weight = 1;
+    }
+
+    if( s->params.intra )
+        size = synth_jitter( s, pid->frame_size, 5 );
+    else
+        size = synth_jitter( s, (int64_t)pid->frame_size * SYNTH_GOP_LENGTH * weight / 20, 20 );
+
+    /* frames arrive at vbv_maxrate and must not underflow the CPB */
+    removal = pid->dts * 300;
+    initial_arrival = MAX( pid->last_arrival, removal - pid->init_delay );
+    size = MIN( size, (removal - initial_arrival) * pid->vbv_maxrate / 27000000 / 8 );
+    size = MAX( size, 1 );
+    final_arrival = initial_arrival + (int64_t)size * 8 * 27000000 / pid->vbv_maxrate;
+    pid->last_arrival = final_arrival;
+
+    frame->data = s->data;
+    frame->size = size;
+    frame->dts = pid->dts;
+    frame->pts = pid->dts + (frame_type == LIBMPEGTS_CODING_TYPE_B ? 0 : 3 * SYNTH_FRAME_DURATION);
+    frame->cpb_initial_arrival_time = initial_arrival;
+    frame->cpb_final_arrival_time = final_arrival;
+    frame->random_access = !gop_pos;
+    frame->frame_type = frame_type;
+    frame->ref_pic_idc = frame_type != LIBMPEGTS_CODING_TYPE_B;
+}
+
+int synth_next_frames( synth_t *s, ts_frame_t **frames )
+{
+    int num_frames = 0;
+
+    s->period_end = (s->params.video_format ? s->pids[0].dts : s->period_end) + SYNTH_FRAME_DURATION;
+
+    for( int i = 0; i < s->num_pids; i++ )
+    {
+        synth_pid_t *pid = &s->pids[i];
+
+        while( pid->dts < s->period_end && num_frames < s->max_frames )
+        {
+            ts_frame_t *frame = &s->frames[num_frames++];
+
+            memset( frame, 0, sizeof(*frame) );
+            frame->pid = pid->pid;
+
+            if( pid->type == SYNTH_VIDEO )
+                synth_video_frame( s, pid, frame );
+            else
+            {
+                frame->dts = frame->pts = pid->dts;
+                frame->random_access = 1;
+                if( pid->type == SYNTH_TELETEXT )
+                {
+                    frame->data = s->ttx;
+                    frame->size = SYNTH_TTX_SIZE;
+                }
+                else if( pid->type == SYNTH_SCTE35 )
+                {
+                    frame->data = s->scte35;
+                    frame->size = SYNTH_SCTE35_SIZE;
+                }
+                else
+                {
+                    frame->data = s->data;
+                    frame->size = pid->type == SYNTH_AUDIO && s->params.audio_format != LIBMPEGTS_AUDIO_302M ?
+                                  synth_jitter( s, pid->frame_size, 2 ) : pid->frame_size;
+                }
+            }
+
+            pid->dts += pid->duration;
+            pid->frame_num++;
+
+            /* only one video frame at a time */
+            if( pid->type == SYNTH_VIDEO )
+                break;
+        }
+    }
+
+    *frames = s->frames;
+
+    return num_frames;
+}
+
+int synth_video_bitrate( synth_t *s )
+{
+    return s->video_bitrate;
+}
+
+void synth_close( synth_t *s )
+{
+    if( !s )
+        return;
+
+    free( s->pids );
+    free( s->programs );
+    free( s->streams );
+    free( s->frames );
+    free( s->data );
+    free( s );
+}
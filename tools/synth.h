@@ -0,0 +1,72 @@
+/*****************************************************************************
+ * synth.h : synthetic audio/video source for benchmarks and tests
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+#ifndef LIBMPEGTS_SYNTH_H
+#define LIBMPEGTS_SYNTH_H
+
+/* Frame period of the source in 90kHz ticks (25fps) */
+#define SYNTH_FRAME_DURATION 3600
+
+/* Synthetic mux parameters
+ *
+ * num_programs - number of programs (more than one is an MPTS)
+ * num_pids - elementary streams per program, including the video stream.
+ *            Streams after the video cycle through audio, audio, DVB subtitles, teletext and SCTE-35.
+ *            Program n has its PMT on PID 0x20 + n * (num_pids + 1), followed by its streams.
+ * video_format - LIBMPEGTS_VIDEO_MPEG2, LIBMPEGTS_VIDEO_AVC or 0 for audio/data-only programs
+ * audio_format - LIBMPEGTS_AUDIO_ADTS, LIBMPEGTS_AUDIO_AC3 or LIBMPEGTS_AUDIO_302M
+ * muxrate - in bits/s. The video bitrate is whatever is left over after audio and data.
+ * cbr - pad to constant bitrate
+ * ts_type - TS_TYPE_DVB is needed for subtitles and teletext
+ * seed - seed of the frame size generator
+ * intra - AVC High 4:2:2 Intra video where every frame is an IDR, as used for contribution
+ * mux_delay, full_tstd - passed on to ts_main_t
+ */
+typedef struct
+{
+    int num_programs;
+    int num_pids;
+    int video_format;
+    int audio_format;
+    int muxrate;
+    int cbr;
+    int ts_type;
+    uint32_t seed;
+    int intra;
+    int true_vbr;
+    int mux_delay;
+    int full_tstd;
+} synth_params_t;
+
+typedef struct synth_t synth_t;
+
+synth_t *synth_open( synth_params_t *params );
+
+/* Setup the transport stream and all the streams on a freshly created writer */
+int synth_setup_writer( synth_t *s, ts_writer_t *w );
+
+/* Generates the frames of the next frame period.
+ * Returns the number of frames which stay valid until the next call. */
+int synth_next_frames( synth_t *s, ts_frame_t **frames );
+
+/* Video bitrate of each program in bits/s */
+int synth_video_bitrate( synth_t *s );
+
+void synth_close( synth_t *s );
+
+#endif
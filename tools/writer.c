@@ -0,0 +1,697 @@
+/*****************************************************************************
+ * writer.c : tests of the writer's limits and telemetry
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Every test muxes the synthetic programme of tools/synth.c and checks what the writer
+ * reports about it. The byte-exact output is covered by tools/golden.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "../libmpegts.h"
+#include "synth.h"
+
+#define TEST_FRAMES    150 /* 6 seconds at 25fps */
+#define TEST_MUXRATE   8000000
+/* the single programme of synth_open with a video and an audio stream */
+#define TEST_PMT_PID   0x20
+#define TEST_VIDEO_PID 0x21
+#define TEST_AUDIO_PID 0x22
+
+typedef struct
+{
+    synth_params_t params;
+    synth_t *synth;
+    ts_writer_t *w;
+    ts_analyzer_t *a; /* optional, checks the output */
+    int64_t early; /* the video frames arrive this much earlier than the synthetic HRD (27MHz) */
+    uint64_t video_pes; /* started in the output */
+    uint64_t psi_packets; /* PAT, PMT and SI in the output */
+    uint64_t payload_bytes; /* of the streams in the output, without the PES headers */
+    int audio_deleted; /* the audio frames are no longer written */
+    uint64_t audio_packets; /* in the output */
+    int audio_left; /* bytes of the last audio PES still to come */
+} test_mux_t;
+
+static void default_params( synth_params_t *params )
+{
+    memset( params, 0, sizeof(*params) );
+    params->num_programs = 1;
+    params->num_pids = 2;
+    params->video_format = LIBMPEGTS_VIDEO_AVC;
+    params->audio_format = LIBMPEGTS_AUDIO_ADTS;
+    params->muxrate = TEST_MUXRATE;
+    params->cbr = 1;
+    params->ts_type = TS_TYPE_DVB;
+    params->seed = 1;
+}
+
+static void close_mux( test_mux_t *m )
+{
+    if( m->w )
+        ts_close_writer( m->w );
+    synth_close( m->synth );
+    m->w = NULL;
+    m->synth = NULL;
+}
+
+/* Opens the source and sets up a writer for it */
+static int open_mux( test_mux_t *m )
+{
+    m->synth = synth_open( &m->params );
+    m->w = ts_create_writer();
+    if( !m->synth || !m->w || synth_setup_writer( m->synth, m->w ) < 0 )
+    {
+        close_mux( m );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Muxes num_frames frame periods, 0 flushes the frames which are still buffered */
+static int mux_frames( test_mux_t *m, int num_frames )
+{
+    ts_frame_t *frames = NULL;
+    uint8_t *out;
+    int64_t *pcr_list;
+    int len;
+
+    for( int f = 0; f < num_frames || !num_frames; f++ )
+    {
+        int num = num_frames ? synth_next_frames( m->synth, &frames ) : 0;
+
+        for( int i = 0; i < num; i++ )
+        {
+            if( frames[i].pid != TEST_VIDEO_PID )
+                continue;
+            frames[i].cpb_initial_arrival_time -= m->early;
+            frames[i].cpb_final_arrival_time -= m->early;
+        }
+
+        /* the video frame comes first */
+        if( m->audio_deleted && num > 1 )
+            num = 1;
+
+        if( ts_write_frames( m->w, frames, num, &out, &len, &pcr_list ) < 0 )
+            return -1;
+        if( m->a && len && ts_analyze( m->a, out, len ) < 0 )
+            return -1;
+        for( int i = 0; i < len; i += 188 )
+        {
+            uint8_t *pkt = &out[i];
+            int pid = ( pkt[1] & 0x1f ) << 8 | pkt[2];
+            int pusi = !!( pkt[1] & 0x40 );
+            int afc = pkt[3] >> 4 & 3;
+            int start = afc & 2 ? 5 + pkt[4] : 4;
+
+            m->video_pes += pusi && pid == TEST_VIDEO_PID;
+            m->psi_packets += pid < 0x20 || pid == TEST_PMT_PID;
+            if( ( pid == TEST_VIDEO_PID || pid == TEST_AUDIO_PID ) && ( afc & 1 ) )
+                m->payload_bytes += 188 - start - pusi * ( 9 + pkt[start+8] );
+            if( pid == TEST_AUDIO_PID )
+            {
+                /* audio PES have their PES_packet_length set */
+                if( pusi )
+                    m->audio_left = 6 + ( pkt[start+4] << 8 | pkt[start+5] );
+                m->audio_left -= 188 - start;
+                m->audio_packets++;
+            }
+        }
+        if( !num_frames )
+            break;
+    }
+
+    return 0;
+}
+
+/**** Mux delay ****/
+
+/* The video frames arrive up to 450ms before their DTS, which is just below the minimum delay of
+ * half a second implied by the VBV. Arriving 500ms earlier than that, a budget between the two
+ * has to hold them back. A budget below the minimum is rejected at setup and when the muxrate
+ * drops far enough to raise the minimum above it. */
+static int test_mux_delay( void )
+{
+    test_mux_t m = { { 0 } };
+    int64_t min_delay, max_delay, budget, min_after;
+    int errors = 0;
+
+    default_params( &m.params );
+    m.early = 500 * 27000LL;
+    if( open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES ) < 0 || mux_frames( &m, 0 ) < 0 )
+        goto fail;
+    ts_get_mux_delay( m.w, &min_delay, &max_delay );
+    close_mux( &m );
+
+    /* whole milliseconds strictly between the minimum and the unconstrained delay */
+    budget = min_delay / 27000 + 50;
+    errors += min_delay <= 0 || max_delay <= budget * 27000;
+    if( errors )
+        fprintf( stderr, "Mux delay: minimum %"PRIi64"ms, %"PRIi64"ms without a budget\n",
+                 min_delay / 27000, max_delay / 27000 );
+
+    /* rejected below the minimum */
+    m.params.mux_delay = min_delay / 27000 - 1;
+    if( !open_mux( &m ) )
+    {
+        fprintf( stderr, "Mux delay: %dms accepted below the minimum of %"PRIi64"ms\n",
+                 m.params.mux_delay, min_delay / 27000 );
+        errors++;
+        close_mux( &m );
+    }
+
+    m.params.mux_delay = budget;
+    if( open_mux( &m ) < 0 )
+        goto fail;
+
+    /* a muxrate whose payload rate is below the VBV rate needs a longer delay */
+    errors += !ts_update_muxrate( m.w, TEST_MUXRATE / 4 );
+
+    if( mux_frames( &m, TEST_FRAMES ) < 0 || mux_frames( &m, 0 ) < 0 )
+        goto fail;
+    ts_get_mux_delay( m.w, &min_after, NULL );
+    ts_get_mux_delay( m.w, NULL, &max_delay );
+    close_mux( &m );
+
+    /* the rejected muxrate left the minimum alone */
+    if( max_delay > budget * 27000 || min_after != min_delay )
+    {
+        fprintf( stderr, "Mux delay: %"PRIi64"ms with a budget of %"PRIi64"ms, minimum %"PRIi64"ms\n",
+                 max_delay / 27000, budget, min_after / 27000 );
+        errors++;
+    }
+
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    return -1;
+}
+
+/**** Latency and T-STD statistics ****/
+
+/* the bucket of a value as documented for ts_histogram_t */
+static int get_bucket( int64_t value )
+{
+    int bucket = 1;
+
+    if( value < 0 )
+        return 0;
+    while( bucket < LIBMPEGTS_HISTOGRAM_BUCKETS - 1 && value >= ( 27000LL << (bucket - 1) ) )
+        bucket++;
+    return bucket;
+}
+
+/* Checks that the histogram has count values, that its minimum and maximum are in their buckets
+ * and that nothing is outside of them */
+static int check_histogram( const char *name, ts_histogram_t *h, uint64_t count )
+{
+    int first = get_bucket( h->min ), last = get_bucket( h->max );
+    uint64_t total = 0;
+    int errors = h->count != count || h->min > h->max || h->sum < h->min * (int64_t)count ||
+                 h->sum > h->max * (int64_t)count || ( count && ( !h->buckets[first] || !h->buckets[last] ) );
+
+    for( int i = 0; i < LIBMPEGTS_HISTOGRAM_BUCKETS; i++ )
+    {
+        total += h->buckets[i];
+        errors += ( i < first || i > last ) && h->buckets[i];
+    }
+    errors += total != count;
+
+    if( errors )
+        fprintf( stderr, "Latency: %s has %"PRIu64" of %"PRIu64" values from %"PRIi64" to %"PRIi64" in buckets %d to %d\n",
+                 name, total, count, h->min, h->max, first, last );
+
+    return errors;
+}
+
+static int check_buffer( const char *name, ts_buffer_stats_t *b, int size )
+{
+    int errors = b->size != size || b->min < 0 || b->min > b->max || b->max > b->size ||
+                 b->fullness < b->min || b->fullness > b->max || b->mean < b->min || b->mean > b->max;
+
+    if( errors )
+        fprintf( stderr, "T-STD: %s of %d bits for %d has %d, %d to %d, mean %.0f\n",
+                 name, b->size, size, b->fullness, b->min, b->max, b->mean );
+
+    return errors;
+}
+
+/* After a reset the window starts from the current fullness */
+static int check_reset( const char *name, ts_buffer_stats_t *b )
+{
+    int errors = b->min != b->fullness || b->max != b->fullness || b->mean != b->fullness;
+
+    if( errors )
+        fprintf( stderr, "T-STD: %s was not reset\n", name );
+
+    return errors;
+}
+
+/* Every video frame is a PES, so each histogram has one value per PES in the output. The DTS slack
+ * of a stream which is never late is in the non-negative buckets. */
+static int test_latency_stats( void )
+{
+    test_mux_t m = { { 0 } };
+    ts_latency_stats_t stats;
+    int errors = 0;
+
+    default_params( &m.params );
+    if( open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES ) < 0 || mux_frames( &m, 0 ) < 0 )
+        goto fail;
+
+    if( ts_get_latency_stats( m.w, TEST_VIDEO_PID, &stats, 1 ) < 0 )
+        goto fail;
+    errors += check_histogram( "first packet", &stats.first_packet_latency, m.video_pes );
+    errors += check_histogram( "last packet", &stats.last_packet_latency, m.video_pes );
+    errors += check_histogram( "DTS slack", &stats.dts_slack, m.video_pes );
+    errors += m.video_pes < TEST_FRAMES - 1 || stats.first_packet_latency.min > stats.last_packet_latency.min ||
+              stats.first_packet_latency.max > stats.last_packet_latency.max || stats.dts_slack.min < 0;
+
+    if( ts_get_latency_stats( m.w, TEST_VIDEO_PID, &stats, 0 ) < 0 )
+        goto fail;
+    errors += check_histogram( "reset", &stats.first_packet_latency, 0 );
+    errors += ts_get_latency_stats( m.w, 0x1fff, &stats, 0 ) != -1;
+    close_mux( &m );
+
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    return -1;
+}
+
+/* With full_tstd every buffer of the video has a size from the level and none goes beyond it.
+ * The system buffers have the sizes and rates of ISO 13818-1 and are not on PID 0, the PAT. */
+static int test_tstd_stats( void )
+{
+    test_mux_t m = { { 0 } };
+    ts_tstd_stats_t stats, sys;
+    int errors = 0;
+
+    default_params( &m.params );
+    m.params.full_tstd = 1;
+    if( open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES ) < 0 )
+        goto fail;
+
+    if( ts_get_tstd_stats( m.w, TEST_VIDEO_PID, &stats, 1 ) < 0 ||
+        ts_get_tstd_stats( m.w, LIBMPEGTS_SYSTEM_BUFFERS, &sys, 1 ) < 0 )
+        goto fail;
+    errors += check_buffer( "video TB", &stats.tb, 512 * 8 );
+    errors += check_buffer( "video MB", &stats.mb, stats.mb.size );
+    errors += check_buffer( "video EB", &stats.eb, stats.eb.size );
+    /* MB leaks as fast as TB fills it at these rates so it can stay empty */
+    errors += stats.rx <= 0 || stats.rbx <= 0 || stats.mb.size <= 0 || stats.eb.size <= 0 ||
+              !stats.tb.max || !stats.eb.max;
+    errors += check_buffer( "system TB", &sys.tb, 512 * 8 );
+    errors += sys.rx != 1000000 || sys.rbx != 80000 || !sys.tb.max;
+
+    if( ts_get_tstd_stats( m.w, TEST_VIDEO_PID, &stats, 0 ) < 0 ||
+        ts_get_tstd_stats( m.w, LIBMPEGTS_SYSTEM_BUFFERS, &sys, 0 ) < 0 )
+        goto fail;
+    errors += check_reset( "video TB", &stats.tb ) + check_reset( "video MB", &stats.mb ) +
+              check_reset( "video EB", &stats.eb ) + check_reset( "system TB", &sys.tb );
+
+    /* the audio has no multiplex buffer */
+    if( ts_get_tstd_stats( m.w, TEST_AUDIO_PID, &stats, 0 ) < 0 )
+        goto fail;
+    errors += check_buffer( "audio TB", &stats.tb, 512 * 8 );
+    errors += check_buffer( "audio B", &stats.mb, stats.mb.size );
+    errors += stats.mb.size <= 0 || stats.eb.size || stats.eb.max;
+
+    errors += ts_get_tstd_stats( m.w, 0, &stats, 0 ) != -1;
+    close_mux( &m );
+
+    if( errors )
+        fprintf( stderr, "T-STD: %d errors\n", errors );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    return -1;
+}
+
+/**** Packet counters ****/
+
+/* The counters of ts_get_stats have to match what is found in the output */
+static int test_stats( void )
+{
+    test_mux_t m = { { 0 } };
+    ts_stats_t stats;
+    int errors = 0;
+
+    default_params( &m.params );
+    if( open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES ) < 0 || mux_frames( &m, 0 ) < 0 ||
+        ts_get_stats( m.w, &stats, 1 ) < 0 )
+        goto fail;
+
+    if( !stats.psi_packets || stats.psi_packets != m.psi_packets || stats.payload_bytes != m.payload_bytes ||
+        stats.total_packets != stats.payload_packets + stats.pcr_packets + stats.null_packets + stats.psi_packets )
+    {
+        fprintf( stderr, "Stats: %"PRIu64" PSI packets for %"PRIu64", %"PRIu64" payload bytes for %"PRIu64"\n",
+                 stats.psi_packets, m.psi_packets, stats.payload_bytes, m.payload_bytes );
+        errors++;
+    }
+
+    /* nothing has been written since the reset */
+    if( ts_get_stats( m.w, &stats, 0 ) < 0 )
+        goto fail;
+    errors += !!( stats.total_packets | stats.psi_packets | stats.payload_bytes );
+
+    close_mux( &m );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    return -1;
+}
+
+/**** PMT ****/
+
+#define TEST_PMT_PIDS 16 /* enough stream loop entries for a PMT of two packets */
+
+/* A PMT longer than one packet is queued and spaced out between the other packets.
+ * The analyzer has to find its section CRC correct. A PMT larger than a section can be is refused. */
+static int test_pmt_crc( void )
+{
+    test_mux_t m = { { 0 } }, big = { { 0 } };
+    ts_analyzer_report_t report;
+    uint64_t pat_packets = 0, pmt_packets = 0;
+    int errors = 0;
+
+    default_params( &m.params );
+    m.params.num_pids = TEST_PMT_PIDS;
+    m.a = ts_create_analyzer( NULL );
+    if( !m.a || open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES ) < 0 || mux_frames( &m, 0 ) < 0 ||
+        ts_get_analyzer_report( m.a, &report ) < 0 )
+        goto fail;
+
+    for( int i = 0; i < report.num_pids; i++ )
+    {
+        if( report.pids[i].pid == 0 )
+            pat_packets = report.pids[i].packets;
+        else if( report.pids[i].pid == TEST_PMT_PID )
+            pmt_packets = report.pids[i].packets;
+    }
+
+    if( !pat_packets || pmt_packets < 2 * pat_packets || report.errors[LIBMPEGTS_ERR_CRC] )
+    {
+        fprintf( stderr, "PMT: %"PRIu64" packets for %"PRIu64" PATs, %"PRIu64" CRC errors\n",
+                 pmt_packets, pat_packets, report.errors[LIBMPEGTS_ERR_CRC] );
+        errors++;
+    }
+
+    default_params( &big.params );
+    big.params.num_pids = 100;
+    big.params.muxrate = 80000000;
+    if( open_mux( &big ) == 0 )
+    {
+        fprintf( stderr, "PMT of %i streams was accepted\n", big.params.num_pids );
+        close_mux( &big );
+        errors++;
+    }
+
+    close_mux( &m );
+    ts_close_analyzer( m.a );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    if( m.a )
+        ts_close_analyzer( m.a );
+    return -1;
+}
+
+/**** Stream deletion ****/
+
+/* The audio stream is deleted a third of the way in, once a call has ended in the middle of one of its
+ * PES. The deletion is refused until that PES has been sent, the writer is tried again after every
+ * frame period. The last audio PES has to be complete and nothing follows it on the PID. */
+static int test_delete_stream( void )
+{
+    test_mux_t m = { { 0 } };
+    uint64_t audio_packets;
+    int refused = 0, errors = 0;
+
+    default_params( &m.params );
+    if( open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES / 3 ) < 0 )
+        goto fail;
+
+    for( int f = TEST_FRAMES / 3; f < TEST_FRAMES && !m.audio_deleted; f++ )
+    {
+        /* start once a call has ended in the middle of an audio PES */
+        if( m.audio_left || refused )
+        {
+            if( ts_delete_stream( m.w, TEST_AUDIO_PID ) == 0 )
+            {
+                m.audio_deleted = 1;
+                errors += m.audio_left != 0;
+            }
+            else
+            {
+                refused++;
+                errors += m.audio_left == 0; /* refused without a reason */
+            }
+        }
+        if( mux_frames( &m, 1 ) < 0 )
+            goto fail;
+    }
+
+    audio_packets = m.audio_packets;
+    if( mux_frames( &m, TEST_FRAMES / 3 ) < 0 || mux_frames( &m, 0 ) < 0 )
+        goto fail;
+
+    if( !refused || !m.audio_deleted || m.audio_packets != audio_packets || ts_delete_stream( m.w, TEST_AUDIO_PID ) == 0 )
+        errors++;
+    if( errors )
+        fprintf( stderr, "Delete stream: deleted %d, refused %d times, %"PRIu64" packets after\n",
+                 m.audio_deleted, refused, m.audio_packets - audio_packets );
+
+    close_mux( &m );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    return -1;
+}
+
+/**** Adding streams ****/
+
+/* Audio streams are added to the running programme until the PMT would outgrow its section.
+ * The refused stream must not be kept and the PMTs sent afterwards must still be correct. */
+static int test_add_stream( void )
+{
+    test_mux_t m = { { 0 } };
+    ts_analyzer_report_t report;
+    ts_stream_t stream = { 0 };
+    int added = 0, errors = 0;
+
+    default_params( &m.params );
+    m.a = ts_create_analyzer( NULL );
+    if( !m.a || open_mux( &m ) < 0 || mux_frames( &m, TEST_FRAMES / 3 ) < 0 )
+        goto fail;
+
+    stream.stream_format = LIBMPEGTS_AUDIO_ADTS;
+    stream.stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO;
+    for( stream.pid = TEST_AUDIO_PID + 1; ts_add_stream( m.w, 1, &stream ) == 0; stream.pid++ )
+        added++;
+
+    /* refused, so there is nothing to delete */
+    errors += ts_delete_stream( m.w, stream.pid ) == 0;
+
+    if( mux_frames( &m, TEST_FRAMES / 3 ) < 0 || mux_frames( &m, 0 ) < 0 ||
+        ts_get_analyzer_report( m.a, &report ) < 0 )
+        goto fail;
+
+    if( !added || report.errors[LIBMPEGTS_ERR_CRC] || report.errors[LIBMPEGTS_ERR_PMT] )
+        errors++;
+    if( errors )
+        fprintf( stderr, "Add stream: added %d, %"PRIu64" CRC errors, %"PRIu64" PMT errors\n",
+                 added, report.errors[LIBMPEGTS_ERR_CRC], report.errors[LIBMPEGTS_ERR_PMT] );
+
+    close_mux( &m );
+    ts_close_analyzer( m.a );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    if( m.a )
+        ts_close_analyzer( m.a );
+    return -1;
+}
+
+/**** T-STD history ****/
+
+#define TEST_HISTORY_SIZE     8
+#define TEST_HISTORY_BIG      1024 /* never fills when read after every call */
+#define TEST_HISTORY_INTERVAL 10   /* ms */
+
+typedef struct
+{
+    ts_tstd_sample_t *samples;
+    int num_samples;
+} test_history_t;
+
+/* Reads everything in the ring, in two parts to check that a partial read keeps the order */
+static int read_history( ts_writer_t *w, int pid, test_history_t *h )
+{
+    ts_tstd_sample_t *temp = realloc( h->samples, (h->num_samples + TEST_HISTORY_BIG) * sizeof(*temp) );
+    int num;
+
+    if( !temp )
+        return -1;
+    h->samples = temp;
+
+    for( int i = 0; i < 2; i++ )
+    {
+        num = ts_read_tstd_history( w, pid, h->samples + h->num_samples, i ? TEST_HISTORY_BIG : 3 );
+        if( num < 0 )
+            return -1;
+        h->num_samples += num;
+    }
+
+    return 0;
+}
+
+/* The same programme is muxed twice. The first writer has a large ring and reads it after every
+ * call, so it sees every sample. The second has a small ring and reads only at the end, so its
+ * ring has been overfilled: it has to return the newest samples in order and count the others
+ * as dropped. */
+static int test_tstd_history( void )
+{
+    static const int pids[2] = { TEST_VIDEO_PID, LIBMPEGTS_SYSTEM_BUFFERS };
+    test_mux_t m = { { 0 } };
+    test_history_t all[2] = { { 0 } }, last[2] = { { 0 } };
+    ts_tstd_stats_t stats;
+    int errors = 0;
+
+    default_params( &m.params );
+    m.params.full_tstd = 1;
+
+    for( int pass = 0; pass < 2; pass++ )
+    {
+        test_history_t *h = pass ? last : all;
+
+        if( open_mux( &m ) < 0 || ts_setup_tstd_history( m.w, pass ? TEST_HISTORY_SIZE : TEST_HISTORY_BIG, TEST_HISTORY_INTERVAL ) < 0 )
+            goto fail;
+
+        for( int f = 0; f < TEST_FRAMES; f++ )
+        {
+            if( mux_frames( &m, 1 ) < 0 )
+                goto fail;
+            for( int i = 0; i < 2 && !pass; i++ )
+                if( read_history( m.w, pids[i], &h[i] ) < 0 )
+                    goto fail;
+        }
+
+        for( int i = 0; i < 2; i++ )
+        {
+            uint64_t dropped = pass ? all[i].num_samples - TEST_HISTORY_SIZE : 0;
+
+            if( read_history( m.w, pids[i], &h[i] ) < 0 || ts_get_tstd_stats( m.w, pids[i], &stats, 1 ) < 0 )
+                goto fail;
+            if( stats.history_dropped != dropped )
+            {
+                fprintf( stderr, "T-STD history: %"PRIu64" samples of %d dropped for %"PRIu64"\n",
+                         stats.history_dropped, pids[i], dropped );
+                errors++;
+            }
+            if( ts_get_tstd_stats( m.w, pids[i], &stats, 0 ) < 0 )
+                goto fail;
+            errors += !!stats.history_dropped;
+        }
+        close_mux( &m );
+    }
+
+    for( int i = 0; i < 2; i++ )
+    {
+        test_history_t *a = &all[i], *l = &last[i];
+
+        for( int j = 1; j < a->num_samples; j++ )
+            errors += a->samples[j].pcr - a->samples[j-1].pcr < TEST_HISTORY_INTERVAL * 27000LL;
+        errors += a->num_samples < TEST_FRAMES * 2 || l->num_samples != TEST_HISTORY_SIZE ||
+                  memcmp( l->samples, a->samples + a->num_samples - TEST_HISTORY_SIZE, TEST_HISTORY_SIZE * sizeof(*l->samples) );
+        free( a->samples );
+        free( l->samples );
+    }
+
+    if( errors )
+        fprintf( stderr, "T-STD history: %d errors\n", errors );
+    return errors ? -1 : 0;
+
+fail:
+    close_mux( &m );
+    for( int i = 0; i < 2; i++ )
+    {
+        free( all[i].samples );
+        free( last[i].samples );
+    }
+    return -1;
+}
+
+/**** Tests ****/
+
+typedef struct
+{
+    const char *name;
+    int (*run)( void );
+} writer_test_t;
+
+static const writer_test_t tests[] =
+{
+    { "mux-delay", test_mux_delay },
+    { "latency-stats", test_latency_stats },
+    { "tstd-stats", test_tstd_stats },
+    { "tstd-history", test_tstd_history },
+    { "stats", test_stats },
+    { "pmt-crc", test_pmt_crc },
+    { "delete-stream", test_delete_stream },
+    { "add-stream", test_add_stream },
+    { 0 }
+};
+
+int main( int argc, char **argv )
+{
+    int failed = 0;
+
+    for( int i = 0; tests[i].name; i++ )
+    {
+        int selected = argc < 2;
+
+        for( int j = 1; j < argc; j++ )
+            selected |= !strcmp( argv[j], tests[i].name );
+        if( !selected )
+            continue;
+
+        if( tests[i].run() < 0 )
+        {
+            printf( "%-26s FAIL\n", tests[i].name );
+            failed++;
+        }
+        else
+            printf( "%-26s ok\n", tests[i].name );
+    }
+
+    if( failed )
+        fprintf( stderr, "%d test(s) failed\n", failed );
+
+    return !!failed;
+}